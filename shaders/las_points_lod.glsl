@@ -13,7 +13,7 @@ uniform float pointRadius = 1.3;     //# uiname=Point Radius (m); min=0.001; max
 uniform float trimRadius = 1000000;//# uiname=Trim Radius; min=1; max=1000000
 uniform float exposure = 1.0;      //# uiname=Exposure; min=0.001; max=10000
 uniform float contrast = 1.0;      //# uiname=Contrast; min=0.001; max=10000
-const int colorMode = 1;         //# uiname=Colour Mode; enum=Intensity|Colour|Return Number|Number Of Returns|Point Source|Classification|File Number
+uniform int colorMode = 0;       //# uiname=Colour Mode; enum=Intensity|Colour|Las Classification
 uniform int markerShape = 0;
 uniform int level = -1;
 uniform float minPointSize = 0;
@@ -27,9 +27,10 @@ in float coverage;
 uniform vec3 cursorPos = vec3(0);
 uniform int fileNumber = 0;
 in float intensity;
+in float classification;
 in float simplifyThreshold;
 in vec3 position;
-//in vec3 color;
+in vec3 color;
 
 flat out float modifiedPointRadius;
 flat out float pointScreenSize;
@@ -61,6 +62,18 @@ void main()
         pointColor = tonemap(intensity/400.0, exposure, contrast) * baseColor;
     else if (colorMode == 1)
         pointColor = contrast*(exposure*color - vec3(0.5)) + vec3(0.5);
+    else if (colorMode == 2)
+    {
+        // Colour according to some common classifications defined in the LAS spec
+        int cls = int(classification + 0.5);
+        pointColor = vec3(exposure*classification);
+        if (cls == 2)      pointColor = vec3(0.33, 0.18, 0.0); // ground
+        else if (cls == 3) pointColor = vec3(0.25, 0.49, 0.0); // low vegetation
+        else if (cls == 4) pointColor = vec3(0.36, 0.7,  0.0); // medium vegetation
+        else if (cls == 5) pointColor = vec3(0.52, 1.0,  0.0); // high vegetation
+        else if (cls == 6) pointColor = vec3(0.8,  0.0,  0.0); // building
+        else if (cls == 9) pointColor = vec3(0.0,  0.0,  0.8); // water
+    }
     // Ensure zero size points are discarded.  The actual minimum point size is
     // hardware and driver dependent, so set the fragMarkerShape to discarded for
     // good measure.
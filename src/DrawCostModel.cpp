@@ -3,6 +3,28 @@
 
 #include "DrawCostModel.h"
 
+#include <cmath>
+#include <cstdio>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "Geometry.h"
+#include "tinyformat.h"
+
+DrawCostModel::DrawCostModel()
+    : m_quality(1),
+    m_incQuality(1),
+    m_residualScale(10),
+    m_numRejected(0)
+{
+    // Weak conservative prior: assert that we can draw one million vertices
+    // in 50 millisecs, with uncertain cost for everything else.
+    m_coeffs << 0, 50, 0, 0, 0;
+    m_P = 100*Matrix::Identity();
+}
+
+
 // Figure out quality we should use to render points with the current camera
 // transformation
 double DrawCostModel::quality(double targetMillisecs,
@@ -23,10 +45,7 @@ double DrawCostModel::quality(double targetMillisecs,
     // Estimate frame time at each quality
     double frameTimeEst[numQualitySamps] = {0};
     for (int i = 0; i < numQualitySamps; ++i)
-    {
-        V3d v(1, drawCounts[i].numVertices, 0);
-        frameTimeEst[i] = m_modelCoeffs.dot(v);
-    }
+        frameTimeEst[i] = predictFrameTime(drawCounts[i]);
 
     // Interpolate desired quality using guess at the frame time
     bool expectMoreToDraw = false;
@@ -63,28 +82,122 @@ double DrawCostModel::quality(double targetMillisecs,
 }
 
 
-V3d DrawCostModel::fitCostModel(const DrawRecords& drawRecords)
+DrawCostModel::Vector DrawCostModel::features(const DrawCount& drawCount)
 {
-    // Initialize sums to nonzero for a weak conservative regularization:
-    // assert that we can draw nvsum vertices in tsum millisecs.
-    double nvsum = 1000000;
-    double tsum = 50;
+    // Scale terms so that the coefficients are all of a similar order of
+    // magnitude, for numerical stability.
+    Vector x;
+    x << 1,
+         drawCount.numVertices/1e6,
+         drawCount.numDrawCalls/1e3,
+         drawCount.numBytesUploaded/1e6,
+         drawCount.numMeshes;
+    return x;
+}
+
+
+double DrawCostModel::predictFrameTime(const DrawCount& drawCount) const
+{
+    // No term can have a negative cost.  Also keep a tiny minimum per-vertex
+    // cost so that the predicted time always increases with the quality.
+    Vector coeffs = m_coeffs.cwiseMax(0);
+    coeffs[1] = std::max(coeffs[1], 1e-3);
+    return coeffs.dot(features(drawCount));
+}
+
 
-    double regWeight = 1e-3;
-    nvsum *= regWeight;
-    tsum *= regWeight;
+bool DrawCostModel::addSample(const DrawCount& drawCount, double frameTime)
+{
+    // Weight of previous samples relative to the current one
+    const double forgetFactor = 0.9;
+    // Bound on the covariance, preventing windup of terms which aren't
+    // excited by recent samples.
+    const double maxCovarianceTrace = 1e4;
+    // Frames slower than predicted by this many typical errors are outliers
+    const double outlierThreshold = 4;
+    const double minOutlierMillisecs = 5;
+    // Accept anyway after this many consecutive outliers, since the cost of
+    // rendering has probably changed.
+    const int maxConsecutiveRejected = 3;
 
-    int numDrawRecs = (int)drawRecords.size();
-    for (int i = 0; i < numDrawRecs; ++i)
+    Vector x = features(drawCount);
+    double residual = frameTime - m_coeffs.dot(x);
+    if (residual > outlierThreshold*m_residualScale + minOutlierMillisecs &&
+        m_numRejected < maxConsecutiveRejected)
     {
-        // Weight in favour of recent measurements.
-        double w = exp(-0.2*(numDrawRecs - 1 - i));
-        auto& rec = drawRecords[i];
-        nvsum += w*rec.first.numVertices;
-        tsum += w*rec.second;
+        ++m_numRejected;
+        return false;
     }
+    m_numRejected = 0;
+    m_residualScale = 0.9*m_residualScale + 0.1*std::abs(residual);
 
-    return V3d(0, tsum/nvsum, 0);
+    // Recursive least squares update with exponential forgetting
+    Vector Px = m_P*x;
+    Vector gain = Px / (forgetFactor + x.dot(Px));
+    m_coeffs += gain*residual;
+    m_P = (m_P - gain*Px.transpose()) / forgetFactor;
+    m_P = 0.5*(m_P + m_P.transpose()).eval();
+    double trace = m_P.trace();
+    if (trace > maxCovarianceTrace)
+        m_P *= maxCovarianceTrace/trace;
+    return true;
 }
 
 
+//------------------------------------------------------------------------------
+void writeDrawCostSample(std::ostream& out, const DrawCostSample& sample)
+{
+    const DrawCount& dc = sample.drawCount;
+    tfm::format(out, "%.0f,%.0f,%.0f,%.0f,%.3f\n", dc.numVertices,
+                dc.numDrawCalls, dc.numBytesUploaded, dc.numMeshes,
+                sample.frameTime);
+}
+
+
+std::vector<DrawCostSample> readDrawCostTrace(std::istream& in)
+{
+    std::vector<DrawCostSample> trace;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        DrawCostSample sample;
+        DrawCount& dc = sample.drawCount;
+        if (sscanf(line.c_str(), "%lf,%lf,%lf,%lf,%lf", &dc.numVertices,
+                   &dc.numDrawCalls, &dc.numBytesUploaded, &dc.numMeshes,
+                   &sample.frameTime) == 5)
+        {
+            trace.push_back(sample);
+        }
+    }
+    return trace;
+}
+
+
+DrawCostReplayScore replayDrawCostTrace(DrawCostModel& model,
+                                        const std::vector<DrawCostSample>& trace,
+                                        double targetMillisecs)
+{
+    DrawCostReplayScore score;
+    double absErrSum = 0;
+    double sqErrSum = 0;
+    int numMissed = 0;
+    for (const DrawCostSample& sample : trace)
+    {
+        double predicted = model.predictFrameTime(sample.drawCount);
+        double err = sample.frameTime - predicted;
+        absErrSum += std::abs(err);
+        sqErrSum += err*err;
+        if (predicted <= targetMillisecs && sample.frameTime > targetMillisecs)
+            ++numMissed;
+        if (!model.addSample(sample.drawCount, sample.frameTime))
+            ++score.numRejected;
+        ++score.numFrames;
+    }
+    if (score.numFrames > 0)
+    {
+        score.meanAbsError = absErrSum/score.numFrames;
+        score.rmsError = std::sqrt(sqErrSum/score.numFrames);
+        score.missedTargetFraction = double(numMissed)/score.numFrames;
+    }
+    return score;
+}
@@ -4,11 +4,15 @@
 #ifndef DRAW_COST_MODEL_H_INCLUDED
 #define DRAW_COST_MODEL_H_INCLUDED
 
-#include <deque>
+#include <iosfwd>
 #include <vector>
 
-#include "Geometry.h"
-#include "util.h"
+#include <Eigen/Core>
+
+#include "DrawCount.h"
+
+class Geometry;
+struct TransformState;
 
 /// Frame time cost model for drawn geometry
 ///
@@ -18,52 +22,100 @@
 /// quality factor is applied to all geometry to achive some consistency in the
 /// amount of per-geometry quality degradation.
 ///
-/// We model the cost of drawing geometry as the function
+/// We model the cost of drawing geometry as the linear function
 ///
-///   t(T,q) = a*Nv(T,q)
+///   t(T,q) = a0 + a1*Nv(T,q) + a2*Nc(T,q) + a3*Nb(T,q) + a4*Nm(T)
 ///
 /// where
 ///   * t is the frame time
 ///   * T is the camera transformation
 ///   * q is the quality
 ///   * Nv is the number of vertices shaded
+///   * Nc is the number of draw calls
+///   * Nb is the number of bytes uploaded to the GPU
+///   * Nm is the number of meshes drawn
 ///
-/// and a is an unknown fitting parameter which depends on the shader, speed of
-/// the GPU etc.
+/// and a0..a4 are unknown fitting parameters which depend on the shader,
+/// speed of the GPU etc.  a0 accounts for fixed per-frame overhead.
+///
+/// The parameters are estimated online with recursive least squares, using
+/// a forgetting factor so that the model tracks changes in the cost of
+/// rendering.  Frames which take much longer than predicted (for example due
+/// to driver stalls) are rejected as outliers.
 class DrawCostModel
 {
     public:
-        DrawCostModel()
-            : m_quality(1),
-            m_incQuality(1),
-            m_maxDrawRecords(20),
-            m_drawRecords(),
-            m_modelCoeffs(fitCostModel(m_drawRecords))
-        { }
+        DrawCostModel();
 
         double quality(double targetMillisecs,
                        const std::vector<const Geometry*>& geoms,
                        const TransformState& transState, bool firstIncrementalFrame);
 
-        void addSample(const DrawCount& drawCount, double frameTime)
-        {
-            m_drawRecords.push_back(std::make_pair(drawCount, double(frameTime)));
-            if ((int)m_drawRecords.size() > m_maxDrawRecords)
-                m_drawRecords.pop_front();
-            m_modelCoeffs = fitCostModel(m_drawRecords);
-        }
+        /// Update the model with a measurement of the time taken to draw
+        /// `drawCount`.  Returns false if the sample was rejected as an
+        /// outlier.
+        bool addSample(const DrawCount& drawCount, double frameTime);
+
+        /// Predict time in milliseconds to draw the given geometry
+        double predictFrameTime(const DrawCount& drawCount) const;
 
     private:
-        typedef std::deque<std::pair<DrawCount,double>> DrawRecords;
+        static const int numTerms = 5;
+        typedef Eigen::Matrix<double,numTerms,1> Vector;
+        typedef Eigen::Matrix<double,numTerms,numTerms> Matrix;
 
-        static V3d fitCostModel(const DrawRecords& drawRecords);
+        static Vector features(const DrawCount& drawCount);
 
         double m_quality;
         double m_incQuality;
-        int m_maxDrawRecords;
-        DrawRecords m_drawRecords;
-        V3d m_modelCoeffs;
+        /// Model coefficients a0..a4, in units matching features()
+        Vector m_coeffs;
+        /// Recursive least squares inverse covariance estimate
+        Matrix m_P;
+        /// Typical absolute prediction error, for outlier rejection
+        double m_residualScale;
+        /// Number of consecutive rejected samples
+        int m_numRejected;
+};
+
+
+/// Measured frame time along with the amount drawn
+struct DrawCostSample
+{
+    DrawCount drawCount;
+    double frameTime;
+
+    DrawCostSample(const DrawCount& drawCount = DrawCount(), double frameTime = 0)
+        : drawCount(drawCount), frameTime(frameTime) {}
+};
+
+/// Write sample as a line of comma separated values:
+/// numVertices,numDrawCalls,numBytesUploaded,numMeshes,frameTime
+void writeDrawCostSample(std::ostream& out, const DrawCostSample& sample);
+
+/// Read trace of samples as written by writeDrawCostSample().  Lines which
+/// can't be parsed (eg, headers) are ignored.
+std::vector<DrawCostSample> readDrawCostTrace(std::istream& in);
+
+
+/// Summary of how well a DrawCostModel predicts the time of recorded frames
+struct DrawCostReplayScore
+{
+    int numFrames = 0;
+    int numRejected = 0;          ///< Frames rejected as outliers
+    double meanAbsError = 0;      ///< Mean absolute prediction error (ms)
+    double rmsError = 0;          ///< Root mean square prediction error (ms)
+    /// Fraction of frames predicted to be within the target frame time, but
+    /// which actually exceeded it
+    double missedTargetFraction = 0;
 };
 
+/// Replay a recorded trace through `model`, predicting the time of each
+/// frame before adding it as a sample, and score the predictions against a
+/// frame time target of `targetMillisecs`.
+DrawCostReplayScore replayDrawCostTrace(DrawCostModel& model,
+                                        const std::vector<DrawCostSample>& trace,
+                                        double targetMillisecs);
+
 
 #endif // DRAW_COST_MODEL_H_INCLUDED
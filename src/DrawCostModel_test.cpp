@@ -0,0 +1,112 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <random>
+#include <sstream>
+
+#include "DrawCostModel.h"
+
+
+namespace {
+
+// Synthetic frame time with fixed overhead, plus per vertex, per draw call,
+// per byte and per mesh costs.
+double syntheticFrameTime(const DrawCount& dc)
+{
+    return 3 + 20*dc.numVertices/1e6 + 5*dc.numDrawCalls/1e3 +
+           2*dc.numBytesUploaded/1e6 + 4*dc.numMeshes;
+}
+
+DrawCount randomDrawCount(std::mt19937& rng)
+{
+    std::uniform_real_distribution<double> uniform(0, 1);
+    DrawCount dc;
+    dc.numVertices = 2e6*uniform(rng);
+    dc.numDrawCalls = std::floor(2000*uniform(rng));
+    dc.numBytesUploaded = 16*dc.numVertices*uniform(rng);
+    dc.numMeshes = std::floor(3*uniform(rng));
+    return dc;
+}
+
+std::vector<DrawCostSample> syntheticTrace(int numFrames, std::mt19937& rng)
+{
+    std::vector<DrawCostSample> trace;
+    for (int i = 0; i < numFrames; ++i)
+    {
+        DrawCount dc = randomDrawCount(rng);
+        trace.push_back(DrawCostSample(dc, syntheticFrameTime(dc)));
+    }
+    return trace;
+}
+
+}
+
+
+TEST_CASE("DrawCostModel fits all cost terms")
+{
+    std::mt19937 rng(1);
+    DrawCostModel model;
+    for (int i = 0; i < 200; ++i)
+    {
+        DrawCount dc = randomDrawCount(rng);
+        model.addSample(dc, syntheticFrameTime(dc));
+    }
+    for (int i = 0; i < 20; ++i)
+    {
+        DrawCount dc = randomDrawCount(rng);
+        CHECK(model.predictFrameTime(dc) == Approx(syntheticFrameTime(dc)).epsilon(0.01));
+    }
+    // Fixed per-frame overhead is modelled
+    CHECK(model.predictFrameTime(DrawCount()) == Approx(3).epsilon(0.05));
+}
+
+
+TEST_CASE("DrawCostModel rejects stalled frames")
+{
+    std::mt19937 rng(2);
+    DrawCostModel model;
+    for (int i = 0; i < 100; ++i)
+    {
+        DrawCount dc = randomDrawCount(rng);
+        model.addSample(dc, syntheticFrameTime(dc));
+    }
+    DrawCount dc = randomDrawCount(rng);
+    double before = model.predictFrameTime(dc);
+    CHECK(!model.addSample(dc, syntheticFrameTime(dc) + 200));
+    CHECK(model.predictFrameTime(dc) == Approx(before));
+    // Persistent change in frame time is eventually accepted
+    bool accepted = false;
+    for (int i = 0; i < 5 && !accepted; ++i)
+        accepted = model.addSample(dc, syntheticFrameTime(dc) + 200);
+    CHECK(accepted);
+}
+
+
+TEST_CASE("DrawCostModel trace replay")
+{
+    std::mt19937 rng(3);
+    std::vector<DrawCostSample> trace = syntheticTrace(300, rng);
+    // Insert some driver stalls
+    for (size_t i = 50; i < trace.size(); i += 50)
+        trace[i].frameTime += 150;
+
+    // Round trip through the trace file format
+    std::stringstream traceFile;
+    traceFile << "numVertices,numDrawCalls,numBytesUploaded,numMeshes,frameTime\n";
+    for (const DrawCostSample& sample : trace)
+        writeDrawCostSample(traceFile, sample);
+    std::vector<DrawCostSample> readTrace = readDrawCostTrace(traceFile);
+    REQUIRE(readTrace.size() == trace.size());
+    CHECK(readTrace[10].drawCount.numDrawCalls == trace[10].drawCount.numDrawCalls);
+    CHECK(readTrace[10].frameTime == Approx(trace[10].frameTime).epsilon(1e-4));
+
+    DrawCostModel model;
+    DrawCostReplayScore score = replayDrawCostTrace(model, readTrace, 40);
+    CHECK(score.numFrames == 300);
+    CHECK(score.numRejected >= 5);
+    CHECK(score.missedTargetFraction < 0.05);
+    // Error is dominated by the stalls and the first few frames
+    CHECK(score.meanAbsError < 5);
+}
@@ -0,0 +1,133 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#ifndef DISPLAZ_ORDERED_WORK_QUEUE_H_INCLUDED
+#define DISPLAZ_ORDERED_WORK_QUEUE_H_INCLUDED
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Compute a sequence of results on a pool of worker threads, and hand them
+/// back in sequence order.
+///
+/// Workers claim items 0,1,...,numItems-1 in order and compute them with the
+/// work function.  Items may finish out of order; they're held in a reorder
+/// buffer until next() takes them.  To bound memory use, at most maxInFlight
+/// items are claimed but not yet taken at any time, so workers wait when the
+/// consumer falls behind.
+///
+/// If the work function throws, items before the failing one are still
+/// computed and returned in order, after which next() rethrows the exception.
+/// No later items are started.
+template<typename T>
+class OrderedWorkQueue
+{
+    public:
+        typedef std::function<std::unique_ptr<T>(int)> WorkFunc;
+
+        OrderedWorkQueue(int numItems, int numThreads, int maxInFlight,
+                         WorkFunc work)
+            : m_work(work),
+            m_maxInFlight(std::max(1, maxInFlight)),
+            m_nextClaimed(0),
+            m_nextTaken(0),
+            m_errorItem(numItems),
+            m_stopping(false)
+        {
+            for (int i = 0; i < std::max(1, numThreads); ++i)
+                m_threads.emplace_back(&OrderedWorkQueue::workerMain, this);
+        }
+
+        ~OrderedWorkQueue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stopping = true;
+            }
+            m_slotFree.notify_all();
+            for (std::thread& thread : m_threads)
+                thread.join();
+        }
+
+        /// Return result of the next item in sequence, waiting until it's
+        /// computed.  Must be called at most numItems times.
+        std::unique_ptr<T> next()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            int item = m_nextTaken;
+            m_itemDone.wait(lock, [this,item]{
+                return item >= m_errorItem || m_results.find(item) != m_results.end();
+            });
+            // Items finished before a failure are still handed back in order
+            auto result = m_results.find(item);
+            if (result == m_results.end())
+                std::rethrow_exception(m_error);
+            std::unique_ptr<T> value = std::move(result->second);
+            m_results.erase(result);
+            ++m_nextTaken;
+            lock.unlock();
+            m_slotFree.notify_all();
+            return value;
+        }
+
+    private:
+        void workerMain()
+        {
+            while (true)
+            {
+                int item = 0;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_slotFree.wait(lock, [this]{
+                        return m_stopping || m_nextClaimed >= m_errorItem ||
+                               m_nextClaimed < m_nextTaken + m_maxInFlight;
+                    });
+                    if (m_stopping || m_nextClaimed >= m_errorItem)
+                        return;
+                    item = m_nextClaimed++;
+                }
+                try
+                {
+                    std::unique_ptr<T> value = m_work(item);
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_results[item] = std::move(value);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (item < m_errorItem)
+                    {
+                        m_errorItem = item;
+                        m_error = std::current_exception();
+                    }
+                }
+                m_itemDone.notify_all();
+                m_slotFree.notify_all();
+            }
+        }
+
+        WorkFunc m_work;
+        int m_maxInFlight;
+
+        std::mutex m_mutex;
+        std::condition_variable m_itemDone;
+        std::condition_variable m_slotFree;
+        int m_nextClaimed;  ///< Next item to be claimed by a worker
+        int m_nextTaken;    ///< Next item to be returned by next()
+        int m_errorItem;    ///< First item which failed, or numItems
+        bool m_stopping;
+        std::exception_ptr m_error;
+        /// Reorder buffer of finished items
+        std::map<int, std::unique_ptr<T>> m_results;
+        std::vector<std::thread> m_threads;
+};
+
+
+#endif // DISPLAZ_ORDERED_WORK_QUEUE_H_INCLUDED
@@ -0,0 +1,59 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+#include "OrderedWorkQueue.h"
+
+
+TEST_CASE("Ordered work queue returns results in sequence")
+{
+    const int numItems = 200;
+    const int maxInFlight = 5;
+    std::atomic<int> maxClaimed(-1);
+    std::atomic<int> taken(0);
+    std::atomic<bool> inFlightBounded(true);
+    OrderedWorkQueue<int> queue(numItems, 4, maxInFlight,
+        [&](int i)
+        {
+            // `taken` lags the queue by up to one item
+            if (i > taken + maxInFlight)
+                inFlightBounded = false;
+            // Make later items finish first some of the time
+            if (i % 3 == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            int prev = maxClaimed;
+            while (prev < i && !maxClaimed.compare_exchange_weak(prev, i))
+                ;
+            return std::unique_ptr<int>(new int(10*i));
+        });
+    for (int i = 0; i < numItems; ++i)
+    {
+        std::unique_ptr<int> value = queue.next();
+        REQUIRE(value);
+        CHECK(*value == 10*i);
+        ++taken;
+    }
+    CHECK(inFlightBounded);
+    CHECK(maxClaimed == numItems - 1);
+}
+
+
+TEST_CASE("Ordered work queue propagates exceptions")
+{
+    OrderedWorkQueue<int> queue(10, 2, 4,
+        [](int i)
+        {
+            if (i == 3)
+                throw std::runtime_error("work failed");
+            return std::unique_ptr<int>(new int(i));
+        });
+    CHECK(*queue.next() == 0);
+    CHECK(*queue.next() == 1);
+    CHECK(*queue.next() == 2);
+    CHECK_THROWS_AS(queue.next(), const std::runtime_error&);
+}
@@ -0,0 +1,124 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "RenderBenchmark.h"
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+std::vector<CameraKeyframe> readCameraPath(std::istream& in)
+{
+    std::vector<CameraKeyframe> path;
+    std::string line;
+    int lineNum = 0;
+    while (std::getline(in, line))
+    {
+        ++lineNum;
+        size_t firstChar = line.find_first_not_of(" \t\r");
+        if (firstChar == std::string::npos || line[firstChar] == '#')
+            continue;
+        std::istringstream lineStream(line);
+        CameraKeyframe key;
+        std::string extra;
+        if (!(lineStream >> key.position.x >> key.position.y >> key.position.z
+                         >> key.yaw >> key.pitch >> key.roll >> key.radius) ||
+            (lineStream >> extra))
+        {
+            throw DisplazError("Expected \"x y z yaw pitch roll radius\" on "
+                               "line %d of camera path", lineNum);
+        }
+        path.push_back(key);
+    }
+    return path;
+}
+
+
+std::vector<CameraKeyframe> interpolateCameraPath(const std::vector<CameraKeyframe>& keys,
+                                                  int stepsPerSegment)
+{
+    if (keys.size() < 2 || stepsPerSegment < 1)
+        return keys;
+    std::vector<CameraKeyframe> path;
+    for (size_t i = 0; i + 1 < keys.size(); ++i)
+    {
+        const CameraKeyframe& k0 = keys[i];
+        const CameraKeyframe& k1 = keys[i+1];
+        for (int j = 0; j < stepsPerSegment; ++j)
+        {
+            double t = double(j)/stepsPerSegment;
+            CameraKeyframe key;
+            key.position = (1-t)*k0.position + t*k1.position;
+            key.yaw      = (1-t)*k0.yaw      + t*k1.yaw;
+            key.pitch    = (1-t)*k0.pitch    + t*k1.pitch;
+            key.roll     = (1-t)*k0.roll     + t*k1.roll;
+            key.radius   = (1-t)*k0.radius   + t*k1.radius;
+            path.push_back(key);
+        }
+    }
+    path.push_back(keys.back());
+    return path;
+}
+
+
+static void writeFrameStatsJson(std::ostream& out, const FrameStats& stats)
+{
+    const DrawCount& dc = stats.drawCount;
+    tfm::format(out, "{\"frameTime\": %.3f, \"targetTime\": %.3f, "
+                "\"cullTime\": %.3f, \"estimateTime\": %.3f, \"drawTime\": %.3f, "
+                "\"quality\": %.6g, \"points\": %.0f, \"nodes\": %.0f, "
+                "\"occludedNodes\": %.0f, \"drawCalls\": %.0f, \"bytesUploaded\": %.0f}",
+                stats.frameMillisecs, stats.targetMillisecs, stats.cullMillisecs,
+                stats.estimateMillisecs, stats.drawMillisecs, stats.quality,
+                dc.numVertices, dc.numNodes, dc.numOccludedNodes, dc.numDrawCalls,
+                dc.numBytesUploaded);
+}
+
+
+void writeBenchmarkJson(std::ostream& out, int width, int height,
+                        const std::vector<BenchmarkFrame>& frames)
+{
+    double interactiveSum = 0;
+    double interactiveMax = 0;
+    double refinedSum = 0;
+    tfm::format(out, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"frames\": [\n",
+                width, height);
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        const BenchmarkFrame& frame = frames[i];
+        const CameraKeyframe& cam = frame.camera;
+        double refinedTime = 0;
+        double refinedPoints = 0;
+        for (const FrameStats& stats : frame.refined)
+        {
+            refinedTime += stats.frameMillisecs;
+            refinedPoints += stats.drawCount.numVertices;
+        }
+        interactiveSum += frame.interactive.frameMillisecs;
+        interactiveMax = std::max(interactiveMax, frame.interactive.frameMillisecs);
+        refinedSum += refinedTime;
+
+        tfm::format(out, "    {\"frame\": %d,\n"
+                    "     \"camera\": {\"position\": [%.17g, %.17g, %.17g], "
+                    "\"angles\": [%.17g, %.17g, %.17g], \"radius\": %.17g},\n"
+                    "     \"interactive\": ",
+                    i, cam.position.x, cam.position.y, cam.position.z,
+                    cam.yaw, cam.pitch, cam.roll, cam.radius);
+        writeFrameStatsJson(out, frame.interactive);
+        tfm::format(out, ",\n     \"refined\": {\"frames\": %d, \"totalTime\": %.3f, "
+                    "\"points\": %.0f, \"perFrame\": [",
+                    frame.refined.size(), refinedTime, refinedPoints);
+        for (size_t j = 0; j < frame.refined.size(); ++j)
+        {
+            out << (j == 0 ? "\n       " : ",\n       ");
+            writeFrameStatsJson(out, frame.refined[j]);
+        }
+        out << "]}}" << (i + 1 < frames.size() ? ",\n" : "\n");
+    }
+    size_t n = std::max<size_t>(frames.size(), 1);
+    tfm::format(out, "  ],\n  \"summary\": {\"meanInteractiveTime\": %.3f, "
+                "\"maxInteractiveTime\": %.3f, \"meanRefinedTime\": %.3f}\n}\n",
+                interactiveSum/n, interactiveMax, refinedSum/n);
+}
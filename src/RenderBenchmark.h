@@ -0,0 +1,58 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#ifndef DISPLAZ_RENDER_BENCHMARK_H_INCLUDED
+#define DISPLAZ_RENDER_BENCHMARK_H_INCLUDED
+
+#include <iosfwd>
+#include <vector>
+
+#include "RenderStats.h"
+#include "util.h"
+
+/// Camera view at one point along a camera path.
+///
+/// The parameters are those accepted by the SET_VIEW_POSITION,
+/// SET_VIEW_ANGLES and SET_VIEW_RADIUS IPC commands.
+struct CameraKeyframe
+{
+    V3d position = V3d(0);  ///< View focus point
+    double yaw = 0;         ///< View angles in degrees
+    double pitch = 0;
+    double roll = 0;
+    double radius = 1;      ///< Distance from camera to focus point
+};
+
+/// Read camera path with one keyframe per line, in the format
+///
+///   x y z yaw pitch roll radius
+///
+/// Blank lines and lines starting with '#' are ignored.  Throws DisplazError
+/// on badly formatted input.
+std::vector<CameraKeyframe> readCameraPath(std::istream& in);
+
+/// Return path with `stepsPerSegment` frames linearly interpolated between
+/// each pair of consecutive keyframes.  The last keyframe is included, so a
+/// path of N keyframes results in (N-1)*stepsPerSegment + 1 frames.
+std::vector<CameraKeyframe> interpolateCameraPath(const std::vector<CameraKeyframe>& keys,
+                                                  int stepsPerSegment);
+
+
+/// Measurements for rendering one frame of a camera path benchmark
+struct BenchmarkFrame
+{
+    CameraKeyframe camera;
+    /// Single frame drawn within the interactive frame budget
+    FrameStats interactive;
+    /// Frames drawn when refining the view until all geometry is drawn,
+    /// starting from scratch
+    std::vector<FrameStats> refined;
+};
+
+/// Write benchmark results for an image size of `width` x `height` as JSON,
+/// including per-frame timings, points drawn and DrawCostModel quality.
+void writeBenchmarkJson(std::ostream& out, int width, int height,
+                        const std::vector<BenchmarkFrame>& frames);
+
+
+#endif // DISPLAZ_RENDER_BENCHMARK_H_INCLUDED
@@ -0,0 +1,56 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <sstream>
+
+#include "RenderBenchmark.h"
+
+
+TEST_CASE("Camera path parsing and interpolation")
+{
+    std::istringstream in(
+        "# x y z yaw pitch roll radius\n"
+        "0 0 0  0 90 0  10\n"
+        "\n"
+        "10 20 30  90 45 0  20\n"
+    );
+    std::vector<CameraKeyframe> keys = readCameraPath(in);
+    REQUIRE(keys.size() == 2);
+    CHECK(keys[1].position.y == 20);
+    CHECK(keys[1].yaw == 90);
+    CHECK(keys[1].radius == 20);
+
+    std::vector<CameraKeyframe> path = interpolateCameraPath(keys, 4);
+    REQUIRE(path.size() == 5);
+    CHECK(path[0].position.x == 0);
+    CHECK(path[2].position.z == Approx(15));
+    CHECK(path[2].pitch == Approx(67.5));
+    CHECK(path[4].radius == 20);
+
+    std::istringstream badIn("1 2 3 4 5 6\n");
+    CHECK_THROWS_AS(readCameraPath(badIn), const DisplazError&);
+    std::istringstream extraIn("1 2 3 4 5 6 7 8\n");
+    CHECK_THROWS_AS(readCameraPath(extraIn), const DisplazError&);
+}
+
+
+TEST_CASE("Benchmark JSON output")
+{
+    std::vector<BenchmarkFrame> frames(2);
+    frames[0].interactive.frameMillisecs = 20;
+    frames[0].interactive.drawCount.numVertices = 1000;
+    frames[1].interactive.frameMillisecs = 40;
+    frames[1].refined.resize(3);
+    for (FrameStats& stats : frames[1].refined)
+        stats.frameMillisecs = 30;
+    std::ostringstream out;
+    writeBenchmarkJson(out, 640, 480, frames);
+    std::string json = out.str();
+    CHECK(json.find("\"width\": 640") != std::string::npos);
+    CHECK(json.find("\"points\": 1000") != std::string::npos);
+    CHECK(json.find("\"frames\": 3, \"totalTime\": 90.000") != std::string::npos);
+    CHECK(json.find("\"meanInteractiveTime\": 30.000") != std::string::npos);
+    CHECK(json.find("\"maxInteractiveTime\": 40.000") != std::string::npos);
+}
@@ -0,0 +1,81 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "RenderStats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <ostream>
+
+#include "tinyformat.h"
+
+void writeFrameStatsHeader(std::ostream& out)
+{
+    out << "vertices,drawCalls,bytesUploaded,meshes,frameTime,"
+           "frame,incremental,quality,targetTime,cullTime,estimateTime,"
+           "drawTime,nodes,geomPoints\n";
+}
+
+
+void writeFrameStats(std::ostream& out, const FrameStats& stats)
+{
+    const DrawCount& dc = stats.drawCount;
+    tfm::format(out, "%.0f,%.0f,%.0f,%.0f,%.3f,%d,%d,%.6g,%.3f,%.3f,%.3f,%.3f,%.0f,",
+                dc.numVertices, dc.numDrawCalls, dc.numBytesUploaded,
+                dc.numMeshes, stats.frameMillisecs, stats.frameNumber,
+                stats.incremental ? 1 : 0, stats.quality,
+                stats.targetMillisecs, stats.cullMillisecs,
+                stats.estimateMillisecs, stats.drawMillisecs, dc.numNodes);
+    for (size_t i = 0; i < stats.geomPointCounts.size(); ++i)
+    {
+        if (i != 0)
+            out << ';';
+        tfm::format(out, "%.0f", stats.geomPointCounts[i]);
+    }
+    out << '\n';
+}
+
+
+//------------------------------------------------------------------------------
+RenderStats::RenderStats(size_t capacity)
+    : m_frames(std::max<size_t>(capacity, 1))
+{ }
+
+
+void RenderStats::addFrame(const FrameStats& stats)
+{
+    m_frames[m_next] = stats;
+    m_next = (m_next + 1) % m_frames.size();
+    m_size = std::min(m_size + 1, m_frames.size());
+    if (m_trace)
+        writeFrameStats(*m_trace, stats);
+}
+
+
+const FrameStats& RenderStats::recent(size_t i) const
+{
+    assert(i < m_size);
+    return m_frames[(m_next + m_frames.size() - 1 - i) % m_frames.size()];
+}
+
+
+void RenderStats::writeRecent(std::ostream& out, size_t numFrames) const
+{
+    writeFrameStatsHeader(out);
+    for (size_t i = std::min(numFrames, m_size); i > 0; --i)
+        writeFrameStats(out, recent(i-1));
+}
+
+
+bool RenderStats::setTraceFile(const std::string& fileName)
+{
+    m_trace.reset();
+    if (fileName.empty())
+        return true;
+    auto trace = std::make_unique<std::ofstream>(fileName);
+    if (!*trace)
+        return false;
+    writeFrameStatsHeader(*trace);
+    m_trace = std::move(trace);
+    return true;
+}
@@ -0,0 +1,78 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#ifndef DISPLAZ_RENDER_STATS_H_INCLUDED
+#define DISPLAZ_RENDER_STATS_H_INCLUDED
+
+#include <cstdint>
+#include <fstream>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DrawCount.h"
+
+/// Timing and geometry statistics for a single rendered frame
+struct FrameStats
+{
+    int64_t frameNumber = 0;
+    bool incremental = false;       ///< Frame refines the previous frame
+    double quality = 0;             ///< Quality chosen by DrawCostModel
+    double targetMillisecs = 0;     ///< Frame time budget
+    double frameMillisecs = 0;      ///< Actual frame time
+    double cullMillisecs = 0;       ///< Time spent in Geometry::cull()
+    double estimateMillisecs = 0;   ///< Time spent choosing the quality
+    double drawMillisecs = 0;       ///< Time spent drawing, including glFinish()
+    DrawCount drawCount;            ///< Total geometry drawn
+    /// Number of points drawn for each geometry in the selection
+    std::vector<double> geomPointCounts;
+};
+
+
+/// Write CSV header line naming the columns written by writeFrameStats()
+void writeFrameStatsHeader(std::ostream& out);
+
+/// Write frame stats as a line of comma separated values.
+///
+/// The first columns match writeDrawCostSample(), so traces can be fed
+/// directly to readDrawCostTrace().  The per-geometry point counts are
+/// written in the final column, separated by semicolons.
+void writeFrameStats(std::ostream& out, const FrameStats& stats);
+
+
+/// Fixed size history of recent frame statistics, with optional continuous
+/// logging to a CSV trace file.
+class RenderStats
+{
+    public:
+        RenderStats(size_t capacity = 256);
+
+        /// Record stats for a new frame, discarding the oldest frame if the
+        /// history is full.
+        void addFrame(const FrameStats& stats);
+
+        /// Number of frames in the history
+        size_t size() const { return m_size; }
+
+        /// Return stats for the i'th most recent frame; 0 is the latest.
+        const FrameStats& recent(size_t i) const;
+
+        /// Write CSV header followed by the `numFrames` most recent frames,
+        /// oldest first.
+        void writeRecent(std::ostream& out, size_t numFrames) const;
+
+        /// Start appending each new frame to a CSV trace at `fileName`,
+        /// or stop tracing if `fileName` is empty.  Return false if the
+        /// file couldn't be opened.
+        bool setTraceFile(const std::string& fileName);
+
+    private:
+        std::vector<FrameStats> m_frames;
+        size_t m_next = 0;
+        size_t m_size = 0;
+        std::unique_ptr<std::ofstream> m_trace;
+};
+
+
+#endif // DISPLAZ_RENDER_STATS_H_INCLUDED
@@ -0,0 +1,64 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <sstream>
+
+#include "DrawCostModel.h"
+#include "RenderStats.h"
+
+
+static FrameStats makeFrame(int frameNumber)
+{
+    FrameStats stats;
+    stats.frameNumber = frameNumber;
+    stats.frameMillisecs = 10 + frameNumber;
+    stats.drawCount.numVertices = 1000*frameNumber;
+    stats.drawCount.numDrawCalls = frameNumber;
+    stats.geomPointCounts = {600.0*frameNumber, 400.0*frameNumber};
+    return stats;
+}
+
+
+TEST_CASE("RenderStats history")
+{
+    RenderStats stats(4);
+    CHECK(stats.size() == 0);
+    for (int i = 0; i < 3; ++i)
+        stats.addFrame(makeFrame(i));
+    REQUIRE(stats.size() == 3);
+    CHECK(stats.recent(0).frameNumber == 2);
+    CHECK(stats.recent(2).frameNumber == 0);
+    // Oldest frames are discarded once the history is full
+    for (int i = 3; i < 10; ++i)
+        stats.addFrame(makeFrame(i));
+    REQUIRE(stats.size() == 4);
+    CHECK(stats.recent(0).frameNumber == 9);
+    CHECK(stats.recent(3).frameNumber == 6);
+}
+
+
+TEST_CASE("RenderStats CSV output")
+{
+    RenderStats stats(10);
+    for (int i = 1; i <= 5; ++i)
+        stats.addFrame(makeFrame(i));
+    std::stringstream out;
+    stats.writeRecent(out, 2);
+
+    std::string header, line;
+    std::getline(out, header);
+    CHECK(header.find("frameTime") != std::string::npos);
+    std::getline(out, line);
+    CHECK(line.substr(0, 14) == "4000,4,0,0,14.");
+    CHECK(line.substr(line.size() - 9) == "2400;1600");
+
+    // Traces can be replayed through the draw cost model
+    out.clear();
+    out.seekg(0);
+    std::vector<DrawCostSample> trace = readDrawCostTrace(out);
+    REQUIRE(trace.size() == 2);
+    CHECK(trace[1].drawCount.numVertices == 5000);
+    CHECK(trace[1].frameTime == Approx(15));
+}
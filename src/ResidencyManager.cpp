@@ -0,0 +1,122 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "ResidencyManager.h"
+
+#include <vector>
+
+ResidencyManager::ResidencyManager(uint64_t budgetBytes)
+    : m_budget(budgetBytes)
+{ }
+
+
+void ResidencyManager::setBudget(uint64_t budgetBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = budgetBytes;
+}
+
+
+uint64_t ResidencyManager::budget() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget;
+}
+
+
+ResidencyManager::Handle ResidencyManager::add(uint64_t bytes, std::function<void()> evict)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Handle handle = m_nextHandle++;
+    m_entries.push_front(Entry{handle, bytes, 0, std::move(evict)});
+    m_index[handle] = m_entries.begin();
+    m_stats.residentBytes += bytes;
+    m_stats.numEntries += 1;
+    return handle;
+}
+
+
+void ResidencyManager::remove(Handle handle)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(handle);
+    if (it == m_index.end())
+        return;
+    const Entry& entry = *it->second;
+    m_stats.residentBytes -= entry.bytes;
+    if (entry.pinCount > 0)
+        m_stats.pinnedBytes -= entry.bytes;
+    m_stats.numEntries -= 1;
+    m_entries.erase(it->second);
+    m_index.erase(it);
+}
+
+
+void ResidencyManager::touch(Handle handle)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(handle);
+    if (it != m_index.end())
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+}
+
+
+void ResidencyManager::pin(Handle handle)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(handle);
+    if (it == m_index.end())
+        return;
+    Entry& entry = *it->second;
+    if (entry.pinCount++ == 0)
+        m_stats.pinnedBytes += entry.bytes;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+}
+
+
+void ResidencyManager::unpin(Handle handle)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_index.find(handle);
+    if (it == m_index.end())
+        return;
+    Entry& entry = *it->second;
+    if (entry.pinCount > 0 && --entry.pinCount == 0)
+        m_stats.pinnedBytes -= entry.bytes;
+}
+
+
+size_t ResidencyManager::enforceBudget()
+{
+    std::vector<std::function<void()>> evictions;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.end();
+        while (m_stats.residentBytes > m_budget && it != m_entries.begin())
+        {
+            --it;
+            if (it->pinCount > 0)
+                continue;
+            m_stats.residentBytes -= it->bytes;
+            m_stats.numEntries -= 1;
+            m_stats.numEvictions += 1;
+            m_stats.evictedBytes += it->bytes;
+            evictions.push_back(std::move(it->evict));
+            m_index.erase(it->handle);
+            it = m_entries.erase(it);
+        }
+    }
+    for (auto& evict : evictions)
+    {
+        if (evict)
+            evict();
+    }
+    return evictions.size();
+}
+
+
+ResidencyStats ResidencyManager::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stats;
+}
@@ -0,0 +1,88 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#ifndef DISPLAZ_RESIDENCY_MANAGER_H_INCLUDED
+#define DISPLAZ_RESIDENCY_MANAGER_H_INCLUDED
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/// Memory use and eviction counts for a ResidencyManager
+struct ResidencyStats
+{
+    uint64_t residentBytes = 0; ///< Total size of all entries
+    uint64_t pinnedBytes = 0;   ///< Size of entries which can't be evicted
+    uint64_t numEntries = 0;
+    uint64_t numEvictions = 0;  ///< Total entries evicted so far
+    uint64_t evictedBytes = 0;  ///< Total bytes evicted so far
+};
+
+
+/// Least recently used residency tracking for data which can be reloaded on
+/// demand, such as decoded nodes of a spatial hierarchy and the raw file
+/// pages they are read from.
+///
+/// Owners register each piece of data with add(), passing a function which
+/// frees it.  When the total size exceeds the byte budget, enforceBudget()
+/// frees the least recently used entries which aren't pinned.
+///
+/// Eviction only happens within enforceBudget(), so owners control which
+/// thread their data is freed on; all other functions may be called from any
+/// thread.  Eviction functions are called without any internal lock held,
+/// after their entry has been removed.
+class ResidencyManager
+{
+    public:
+        typedef uint64_t Handle; ///< Entry identifier; zero is never used
+
+        explicit ResidencyManager(uint64_t budgetBytes);
+
+        void setBudget(uint64_t budgetBytes);
+        uint64_t budget() const;
+
+        /// Register `bytes` of newly loaded data as most recently used,
+        /// with function `evict` to free it
+        Handle add(uint64_t bytes, std::function<void()> evict);
+
+        /// Stop tracking data which the owner has freed itself.  The
+        /// eviction function isn't called.  Unknown handles are ignored.
+        void remove(Handle handle);
+
+        /// Mark entry as most recently used
+        void touch(Handle handle);
+
+        /// Prevent entry from being evicted until a matching unpin().
+        /// Pinning also marks the entry as most recently used.
+        void pin(Handle handle);
+        void unpin(Handle handle);
+
+        /// Evict least recently used unpinned entries until the resident
+        /// size is within budget.  Return the number of entries evicted.
+        size_t enforceBudget();
+
+        ResidencyStats stats() const;
+
+    private:
+        struct Entry
+        {
+            Handle handle;
+            uint64_t bytes;
+            int pinCount;
+            std::function<void()> evict;
+        };
+        typedef std::list<Entry> EntryList;
+
+        mutable std::mutex m_mutex;
+        uint64_t m_budget;
+        Handle m_nextHandle = 1;
+        /// Entries in order of use, most recent first
+        EntryList m_entries;
+        std::unordered_map<Handle, EntryList::iterator> m_index;
+        ResidencyStats m_stats;
+};
+
+
+#endif // DISPLAZ_RESIDENCY_MANAGER_H_INCLUDED
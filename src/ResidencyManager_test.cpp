@@ -0,0 +1,54 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <vector>
+
+#include "ResidencyManager.h"
+
+
+TEST_CASE("Residency manager evicts least recently used entries")
+{
+    ResidencyManager residency(300);
+    std::vector<int> evicted;
+    auto evictFunc = [&](int i) { return [&evicted,i]() { evicted.push_back(i); }; };
+    ResidencyManager::Handle h0 = residency.add(100, evictFunc(0));
+    ResidencyManager::Handle h1 = residency.add(100, evictFunc(1));
+    ResidencyManager::Handle h2 = residency.add(100, evictFunc(2));
+    CHECK(residency.enforceBudget() == 0);
+    CHECK(residency.stats().residentBytes == 300);
+
+    // Least recently used is now h1
+    residency.touch(h0);
+    residency.add(100, evictFunc(3));
+    CHECK(residency.enforceBudget() == 1);
+    REQUIRE(evicted.size() == 1);
+    CHECK(evicted[0] == 1);
+
+    // Pinned entries survive even when least recently used
+    residency.pin(h2);
+    residency.touch(h0);
+    residency.add(150, evictFunc(4));
+    CHECK(residency.enforceBudget() == 2);
+    REQUIRE(evicted.size() == 3);
+    CHECK(evicted[1] == 3);
+    CHECK(evicted[2] == 0);
+
+    ResidencyStats stats = residency.stats();
+    CHECK(stats.residentBytes == 250);
+    CHECK(stats.pinnedBytes == 100);
+    CHECK(stats.numEntries == 2);
+    CHECK(stats.numEvictions == 3);
+    CHECK(stats.evictedBytes == 300);
+
+    // Removed entries are forgotten without calling the eviction function
+    residency.unpin(h2);
+    residency.remove(h2);
+    residency.remove(h1);
+    residency.setBudget(0);
+    CHECK(residency.enforceBudget() == 1);
+    CHECK(evicted.size() == 4);
+    CHECK(evicted[3] == 4);
+    CHECK(residency.stats().residentBytes == 0);
+}
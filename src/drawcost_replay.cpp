@@ -0,0 +1,52 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Replay recorded frame time traces through DrawCostModel and report how
+// well it predicts the time of each frame.
+//
+// Traces are comma separated files as written by writeDrawCostSample().
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "DrawCostModel.h"
+
+#include "tinyformat.h"
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        tfm::printfln("Usage: %s trace.csv [trace2.csv ...] [--target millisecs]", argv[0]);
+        return EXIT_FAILURE;
+    }
+    double targetMillisecs = 40;
+    std::vector<const char*> traceFiles;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]) == "--target" && i + 1 < argc)
+            targetMillisecs = atof(argv[++i]);
+        else
+            traceFiles.push_back(argv[i]);
+    }
+    tfm::printfln("%-30s %8s %8s %10s %10s %8s", "trace", "frames",
+                  "rejected", "mean_err", "rms_err", "missed");
+    for (const char* fileName : traceFiles)
+    {
+        std::ifstream file(fileName);
+        if (!file)
+        {
+            tfm::printfln("Could not open %s", fileName);
+            return EXIT_FAILURE;
+        }
+        DrawCostModel model;
+        DrawCostReplayScore score = replayDrawCostTrace(model, readDrawCostTrace(file),
+                                                        targetMillisecs);
+        tfm::printfln("%-30s %8d %8d %10.2f %10.2f %7.1f%%", fileName,
+                      score.numFrames, score.numRejected, score.meanAbsError,
+                      score.rmsError, 100*score.missedTargetFraction);
+    }
+    return EXIT_SUCCESS;
+}
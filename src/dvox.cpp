@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <fstream>
 #include <queue>
+#include <thread>
 #include <unordered_map>
 
 #include "argparse.h"
@@ -35,9 +36,13 @@ int main(int argc, char* argv[])
     float pointRadius = 0.2f;
     int brickRes = 8;
     double leafNodeWidth = 2.5;
+    int leafPointCount = 4096;
 
     double dbTileSize = 100;
     double dbCacheSize = 100;
+    double dbWriteBufferSize = 256;
+
+    int numThreads = std::max(1, (int)std::thread::hardware_concurrency());
 
     bool logProgress = false;
     int logLevel = Logger::Info;
@@ -58,11 +63,14 @@ int main(int argc, char* argv[])
                                         "Bounding box for hcloud (min_x min_y min_z width)",
         "-pointradius %f", &pointRadius, "Assumed radius of points used during voxelization",
         "-brickresolution %d", &brickRes, "Resolution of octree bricks",
-        "-leafnoderadius %F", &leafNodeWidth, "Desired width for octree leaf nodes",
+        "-leafnoderadius %F", &leafNodeWidth, "Minimum width for octree leaf nodes",
+        "-leafpoints %d", &leafPointCount, "Split octree nodes containing more than this many points (default 4096)",
+        "-threads %d", &numThreads, "Number of worker threads for conversion and voxelization (default: number of cores)",
 
         "<SEPARATOR>", "\nPoint Database options:",
         "-dbtilesize %F", &dbTileSize, "Tile size of temporary point database",
         "-dbcachesize %F", &dbCacheSize, "In-memory cache size for database in MB (default 100 MB)",
+        "-dbwritebuffer %F", &dbWriteBufferSize, "Write buffer size per database tile in KB (default 256 KB)",
 
         "<SEPARATOR>", "\nInformational options:",
         "-loglevel %d",  &logLevel,    "Logger verbosity (default 3 = info, greater is more verbose)",
@@ -101,8 +109,10 @@ int main(int argc, char* argv[])
                                             g_positionalArgs.end()-1);
         if (endswith(outputPath.toLower(), ".pointdb"))
         {
-            convertLasToPointDb(outputPath, inputPaths,
-                                Imath::Box3d(), dbTileSize, logger);
+            convertLasToPointDb(outputPath, inputPaths, Imath::Box3d(), dbTileSize,
+                                (size_t)(dbWriteBufferSize*1024),
+                                (size_t)(dbCacheSize*1024*1024),
+                                numThreads, logger);
         }
         else
         {
@@ -121,12 +131,13 @@ int main(int argc, char* argv[])
                                   (size_t)(dbCacheSize*1024*1024),
                                   logger);
 
-            int leafDepth = (int)floor(log(rootNodeWidth/leafNodeWidth)/log(2) + 0.5);
-            logger.info("Leaf node width = %.3f", rootNodeWidth / (1 << leafDepth));
+            int maxDepth = (int)floor(log(rootNodeWidth/leafNodeWidth)/log(2) + 0.5);
+            logger.info("Minimum leaf node width = %.3f", rootNodeWidth / (1 << maxDepth));
             std::ofstream outputFile(outputPath);
             voxelizePointCloud(outputFile, pointDb, pointRadius,
                                boundMin, rootNodeWidth,
-                               leafDepth, brickRes, logger);
+                               maxDepth, leafPointCount, brickRes, numThreads,
+                               logger);
         }
     }
     catch (std::exception& e)
@@ -7,6 +7,7 @@
 #include "DataSetUI.h"
 #include "fileloader.h"
 #include "geometrycollection.h"
+#include "HCloudView.h"
 #include "HelpDialog.h"
 #include "IpcChannel.h"
 #include "QtLogger.h"
@@ -18,6 +19,7 @@
 #include "View3D.h"
 #include "HookFormatter.h"
 #include "HookManager.h"
+#include "RenderBenchmark.h"
 
 #include <QSignalMapper>
 #include <QThread>
@@ -40,7 +42,8 @@
 #include <QDropEvent>
 #include <QLocalServer>
 #include <QMimeData>
-#include <QGLFormat>
+#include <QImage>
+#include <QPointer>
 #include <QPushButton>
 #include <QLabel>
 #include <QDesktopServices>
@@ -54,6 +57,8 @@ std::vector<std::vector<size_t>> dbscanCluster(const std::vector<Point3D>& point
 #include <Eigen/Dense>
 #include <vector>
 #include <cmath>
+#include <fstream>
+#include <sstream>
 
 using Point = Eigen::Vector3d;
 
@@ -112,10 +117,18 @@ void dbscan(const std::vector<Point>& points, double eps, int minPts, std::vecto
     }
 }
 
+/// Camera rotation for view angles in degrees, as in SET_VIEW_ANGLES
+static QQuaternion viewAnglesRotation(double yaw, double pitch, double roll)
+{
+    return QQuaternion::fromAxisAndAngle(0,0,1, roll)  *
+           QQuaternion::fromAxisAndAngle(1,0,0, pitch-90) *
+           QQuaternion::fromAxisAndAngle(0,0,1, yaw);
+}
+
 //------------------------------------------------------------------------------
 // MainWindow implementation
 
-MainWindow::MainWindow(const QGLFormat& format)
+MainWindow::MainWindow(bool offscreen)
     : m_settings(QSettings::IniFormat, QSettings::UserScope, QCoreApplication::organizationName(), QCoreApplication::applicationName()),
     m_maxPointCount(200*1000*1000), // 200 million
     m_geometries(0),
@@ -265,20 +278,24 @@ MainWindow::MainWindow(const QGLFormat& format)
     //connect(m_, SIGNAL(aboutToShow()), this, SLOT(updateRecentFiles()));
     //
     //
-    QWidget* mapWindow = new QWidget();
-    mapWindow->setWindowTitle("Map");
-    mapWindow->resize(800, 600);
+    // The map view isn't needed for batch rendering
+    if (!offscreen)
+    {
+        QWidget* mapWindow = new QWidget();
+        mapWindow->setWindowTitle("Map");
+        mapWindow->resize(800, 600);
 
-    QWebEngineView* webView = new QWebEngineView(mapWindow);
-    webView->load(QUrl("http://localhost:8000/map.html"));
+        QWebEngineView* webView = new QWebEngineView(mapWindow);
+        webView->load(QUrl("http://localhost:8000/map.html"));
 
-    // Create layout and add webView
-    QVBoxLayout* layout = new QVBoxLayout(mapWindow);
-    layout->setContentsMargins(0, 0, 0, 0);  // Optional: no margins
-    layout->addWidget(webView);
+        // Create layout and add webView
+        QVBoxLayout* layout = new QVBoxLayout(mapWindow);
+        layout->setContentsMargins(0, 0, 0, 0);  // Optional: no margins
+        layout->addWidget(webView);
 
-    mapWindow->setLayout(layout);
-    mapWindow->show();
+        mapWindow->setLayout(layout);
+        mapWindow->show();
+    }
 
     m_poleListWidget = new QListWidget(this);
     m_poleListWidget->setMinimumWidth(200);
@@ -376,7 +393,7 @@ MainWindow::MainWindow(const QGLFormat& format)
     // Point viewer
     DataSetUI* dataSetUI = new DataSetUI(this);
 
-    m_pointView = new View3D(m_geometries, format, this, dataSetUI);
+    m_pointView = new View3D(m_geometries, this, dataSetUI, offscreen);
     setCentralWidget(m_pointView);
     connect(m_trackBall, SIGNAL(triggered(bool)),
             &(m_pointView->camera()), SLOT(setTrackballInteraction(bool)));
@@ -403,6 +420,8 @@ MainWindow::MainWindow(const QGLFormat& format)
     viewMenu->addAction(m_pointView->m_axesAction);
     viewMenu->addAction(m_pointView->m_gridAction);
     viewMenu->addAction(m_pointView->m_annotationAction);
+    viewMenu->addAction(m_pointView->m_renderStatsAction);
+    viewMenu->addAction(m_pointView->m_occlusionCullingAction);
 
     //--------------------------------------------------
     // Docked widgets
@@ -903,11 +922,7 @@ void MainWindow::handleMessage(QByteArray message)
             std::cerr << "Could not parse Euler angles for view\n";
             return;
         }
-        m_pointView->camera().setRotation(
-            QQuaternion::fromAxisAndAngle(0,0,1, roll)  *
-            QQuaternion::fromAxisAndAngle(1,0,0, pitch-90) *
-            QQuaternion::fromAxisAndAngle(0,0,1, yaw)
-        );
+        m_pointView->camera().setRotation(viewAnglesRotation(yaw, pitch, roll));
     }
     else if (commandTokens[0] == "SET_VIEW_ROTATION")
     {
@@ -941,6 +956,24 @@ void MainWindow::handleMessage(QByteArray message)
         }
         m_pointView->camera().setEyeToCenterDistance(viewRadius);
     }
+    else if (commandTokens[0] == "SET_FRAME_BUDGET")
+    {
+        if (commandTokens.size() != 3)
+        {
+            std::cerr << "Expected interactive and refinement frame budgets\n";
+            return;
+        }
+        bool interactiveOk = false, refineOk = false;
+        double interactiveMillisecs = commandTokens[1].toDouble(&interactiveOk);
+        double refineMillisecs      = commandTokens[2].toDouble(&refineOk);
+        if (!interactiveOk || !refineOk ||
+            interactiveMillisecs <= 0 || refineMillisecs <= 0)
+        {
+            std::cerr << "Could not parse frame budget\n";
+            return;
+        }
+        m_pointView->setFrameBudget(interactiveMillisecs, refineMillisecs);
+    }
     else if (commandTokens[0] == "QUERY_CURSOR")
     {
         // Yuck!
@@ -954,6 +987,99 @@ void MainWindow::handleMessage(QByteArray message)
         std::string response = tfm::format("%.15g %.15g %.15g", p.x, p.y, p.z);
         channel->sendMessage(QByteArray(response.data(), (int)response.size()));
     }
+    else if (commandTokens[0] == "QUERY_RENDER_STATS")
+    {
+        IpcChannel* channel = dynamic_cast<IpcChannel*>(sender());
+        if (!channel)
+        {
+            qWarning() << "Signalling object not a IpcChannel!\n";
+            return;
+        }
+        RenderStats& stats = m_pointView->renderStats();
+        size_t numFrames = stats.size();
+        if (commandTokens.size() > 1)
+        {
+            bool ok = false;
+            int n = commandTokens[1].toInt(&ok);
+            if (!ok || n < 0)
+            {
+                std::cerr << "Could not parse number of frames\n";
+                return;
+            }
+            numFrames = n;
+        }
+        std::ostringstream out;
+        stats.writeRecent(out, numFrames);
+        std::string response = out.str();
+        channel->sendMessage(QByteArray(response.data(), (int)response.size()));
+    }
+    else if (commandTokens[0] == "SET_RENDER_TRACE")
+    {
+        std::string fileName;
+        if (commandTokens.size() > 1)
+            fileName = commandTokens[1].toStdString();
+        if (!m_pointView->renderStats().setTraceFile(fileName))
+            g_logger.error("Could not open render trace file \"%s\"", fileName);
+    }
+    else if (commandTokens[0] == "RENDER_IMAGE")
+    {
+        if (commandTokens.size() != 4)
+        {
+            std::cerr << "Expected image file name, width and height\n";
+            return;
+        }
+        QString fileName = QString::fromUtf8(commandTokens[1]);
+        bool widthOk = false, heightOk = false;
+        QSize size(commandTokens[2].toInt(&widthOk), commandTokens[3].toInt(&heightOk));
+        if (!widthOk || !heightOk || size.isEmpty())
+        {
+            std::cerr << "Could not parse image size\n";
+            return;
+        }
+        QPointer<IpcChannel> channel = dynamic_cast<IpcChannel*>(sender());
+        runAfterPendingLoads([this, channel, fileName, size]()
+        {
+            QImage image = m_pointView->renderImage(size);
+            QByteArray response = "OK";
+            if (!image.save(fileName))
+                response = "Could not write image " + fileName.toUtf8();
+            if (channel)
+                channel->sendMessage(response);
+        });
+    }
+    else if (commandTokens[0] == "RUN_BENCHMARK")
+    {
+        if (commandTokens.size() != 6)
+        {
+            std::cerr << "Expected camera path, output file, width, height and steps\n";
+            return;
+        }
+        QString pathFileName = QString::fromUtf8(commandTokens[1]);
+        QString jsonFileName = QString::fromUtf8(commandTokens[2]);
+        bool widthOk = false, heightOk = false, stepsOk = false;
+        QSize size(commandTokens[3].toInt(&widthOk), commandTokens[4].toInt(&heightOk));
+        int stepsPerSegment = commandTokens[5].toInt(&stepsOk);
+        if (!widthOk || !heightOk || !stepsOk || size.isEmpty())
+        {
+            std::cerr << "Could not parse benchmark image size or steps\n";
+            return;
+        }
+        QPointer<IpcChannel> channel = dynamic_cast<IpcChannel*>(sender());
+        runAfterPendingLoads([=]()
+        {
+            QByteArray response = "OK";
+            try
+            {
+                runBenchmark(pathFileName, jsonFileName, size, stepsPerSegment);
+            }
+            catch (std::exception& e)
+            {
+                response = e.what();
+            }
+            if (channel)
+                channel->sendMessage(response);
+        });
+    }
     else if (commandTokens[0] == "QUIT")
     {
         close();
@@ -1170,6 +1296,7 @@ void MainWindow::openShaderFile(const QString& shaderFileName)
     m_currShaderFileName = shaderFile.fileName();
     QByteArray src = shaderFile.readAll();
     m_shaderEditor->setPlainText(src);
+    m_pointView->makeRenderCurrent();
     m_pointView->shaderProgram().setShader(src);
     m_pointView->enable().set(src);
     m_settings.setValue("lastShader", m_currShaderFileName);
@@ -1221,6 +1348,7 @@ void MainWindow::saveShaderFile()
 
 void MainWindow::compileShaderFile()
 {
+    m_pointView->makeRenderCurrent();
     m_pointView->shaderProgram().setShader(m_shaderEditor->toPlainText());
     m_pointView->enable().set(m_shaderEditor->toPlainText());
 }
@@ -1253,6 +1381,51 @@ void MainWindow::helpDialog()
 }
 
 
+void MainWindow::runAfterPendingLoads(std::function<void()> func)
+{
+    // The loader thread handles requests in order, so queue a request behind
+    // any pending file loads.  func is then queued back to the GUI thread,
+    // after the loaded geometry has been added.
+    QMetaObject::invokeMethod(m_fileLoader, [this, func]()
+    {
+        QMetaObject::invokeMethod(this, func, Qt::QueuedConnection);
+    }, Qt::QueuedConnection);
+}
+
+
+void MainWindow::runBenchmark(const QString& pathFileName, const QString& jsonFileName,
+                              const QSize& size, int stepsPerSegment)
+{
+    std::ifstream pathFile(pathFileName.toStdString());
+    if (!pathFile)
+        throw DisplazError("Could not open camera path \"%s\"", pathFileName.toStdString());
+    std::vector<CameraKeyframe> path = interpolateCameraPath(readCameraPath(pathFile),
+                                                             stepsPerSegment);
+    RenderStats& stats = m_pointView->renderStats();
+    std::vector<BenchmarkFrame> frames;
+    for (const CameraKeyframe& key : path)
+    {
+        m_pointView->setExplicitCursorPos(key.position);
+        m_pointView->camera().setRotation(viewAnglesRotation(key.yaw, key.pitch, key.roll));
+        m_pointView->camera().setEyeToCenterDistance(key.radius);
+        BenchmarkFrame frame;
+        frame.camera = key;
+        m_pointView->renderOffscreen(size, false);
+        frame.interactive = stats.recent(0);
+        size_t numRefined = std::min<size_t>(m_pointView->renderOffscreen(size, true),
+                                             stats.size());
+        for (size_t i = numRefined; i > 0; --i)
+            frame.refined.push_back(stats.recent(i-1));
+        frames.push_back(frame);
+    }
+    std::ofstream jsonFile(jsonFileName.toStdString());
+    writeBenchmarkJson(jsonFile, size.width(), size.height(), frames);
+    if (!jsonFile)
+        throw DisplazError("Could not write benchmark results to \"%s\"", jsonFileName.toStdString());
+    g_logger.info("Wrote benchmark results for %d frames to %s", frames.size(), jsonFileName);
+}
+
+
 void MainWindow::screenShot()
 {
     const QString screenShotDirectory = m_settings.value("screenShotDirectory").toString();
@@ -1375,6 +1548,14 @@ void MainWindow::readSettings()
     m_dockDataSetVisible          = m_settings.value("dataSet").toBool();
     m_dockLogVisible              = m_settings.value("log").toBool();
 
+    // Memory for streamed hcloud data and its vertex buffers, in MB
+    const double hcloudMemoryBudget = m_settings.value("hcloudMemoryBudget",
+                                            HCloudView::memoryBudget()/(1024.0*1024.0)).toDouble();
+    HCloudView::setMemoryBudget(uint64_t(hcloudMemoryBudget*1024*1024));
+    const double hcloudGpuMemoryBudget = m_settings.value("hcloudGpuMemoryBudget",
+                                            HCloudView::gpuMemoryBudget()/(1024.0*1024.0)).toDouble();
+    HCloudView::setGpuMemoryBudget(uint64_t(hcloudGpuMemoryBudget*1024*1024));
+
     m_settings.beginGroup("view");
     m_pointView->readSettings(m_settings);
     m_settings.endGroup();
@@ -1398,6 +1579,8 @@ void MainWindow::writeSettings()
     m_settings.setValue("shaderParameters", m_dockShaderParametersVisible);
     m_settings.setValue("dataSet",          m_dockDataSetVisible);
     m_settings.setValue("log",              m_dockLogVisible);
+    m_settings.setValue("hcloudMemoryBudget", HCloudView::memoryBudget()/(1024.0*1024.0));
+    m_settings.setValue("hcloudGpuMemoryBudget", HCloudView::gpuMemoryBudget()/(1024.0*1024.0));
 
     m_settings.beginGroup("view");
     m_pointView->writeSettings(m_settings);
@@ -21,7 +21,6 @@ class QSignalMapper;
 class QPlainTextEdit;
 class QProgressBar;
 class QModelIndex;
-class QGLFormat;
 
 class HelpDialog;
 class View3D;
@@ -40,7 +39,9 @@ class MainWindow : public QMainWindow
     Q_OBJECT
 
     public:
-        MainWindow(const QGLFormat& format);
+        /// If `offscreen` is true no windows are shown, and the point view
+        /// draws using a windowless OpenGL context.  See View3D.
+        MainWindow(bool offscreen = false);
 
         /// Hint at an appropriate size
         QSize sizeHint() const;
@@ -95,6 +96,15 @@ class MainWindow : public QMainWindow
         void readSettings();
         void writeSettings();
 
+        /// Run `func` on the GUI thread once all currently requested file
+        /// loads have completed.
+        void runAfterPendingLoads(std::function<void()> func);
+
+        /// Render frames along the camera path in `pathFileName` offscreen,
+        /// writing timings to `jsonFileName`.  See RenderBenchmark.h
+        void runBenchmark(const QString& pathFileName, const QString& jsonFileName,
+                          const QSize& size, int stepsPerSegment);
+
     private:
         // Gui objects
         QProgressBar* m_progressBar = nullptr;
@@ -5,7 +5,7 @@
 
 //#include <QDataStream>
 #include <QApplication>
-#include <QGLFormat>
+#include <QSurfaceFormat>
 
 #include "argparse.h"
 #include "config.h"
@@ -45,6 +45,7 @@ int guimain(int argc, char* argv[])
     std::string lockId;
     std::string socketName;
     std::string serverName;
+    bool offscreen = false;
 
     ArgParse::ArgParse ap;
     ap.options(
@@ -53,6 +54,7 @@ int guimain(int argc, char* argv[])
         "-instancelock %s %s", &lockName, &lockId, "Single instance lock name and ID to reacquire",
         "-socketname %s",      &socketName,        "Local socket name for IPC",
         "-server %s",          &serverName,        "DEBUG: Compute lock file and socket name; do not inherit lock",
+        "-offscreen",          &offscreen,         "Run without showing any windows, for batch rendering",
         NULL
     );
 
@@ -68,6 +70,46 @@ int guimain(int argc, char* argv[])
     QCoreApplication::setOrganizationDomain("github.com/c42f/displaz");
     QCoreApplication::setAttribute(Qt::AA_EnableHighDpiScaling);
 
+#if defined(Q_OS_UNIX) && !defined(Q_OS_MAC)
+    // Offscreen rendering uses a windowless OpenGL context, so there's no
+    // need for an X server.  The offscreen platform plugin can only create
+    // contexts through GLX, so use it only when a display is available.
+    // Otherwise use EGL directly: Mesa's surfaceless platform needs neither
+    // a display server nor a KMS device.  Other platform plugins can be
+    // chosen by setting QT_QPA_PLATFORM explicitly.
+    if (offscreen && qgetenv("QT_QPA_PLATFORM").isEmpty())
+    {
+        auto setDefaultEnv = [](const char* name, const char* value)
+        {
+            if (qgetenv(name).isEmpty())
+                qputenv(name, value);
+        };
+        if (!qgetenv("DISPLAY").isEmpty())
+        {
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        }
+        else
+        {
+            qputenv("QT_QPA_PLATFORM", "eglfs");
+            setDefaultEnv("QT_QPA_EGLFS_INTEGRATION", "none");
+            setDefaultEnv("QT_QPA_EGLFS_DISABLE_INPUT", "1");
+            setDefaultEnv("EGL_PLATFORM", "surfaceless");
+        }
+    }
+#endif
+
+    // Multisampled antialiasing - this makes rendered point clouds look much
+    // nicer, but also makes the render much slower, especially on lower
+    // powered graphics cards.
+    //
+    // The default format must be set before creating the application for
+    // QOpenGLWidget to pick it up on all platforms.
+    QSurfaceFormat f = QSurfaceFormat::defaultFormat();
+    f.setVersion( 3, 2 );
+    f.setProfile( QSurfaceFormat::CoreProfile );
+    //f.setSamples(4);
+    QSurfaceFormat::setDefaultFormat(f);
+
     QApplication app(argc, argv);
 
     setupQFileSearchPaths();
@@ -77,16 +119,7 @@ int guimain(int argc, char* argv[])
     qRegisterMetaType<std::shared_ptr<Geometry>>("std::shared_ptr<Geometry>");
     qRegisterMetaType<std::shared_ptr<GeometryMutator>>("std::shared_ptr<GeometryMutator>");
 
-    // Multisampled antialiasing - this makes rendered point clouds look much
-    // nicer, but also makes the render much slower, especially on lower
-    // powered graphics cards.
-    QGLFormat f = QGLFormat::defaultFormat();
-    f.setVersion( 3, 2 );
-    f.setProfile( QGLFormat::CoreProfile ); // Requires >=Qt-4.8.0
-    //f.setSampleBuffers(true);
-    QGLFormat::setDefaultFormat(f);
-
-    MainWindow window(f);
+    MainWindow window(offscreen);
 
     // Inherit instance lock (or debug: acquire it)
     if (!serverName.empty())
@@ -107,6 +140,7 @@ int guimain(int argc, char* argv[])
 
     if (!socketName.empty())
         window.startIpcServer(QString::fromStdString(socketName));
-    window.show();
+    if (!offscreen)
+        window.show();
     return app.exec();
 }
@@ -3,8 +3,13 @@
 
 #include "hcloud.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
 
 #include "tinyformat.h"
 #include "util.h"
@@ -38,6 +43,19 @@ void HCloudHeader::write(std::ostream& out) const
     writeLE<double>(headerBytes, treeBoundingBox.max.y);
     writeLE<double>(headerBytes, treeBoundingBox.max.z);
     writeLE<uint16_t>(headerBytes, brickSize);
+    writeLE<uint16_t>(headerBytes, (uint16_t)attributes.size());
+    for (const HCloudAttribute& attr : attributes)
+    {
+        writeLE<uint16_t>(headerBytes, (uint16_t)attr.name.size());
+        headerBytes.write(attr.name.data(), attr.name.size());
+        writeLE<uint8_t>(headerBytes, attr.spec.type);
+        writeLE<uint8_t>(headerBytes, attr.spec.elsize);
+        writeLE<uint8_t>(headerBytes, attr.spec.count);
+        writeLE<uint8_t>(headerBytes, attr.spec.semantics);
+        writeLE<uint8_t>(headerBytes, attr.spec.fixedPoint);
+        writeLE<uint8_t>(headerBytes, attr.categorical);
+    }
+    writeLE<uint64_t>(headerBytes, numIndexNodes);
     headerSize = (uint32_t)headerBytes.tellp();
     headerBytes.seekp(headerSizePos);
     writeLE<uint32_t>(headerBytes, headerSize);
@@ -54,7 +72,7 @@ void HCloudHeader::read(std::istream& in)
         throw DisplazError("Bad magic number: not a hierarchical point cloud");
     }
     version = readLE<uint16_t>(in);
-    if (version != HCLOUD_VERSION)
+    if (version < 1 || version > HCLOUD_VERSION)
         throw DisplazError("Unknown hcloud version: %d", version);
     headerSize = readLE<uint32_t>(in);
     numPoints  = readLE<uint64_t>(in);
@@ -77,6 +95,31 @@ void HCloudHeader::read(std::istream& in)
     treeBoundingBox.max.y = readLE<double>(in);
     treeBoundingBox.max.z = readLE<double>(in);
     brickSize = readLE<uint16_t>(in);
+    attributes.clear();
+    // Early version 2 files end the header here, without an attribute table
+    const uint32_t headerSizeNoAttributes = HCLOUD_MAGIC_SIZE + 2 + 4 + 4*8 + 15*8 + 2;
+    if (version < 2 || (version == 2 && headerSize == headerSizeNoAttributes))
+    {
+        attributes.push_back(HCloudAttribute("intensity", TypeSpec::float32()));
+        return;
+    }
+    int numAttributes = readLE<uint16_t>(in);
+    for (int i = 0; i < numAttributes; ++i)
+    {
+        HCloudAttribute attr;
+        attr.name.resize(readLE<uint16_t>(in));
+        in.read(&attr.name[0], attr.name.size());
+        attr.spec.type       = TypeSpec::Type(readLE<uint8_t>(in));
+        attr.spec.elsize     = readLE<uint8_t>(in);
+        attr.spec.count      = readLE<uint8_t>(in);
+        attr.spec.semantics  = TypeSpec::Semantics(readLE<uint8_t>(in));
+        attr.spec.fixedPoint = readLE<uint8_t>(in) != 0;
+        attr.categorical     = readLE<uint8_t>(in) != 0;
+        if (!in || attr.spec.count < 1)
+            throw DisplazError("Bad hcloud attribute descriptor");
+        attributes.push_back(attr);
+    }
+    numIndexNodes = (version >= 3) ? readLE<uint64_t>(in) : 0;
 }
 
 std::ostream& operator<<(std::ostream& out, const HCloudHeader& h)
@@ -91,7 +134,9 @@ std::ostream& operator<<(std::ostream& out, const HCloudHeader& h)
         "offset = %.3f\n"
         "boundingBox = [%.3f -- %.3f]\n"
         "treeBoundingBox = [%.3f -- %.3f]\n"
-        "brickSize = %d",
+        "brickSize = %d\n"
+        "numIndexNodes = %d\n"
+        "attributes =",
         h.version,
         h.headerSize,
         h.numPoints,
@@ -103,8 +148,547 @@ std::ostream& operator<<(std::ostream& out, const HCloudHeader& h)
         h.boundingBox.max,
         h.treeBoundingBox.min,
         h.treeBoundingBox.max,
-        h.brickSize
+        h.brickSize,
+        h.numIndexNodes
     );
+    for (const HCloudAttribute& attr : h.attributes)
+        tfm::format(out, " %s:%s%s", attr.name, attr.spec, attr.categorical ? "(categorical)" : "");
     return out;
 }
 
+
+
+//------------------------------------------------------------------------------
+void NodeIndexData::write(std::ostream& out) const
+{
+    writeLE<uint8_t> (out, flags);
+    writeLE<uint8_t> (out, codec);
+    writeLE<uint64_t>(out, dataOffset);
+    writeLE<uint32_t>(out, dataSize);
+    writeLE<uint32_t>(out, numPoints);
+}
+
+void NodeIndexData::read(std::istream& in, int version)
+{
+    flags = IndexFlags(readLE<uint8_t>(in));
+    if (version >= 2)
+    {
+        codec      = NodeCodec(readLE<uint8_t>(in));
+        dataOffset = readLE<uint64_t>(in);
+        dataSize   = readLE<uint32_t>(in);
+        numPoints  = readLE<uint32_t>(in);
+    }
+    else
+    {
+        codec      = NodeCodec_Float32;
+        dataOffset = readLE<uint64_t>(in);
+        numPoints  = readLE<uint32_t>(in);
+        int numArrays = (flags == IndexFlags_Voxels) ? 5 : 4;
+        dataSize   = numArrays*sizeof(float)*numPoints;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+namespace {
+
+void encodeIndexRecord(char* rec, const NodeIndexData& idata, uint8_t childMask,
+                       uint64_t firstChild)
+{
+    memset(rec, 0, HCLOUD_INDEX_RECORD_SIZE);
+    writeLE<uint64_t>(rec,      idata.dataOffset);
+    writeLE<uint64_t>(rec + 8,  firstChild);
+    writeLE<uint32_t>(rec + 16, idata.dataSize);
+    writeLE<uint32_t>(rec + 20, idata.numPoints);
+    rec[24] = (char)idata.flags;
+    rec[25] = (char)idata.codec;
+    rec[26] = (char)childMask;
+}
+
+/// Node of a depth first index, as stored in version 1 and 2 files
+struct DepthFirstNode
+{
+    NodeIndexData idata;
+    uint8_t childMask;
+    std::vector<size_t> children;
+};
+
+size_t readDepthFirstIndex(std::istream& in, int version,
+                           std::vector<DepthFirstNode>& nodes)
+{
+    size_t nodeIdx = nodes.size();
+    nodes.emplace_back();
+    nodes[nodeIdx].idata.read(in, version);
+    uint8_t childMask = readLE<uint8_t>(in);
+    nodes[nodeIdx].childMask = childMask;
+    for (int i = 0; i < 8; ++i)
+    {
+        if ((childMask >> i) & 1)
+        {
+            size_t child = readDepthFirstIndex(in, version, nodes);
+            nodes[nodeIdx].children.push_back(child);
+        }
+    }
+    return nodeIdx;
+}
+
+}
+
+
+void HCloudIndex::read(std::istream& in, const HCloudHeader& header)
+{
+    if (header.version >= 3)
+    {
+        uint64_t numBytes = header.numIndexNodes*HCLOUD_INDEX_RECORD_SIZE;
+        m_ownedRecords.reset(new char[numBytes]);
+        in.read(m_ownedRecords.get(), numBytes);
+        if (!in || header.numIndexNodes == 0)
+            throw DisplazError("Could not read hcloud index");
+        m_numNodes = header.numIndexNodes;
+    }
+    else
+    {
+        // Convert the depth first index of older files.  This requires
+        // reading the whole index, as the size of each subtree isn't known.
+        std::vector<DepthFirstNode> nodes;
+        readDepthFirstIndex(in, header.version, nodes);
+        std::vector<size_t> order(1, 0);
+        order.reserve(nodes.size());
+        m_ownedRecords.reset(new char[nodes.size()*HCLOUD_INDEX_RECORD_SIZE]);
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            const DepthFirstNode& node = nodes[order[i]];
+            encodeIndexRecord(m_ownedRecords.get() + i*HCLOUD_INDEX_RECORD_SIZE,
+                              node.idata, node.childMask, order.size());
+            order.insert(order.end(), node.children.begin(), node.children.end());
+        }
+        m_numNodes = nodes.size();
+    }
+    m_records = m_ownedRecords.get();
+}
+
+
+NodeIndexData HCloudIndex::nodeData(uint64_t node) const
+{
+    const char* rec = record(node);
+    NodeIndexData idata;
+    idata.dataOffset = readLE<uint64_t>(rec);
+    idata.dataSize   = readLE<uint32_t>(rec + 16);
+    idata.numPoints  = readLE<uint32_t>(rec + 20);
+    idata.flags = IndexFlags(uint8_t(rec[24]));
+    idata.codec = NodeCodec(uint8_t(rec[25]));
+    return idata;
+}
+
+
+uint64_t HCloudIndex::child(uint64_t node, int octant) const
+{
+    uint64_t firstChild = readLE<uint64_t>(record(node) + 8);
+    uint8_t mask = childMask(node);
+    assert((mask >> octant) & 1);
+    // Children are stored contiguously in octant order
+    uint64_t child = firstChild;
+    for (int i = 0; i < octant; ++i)
+        child += (mask >> i) & 1;
+    return child;
+}
+
+
+bool HCloudIndex::validateNode(uint64_t node, uint64_t fileSize, std::string* error) const
+{
+    if (node >= m_numNodes)
+    {
+        if (error)
+            *error = tfm::format("node %d is outside the index", node);
+        return false;
+    }
+    const char* rec = record(node);
+    uint64_t dataOffset = readLE<uint64_t>(rec);
+    uint64_t firstChild = readLE<uint64_t>(rec + 8);
+    uint32_t dataSize   = readLE<uint32_t>(rec + 16);
+    int numChildren = 0;
+    for (uint8_t mask = childMask(node); mask != 0; mask >>= 1)
+        numChildren += mask & 1;
+    // Children follow their parent in breadth first order, so checking this
+    // for each node visited also rules out cycles.
+    if (numChildren > 0 && (firstChild <= node ||
+                            firstChild > m_numNodes - numChildren))
+    {
+        if (error)
+            *error = tfm::format("node %d has children outside the index", node);
+        return false;
+    }
+    if (dataOffset > fileSize || dataSize > fileSize - dataOffset)
+    {
+        if (error)
+            *error = tfm::format("node %d has data outside the file", node);
+        return false;
+    }
+    return true;
+}
+
+
+void HCloudIndex::writeRecord(std::ostream& out, const NodeIndexData& idata,
+                              uint8_t childMask, uint64_t firstChild)
+{
+    char rec[HCLOUD_INDEX_RECORD_SIZE];
+    encodeIndexRecord(rec, idata, childMask, firstChild);
+    out.write(rec, HCLOUD_INDEX_RECORD_SIZE);
+}
+
+
+Imath::Box3f childBoundingBox(const Imath::Box3f& bbox, int octant)
+{
+    Imath::V3f center = bbox.center();
+    Imath::Box3f b = bbox;
+    if (octant % 2 == 0)
+        b.max.x = center.x;
+    else
+        b.min.x = center.x;
+    if ((octant/2) % 2 == 0)
+        b.max.y = center.y;
+    else
+        b.min.y = center.y;
+    if ((octant/4) % 2 == 0)
+        b.max.z = center.z;
+    else
+        b.min.z = center.z;
+    return b;
+}
+
+
+//------------------------------------------------------------------------------
+int attributeComponentCount(const std::vector<HCloudAttribute>& attributes)
+{
+    int count = 0;
+    for (const HCloudAttribute& attr : attributes)
+        count += attr.spec.count;
+    return count;
+}
+
+
+//------------------------------------------------------------------------------
+// Node data encoding
+//
+// Quantized node data starts with dequantization parameters, so that
+// x = min + scale*q:
+//
+//   float32 positionMin[3], positionScale[3]
+//   float32 attributeMin, attributeScale   (for each attribute component)
+//
+// This is followed by the quantized arrays for position (uint16, interleaved
+// xyz), coverage (uint8, voxels only) and each attribute (uint16, with
+// interleaved components).  The delta codec stores each array as zigzag
+// varints of the difference from the previous element's value (for
+// positions and multi-component attributes, the same component of the
+// previous point).
+//
+// Integer attributes with a range of no more than 16 bits are quantized with
+// unit scale, so that they're stored exactly.
+
+namespace {
+
+const int maxQ16 = 0xFFFF;
+const int maxQ8 = 0xFF;
+
+/// Compute quantization parameters for `n` values spaced `stride` apart,
+/// mapping them to the integer range [0,maxQ].
+void quantizationRange(const float* x, size_t n, int stride, int maxQ,
+                       bool integral, float& minVal, float& scale)
+{
+    if (n == 0)
+    {
+        minVal = 0;
+        scale = 0;
+        return;
+    }
+    float maxVal = x[0];
+    minVal = x[0];
+    for (size_t i = 1; i < n; ++i)
+    {
+        minVal = std::min(minVal, x[i*stride]);
+        maxVal = std::max(maxVal, x[i*stride]);
+    }
+    if (integral && maxVal - minVal <= maxQ)
+        scale = 1;
+    else
+        scale = (maxVal - minVal)/maxQ;
+}
+
+template<typename T>
+void quantize(T* q, const float* x, size_t n, int stride,
+              float minVal, float scale, int maxQ)
+{
+    float invScale = (scale > 0) ? 1/scale : 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int v = (int)std::floor((x[i*stride] - minVal)*invScale + 0.5f);
+        q[i*stride] = (T)std::max(0, std::min(maxQ, v));
+    }
+}
+
+template<typename T>
+void appendRaw(std::string& buf, const std::vector<T>& q)
+{
+    buf.append((const char*)q.data(), q.size()*sizeof(T));
+}
+
+/// Append differences between successive values spaced `stride` apart as
+/// zigzag encoded LEB128 varints.
+template<typename T>
+void appendDeltas(std::string& buf, const std::vector<T>& q, int stride)
+{
+    for (size_t i = 0; i < q.size(); ++i)
+    {
+        int32_t prev = (i >= (size_t)stride) ? q[i - stride] : 0;
+        int32_t d = int32_t(q[i]) - prev;
+        uint32_t z = (uint32_t(d) << 1) ^ uint32_t(d >> 31);
+        while (z >= 0x80)
+        {
+            buf.push_back(char(z | 0x80));
+            z >>= 7;
+        }
+        buf.push_back(char(z));
+    }
+}
+
+/// Reader for encoded node data with bounds checking
+class NodeDataReader
+{
+    public:
+        NodeDataReader(const char* data, size_t size)
+            : m_data(data), m_end(data + size), m_bad(false) { }
+
+        bool bad() const { return m_bad; }
+        bool atEnd() const { return m_data == m_end; }
+
+        template<typename T>
+        T read()
+        {
+            T val = T();
+            if (m_end - m_data < (ptrdiff_t)sizeof(T))
+            {
+                m_bad = true;
+                return val;
+            }
+            memcpy(&val, m_data, sizeof(T));
+            m_data += sizeof(T);
+            return val;
+        }
+
+        /// Read `n` values of type T, dequantizing the ith value into
+        /// x[i] with parameters minVal[i % stride] and scale[i % stride].
+        template<typename T>
+        void readRaw(float* x, size_t n, int stride, const float* minVal,
+                     const float* scale)
+        {
+            for (size_t i = 0; i < n; ++i)
+                x[i] = minVal[i % stride] + scale[i % stride]*read<T>();
+        }
+
+        /// Read `n` values of type T, delta encoded relative to the value
+        /// `stride` elements earlier, and dequantize as for readRaw().
+        template<typename T>
+        void readDeltas(float* x, size_t n, int stride, const float* minVal,
+                        const float* scale)
+        {
+            std::vector<T> q(n);
+            for (size_t i = 0; i < n; ++i)
+            {
+                uint32_t z = 0;
+                for (int shift = 0; ; shift += 7)
+                {
+                    if (m_data == m_end || shift > 28)
+                    {
+                        m_bad = true;
+                        return;
+                    }
+                    uint8_t c = *m_data++;
+                    z |= uint32_t(c & 0x7f) << shift;
+                    if (!(c & 0x80))
+                        break;
+                }
+                int32_t d = int32_t(z >> 1) ^ -int32_t(z & 1);
+                int32_t prev = (i >= (size_t)stride) ? q[i - stride] : 0;
+                q[i] = T(prev + d);
+                x[i] = minVal[i % stride] + scale[i % stride]*q[i];
+            }
+        }
+
+        /// Read array as for readRaw() or readDeltas() depending on `delta`
+        template<typename T>
+        void readArray(bool delta, float* x, size_t n, int stride,
+                       const float* minVal, const float* scale)
+        {
+            if (delta)
+                readDeltas<T>(x, n, stride, minVal, scale);
+            else
+                readRaw<T>(x, n, stride, minVal, scale);
+        }
+
+    private:
+        const char* m_data;
+        const char* m_end;
+        bool m_bad;
+};
+
+}
+
+
+void encodeNodeData(std::ostream& out, NodeIndexData& indexData,
+                    const std::vector<HCloudAttribute>& attributes,
+                    const float* position, const float* coverage,
+                    const float* attributeData, uint32_t numPoints)
+{
+    float posMin[3], posScale[3];
+    std::vector<uint16_t> qpos(3*numPoints);
+    for (int c = 0; c < 3; ++c)
+    {
+        quantizationRange(position + c, numPoints, 3, maxQ16, false, posMin[c], posScale[c]);
+        quantize(qpos.data() + c, position + c, numPoints, 3, posMin[c], posScale[c], maxQ16);
+    }
+    // Dequantization parameters, in the order they're stored
+    std::vector<float> params(posMin, posMin + 3);
+    params.insert(params.end(), posScale, posScale + 3);
+    std::vector<uint8_t> qcov;
+    if (coverage)
+    {
+        qcov.resize(numPoints);
+        quantize(qcov.data(), coverage, numPoints, 1, 0.0f, 1.0f/maxQ8, maxQ8);
+        // Voxels are only stored for nonzero coverage, so keep it that way
+        for (uint32_t i = 0; i < numPoints; ++i)
+        {
+            if (qcov[i] == 0 && coverage[i] > 0)
+                qcov[i] = 1;
+        }
+    }
+    std::vector<std::vector<uint16_t>> qattrs;
+    for (const HCloudAttribute& attr : attributes)
+    {
+        int count = attr.spec.count;
+        bool integral = attr.spec.type != TypeSpec::Float;
+        qattrs.emplace_back(count*numPoints);
+        for (int c = 0; c < count; ++c)
+        {
+            float minVal, scale;
+            quantizationRange(attributeData + c, numPoints, count, maxQ16,
+                              integral, minVal, scale);
+            quantize(qattrs.back().data() + c, attributeData + c, numPoints,
+                     count, minVal, scale, maxQ16);
+            params.push_back(minVal);
+            params.push_back(scale);
+        }
+        attributeData += count*numPoints;
+    }
+
+    std::string fixedData;
+    appendRaw(fixedData, qpos);
+    appendRaw(fixedData, qcov);
+    for (const auto& qattr : qattrs)
+        appendRaw(fixedData, qattr);
+    std::string deltaData;
+    appendDeltas(deltaData, qpos, 3);
+    appendDeltas(deltaData, qcov, 1);
+    for (size_t i = 0; i < qattrs.size(); ++i)
+        appendDeltas(deltaData, qattrs[i], attributes[i].spec.count);
+
+    bool useDelta = deltaData.size() < fixedData.size();
+    const std::string& body = useDelta ? deltaData : fixedData;
+    for (float p : params)
+        writeLE<float>(out, p);
+    out.write(body.data(), body.size());
+
+    indexData.codec = useDelta ? NodeCodec_QuantizedDelta : NodeCodec_Quantized;
+    indexData.dataSize = uint32_t(params.size()*sizeof(float) + body.size());
+    indexData.numPoints = numPoints;
+}
+
+
+/// Scale for converting stored attribute values to the values seen by
+/// shaders
+static float attributeValueScale(const TypeSpec& spec)
+{
+    if (spec.type == TypeSpec::Float || !spec.fixedPoint)
+        return 1;
+    double maxVal = (spec.type == TypeSpec::Uint) ? std::ldexp(1.0, 8*spec.elsize) - 1
+                                                  : std::ldexp(1.0, 8*spec.elsize - 1) - 1;
+    return float(1/maxVal);
+}
+
+
+bool decodeNodeData(const NodeIndexData& indexData,
+                    const std::vector<HCloudAttribute>& attributes,
+                    const char* data, float* position, float* coverage,
+                    float* attributeData)
+{
+    size_t n = indexData.numPoints;
+    bool hasCoverage = indexData.flags == IndexFlags_Voxels;
+    NodeDataReader reader(data, indexData.dataSize);
+    bool quantized = indexData.codec == NodeCodec_Quantized ||
+                     indexData.codec == NodeCodec_QuantizedDelta;
+    if (!quantized && indexData.codec != NodeCodec_Float32)
+        return false;
+    bool delta = indexData.codec == NodeCodec_QuantizedDelta;
+    // Dequantization parameters for positions and coverage
+    float posMin[3] = {0,0,0}, posScale[3] = {1,1,1};
+    float covMin = 0, covScale = 1;
+    std::vector<float> attrMin, attrScale;
+    for (const HCloudAttribute& attr : attributes)
+    {
+        for (int c = 0; c < attr.spec.count; ++c)
+        {
+            attrMin.push_back(0);
+            attrScale.push_back(1);
+        }
+    }
+    if (quantized)
+    {
+        for (int c = 0; c < 3; ++c)
+            posMin[c] = reader.read<float>();
+        for (int c = 0; c < 3; ++c)
+            posScale[c] = reader.read<float>();
+        covScale = 1.0f/maxQ8;
+        for (size_t c = 0; c < attrMin.size(); ++c)
+        {
+            attrMin[c] = reader.read<float>();
+            attrScale[c] = reader.read<float>();
+        }
+    }
+    size_t componentOffset = 0;
+    for (const HCloudAttribute& attr : attributes)
+    {
+        float valueScale = attributeValueScale(attr.spec);
+        for (int c = 0; c < attr.spec.count; ++c)
+        {
+            attrMin[componentOffset + c] *= valueScale;
+            attrScale[componentOffset + c] *= valueScale;
+        }
+        componentOffset += attr.spec.count;
+    }
+    if (!quantized)
+    {
+        reader.readRaw<float>(position, 3*n, 3, posMin, posScale);
+        if (hasCoverage)
+            reader.readRaw<float>(coverage, n, 1, &covMin, &covScale);
+    }
+    else
+    {
+        reader.readArray<uint16_t>(delta, position, 3*n, 3, posMin, posScale);
+        if (hasCoverage)
+            reader.readArray<uint8_t>(delta, coverage, n, 1, &covMin, &covScale);
+    }
+    componentOffset = 0;
+    for (const HCloudAttribute& attr : attributes)
+    {
+        int count = attr.spec.count;
+        const float* minVal = &attrMin[componentOffset];
+        const float* scale = &attrScale[componentOffset];
+        if (quantized)
+            reader.readArray<uint16_t>(delta, attributeData, count*n, count, minVal, scale);
+        else
+            reader.readRaw<float>(attributeData, count*n, count, minVal, scale);
+        attributeData += count*n;
+        componentOffset += count;
+    }
+    return !reader.bad() && reader.atEnd();
+}
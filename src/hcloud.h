@@ -6,15 +6,47 @@
 #define DISPLAZ_HCLOUD_H_INCLUDED
 
 #include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <Imath/ImathVec.h>
 #include <Imath/ImathBox.h>
 
+#include "typespec.h"
+
 //------------------------------------------------------------------------------
 /// Magic number at start of each hcloud file, and size in bytes
 #define HCLOUD_MAGIC "HierarchicalPointCloud\n\x0c"
 #define HCLOUD_MAGIC_SIZE 24
-#define HCLOUD_VERSION 1
+#define HCLOUD_VERSION 3
+
+
+/// Description of a per-point attribute channel in hcloud node data, such as
+/// intensity, color or classification
+///
+/// `spec` is the type of the attribute in the source data.  Whatever the
+/// type, attributes are carried through the voxelizer and decoded from node
+/// data as float32 with `spec.count` components per point.
+struct HCloudAttribute
+{
+    std::string name;
+    TypeSpec spec;
+    /// Values are labels (eg, classification) which are combined by majority
+    /// vote rather than averaging
+    bool categorical;
+
+    HCloudAttribute() : categorical(false) {}
+
+    HCloudAttribute(const std::string& name, const TypeSpec& spec,
+                    bool categorical = false)
+        : name(name), spec(spec), categorical(categorical)
+    {}
+};
+
+/// Return total number of float components per point for all attributes
+int attributeComponentCount(const std::vector<HCloudAttribute>& attributes);
 
 
 /// Collection of header metadata stored in a hcloud file
@@ -26,11 +58,15 @@ struct HCloudHeader
     uint64_t numVoxels;   ///< Total number of voxels
     uint64_t indexOffset; ///< Offset to tree index in bytes
     uint64_t dataOffset;  ///< Offset to start of data section, in bytes
+    uint64_t numIndexNodes; ///< Number of nodes in the index (version 3+)
 
     Imath::V3d offset;    ///< Offset for positions stored in data section (TODO: remove)
     Imath::Box3d boundingBox;  ///< Bounding box of raw data
     Imath::Box3d treeBoundingBox; ///< Bouding box of root node of tree
     uint16_t brickSize;   ///< Voxel resolution of interior nodes in tree
+    /// Attribute channels stored for each point, in node data order.
+    /// (Version 1 and early version 2 files only have intensity.)
+    std::vector<HCloudAttribute> attributes;
 
     HCloudHeader()
         : version(HCLOUD_VERSION),
@@ -39,8 +75,10 @@ struct HCloudHeader
         numVoxels(0),
         indexOffset(0),
         dataOffset(0),
+        numIndexNodes(0),
         offset(0),
-        brickSize(0)
+        brickSize(0),
+        attributes(1, HCloudAttribute("intensity", TypeSpec::float32()))
     { }
 
 
@@ -63,20 +101,178 @@ enum IndexFlags
 };
 
 
+/// Encoding of node data arrays
+///
+/// Node data consists of positions (three components per element), coverage
+/// (voxel nodes only) and the attributes, each stored as a separate array.
+enum NodeCodec
+{
+    /// Raw float32 arrays.  The only encoding in version 1 files.
+    NodeCodec_Float32 = 0,
+    /// Positions quantized to 16 bits relative to the bounding box of the
+    /// node data, and coverage to 8 bits.  Each component of every
+    /// attribute channel is quantized to 16 bits relative to its range
+    /// within the node; integer channels whose range in the node spans at
+    /// most 16 bits are stored exactly.
+    NodeCodec_Quantized = 1,
+    /// As for NodeCodec_Quantized, but with each array stored as varint
+    /// encoded differences between successive elements.
+    NodeCodec_QuantizedDelta = 2,
+};
+
+
 struct NodeIndexData
 {
     IndexFlags flags;
+    NodeCodec codec;
     uint64_t dataOffset;
+    uint32_t dataSize;  ///< Size of encoded node data in bytes
     uint32_t numPoints;
 
     NodeIndexData()
         : flags(IndexFlags_Points),
+        codec(NodeCodec_Float32),
         dataOffset(0),
+        dataSize(0),
         numPoints(0)
     { }
+
+    /// Write node index data in the version 2 format
+    void write(std::ostream& out) const;
+
+    /// Read node index data from a version 1 or 2 depth first index
+    void read(std::istream& in, int version);
+};
+
+
+/// Layout of the decoded data for a node in a single buffer: positions,
+/// then coverage (voxel nodes only), then the attribute channels in header
+/// order, each as an array of floats.
+struct NodeBufferLayout
+{
+    uint64_t coverageOffset;   ///< Byte offset of coverage, if present
+    uint64_t attributeOffset;  ///< Byte offset of the first attribute channel
+    uint64_t sizeBytes;        ///< Total size in bytes
+
+    /// Layout for `numPoints` points with `numComponents` attribute
+    /// components per point
+    NodeBufferLayout(IndexFlags flags, uint64_t numPoints, int numComponents)
+    {
+        coverageOffset = 3*sizeof(float)*numPoints;
+        attributeOffset = coverageOffset +
+                          ((flags == IndexFlags_Voxels) ? sizeof(float)*numPoints : 0);
+        sizeBytes = attributeOffset + numComponents*sizeof(float)*numPoints;
+    }
 };
 
 
+/// Size in bytes of each node record in a version 3 index
+#define HCLOUD_INDEX_RECORD_SIZE 32
+
+/// Read only view of the hcloud octree index
+///
+/// From version 3 the index is an array of fixed size node records in
+/// breadth first order, with the children of each node stored contiguously.
+/// It can therefore be memory mapped and navigated in place, without building
+/// any per-node data structures when the file is opened.  Node bounding boxes
+/// aren't stored; they're derived from the root box during traversal using
+/// childBoundingBox().
+///
+/// Each record is laid out as follows (little endian):
+///
+///   uint64 dataOffset
+///   uint64 firstChild  - record number of the first child
+///   uint32 dataSize
+///   uint32 numPoints
+///   uint8  flags
+///   uint8  codec
+///   uint8  childMask   - bit i is set when octant i has a child
+///   uint8  reserved[5]
+///
+/// Node 0 is the root.
+class HCloudIndex
+{
+    public:
+        HCloudIndex() : m_records(nullptr), m_numNodes(0) {}
+
+        /// View `numNodes` records at `records`, which must remain valid for
+        /// the lifetime of the index (eg, a memory mapped file)
+        HCloudIndex(const char* records, uint64_t numNodes)
+            : m_records(records), m_numNodes(numNodes)
+        { }
+
+        /// Read index of a file with the given header from `in`, which must be
+        /// positioned at the start of the index.  Older depth first indices
+        /// are converted to the breadth first layout.
+        void read(std::istream& in, const HCloudHeader& header);
+
+        /// Return number of nodes in the index
+        uint64_t size() const { return m_numNodes; }
+
+        NodeIndexData nodeData(uint64_t node) const;
+
+        uint8_t childMask(uint64_t node) const { return record(node)[26]; }
+
+        bool isLeaf(uint64_t node) const { return childMask(node) == 0; }
+
+        /// Return record number of the child in the given octant.  The child
+        /// must exist.
+        uint64_t child(uint64_t node, int octant) const;
+
+        /// Check that the children of `node` are within the index, and that
+        /// its data is within a file of `fileSize` bytes.  Only the record
+        /// for `node` is read, so large indices can be checked lazily as
+        /// nodes are visited.
+        ///
+        /// Return false and set `error` (if non-null) for a corrupt record.
+        bool validateNode(uint64_t node, uint64_t fileSize,
+                          std::string* error = nullptr) const;
+
+        /// Append record for a node to `out`
+        static void writeRecord(std::ostream& out, const NodeIndexData& idata,
+                                uint8_t childMask, uint64_t firstChild);
+
+    private:
+        const char* record(uint64_t node) const
+        {
+            return m_records + node*HCLOUD_INDEX_RECORD_SIZE;
+        }
+
+        std::unique_ptr<char[]> m_ownedRecords;
+        const char* m_records;
+        uint64_t m_numNodes;
+};
+
+
+/// Return bounding box of the child of a node with bounding box `bbox`, in
+/// the given octant (ordered x + 2*y + 4*z)
+Imath::Box3f childBoundingBox(const Imath::Box3f& bbox, int octant);
+
+
+/// Encode node data arrays and write them to `out`, using whichever
+/// quantized encoding is smallest.
+///
+/// `position` has 3*numPoints elements; `coverage` is null for point nodes.
+/// `attributeData` holds each of the `attributes` in turn, as an array of
+/// spec.count*numPoints values.  The codec, dataSize and numPoints fields of
+/// `indexData` are filled in.
+void encodeNodeData(std::ostream& out, NodeIndexData& indexData,
+                    const std::vector<HCloudAttribute>& attributes,
+                    const float* position, const float* coverage,
+                    const float* attributeData, uint32_t numPoints);
+
+/// Decode `indexData.dataSize` bytes of node data from `data` into arrays
+/// laid out as for encodeNodeData().  `coverage` is only written for voxel
+/// nodes.  Fixed point integer attributes are scaled into the range [0,1],
+/// as OpenGL would for normalized vertex attributes.
+///
+/// Return false if the data is malformed.
+bool decodeNodeData(const NodeIndexData& indexData,
+                    const std::vector<HCloudAttribute>& attributes,
+                    const char* data, float* position, float* coverage,
+                    float* attributeData);
+
+
 // TODO: HCloudInput & HCloudOutput classes for hcloud IO
 
 
@@ -0,0 +1,329 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <cmath>
+#include <sstream>
+#include <vector>
+
+#include "hcloud.h"
+#include "util.h"
+
+
+TEST_CASE("Node data encoding round trip")
+{
+    const uint32_t n = 1000;
+    std::vector<float> position(3*n);
+    std::vector<float> coverage(n);
+    std::vector<float> intensity(n);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        // Smooth surface-like positions within a 10m node
+        position[3*i]   = 100.0f + 10.0f*(i % 32)/32;
+        position[3*i+1] = -50.0f + 10.0f*(i / 32)/32;
+        position[3*i+2] = 2.0f + std::sin(0.1f*i);
+        coverage[i] = (i % 7 + 1)/7.0f;
+        intensity[i] = float(i % 300)*100;
+    }
+    std::vector<HCloudAttribute> intensityOnly;
+    intensityOnly.push_back(HCloudAttribute("intensity", TypeSpec::float32()));
+
+    SECTION("Voxels")
+    {
+        std::stringstream out;
+        NodeIndexData idata;
+        idata.flags = IndexFlags_Voxels;
+        encodeNodeData(out, idata, intensityOnly, position.data(),
+                       coverage.data(), intensity.data(), n);
+        std::string data = out.str();
+        CHECK(idata.numPoints == n);
+        CHECK(idata.dataSize == data.size());
+        CHECK(idata.codec != NodeCodec_Float32);
+        // At least twice as small as raw float32 arrays
+        CHECK(data.size() < n*5*sizeof(float)/2);
+
+        std::vector<float> position2(3*n), coverage2(n), intensity2(n);
+        REQUIRE(decodeNodeData(idata, intensityOnly, data.data(), position2.data(),
+                               coverage2.data(), intensity2.data()));
+        for (uint32_t i = 0; i < 3*n; ++i)
+            CHECK(std::abs(position2[i] - position[i]) < 1e-3f);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            CHECK(std::abs(coverage2[i] - coverage[i]) <= 0.5f/255 + 1e-6f);
+            CHECK(coverage2[i] > 0);
+            CHECK(std::abs(intensity2[i] - intensity[i]) <= 0.5f);
+        }
+
+        // Truncated data is rejected
+        NodeIndexData truncated = idata;
+        truncated.dataSize -= 1;
+        CHECK(!decodeNodeData(truncated, intensityOnly, data.data(), position2.data(),
+                              coverage2.data(), intensity2.data()));
+    }
+
+    SECTION("Points with constant values")
+    {
+        std::vector<float> flat(3*n, 1.5f);
+        std::vector<float> constIntensity(n, 42);
+        std::stringstream out;
+        NodeIndexData idata;
+        idata.flags = IndexFlags_Points;
+        encodeNodeData(out, idata, intensityOnly, flat.data(), nullptr,
+                       constIntensity.data(), n);
+        std::string data = out.str();
+        // Constant values compress to a byte per value with delta coding
+        CHECK(idata.codec == NodeCodec_QuantizedDelta);
+        CHECK(data.size() < 8*sizeof(float) + 4*n + 1);
+        std::vector<float> position2(3*n), intensity2(n);
+        REQUIRE(decodeNodeData(idata, intensityOnly, data.data(), position2.data(),
+                               nullptr, intensity2.data()));
+        CHECK(position2 == flat);
+        CHECK(intensity2 == constIntensity);
+    }
+
+    SECTION("Multiple attributes")
+    {
+        std::vector<HCloudAttribute> attrs;
+        attrs.push_back(HCloudAttribute("intensity", TypeSpec::uint16_i()));
+        attrs.push_back(HCloudAttribute("color", TypeSpec(TypeSpec::Uint,2,3,TypeSpec::Color)));
+        attrs.push_back(HCloudAttribute("classification", TypeSpec::uint8_i(), true));
+        REQUIRE(attributeComponentCount(attrs) == 5);
+        std::vector<float> attrData(5*n);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            attrData[i] = float(i*37 % 65536);
+            attrData[n + 3*i]     = 65535;
+            attrData[n + 3*i + 1] = float(i % 256)*256;
+            attrData[n + 3*i + 2] = 0;
+            attrData[4*n + i] = float(i % 10 + 1);
+        }
+        std::stringstream out;
+        NodeIndexData idata;
+        idata.flags = IndexFlags_Points;
+        encodeNodeData(out, idata, attrs, position.data(), nullptr, attrData.data(), n);
+        std::string data = out.str();
+        std::vector<float> position2(3*n), attrData2(5*n);
+        REQUIRE(decodeNodeData(idata, attrs, data.data(), position2.data(),
+                               nullptr, attrData2.data()));
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            // Integer attributes are exact
+            CHECK(attrData2[i] == attrData[i]);
+            CHECK(attrData2[4*n + i] == attrData[4*n + i]);
+            // Fixed point color is normalized
+            CHECK(attrData2[n + 3*i] == 1.0f);
+            CHECK(std::abs(attrData2[n + 3*i + 1] - attrData[n + 3*i + 1]/65535) < 1e-6f);
+            CHECK(attrData2[n + 3*i + 2] == 0.0f);
+        }
+    }
+
+    SECTION("Version 1 float32 data")
+    {
+        std::stringstream in;
+        writeLE<uint8_t>(in, IndexFlags_Points);
+        writeLE<uint64_t>(in, 1234);
+        writeLE<uint32_t>(in, n);
+        NodeIndexData idata;
+        idata.read(in, 1);
+        CHECK(idata.codec == NodeCodec_Float32);
+        CHECK(idata.dataOffset == 1234);
+        CHECK(idata.dataSize == n*4*sizeof(float));
+
+        std::string data((const char*)position.data(), 3*n*sizeof(float));
+        data.append((const char*)intensity.data(), n*sizeof(float));
+        std::vector<float> position2(3*n), intensity2(n);
+        REQUIRE(decodeNodeData(idata, intensityOnly, data.data(), position2.data(),
+                               nullptr, intensity2.data()));
+        CHECK(position2 == position);
+        CHECK(intensity2 == intensity);
+    }
+}
+
+
+TEST_CASE("Node index data round trip")
+{
+    NodeIndexData idata;
+    idata.flags = IndexFlags_Voxels;
+    idata.codec = NodeCodec_QuantizedDelta;
+    idata.dataOffset = 1ULL << 40;
+    idata.dataSize = 5678;
+    idata.numPoints = 910;
+    std::stringstream buf;
+    idata.write(buf);
+    NodeIndexData idata2;
+    idata2.read(buf, HCLOUD_VERSION);
+    CHECK(idata2.flags == idata.flags);
+    CHECK(idata2.codec == idata.codec);
+    CHECK(idata2.dataOffset == idata.dataOffset);
+    CHECK(idata2.dataSize == idata.dataSize);
+    CHECK(idata2.numPoints == idata.numPoints);
+}
+
+
+TEST_CASE("Node buffer layout")
+{
+    // Coverage follows the positions directly for voxel nodes, and the
+    // attribute channels follow coverage
+    NodeBufferLayout voxels(IndexFlags_Voxels, 10, 2);
+    CHECK(voxels.coverageOffset == 3*10*sizeof(float));
+    CHECK(voxels.attributeOffset == 4*10*sizeof(float));
+    CHECK(voxels.sizeBytes == 6*10*sizeof(float));
+    NodeBufferLayout points(IndexFlags_Points, 10, 2);
+    CHECK(points.attributeOffset == 3*10*sizeof(float));
+    CHECK(points.sizeBytes == 5*10*sizeof(float));
+}
+
+
+TEST_CASE("HCloud header attributes round trip")
+{
+    HCloudHeader header;
+    header.brickSize = 8;
+    header.attributes.clear();
+    header.attributes.push_back(HCloudAttribute("color", TypeSpec(TypeSpec::Uint,2,3,TypeSpec::Color)));
+    header.attributes.push_back(HCloudAttribute("classification", TypeSpec::uint8_i(), true));
+    std::stringstream buf;
+    header.write(buf);
+    HCloudHeader header2;
+    header2.read(buf);
+    CHECK(header2.headerSize == buf.str().size());
+    CHECK(header2.brickSize == 8);
+    REQUIRE(header2.attributes.size() == 2);
+    CHECK(header2.attributes[0].name == "color");
+    CHECK(header2.attributes[0].spec == header.attributes[0].spec);
+    CHECK(!header2.attributes[0].categorical);
+    CHECK(header2.attributes[1].name == "classification");
+    CHECK(header2.attributes[1].spec == TypeSpec::uint8_i());
+    CHECK(header2.attributes[1].categorical);
+}
+
+
+TEST_CASE("HCloud version 2 header without attributes")
+{
+    // Early version 2 headers end after brickSize, with intensity only
+    HCloudHeader header;
+    header.version = 2;
+    header.brickSize = 8;
+    header.attributes.push_back(HCloudAttribute("color", TypeSpec::float32()));
+    std::stringstream full;
+    header.write(full);
+    const uint32_t oldHeaderSize = HCLOUD_MAGIC_SIZE + 2 + 4 + 4*8 + 15*8 + 2;
+    std::string bytes = full.str().substr(0, oldHeaderSize);
+    std::stringstream sizeBytes;
+    writeLE<uint32_t>(sizeBytes, oldHeaderSize);
+    bytes.replace(HCLOUD_MAGIC_SIZE + 2, 4, sizeBytes.str());
+    std::stringstream in(bytes);
+    HCloudHeader header2;
+    header2.read(in);
+    CHECK(header2.brickSize == 8);
+    REQUIRE(header2.attributes.size() == 1);
+    CHECK(header2.attributes[0].name == "intensity");
+}
+
+
+TEST_CASE("HCloud index navigation")
+{
+    // Tree with root -> children in octants 1 and 6; octant 6 has a single
+    // child in octant 0.  Nodes are numbered by their data offset in
+    // depth first order.
+    NodeIndexData idata[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        idata[i].flags = IndexFlags_Voxels;
+        idata[i].codec = NodeCodec_Quantized;
+        idata[i].dataOffset = 100*i;
+        idata[i].dataSize = 10 + i;
+        idata[i].numPoints = 20 + i;
+    }
+    idata[3].flags = IndexFlags_Points;
+
+    HCloudHeader header;
+    HCloudIndex index;
+    SECTION("Breadth first records")
+    {
+        std::stringstream buf;
+        HCloudIndex::writeRecord(buf, idata[0], (1<<1) | (1<<6), 1);
+        HCloudIndex::writeRecord(buf, idata[1], 0, 3);
+        HCloudIndex::writeRecord(buf, idata[2], 1, 3);
+        HCloudIndex::writeRecord(buf, idata[3], 0, 4);
+        CHECK(buf.str().size() == 4*HCLOUD_INDEX_RECORD_SIZE);
+        header.numIndexNodes = 4;
+        index.read(buf, header);
+    }
+    SECTION("Version 2 depth first index")
+    {
+        std::stringstream buf;
+        idata[0].write(buf); writeLE<uint8_t>(buf, (1<<1) | (1<<6));
+        idata[1].write(buf); writeLE<uint8_t>(buf, 0);
+        idata[2].write(buf); writeLE<uint8_t>(buf, 1);
+        idata[3].write(buf); writeLE<uint8_t>(buf, 0);
+        header.version = 2;
+        index.read(buf, header);
+    }
+    REQUIRE(index.size() == 4);
+    CHECK(index.childMask(0) == ((1<<1) | (1<<6)));
+    uint64_t n1 = index.child(0, 1);
+    uint64_t n2 = index.child(0, 6);
+    CHECK(n1 == 1);
+    CHECK(n2 == 2);
+    CHECK(index.isLeaf(n1));
+    CHECK(!index.isLeaf(n2));
+    uint64_t n3 = index.child(n2, 0);
+    CHECK(n3 == 3);
+    CHECK(index.isLeaf(n3));
+    for (int i = 0; i < 4; ++i)
+    {
+        NodeIndexData d = index.nodeData(i);
+        CHECK(d.flags == idata[i].flags);
+        CHECK(d.codec == idata[i].codec);
+        CHECK(d.dataOffset == idata[i].dataOffset);
+        CHECK(d.dataSize == idata[i].dataSize);
+        CHECK(d.numPoints == idata[i].numPoints);
+    }
+}
+
+
+TEST_CASE("HCloud index records are little endian and validated")
+{
+    NodeIndexData idata;
+    idata.flags = IndexFlags_Voxels;
+    idata.dataOffset = 0x0102;
+    idata.dataSize = 0x30;
+    idata.numPoints = 2;
+    std::stringstream buf;
+    HCloudIndex::writeRecord(buf, idata, 1, 1);
+    HCloudIndex::writeRecord(buf, idata, 0, 2);
+    std::string records = buf.str();
+    CHECK(records[0] == 0x02);
+    CHECK(records[1] == 0x01);
+    CHECK(records[8] == 0x01);
+    CHECK(records[16] == 0x30);
+
+    HCloudIndex index(records.data(), 2);
+    std::string error;
+    CHECK(index.validateNode(0, 0x0132));
+    CHECK(index.validateNode(1, 0x0132));
+    CHECK(!index.validateNode(2, 0x0132));
+    // Node data past the end of the file
+    CHECK(!index.validateNode(1, 0x0131, &error));
+    CHECK(!error.empty());
+    // Child reference past the end of the index
+    records[8] = 2;
+    CHECK(!index.validateNode(0, 0x1000));
+    CHECK(index.validateNode(1, 0x1000));
+    // Child reference back to the root
+    records[8] = 0;
+    CHECK(!index.validateNode(0, 0x1000));
+}
+
+
+TEST_CASE("Child bounding boxes")
+{
+    Imath::Box3f bbox(Imath::V3f(0), Imath::V3f(2,4,8));
+    Imath::Box3f b6 = childBoundingBox(bbox, 6);
+    CHECK(b6.min == Imath::V3f(0,2,4));
+    CHECK(b6.max == Imath::V3f(1,4,8));
+    Imath::Box3f b1 = childBoundingBox(bbox, 1);
+    CHECK(b1.min == Imath::V3f(1,0,0));
+    CHECK(b1.max == Imath::V3f(2,2,4));
+}
@@ -21,6 +21,7 @@ void Logger::log(LogLevel level, const char* fmt, tfm::FormatListRef flist, int
 {
     if (level > m_logLevel)
         return;
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
     if (maxMsgs > 0)
     {
         int& count = m_logCountLimit[LogCountKey(fmt, level)];
@@ -5,6 +5,7 @@
 #define LOGGER_H_INCLUDED
 
 #include <map>
+#include <mutex>
 
 #include "tinyformat.h"
 
@@ -98,8 +99,10 @@ class Logger
         /// Report progress of some processing step
         void progress(double progressFraction)
         {
-            if (m_logProgress)
-                progressImpl(progressFraction);
+            if (!m_logProgress)
+                return;
+            std::lock_guard<std::recursive_mutex> lock(m_mutex);
+            progressImpl(progressFraction);
         }
 
     protected:
@@ -115,6 +118,9 @@ class Logger
         int m_logMessageLimit;
 
         std::map<LogCountKey,int> m_logCountLimit;
+        /// Serializes logging from multiple threads.  Recursive because
+        /// logImpl() may report progress.
+        std::recursive_mutex m_mutex;
 };
 
 
@@ -4,6 +4,7 @@
 //#include <QDataStream>
 #include <QCoreApplication>
 #include <QDir>
+#include <QFileInfo>
 #include <QProcess>
 #include <QUuid>
 
@@ -52,6 +53,53 @@ static int hooks(int argc, const char *argv[])
 }
 
 
+/// Render each of `files` to a separate image in `outputDir`, by running a
+/// `displaz -render` process per file with `renderArgs` and up to
+/// `numWorkers` processes at once.  Return the number of failed renders.
+static int renderTiles(const std::vector<PositionalArg>& files,
+                       const QString& outputDir, const QStringList& renderArgs,
+                       int numWorkers)
+{
+    QString exeName = QCoreApplication::applicationFilePath();
+    QDir outDir(outputDir);
+    std::vector<std::unique_ptr<QProcess>> workers;
+    size_t nextFile = 0;
+    int numFailed = 0;
+    while (nextFile < files.size() || !workers.empty())
+    {
+        while (nextFile < files.size() && (int)workers.size() < numWorkers)
+        {
+            QString input = QDir::current().absoluteFilePath(
+                                QString::fromStdString(files[nextFile++].filePath));
+            QString output = outDir.absoluteFilePath(QFileInfo(input).completeBaseName() + ".png");
+            auto worker = std::make_unique<QProcess>();
+            worker->setProcessChannelMode(QProcess::ForwardedChannels);
+            worker->setProperty("input", input);
+            worker->start(exeName, QStringList(renderArgs) << "-render" << output << input);
+            workers.push_back(std::move(worker));
+        }
+        for (auto it = workers.begin(); it != workers.end();)
+        {
+            QProcess& worker = **it;
+            if (worker.state() != QProcess::NotRunning && !worker.waitForFinished(20))
+            {
+                ++it;
+                continue;
+            }
+            if (worker.error() == QProcess::FailedToStart ||
+                worker.exitStatus() != QProcess::NormalExit || worker.exitCode() != 0)
+            {
+                tfm::format(std::cerr, "ERROR: Could not render %s\n",
+                            worker.property("input").toString().toStdString());
+                ++numFailed;
+            }
+            it = workers.erase(it);
+        }
+    }
+    return numFailed;
+}
+
+
 int main(int argc, char *argv[])
 {
     ensureUtf8Argv(&argc, &argv);
@@ -75,6 +123,7 @@ int main(int argc, char *argv[])
     double yaw = -DBL_MAX, pitch = -DBL_MAX, roll = -DBL_MAX;
     double rot[9] = {-DBL_MAX,-DBL_MAX,-DBL_MAX,-DBL_MAX,-DBL_MAX,-DBL_MAX,-DBL_MAX,-DBL_MAX,-DBL_MAX}; // Camera rotation matrix
     double viewRadius = -DBL_MAX;
+    double interactiveFrameBudget = -DBL_MAX, refineFrameBudget = -DBL_MAX;
 
     std::string shaderName;
     std::string unloadRegex;
@@ -91,6 +140,14 @@ int main(int argc, char *argv[])
     bool deleteAfterLoad = false;
     bool quitRemote = false;
     bool queryCursor = false;
+    int queryRenderStats = -1;
+    std::string renderTraceName;
+    std::string renderFileName;
+    int renderWidth = 1024, renderHeight = 768;
+    int renderTileWorkers = 0;
+    std::string benchmarkPathName;
+    std::string benchmarkOutputName;
+    int benchmarkSteps = 10;
     bool script = false;
 
     bool printVersion = false;
@@ -129,6 +186,10 @@ int main(int argc, char *argv[])
                                          "(+x right, +y up, -z into the scene). "
                                          "This alternative to -viewangles is supplied to simplify "
                                          "setting camera rotations from a script.",
+        "-framebudget %F %F", &interactiveFrameBudget, &refineFrameBudget,
+                                         "Set target frame time in milliseconds [interactive, refine]. "
+                                         "Interactive frames are drawn while the camera moves; refinement "
+                                         "frames progressively draw more detail while it is static.",
         "-clear",        &clearFiles,    "Remote: clear all currently loaded files",
         "-unload %s",    &unloadRegex,   "Remote: unload loaded files or annotations who's label matches the given (unix shell style) pattern",
         "-quit",         &quitRemote,    "Remote: close the existing displaz window",
@@ -137,6 +198,8 @@ int main(int argc, char *argv[])
         "-annotation %s %F %F %F", &annotationText, &annotationX, &annotationY, &annotationZ, "Add a text annotation [text, x, y, z]",
         "-rmtemp",       &deleteAfterLoad, "*Delete* files after loading - use with caution to clean up single-use temporary files after loading",
         "-querycursor",  &queryCursor,   "Query 3D cursor location from displaz instance",
+        "-querystats %d", &queryRenderStats, "Query rendering statistics for the given number of most recent frames, in CSV format",
+        "-rendertrace %s", &renderTraceName, "Append rendering statistics for every frame to the given CSV file",
         "-script",       &script,        "Script mode: enable several settings which are useful when calling displaz from a script:"
                                          " (a) do not wait for displaz GUI to exit before returning,",
         "-hook %@ %s %s", hooks, &hookSpecDef, &hookPayloadDef, "Hook to listen for specified event [hook_specifier hook_payload]. Payload is cursor or null",
@@ -144,6 +207,17 @@ int main(int argc, char *argv[])
                                          "spec is a specification of how the user will see the message, it must be "
                                          "'log' to add an info message, or 'log:<level>' to add logging message at one of {error,warning,info,debug} levels.",
 
+        "<SEPARATOR>", "\nBatch rendering:",
+        "-render %s",    &renderFileName, "Render the view to the given image file without showing any windows, then exit",
+        "-rendersize %d %d", &renderWidth, &renderHeight, "Size of rendered image in pixels [width, height]",
+        "-rendertiles %d", &renderTileWorkers, "Render each input file to a separate image in the -render directory, "
+                                         "using the given number of worker processes",
+        "-benchmark %s %s", &benchmarkPathName, &benchmarkOutputName,
+                                         "Render frames offscreen along a camera path, and write timings to a JSON file "
+                                         "[camera_path output.json].  Each line of the camera path is a keyframe "
+                                         "\"x y z yaw pitch roll radius\" as for -viewposition, -viewangles and -viewradius",
+        "-benchsteps %d", &benchmarkSteps, "Number of benchmark frames between consecutive camera path keyframes",
+
         "<SEPARATOR>", "\nAdditional information:",
         "-version",      &printVersion,  "Print version number",
         "-help",         &printHelp,     "Print command line usage help",
@@ -173,6 +247,43 @@ int main(int argc, char *argv[])
     // started at once.
     QCoreApplication application(argc, argv);
 
+    if (!renderFileName.empty() && renderTileWorkers > 0)
+    {
+        QStringList renderArgs;
+        renderArgs << "-rendersize" << QString::number(renderWidth)
+                                    << QString::number(renderHeight);
+        if (maxPointCount > 0)
+            renderArgs << "-maxpoints" << QString::number(maxPointCount);
+        if (!shaderName.empty())
+            renderArgs << "-shader" << QString::fromStdString(shaderName);
+        if (posX != -DBL_MAX)
+            renderArgs << "-viewposition" << QString::number(posX, 'e', 17)
+                       << QString::number(posY, 'e', 17) << QString::number(posZ, 'e', 17);
+        if (viewRadius != -DBL_MAX)
+            renderArgs << "-viewradius" << QString::number(viewRadius);
+        if (yaw != -DBL_MAX)
+            renderArgs << "-viewangles" << QString::number(yaw)
+                       << QString::number(pitch) << QString::number(roll);
+        if (rot[0] != -DBL_MAX)
+        {
+            renderArgs << "-viewrotation";
+            for (int i = 0; i < 9; ++i)
+                renderArgs << QString::number(rot[i]);
+        }
+        QDir().mkpath(QString::fromStdString(renderFileName));
+        int numFailed = renderTiles(g_initialFileNames,
+                                    QString::fromStdString(renderFileName),
+                                    renderArgs, renderTileWorkers);
+        return numFailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    bool offscreen = !renderFileName.empty() || !benchmarkPathName.empty();
+    if (offscreen)
+    {
+        // Batch renders always use their own private GUI instance
+        noServer = true;
+    }
+
     if (noServer)
     {
         // Use unique random server name if -noserver specified: the GUI still
@@ -209,6 +320,8 @@ int main(int argc, char *argv[])
              << "-instancelock" << QString::fromStdString(lockName)
                                 << QString::fromStdString(instanceLock.makeLockId())
              << "-socketname"   << QString::fromStdString(socketName);
+        if (offscreen)
+            args << "-offscreen";
         if (!QProcess::startDetached(exeName, args,
                                      QDir::currentPath(), &guiPid))
         {
@@ -316,6 +429,12 @@ int main(int argc, char *argv[])
         channel->sendMessage("SET_VIEW_RADIUS\n" +
                              QByteArray().setNum(viewRadius));
     }
+    if (interactiveFrameBudget != -DBL_MAX)
+    {
+        channel->sendMessage("SET_FRAME_BUDGET\n" +
+                             QByteArray().setNum(interactiveFrameBudget) + "\n" +
+                             QByteArray().setNum(refineFrameBudget));
+    }
     if (quitRemote)
     {
         channel->sendMessage("QUIT");
@@ -335,6 +454,27 @@ int main(int argc, char *argv[])
             return EXIT_FAILURE;
         }
     }
+    if (queryRenderStats >= 0)
+    {
+        try
+        {
+            channel->sendMessage("QUERY_RENDER_STATS\n" +
+                                 QByteArray().setNum(queryRenderStats));
+            QByteArray msg = channel->receiveMessage();
+            std::cout.write(msg.data(), msg.length());
+        }
+        catch (DisplazError & e)
+        {
+            std::cerr << "ERROR: QUERY_RENDER_STATS message failed:\n" << e.what();
+            return EXIT_FAILURE;
+        }
+    }
+    if (!renderTraceName.empty())
+    {
+        QString tracePath = QDir::current().absoluteFilePath(
+                                QString::fromStdString(renderTraceName));
+        channel->sendMessage("SET_RENDER_TRACE\n" + tracePath.toUtf8());
+    }
     if (maxPointCount > 0)
     {
         channel->sendMessage("SET_MAX_POINT_COUNT\n" +
@@ -356,6 +496,59 @@ int main(int argc, char *argv[])
                              notifySpec.c_str() + "\n" +
                              notifyMessage.c_str());
     }
+    if (!benchmarkPathName.empty())
+    {
+        try
+        {
+            QDir currentDir = QDir::current();
+            channel->sendMessage("RUN_BENCHMARK\n" +
+                currentDir.absoluteFilePath(QString::fromStdString(benchmarkPathName)).toUtf8() + "\n" +
+                currentDir.absoluteFilePath(QString::fromStdString(benchmarkOutputName)).toUtf8() + "\n" +
+                QByteArray().setNum(renderWidth) + "\n" +
+                QByteArray().setNum(renderHeight) + "\n" +
+                QByteArray().setNum(benchmarkSteps));
+            QByteArray msg = channel->receiveMessage(-1);
+            channel->sendMessage("QUIT");
+            channel->waitForDisconnected();
+            if (msg != "OK")
+            {
+                std::cerr << "ERROR: " << msg.constData() << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        catch (DisplazError & e)
+        {
+            std::cerr << "ERROR: RUN_BENCHMARK message failed:\n" << e.what();
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if (!renderFileName.empty())
+    {
+        try
+        {
+            QString imagePath = QDir::current().absoluteFilePath(
+                                    QString::fromStdString(renderFileName));
+            channel->sendMessage("RENDER_IMAGE\n" + imagePath.toUtf8() + "\n" +
+                                 QByteArray().setNum(renderWidth) + "\n" +
+                                 QByteArray().setNum(renderHeight));
+            // Loading and rendering large files can take a long time
+            QByteArray msg = channel->receiveMessage(-1);
+            channel->sendMessage("QUIT");
+            channel->waitForDisconnected();
+            if (msg != "OK")
+            {
+                std::cerr << "ERROR: " << msg.constData() << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+        catch (DisplazError & e)
+        {
+            std::cerr << "ERROR: RENDER_IMAGE message failed:\n" << e.what();
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
     if (!hookPayload.empty())
     {
         QByteArray msg;
@@ -0,0 +1,167 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Benchmark for traversal of the flattened point octree, compared to the
+// equivalent tree of individually allocated nodes linked by child pointers.
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "render/OctreeNode.h"
+#include "util.h"
+
+#include "tinyformat.h"
+
+namespace {
+
+struct NullProgress
+{
+    void operator()(size_t) {}
+};
+
+
+/// Pointer based node, as used by the octree before flattening
+struct PointerNode
+{
+    PointerNode* children[8] = {nullptr};
+    size_t beginIndex = 0;
+    size_t endIndex = 0;
+    Imath::Box3f bbox;
+    V3f center;
+    float halfWidth = 0;
+
+    ~PointerNode()
+    {
+        std::for_each(children, children + 8, [](auto v) { delete v; });
+    }
+};
+
+
+PointerNode* makePointerTree(const Octree& tree, size_t nodeIdx)
+{
+    const OctreeNode& node = tree.nodes[nodeIdx];
+    PointerNode* pnode = new PointerNode();
+    pnode->beginIndex = node.beginIndex;
+    pnode->endIndex = node.endIndex;
+    pnode->bbox = tree.bboxes[nodeIdx];
+    size_t c = node.firstChild;
+    for (int i = 0; i < 8; ++i)
+    {
+        if (node.childMask & (1 << i))
+            pnode->children[i] = makePointerTree(tree, c++);
+    }
+    return pnode;
+}
+
+
+bool intersects(const Imath::Box3f& a, const Imath::Box3f& b)
+{
+    return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+           a.min.y <= b.max.y && b.min.y <= a.max.y &&
+           a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+
+size_t traverseFlat(const Octree& tree, const Imath::Box3f& query)
+{
+    size_t count = 0;
+    std::vector<size_t> nodeStack;
+    nodeStack.push_back(0);
+    while (!nodeStack.empty())
+    {
+        size_t n = nodeStack.back();
+        nodeStack.pop_back();
+        if (!intersects(tree.bboxes[n], query))
+            continue;
+        const OctreeNode& node = tree.nodes[n];
+        count += node.size();
+        for (size_t c = node.firstChild; c < node.endChild(); ++c)
+            nodeStack.push_back(c);
+    }
+    return count;
+}
+
+
+size_t traversePointer(const PointerNode* root, const Imath::Box3f& query)
+{
+    size_t count = 0;
+    std::vector<const PointerNode*> nodeStack;
+    nodeStack.push_back(root);
+    while (!nodeStack.empty())
+    {
+        const PointerNode* node = nodeStack.back();
+        nodeStack.pop_back();
+        if (!intersects(node->bbox, query))
+            continue;
+        count += node->endIndex - node->beginIndex;
+        for (int i = 0; i < 8; ++i)
+        {
+            if (node->children[i])
+                nodeStack.push_back(node->children[i]);
+        }
+    }
+    return count;
+}
+
+
+/// Return mean time in milliseconds for a call to func()
+template<typename Func>
+double timeMillisecs(int repeats, size_t& result, Func func)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; ++i)
+        result += func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count() / repeats;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    // Small leaves and a coarse sampling grid give node counts comparable to
+    // a very large point cloud with the default settings.
+    const size_t pointsPerNode = 16;
+    const int sampleGridRes = 2;
+    const size_t targetNodeCounts[] = {10000, 100000, 1000000};
+
+    tfm::printfln("%10s %14s %14s %14s %14s",
+                  "nodes", "flat_full_ms", "ptr_full_ms", "flat_cull_ms", "ptr_cull_ms");
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    for (size_t targetNodes : targetNodeCounts)
+    {
+        // Node count depends on how the points fall into leaves, so is only
+        // approximately the target.
+        size_t numPoints = 5*targetNodes;
+        std::vector<V3f> P(numPoints);
+        std::vector<size_t> inds(numPoints);
+        for (size_t i = 0; i < numPoints; ++i)
+        {
+            P[i] = V3f(uniform(rng), uniform(rng), uniform(rng));
+            inds[i] = i;
+        }
+        Octree tree;
+        NullProgress progress;
+        makeTree(tree, inds.data(), numPoints, P.data(), V3f(0.5f), 0.5f,
+                 progress, pointsPerNode, sampleGridRes);
+        std::unique_ptr<PointerNode> pointerRoot(makePointerTree(tree, 0));
+
+        Imath::Box3f everything(V3f(-1), V3f(2));
+        Imath::Box3f corner(V3f(0), V3f(0.5f));
+        const int repeats = std::max(1, int(10000000/tree.nodes.size()));
+        size_t sink = 0;
+        double flatFull = timeMillisecs(repeats, sink, [&]() { return traverseFlat(tree, everything); });
+        double ptrFull  = timeMillisecs(repeats, sink, [&]() { return traversePointer(pointerRoot.get(), everything); });
+        double flatCull = timeMillisecs(repeats, sink, [&]() { return traverseFlat(tree, corner); });
+        double ptrCull  = timeMillisecs(repeats, sink, [&]() { return traversePointer(pointerRoot.get(), corner); });
+        tfm::printfln("%10d %14.3f %14.3f %14.3f %14.3f",
+                      tree.nodes.size(), flatFull, ptrFull, flatCull, ptrCull);
+        if (sink == 0)
+            tfm::printfln("no points traversed");
+    }
+    return 0;
+}
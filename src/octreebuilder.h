@@ -77,7 +77,8 @@ class NodeOutputQueue
 /// Class for building octrees in a bottom up fashion
 ///
 /// The user must supply octree leaf nodes in Morton order; the internal nodes
-/// will be built from these.  This correponds to a depth first traversal of
+/// will be built from these.  Leaves may be at any depth up to `maxDepth`, as
+/// long as they don't overlap.  This correponds to a depth first traversal of
 /// the whole tree, but only storing O(log(N)) full bricks in memory at any one
 /// time.  As soon as a brick is no longer needed it is serialized to an output
 /// queue and deallocated.  A lightweight index describing the node is kept and
@@ -86,12 +87,14 @@ class NodeOutputQueue
 class OctreeBuilder
 {
     public:
-        OctreeBuilder(std::ostream& output, int brickRes, int leafDepth,
+        OctreeBuilder(std::ostream& output, int brickRes, int maxDepth,
                       const Imath::V3d& positionOffset,
-                      const Imath::Box3d& rootBound, Logger& logger)
+                      const Imath::Box3d& rootBound,
+                      const std::vector<HCloudAttribute>& attributes,
+                      Logger& logger)
             : m_output(output),
             m_brickRes(brickRes),
-            m_levelInfo(leafDepth+2),
+            m_levelInfo(maxDepth+2),
             m_logger(logger)
         {
             // Fill as much of the header in as possible; we will fill the rest
@@ -100,6 +103,7 @@ class OctreeBuilder
             m_header.treeBoundingBox = rootBound;
             m_header.offset = positionOffset;
             m_header.brickSize = brickRes;
+            m_header.attributes = attributes;
             // Write dummy header - will come back to fill this in later
             m_header.write(m_output);
             // Data starts directly after header
@@ -107,11 +111,14 @@ class OctreeBuilder
         }
 
         /// Add voxel brick and accompanying source points to the cloud
+        ///
+        /// `mortonIndex` is the Morton index of the leaf node within the
+        /// grid of nodes at depth `level`.
         void addNode(int level, int64_t mortonIndex,
                      std::unique_ptr<VoxelBrick> voxelBrick,
                      LeafPointData& leafPointData)
         {
-            assert(level < (int)m_levelInfo.size() + 1);
+            assert(level + 1 < (int)m_levelInfo.size());
             std::unique_ptr<IndexNode> brickIndex =
                 writeNodeData(m_levelInfo[level].outputQueue, level, *voxelBrick);
             std::unique_ptr<IndexNode> pointsIndex =
@@ -127,9 +134,7 @@ class OctreeBuilder
         void finish()
         {
             // Sweep from leaves to root, flushing any last pending bricks
-            int numInternalLevels = (int)m_levelInfo.size() - 1;
-            for (int i = numInternalLevels - 1; i > 0; --i)
-                downsampleLevel(m_levelInfo[i], i);
+            finishDeeperLevels(0);
             assert (m_rootNode);
             // Flush output queues from root to leaves.  This order is useful
             // if page caching starts at the root node data offset, but
@@ -138,7 +143,7 @@ class OctreeBuilder
                 flushQueue(m_levelInfo[i].outputQueue, i);
             m_header.indexOffset = m_output.tellp();
             // TODO: Fill numPoints
-            writeIndex(m_output, m_rootNode.get());
+            m_header.numIndexNodes = writeIndex(m_output, m_rootNode.get());
             m_output.seekp(0);
             m_header.write(m_output);
             m_logger.debug("Wrote hcloud header:\n%s", m_header);
@@ -190,6 +195,9 @@ class OctreeBuilder
                      std::unique_ptr<IndexNode> indexNode)
         {
             assert(level < (int)m_levelInfo.size());
+            // Leaves arrive in Morton order, so no more nodes will be added
+            // below any nodes pending at deeper levels.
+            finishDeeperLevels(level);
             OctreeLevelInfo& levelInfo = m_levelInfo[level];
             ++levelInfo.processedNodeCount;
             if (level == 0)
@@ -201,36 +209,40 @@ class OctreeBuilder
             int64_t parentIndex = mortonIndex/8;
             int childNumber = int(mortonIndex - 8*parentIndex);
             assert(childNumber < 8);
-            if (!levelInfo.hasNodes())
-            {
-                // Special one time case for when no nodes are cached yet
-                levelInfo.parentMortonIndex = parentIndex;
-                levelInfo.pendingNodes[childNumber] = std::move(node);
-                levelInfo.pendingIndexNodes[childNumber] = std::move(indexNode);
-                return;
-            }
-            if (parentIndex != levelInfo.parentMortonIndex)
+            if (levelInfo.hasNodes() && parentIndex != levelInfo.parentMortonIndex)
             {
                 // When `node` isn't a child of the node at level-1, finish
                 // and push it up the tree, replacing with the parent of
                 // `node` so we can set `node` as a child.
                 assert(levelInfo.parentMortonIndex < parentIndex);
                 downsampleLevel(levelInfo, level);
-                levelInfo.parentMortonIndex = parentIndex;
             }
+            levelInfo.parentMortonIndex = parentIndex;
             assert(!levelInfo.pendingNodes[childNumber]);
             assert(!levelInfo.pendingIndexNodes[childNumber]);
             levelInfo.pendingNodes[childNumber] = std::move(node);
             levelInfo.pendingIndexNodes[childNumber] = std::move(indexNode);
         }
 
+        /// Push pending nodes at levels deeper than `level` up the tree
+        void finishDeeperLevels(int level)
+        {
+            for (int i = (int)m_levelInfo.size() - 1; i > level; --i)
+            {
+                if (m_levelInfo[i].hasNodes())
+                    downsampleLevel(m_levelInfo[i], i);
+            }
+        }
+
+        /// Downsample pending nodes at `level` into their parent, and add
+        /// the parent at level-1.  Leaves the level with no pending nodes.
         void downsampleLevel(OctreeLevelInfo& levelInfo, int level)
         {
             // Create new brick by downsampling childern at `level+1`
             VoxelBrick* brickChildren[8] = {0};
             for (int i = 0; i < 8; ++i)
                 brickChildren[i] = levelInfo.pendingNodes[i].get();
-            std::unique_ptr<VoxelBrick> brick(new VoxelBrick(m_brickRes));
+            std::unique_ptr<VoxelBrick> brick(new VoxelBrick(m_brickRes, m_header.attributes));
             brick->renderFromBricks(brickChildren);
             // Serialize brick to queue
             std::unique_ptr<IndexNode> indexNode =
@@ -238,12 +250,14 @@ class OctreeBuilder
             // Link child indices into newly created node index
             for (int i = 0; i < 8; ++i)
                 indexNode->children[i] = std::move(levelInfo.pendingIndexNodes[i]);
-            // Push new brick and index up the tree
-            addNode(level - 1, levelInfo.parentMortonIndex,
-                    std::move(brick), std::move(indexNode));
             // Deallocate bricks at current level
             for (int i = 0; i < 8; ++i)
                 levelInfo.pendingNodes[i].reset();
+            int64_t parentMortonIndex = levelInfo.parentMortonIndex;
+            levelInfo.parentMortonIndex = INT64_MIN;
+            // Push new brick and index up the tree
+            addNode(level - 1, parentMortonIndex,
+                    std::move(brick), std::move(indexNode));
         }
 
         template<typename NodeDataT>
@@ -265,31 +279,31 @@ class OctreeBuilder
             queue.flush(m_output);
         }
 
-        static void writeIndex(std::ostream& out, const IndexNode* rootNode)
+        /// Write index breadth first, returning the number of nodes
+        static uint64_t writeIndex(std::ostream& out, const IndexNode* rootNode)
         {
-            std::vector<const IndexNode*> nodeStack;
-            nodeStack.push_back(rootNode);
-            while (!nodeStack.empty())
+            // Children of each node are queued together, so are contiguous
+            // in the output
+            std::vector<const IndexNode*> nodeQueue;
+            nodeQueue.push_back(rootNode);
+            for (size_t i = 0; i < nodeQueue.size(); ++i)
             {
-                const IndexNode* node = nodeStack.back();
-                nodeStack.pop_back();
+                const IndexNode* node = nodeQueue[i];
+                uint64_t firstChild = nodeQueue.size();
                 uint8_t childNodeMask = 0;
                 // Pack presence of children as bits into a uint8_t
-                for (int i = 0; i < 8; ++i)
-                    childNodeMask |= bool(node->children[i]) << i;
-                writeLE<uint8_t> (out, node->idata.flags);
-                writeLE<uint64_t>(out, node->idata.dataOffset);
-                writeLE<uint32_t>(out, node->idata.numPoints);
-                writeLE<uint8_t> (out, childNodeMask);
-                // Backward iteration here ensures children are ordered from 0
-                // to 7 on disk.
-                for (int i = 7; i >= 0; --i)
+                for (int j = 0; j < 8; ++j)
                 {
-                    const IndexNode* n = node->children[i].get();
+                    const IndexNode* n = node->children[j].get();
                     if (n)
-                        nodeStack.push_back(n);
+                    {
+                        childNodeMask |= 1 << j;
+                        nodeQueue.push_back(n);
+                    }
                 }
+                HCloudIndex::writeRecord(out, node->idata, childNodeMask, firstChild);
             }
+            return nodeQueue.size();
         }
 
         HCloudHeader m_header;
@@ -3,42 +3,174 @@
 
 #include "pointdb.h"
 
+#include <cstring>
 #include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
+
+#include <QFile>
 
 #include "logger.h"
 
 
 //------------------------------------------------------------------------------
+void PointDbTileHeader::write(std::ostream& out) const
+{
+    out.write(POINTDB_TILE_MAGIC, POINTDB_TILE_MAGIC_SIZE);
+    writeLE<uint32_t>(out, version);
+    writeLE<uint32_t>(out, numComponents);
+    writeLE<uint64_t>(out, numPoints);
+    // Pad to full header size
+    for (size_t i = POINTDB_TILE_MAGIC_SIZE + 16; i < size; ++i)
+        writeLE<uint8_t>(out, 0);
+}
+
+
+bool PointDbTileHeader::read(std::istream& in)
+{
+    char magic[POINTDB_TILE_MAGIC_SIZE] = {0};
+    in.read(magic, POINTDB_TILE_MAGIC_SIZE);
+    if (in.gcount() != POINTDB_TILE_MAGIC_SIZE ||
+        memcmp(magic, POINTDB_TILE_MAGIC, POINTDB_TILE_MAGIC_SIZE) != 0)
+    {
+        return false;
+    }
+    version = readLE<uint32_t>(in);
+    if (version < 1 || version > POINTDB_TILE_VERSION)
+        throw DisplazError("Unknown point database tile version: %d", version);
+    numComponents = readLE<uint32_t>(in);
+    numPoints = readLE<uint64_t>(in);
+    in.seekg(size - (POINTDB_TILE_MAGIC_SIZE + 16), std::ios::cur);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+/// Point data of a tile loaded into the cache
+///
+/// Tiles are used in place from a memory mapping where possible; older
+/// interleaved tiles are read and rearranged into owned storage.
+struct SimplePointDb::TileData
+{
+    QFile file;
+    uchar* map;
+    std::vector<float> positionStorage;
+    std::vector<float> attributeStorage;
+
+    const float* position;
+    const float* attributes;
+    size_t numPoints;
+    size_t sizeBytes;
+
+    TileData()
+        : map(nullptr), position(nullptr), attributes(nullptr),
+        numPoints(0), sizeBytes(0) {}
+
+    ~TileData()
+    {
+        if (map)
+            file.unmap(map);
+    }
+};
+
+
 struct SimplePointDb::PointDbTile
 {
-    PointDbTile(TilePos tilePos, const std::string& fileName)
-        : tilePos(tilePos), fileName(fileName), recentlyUsed(false) {}
+    PointDbTile(TilePos tilePos, const std::string& fileName, int64_t totalPoints)
+        : tilePos(tilePos), fileName(fileName), totalPoints(totalPoints),
+        loading(false), inLru(false) {}
 
     TilePos tilePos;
     std::string fileName;
-    std::vector<float> position;
-    std::vector<float> intensity;
+    int64_t totalPoints; ///< Number of points in tile file
 
-    bool recentlyUsed;
+    // Guarded by the shard mutex
+    /// Point data, or null when not cached.  Shared with queries and the
+    /// spans they return; the tile is pinned while anyone else holds it.
+    std::shared_ptr<const TileData> data;
+    bool loading;        ///< Data is being read by some thread
 
-    size_t numPoints() const { return position.size()/3; }
+    // Guarded by m_lruMutex
+    bool inLru;
+    std::list<PointDbTile*>::iterator lruPos;
+};
 
-    size_t sizeBytes() const
-    {
-        return sizeof(float)*position.capacity() +
-                sizeof(float)*intensity.capacity();
-    }
 
-    bool empty() const { return position.empty(); }
+struct SimplePointDb::CacheShard
+{
+    std::mutex mutex;
+    std::condition_variable loaded;
+    std::unordered_map<TilePos, PointDbTile, TilePosHash> tiles;
+};
 
-    void clear()
+
+//------------------------------------------------------------------------------
+/// Number of independently locked parts of the tile cache
+static const int numCacheShards = 16;
+
+/// Maximum number of tiles waiting to be prefetched
+static const size_t maxPrefetchQueueSize = 256;
+
+
+/// Copy the points which lie inside `box` to the output arrays, which must
+/// have space for numPoints points.  Return the number of points copied.
+///
+/// Points near the edge of a tile are mixed inside and outside the box in
+/// acquisition order, so the copy is done branch free: every point is
+/// written to the next output slot, which is only kept if the point is
+/// inside.
+static size_t compactPointsInBox(const float* position, const float* attributes,
+                                 size_t numPoints, int numComponents,
+                                 const Imath::Box3f& box,
+                                 float* outPosition, float* outAttributes)
+{
+    size_t numOut = 0;
+    size_t i = 0;
+#ifdef __SSE2__
+    // Test x,y,z together.  The load picks up the next point's x in the
+    // fourth lane, so the last point is left for the scalar loop.
+    const __m128 boxMin = _mm_setr_ps(box.min.x, box.min.y, box.min.z, 0.0f);
+    const __m128 boxMax = _mm_setr_ps(box.max.x, box.max.y, box.max.z, 0.0f);
+    for (; i + 1 < numPoints; ++i)
     {
-        position.clear();
-        position.shrink_to_fit();
-        intensity.clear();
-        intensity.shrink_to_fit();
+        __m128 p = _mm_loadu_ps(position + 3*i);
+        __m128 inside = _mm_and_ps(_mm_cmpge_ps(p, boxMin), _mm_cmplt_ps(p, boxMax));
+        size_t keep = (_mm_movemask_ps(inside) & 0x7) == 0x7;
+        float* outP = outPosition + 3*numOut;
+        outP[0] = position[3*i];
+        outP[1] = position[3*i+1];
+        outP[2] = position[3*i+2];
+        const float* attrs = attributes + numComponents*i;
+        float* outAttrs = outAttributes + numComponents*numOut;
+        for (int c = 0; c < numComponents; ++c)
+            outAttrs[c] = attrs[c];
+        numOut += keep;
     }
-};
+#endif
+    for (; i < numPoints; ++i)
+    {
+        float x = position[3*i];
+        float y = position[3*i+1];
+        float z = position[3*i+2];
+        size_t keep = x >= box.min.x && x < box.max.x &&
+                      y >= box.min.y && y < box.max.y &&
+                      z >= box.min.z && z < box.max.z;
+        float* outP = outPosition + 3*numOut;
+        outP[0] = x;
+        outP[1] = y;
+        outP[2] = z;
+        const float* attrs = attributes + numComponents*i;
+        float* outAttrs = outAttributes + numComponents*numOut;
+        for (int c = 0; c < numComponents; ++c)
+            outAttrs[c] = attrs[c];
+        numOut += keep;
+    }
+    return numOut;
+}
 
 
 //------------------------------------------------------------------------------
@@ -47,9 +179,12 @@ SimplePointDb::SimplePointDb(const std::string& dirName, size_t cacheMaxSize, Lo
     m_boundingBox(),
     m_tileSize(0),
     m_offset(0),
+    m_numComponents(0),
+    m_numTiles(0),
+    m_shards(new CacheShard[numCacheShards]),
     m_maxCacheSize(cacheMaxSize),
     m_cacheByteSize(0),
-    m_bytesSinceTrim(0),
+    m_stopPrefetch(false),
     m_logger(logger)
 {
     m_logger.debug("Using SimplePointDb cache size: %.2f MB", cacheMaxSize/(1024.0*1024.0));
@@ -57,16 +192,24 @@ SimplePointDb::SimplePointDb(const std::string& dirName, size_t cacheMaxSize, Lo
 }
 
 
-// Declared here to keep definition of PointDbTile out of header
-SimplePointDb::~SimplePointDb() {}
+SimplePointDb::~SimplePointDb()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_prefetchMutex);
+        m_stopPrefetch = true;
+    }
+    m_prefetchReady.notify_all();
+    if (m_prefetchThread.joinable())
+        m_prefetchThread.join();
+}
 
 
 void SimplePointDb::query(const Imath::Box3d& boundingBox,
                           std::vector<float>& position,
-                          std::vector<float>& intensity)
+                          std::vector<float>& attributes)
 {
     position.clear();
-    intensity.clear();
+    attributes.clear();
     int startx = (int)floor(boundingBox.min.x/m_tileSize);
     int starty = (int)floor(boundingBox.min.y/m_tileSize);
     int startz = (int)floor(boundingBox.min.z/m_tileSize);
@@ -79,65 +222,273 @@ void SimplePointDb::query(const Imath::Box3d& boundingBox,
     for (int tileY = starty; tileY < endy; ++tileY)
     for (int tileX = startx; tileX < endx; ++tileX)
     {
-        const PointDbTile* tile = findTile(TilePos(tileX,tileY,tileZ));
-        if (!tile)
+        TilePos pos(tileX,tileY,tileZ);
+        std::shared_ptr<const TileData> tileData = findTile(pos);
+        if (!tileData)
             continue;
-        size_t numPoints = tile->numPoints();
-        for (size_t i = 0; i < numPoints; ++i)
+        const TileData& data = *tileData;
+        if (tileInsideBox(pos, boundingBox))
         {
-            float x = tile->position[3*i];
-            float y = tile->position[3*i+1];
-            float z = tile->position[3*i+2];
-            if (x < offsetBox.min.x || x >= offsetBox.max.x ||
-                y < offsetBox.min.y || y >= offsetBox.max.y ||
-                z < offsetBox.min.z || z >= offsetBox.max.z)
-            {
+            position.insert(position.end(), data.position,
+                            data.position + 3*data.numPoints);
+            attributes.insert(attributes.end(), data.attributes,
+                              data.attributes + m_numComponents*data.numPoints);
+            continue;
+        }
+        size_t begin = position.size()/3;
+        position.resize(3*(begin + data.numPoints));
+        attributes.resize(m_numComponents*(begin + data.numPoints));
+        size_t numInside = compactPointsInBox(data.position, data.attributes,
+                                              data.numPoints, m_numComponents, offsetBox,
+                                              &position[3*begin],
+                                              attributes.data() + m_numComponents*begin);
+        position.resize(3*(begin + numInside));
+        attributes.resize(m_numComponents*(begin + numInside));
+    }
+}
+
+
+void SimplePointDb::query(const Imath::Box3d& boundingBox,
+                          std::vector<PointSpan>& spans)
+{
+    spans.clear();
+    int startx = (int)floor(boundingBox.min.x/m_tileSize);
+    int starty = (int)floor(boundingBox.min.y/m_tileSize);
+    int startz = (int)floor(boundingBox.min.z/m_tileSize);
+    int endx =   (int)ceil(boundingBox.max.x/m_tileSize);
+    int endy =   (int)ceil(boundingBox.max.y/m_tileSize);
+    int endz =   (int)ceil(boundingBox.max.z/m_tileSize);
+    Imath::Box3f offsetBox(boundingBox.min - m_offset,
+                           boundingBox.max - m_offset);
+    for (int tileZ = startz; tileZ < endz; ++tileZ)
+    for (int tileY = starty; tileY < endy; ++tileY)
+    for (int tileX = startx; tileX < endx; ++tileX)
+    {
+        TilePos pos(tileX,tileY,tileZ);
+        std::shared_ptr<const TileData> tileData = findTile(pos);
+        if (!tileData || tileData->numPoints == 0)
+            continue;
+        const TileData& data = *tileData;
+        PointSpan span;
+        if (tileInsideBox(pos, boundingBox))
+        {
+            span.position = data.position;
+            span.attributes = data.attributes;
+            span.numPoints = data.numPoints;
+            span.owner = tileData;
+        }
+        else
+        {
+            std::shared_ptr<std::vector<float>> storage =
+                std::make_shared<std::vector<float>>((3 + m_numComponents)*data.numPoints);
+            float* outPosition = storage->data();
+            float* outAttributes = outPosition + 3*data.numPoints;
+            span.numPoints = compactPointsInBox(data.position, data.attributes,
+                                                data.numPoints, m_numComponents,
+                                                offsetBox, outPosition, outAttributes);
+            if (span.numPoints == 0)
                 continue;
-            }
-            position.push_back(x);
-            position.push_back(y);
-            position.push_back(z);
-            intensity.push_back(tile->intensity[i]);
+            span.position = outPosition;
+            span.attributes = outAttributes;
+            span.owner = storage;
         }
+        spans.push_back(span);
     }
 }
 
 
-const SimplePointDb::PointDbTile* SimplePointDb::findTile(const TilePos& pos)
+bool SimplePointDb::tileInsideBox(const TilePos& pos, const Imath::Box3d& boundingBox) const
+{
+    Imath::V3d tileMin = m_tileSize*Imath::V3d(pos.x, pos.y, pos.z);
+    Imath::V3d tileMax = tileMin + Imath::V3d(m_tileSize);
+    return boundingBox.min.x <= tileMin.x && tileMax.x <= boundingBox.max.x &&
+           boundingBox.min.y <= tileMin.y && tileMax.y <= boundingBox.max.y &&
+           boundingBox.min.z <= tileMin.z && tileMax.z <= boundingBox.max.z;
+}
+
+
+int64_t SimplePointDb::estimatePointCount(const Imath::Box3d& boundingBox) const
 {
-    auto it = m_cache.find(pos);
-    if (it == m_cache.end())
+    if (boundingBox.isEmpty())
         return 0;
-    PointDbTile& tile = *it->second;
-    tile.recentlyUsed = true;
-    if (tile.empty())
-    {
-        readTileFromDisk(tile);
-        size_t s = tile.sizeBytes();
-        m_bytesSinceTrim += s;
-        m_cacheByteSize += s;
-        if (m_cacheByteSize > m_maxCacheSize)
-            trimCache(true);
-        else if (m_bytesSinceTrim > m_maxCacheSize/2)
+    // Only immutable tile fields are used, so no locking is needed
+    double count = 0;
+    auto addTile = [&](const PointDbTile& tile)
+    {
+        Imath::V3d tileMin = m_tileSize*Imath::V3d(tile.tilePos.x, tile.tilePos.y,
+                                                   tile.tilePos.z);
+        double overlapFraction = 1;
+        for (int i = 0; i < 3; ++i)
+        {
+            double overlap = std::min(tileMin[i] + m_tileSize, boundingBox.max[i]) -
+                             std::max(tileMin[i], boundingBox.min[i]);
+            overlapFraction *= std::max(0.0, overlap/m_tileSize);
+        }
+        count += tile.totalPoints*overlapFraction;
+    };
+    Imath::V3d start(floor(boundingBox.min.x/m_tileSize), floor(boundingBox.min.y/m_tileSize),
+                     floor(boundingBox.min.z/m_tileSize));
+    Imath::V3d end(ceil(boundingBox.max.x/m_tileSize), ceil(boundingBox.max.y/m_tileSize),
+                   ceil(boundingBox.max.z/m_tileSize));
+    Imath::V3d numSlots = end - start;
+    if (numSlots.x*numSlots.y*numSlots.z <= m_numTiles)
+    {
+        // Look up only the tiles overlapping the box, as query() does
+        for (int tileZ = (int)start.z; tileZ < (int)end.z; ++tileZ)
+        for (int tileY = (int)start.y; tileY < (int)end.y; ++tileY)
+        for (int tileX = (int)start.x; tileX < (int)end.x; ++tileX)
+        {
+            TilePos pos(tileX, tileY, tileZ);
+            const CacheShard& shard = shardFor(pos);
+            auto it = shard.tiles.find(pos);
+            if (it != shard.tiles.end())
+                addTile(it->second);
+        }
+    }
+    else
+    {
+        // Boxes much larger than the database, such as the root of the
+        // voxelizer's octree, are quicker to handle tile by tile
+        for (int shard = 0; shard < numCacheShards; ++shard)
+        for (auto& it : m_shards[shard].tiles)
+            addTile(it.second);
+    }
+    return (int64_t)ceil(count);
+}
+
+
+void SimplePointDb::prefetch(const Imath::Box3d& boundingBox)
+{
+    int startx = (int)floor(boundingBox.min.x/m_tileSize);
+    int starty = (int)floor(boundingBox.min.y/m_tileSize);
+    int startz = (int)floor(boundingBox.min.z/m_tileSize);
+    int endx =   (int)ceil(boundingBox.max.x/m_tileSize);
+    int endy =   (int)ceil(boundingBox.max.y/m_tileSize);
+    int endz =   (int)ceil(boundingBox.max.z/m_tileSize);
+    std::lock_guard<std::mutex> lock(m_prefetchMutex);
+    for (int tileZ = startz; tileZ < endz; ++tileZ)
+    for (int tileY = starty; tileY < endy; ++tileY)
+    for (int tileX = startx; tileX < endx; ++tileX)
+    {
+        TilePos pos(tileX,tileY,tileZ);
+        if (shardFor(pos).tiles.count(pos))
+            m_prefetchQueue.push_back(pos);
+    }
+    // If the prefetch thread falls behind, drop the oldest requests; their
+    // queries have likely already loaded the tiles.
+    while (m_prefetchQueue.size() > maxPrefetchQueueSize)
+        m_prefetchQueue.pop_front();
+    if (!m_prefetchThread.joinable())
+        m_prefetchThread = std::thread(&SimplePointDb::prefetchThreadMain, this);
+    m_prefetchReady.notify_one();
+}
+
+
+void SimplePointDb::prefetchThreadMain()
+{
+    while (true)
+    {
+        TilePos pos;
+        {
+            std::unique_lock<std::mutex> lock(m_prefetchMutex);
+            m_prefetchReady.wait(lock, [this]{
+                return m_stopPrefetch || !m_prefetchQueue.empty();
+            });
+            if (m_stopPrefetch)
+                return;
+            pos = m_prefetchQueue.front();
+            m_prefetchQueue.pop_front();
+        }
+        try
+        {
+            findTile(pos);
+        }
+        catch (std::exception& e)
         {
-            m_bytesSinceTrim = 0;
-            trimCache(false);
+            // The query which needs the tile will report the error
+            m_logger.debug("Could not prefetch tile %d: %s", pos, e.what());
         }
     }
-    assert(!tile.empty());
-    return &tile;
 }
 
 
-void SimplePointDb::trimCache(bool doClear)
+SimplePointDb::CacheShard& SimplePointDb::shardFor(const TilePos& pos) const
 {
-    for (auto it = m_cache.begin(); it != m_cache.end(); ++it)
+    return m_shards[TilePosHash()(pos) % numCacheShards];
+}
+
+
+std::shared_ptr<const SimplePointDb::TileData> SimplePointDb::findTile(const TilePos& pos)
+{
+    CacheShard& shard = shardFor(pos);
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    auto it = shard.tiles.find(pos);
+    if (it == shard.tiles.end())
+        return nullptr;
+    PointDbTile& tile = it->second;
+    // Another thread may be reading the same tile
+    shard.loaded.wait(lock, [&tile]{ return !tile.loading; });
+    std::shared_ptr<const TileData> data = tile.data;
+    if (data)
+    {
+        lock.unlock();
+        std::lock_guard<std::mutex> lruLock(m_lruMutex);
+        if (tile.inLru)
+            m_lru.splice(m_lru.begin(), m_lru, tile.lruPos);
+        return data;
+    }
+
+    // Read outside the shard lock so other tiles in the shard stay available
+    tile.loading = true;
+    lock.unlock();
+    try
+    {
+        data = readTileFromDisk(tile);
+    }
+    catch (...)
     {
-        PointDbTile& tile = *it->second;
-        if (tile.recentlyUsed)
-            tile.recentlyUsed = false;
-        else if (doClear)
-            tile.clear();
+        lock.lock();
+        tile.loading = false;
+        lock.unlock();
+        shard.loaded.notify_all();
+        throw;
+    }
+    lock.lock();
+    tile.data = data;
+    tile.loading = false;
+    lock.unlock();
+    shard.loaded.notify_all();
+    {
+        std::lock_guard<std::mutex> lruLock(m_lruMutex);
+        tile.lruPos = m_lru.insert(m_lru.begin(), &tile);
+        tile.inLru = true;
+    }
+    if ((m_cacheByteSize += data->sizeBytes) > m_maxCacheSize)
+        trimCache();
+    return data;
+}
+
+
+void SimplePointDb::trimCache()
+{
+    // Lock order is m_lruMutex then shard mutex; findTile never holds a shard
+    // mutex while taking m_lruMutex.
+    std::lock_guard<std::mutex> lruLock(m_lruMutex);
+    auto it = m_lru.end();
+    while (m_cacheByteSize > m_maxCacheSize && it != m_lru.begin())
+    {
+        --it;
+        PointDbTile& tile = **it;
+        CacheShard& shard = shardFor(tile.tilePos);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        // New references are only taken under the shard mutex, so the count
+        // can't grow here
+        if (tile.data.use_count() > 1)
+            continue;
+        m_cacheByteSize -= tile.data->sizeBytes;
+        tile.data.reset();
+        tile.inLru = false;
+        it = m_lru.erase(it);
     }
 }
 
@@ -152,34 +503,137 @@ void SimplePointDb::readConfig()
                 >> m_offset.x >> m_offset.y >> m_offset.z;
     if (!dbConfig)
         throw DisplazError("Could not read DB config file: %s", configFileName);
-    while (true)
+    // Tile positions, followed by the point count in databases written by
+    // newer versions of dvox.  A count of -1 means unknown.
+    std::string line;
+    while (std::getline(dbConfig, line))
     {
+        std::istringstream lineStream(line);
         TilePos pos;
-        dbConfig >> pos.x >> pos.y >> pos.z;
-        if (!dbConfig)
-            break;
+        int64_t totalPoints = -1;
+        lineStream >> pos.x >> pos.y >> pos.z;
+        if (!lineStream)
+            continue;
+        lineStream >> totalPoints;
         std::string fileName = tfm::format("%s/%d_%d_%d.dat", m_dirName, pos.x, pos.y, pos.z);
-        m_cache.insert(std::make_pair(pos,
-                std::unique_ptr<PointDbTile>(new PointDbTile(pos, fileName))));
+        if (shardFor(pos).tiles.emplace(pos, PointDbTile(pos, fileName, totalPoints)).second)
+            ++m_numTiles;
+    }
+    m_logger.info("Loaded config file: %s; %d tiles", configFileName, m_numTiles);
+
+    // Databases written before attributes were generalized carry intensity only
+    std::string attrFileName = tfm::format("%s/attributes.txt", m_dirName);
+    std::ifstream attrConfig(attrFileName.c_str());
+    if (!attrConfig)
+        m_attributes.assign(1, HCloudAttribute("intensity", TypeSpec::float32()));
+    while (attrConfig)
+    {
+        HCloudAttribute attr;
+        int type = 0, semantics = 0, fixedPoint = 0, categorical = 0;
+        attrConfig >> attr.name >> type >> attr.spec.elsize >> attr.spec.count
+                   >> semantics >> fixedPoint >> categorical;
+        if (!attrConfig)
+            break;
+        attr.spec.type = TypeSpec::Type(type);
+        attr.spec.semantics = TypeSpec::Semantics(semantics);
+        attr.spec.fixedPoint = fixedPoint != 0;
+        attr.categorical = categorical != 0;
+        m_attributes.push_back(attr);
+    }
+    m_numComponents = attributeComponentCount(m_attributes);
+
+    // Older databases don't record tile point counts; get them from the
+    // tile header or the size of the tile files instead.
+    for (int shard = 0; shard < numCacheShards; ++shard)
+    for (auto& it : m_shards[shard].tiles)
+    {
+        PointDbTile& tile = it.second;
+        if (tile.totalPoints >= 0)
+            continue;
+        std::ifstream file(tile.fileName, std::ios::binary);
+        if (!file)
+            throw DisplazError("Could not open point database tile %s", tile.fileName);
+        PointDbTileHeader header;
+        if (header.read(file))
+        {
+            tile.totalPoints = header.numPoints;
+            continue;
+        }
+        file.clear();
+        file.seekg(0, std::ios::end);
+        tile.totalPoints = (int64_t)file.tellg()/((3 + m_numComponents)*sizeof(float));
     }
-    m_logger.info("Loaded config file: %s; %d tiles", configFileName, m_cache.size());
 }
 
 
-void SimplePointDb::readTileFromDisk(PointDbTile& tile)
+std::shared_ptr<const SimplePointDb::TileData> SimplePointDb::readTileFromDisk(
+        const PointDbTile& tile) const
 {
-    std::ifstream file(tile.fileName, std::ios::binary | std::ios::ate);
-    size_t numPoints = file.tellg()/(4*sizeof(float));
-    tile.position.resize(3*numPoints);
-    tile.intensity.resize(numPoints);
-    file.seekg(0);
-    for (size_t i = 0; i < numPoints; ++i)
+    std::shared_ptr<TileData> data = std::make_shared<TileData>();
+    std::ifstream file(tile.fileName, std::ios::binary);
+    PointDbTileHeader header;
+    if (!file)
+        throw DisplazError("Could not open point database tile %s", tile.fileName);
+    if (header.read(file))
+    {
+        if ((int)header.numComponents != m_numComponents)
+        {
+            throw DisplazError("Point database tile %s has %d attribute components; expected %d",
+                               tile.fileName, header.numComponents, m_numComponents);
+        }
+        data->numPoints = header.numPoints;
+        size_t dataBytes = (3 + m_numComponents)*sizeof(float)*data->numPoints;
+        data->file.setFileName(QString::fromUtf8(tile.fileName.c_str()));
+        if (data->numPoints > 0 && data->file.open(QIODevice::ReadOnly))
+            data->map = data->file.map(0, PointDbTileHeader::size + dataBytes);
+        if (data->map)
+        {
+            data->position = (const float*)(data->map + PointDbTileHeader::size);
+            data->sizeBytes = dataBytes;
+        }
+        else
+        {
+            // Mapping failed (or the tile is empty); read blocks instead
+            data->positionStorage.resize(3*data->numPoints);
+            data->attributeStorage.resize(m_numComponents*data->numPoints);
+            file.read((char*)data->positionStorage.data(),
+                      data->positionStorage.size()*sizeof(float));
+            file.read((char*)data->attributeStorage.data(),
+                      data->attributeStorage.size()*sizeof(float));
+        }
+    }
+    else
     {
-        file.read((char*)&tile.position[3*i], 3*sizeof(float));
-        file.read((char*)&tile.intensity[i], sizeof(float));
+        // Older tiles interleave position and attributes; read the whole
+        // file at once and split it into blocks.
+        file.clear();
+        file.seekg(0, std::ios::end);
+        size_t pointFloats = 3 + m_numComponents;
+        data->numPoints = file.tellg()/(pointFloats*sizeof(float));
+        std::vector<float> records(pointFloats*data->numPoints);
+        file.seekg(0);
+        file.read((char*)records.data(), records.size()*sizeof(float));
+        data->positionStorage.resize(3*data->numPoints);
+        data->attributeStorage.resize(m_numComponents*data->numPoints);
+        for (size_t i = 0; i < data->numPoints; ++i)
+        {
+            const float* rec = &records[pointFloats*i];
+            std::copy(rec, rec + 3, &data->positionStorage[3*i]);
+            std::copy(rec + 3, rec + pointFloats,
+                      data->attributeStorage.data() + m_numComponents*i);
+        }
     }
     if (!file)
         throw DisplazError("Error reading points for tile at %d", tile.tilePos);
+    if (!data->map)
+    {
+        data->position = data->positionStorage.data();
+        data->attributes = data->attributeStorage.data();
+        data->sizeBytes = sizeof(float)*(data->positionStorage.capacity() +
+                                         data->attributeStorage.capacity());
+    }
+    else
+        data->attributes = data->position + 3*data->numPoints;
     m_logger.debug("Cache tile: %d", tile.tilePos);
+    return data;
 }
-
@@ -4,20 +4,83 @@
 #ifndef DISPLAZ_POINTDB_H_INCLUDED
 #define DISPLAZ_POINTDB_H_INCLUDED
 
-#include <map>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
+#include "hcloud.h"
 #include "util.h"
 
 class Logger;
 
+#define POINTDB_TILE_MAGIC "PointDbTile\n"
+#define POINTDB_TILE_MAGIC_SIZE 12
+#define POINTDB_TILE_VERSION 1
+
+/// Header of a point database tile file
+///
+/// The header is followed by a block of 3*numPoints floats of xyz positions,
+/// then a block of numComponents*numPoints point-major attribute floats, so a
+/// whole tile can be used directly from a memory mapping.  Tiles written by
+/// older versions of dvox have no header, and interleave the position and
+/// attributes of each point.
+struct PointDbTileHeader
+{
+    uint32_t version;       ///< Version of tile format
+    uint32_t numComponents; ///< Number of attribute floats per point
+    uint64_t numPoints;     ///< Number of points in tile
+
+    /// Size of header in bytes; keeps the data blocks float aligned
+    static const size_t size = 32;
+
+    PointDbTileHeader(uint64_t numPoints = 0, uint32_t numComponents = 0)
+        : version(POINTDB_TILE_VERSION),
+        numComponents(numComponents),
+        numPoints(numPoints)
+    { }
+
+    /// Write tile header to given stream
+    void write(std::ostream& out) const;
+
+    /// Read tile header from given stream
+    ///
+    /// Return false if the stream doesn't start with a tile header, as for
+    /// older tiles.
+    bool read(std::istream& in);
+};
+
+
+/// Run of points returned from a point database query
+///
+/// The data may be a view directly onto a cached tile, or storage owned by
+/// the query; either way `owner` keeps it alive, so spans remain valid after
+/// the tile is evicted from the database cache.
+struct PointSpan
+{
+    const float* position;   ///< 3*numPoints floats
+    const float* attributes; ///< Per point attributes, point-major
+    size_t numPoints;
+    std::shared_ptr<const void> owner;
+};
+
+
 /// Reader for simple point database format
 ///
 /// The idea here is to be able to fairly quickly query for all points within a
 /// bounding box, when the full set of points is larger than available memory.
 /// For typical airborne laser scanning parameters the point density is
 /// reasonably predictable so we just grid up the domain into fixed size tiles.
+///
+/// Queries may be made from several threads at once.  Loaded tiles are kept
+/// in a cache of at most cacheMaxSize bytes, evicting the least recently used
+/// tiles first.  Tiles in use by a running query or by spans returned from
+/// query() are pinned, so the cache may temporarily exceed its size while
+/// they're held.
 class SimplePointDb
 {
     public:
@@ -27,33 +90,87 @@ class SimplePointDb
 
         /// Return all points within the given bounding box
         ///
-        /// Point positions are relative to the overall offset
+        /// Point positions are relative to the overall offset.  Attributes
+        /// are returned point-major, with attributeComponentCount(attributes())
+        /// floats per point.
         void query(const Imath::Box3d& boundingBox,
                    std::vector<float>& position,
-                   std::vector<float>& intensity);
+                   std::vector<float>& attributes);
+
+        /// Return all points within the given bounding box as a list of spans
+        ///
+        /// Tiles which lie entirely inside the box are returned as views of
+        /// the tile data without copying or per point tests.  Points from
+        /// tiles which only partially overlap the box are copied.
+        void query(const Imath::Box3d& boundingBox,
+                   std::vector<PointSpan>& spans);
+
+        /// Start loading the tiles covering the given bounding box into the
+        /// cache in the background, ready for a later query.
+        void prefetch(const Imath::Box3d& boundingBox);
+
+        /// Estimate the number of points inside the given bounding box
+        ///
+        /// This uses the point counts of each tile from the database config,
+        /// assuming points are spread evenly through each tile, so doesn't
+        /// touch the tile data.
+        int64_t estimatePointCount(const Imath::Box3d& boundingBox) const;
+
+        /// Return number of bytes of tile data currently held by the cache
+        size_t cacheSizeBytes() const { return m_cacheByteSize; }
 
         /// Return offset of coordinate system from origin
         Imath::V3d offset() const { return m_offset; }
 
+        /// Return list of attributes carried by each point
+        const std::vector<HCloudAttribute>& attributes() const { return m_attributes; }
+
     private:
         struct PointDbTile;
+        struct TileData;
+        struct CacheShard;
+
+        /// Return data for tile at `pos`, loading it into the cache if
+        /// necessary, or null if the database has no such tile.  The tile is
+        /// pinned while the returned pointer is held.
+        std::shared_ptr<const TileData> findTile(const TilePos& pos);
 
-        const PointDbTile* findTile(const TilePos& pos);
+        CacheShard& shardFor(const TilePos& pos) const;
 
-        void trimCache(bool doClear);
+        /// Return whether all points of the tile at `pos` are inside box
+        bool tileInsideBox(const TilePos& pos, const Imath::Box3d& boundingBox) const;
+
+        /// Evict least recently used tiles until the cache fits in
+        /// m_maxCacheSize, or only pinned tiles remain.
+        void trimCache();
 
         void readConfig();
 
-        void readTileFromDisk(PointDbTile& tile);
+        std::shared_ptr<const TileData> readTileFromDisk(const PointDbTile& tile) const;
+
+        void prefetchThreadMain();
 
         std::string m_dirName;
         Imath::Box3d m_boundingBox;
         double m_tileSize;
         Imath::V3d m_offset;
-        std::map<TilePos, std::unique_ptr<PointDbTile>, TilePosLess> m_cache;
+        std::vector<HCloudAttribute> m_attributes;
+        int m_numComponents;
+        size_t m_numTiles;
+        /// Tiles, hashed by position into independently locked shards.  The
+        /// set of tiles is fixed once the config is read.
+        std::unique_ptr<CacheShard[]> m_shards;
         size_t m_maxCacheSize;
-        size_t m_cacheByteSize;
-        size_t m_bytesSinceTrim;
+        std::atomic<size_t> m_cacheByteSize;
+        /// Loaded tiles, most recently used first
+        std::mutex m_lruMutex;
+        std::list<PointDbTile*> m_lru;
+        /// Tiles waiting to be loaded by the prefetch thread
+        std::mutex m_prefetchMutex;
+        std::condition_variable m_prefetchReady;
+        std::deque<TilePos> m_prefetchQueue;
+        bool m_stopPrefetch;
+        std::thread m_prefetchThread;
         Logger& m_logger;
 };
 
@@ -0,0 +1,146 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Benchmark for SimplePointDb queries from several threads over a synthetic
+// database, comparing concurrent queries against the same queries
+// serialized with a single lock as the voxelizer used to make them.
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+#include "pointdb.h"
+
+#include "tinyformat.h"
+
+namespace {
+
+const int tilesPerSide = 8;
+const double tileSize = 100;
+const int pointsPerTile = 200000;
+
+
+void writeDatabase(const std::string& dbName)
+{
+    std::filesystem::remove_all(dbName);
+    std::filesystem::create_directory(dbName);
+    std::ofstream config(dbName + "/config.txt");
+    tfm::format(config, "%f\n0 0 0 %f %f %f\n0 0 0\n", tileSize,
+                tilesPerSide*tileSize, tilesPerSide*tileSize, tileSize);
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::vector<float> position(3*pointsPerTile);
+    std::vector<float> intensity(pointsPerTile);
+    for (int ty = 0; ty < tilesPerSide; ++ty)
+    for (int tx = 0; tx < tilesPerSide; ++tx)
+    {
+        tfm::format(config, "%d %d 0 %d\n", tx, ty, pointsPerTile);
+        for (int i = 0; i < pointsPerTile; ++i)
+        {
+            position[3*i]   = float(tileSize*(tx + uniform(rng)));
+            position[3*i+1] = float(tileSize*(ty + uniform(rng)));
+            position[3*i+2] = float(0.1*tileSize*uniform(rng));
+            intensity[i] = 1000*uniform(rng);
+        }
+        std::ofstream tileFile(tfm::format("%s/%d_%d_0.dat", dbName, tx, ty),
+                               std::ios::binary);
+        PointDbTileHeader(pointsPerTile, 1).write(tileFile);
+        tileFile.write((const char*)position.data(), position.size()*sizeof(float));
+        tileFile.write((const char*)intensity.data(), intensity.size()*sizeof(float));
+    }
+}
+
+
+struct BenchResult
+{
+    double seconds;
+    int64_t numPoints;
+};
+
+
+/// Run `queriesPerThread` random chunk sized queries on each of `numThreads`
+/// threads.  If `serialize` is true, hold a lock around each query.
+BenchResult runQueries(SimplePointDb& pointDb, int numThreads, int queriesPerThread,
+                       bool serialize)
+{
+    std::mutex queryMutex;
+    std::atomic<int64_t> numPoints(0);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::mt19937 rng(100 + t);
+            std::uniform_real_distribution<double> uniform(0, (tilesPerSide - 1.5)*tileSize);
+            std::vector<float> position;
+            std::vector<float> intensity;
+            for (int q = 0; q < queriesPerThread; ++q)
+            {
+                V3d min(uniform(rng), uniform(rng), -1);
+                Imath::Box3d box(min, min + V3d(1.5*tileSize, 1.5*tileSize, tileSize));
+                if (serialize)
+                {
+                    std::lock_guard<std::mutex> lock(queryMutex);
+                    pointDb.query(box, position, intensity);
+                }
+                else
+                    pointDb.query(box, position, intensity);
+                numPoints += position.size()/3;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    BenchResult result;
+    result.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+    result.numPoints = numPoints;
+    return result;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    std::string dbName = (std::filesystem::temp_directory_path() /
+                          "displaz_pointdb_bench.pointdb").string();
+    writeDatabase(dbName);
+    StreamLogger logger(std::cerr);
+    logger.setLogLevel(Logger::Warning);
+
+    const size_t tileBytes = pointsPerTile*4*sizeof(float);
+    const int numTiles = tilesPerSide*tilesPerSide;
+    const int totalQueries = 256;
+    tfm::printfln("%12s %8s %14s %14s %14s %14s %8s",
+                  "cache_tiles", "threads", "serial_ms", "serial_Mpt/s",
+                  "concur_ms", "concur_Mpt/s", "speedup");
+    for (int cacheTiles : {numTiles, numTiles/4})
+    {
+        for (int numThreads : {1, 2, 4, 8})
+        {
+            // Fresh databases, so both runs start with a cold cache
+            SimplePointDb serialDb(dbName, cacheTiles*tileBytes, logger);
+            BenchResult serial = runQueries(serialDb, numThreads,
+                                            totalQueries/numThreads, true);
+            SimplePointDb concurrentDb(dbName, cacheTiles*tileBytes, logger);
+            BenchResult concurrent = runQueries(concurrentDb, numThreads,
+                                                totalQueries/numThreads, false);
+            tfm::printfln("%12d %8d %14.1f %14.1f %14.1f %14.1f %8.2f",
+                          cacheTiles, numThreads,
+                          1000*serial.seconds, 1e-6*serial.numPoints/serial.seconds,
+                          1000*concurrent.seconds,
+                          1e-6*concurrent.numPoints/concurrent.seconds,
+                          serial.seconds/concurrent.seconds);
+        }
+    }
+    std::filesystem::remove_all(dbName);
+    return 0;
+}
@@ -0,0 +1,245 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+#include "pointdb.h"
+
+
+namespace {
+
+struct TestPoint
+{
+    V3f P;
+    float intensity;
+    float returnNumber;
+};
+
+bool operator<(const TestPoint& a, const TestPoint& b)
+{
+    if (a.P.x != b.P.x) return a.P.x < b.P.x;
+    if (a.P.y != b.P.y) return a.P.y < b.P.y;
+    return a.P.z < b.P.z;
+}
+
+}
+
+
+TEST_CASE("Point database queries")
+{
+    // Two tile database with one tile in the current layout and one in the
+    // older interleaved layout
+    std::string dbName = "pointdb_test.pointdb";
+    std::filesystem::remove_all(dbName);
+    std::filesystem::create_directory(dbName);
+    const double tileSize = 10;
+    const int numComponents = 2;
+    std::map<TilePos, std::vector<TestPoint>, TilePosLess> tiles;
+    std::vector<TestPoint> allPoints;
+    for (int k = 0; k < 20; ++k)
+    for (int j = 0; j < 10; ++j)
+    for (int i = 0; i < 10; ++i)
+    {
+        TestPoint p = {V3f(i + 0.25f*(j % 4), j + 0.5f, k + 0.5f),
+                       float(i + 10*j), float(k % 3)};
+        TilePos pos(0, 0, (int)floor(p.P.z/tileSize));
+        tiles[pos].push_back(p);
+        allPoints.push_back(p);
+    }
+    {
+        std::ofstream config(dbName + "/config.txt");
+        config << tileSize << "\n0 0 0 10 10 20\n0 0 0\n";
+        std::ofstream attrConfig(dbName + "/attributes.txt");
+        attrConfig << "intensity 0 4 1 0 0 0\nreturnNumber 0 4 1 0 0 0\n";
+        for (auto& tile : tiles)
+        {
+            const TilePos& pos = tile.first;
+            const std::vector<TestPoint>& points = tile.second;
+            config << pos.x << " " << pos.y << " " << pos.z << " " << points.size() << "\n";
+            std::ofstream tileFile(tfm::format("%s/%d_%d_%d.dat", dbName, pos.x, pos.y, pos.z),
+                                   std::ios::binary);
+            if (pos.z == 0)
+            {
+                PointDbTileHeader(points.size(), numComponents).write(tileFile);
+                for (const TestPoint& p : points)
+                    tileFile.write((const char*)&p.P, 3*sizeof(float));
+                for (const TestPoint& p : points)
+                    tileFile.write((const char*)&p.intensity, numComponents*sizeof(float));
+            }
+            else
+            {
+                for (const TestPoint& p : points)
+                    tileFile.write((const char*)&p, sizeof(TestPoint));
+            }
+        }
+    }
+
+    StreamLogger logger(std::cerr);
+    logger.setLogLevel(Logger::Warning);
+    // Cache too small to hold both tiles at once
+    SimplePointDb pointDb(dbName, 16*1024, logger);
+    REQUIRE(pointDb.attributes().size() == 2);
+
+    // Small boxes look up the tiles they overlap; large boxes visit every tile
+    CHECK(pointDb.estimatePointCount(Imath::Box3d(V3d(0), V3d(10, 10, 5))) == 500);
+    CHECK(pointDb.estimatePointCount(Imath::Box3d(V3d(0, 0, 5), V3d(10, 10, 15))) == 1000);
+    CHECK(pointDb.estimatePointCount(Imath::Box3d(V3d(0), V3d(10, 10, 20))) == 2000);
+    CHECK(pointDb.estimatePointCount(Imath::Box3d(V3d(-100), V3d(100))) == 2000);
+    CHECK(pointDb.estimatePointCount(Imath::Box3d(V3d(20), V3d(30))) == 0);
+
+    Imath::Box3d boxes[] = {
+        Imath::Box3d(V3d(-1), V3d(11, 11, 21)),          // Contains both tiles
+        Imath::Box3d(V3d(-1), V3d(11, 11, 10)),          // Contains first tile exactly
+        Imath::Box3d(V3d(2.3, 1.7, 3.2), V3d(7.1, 8.5, 14.5)), // Overlaps both
+        Imath::Box3d(V3d(20), V3d(30))                   // Empty
+    };
+    for (const Imath::Box3d& box : boxes)
+    {
+        std::vector<TestPoint> expected;
+        for (const TestPoint& p : allPoints)
+        {
+            if (p.P.x >= box.min.x && p.P.x < box.max.x &&
+                p.P.y >= box.min.y && p.P.y < box.max.y &&
+                p.P.z >= box.min.z && p.P.z < box.max.z)
+                expected.push_back(p);
+        }
+        std::sort(expected.begin(), expected.end());
+
+        std::vector<float> position;
+        std::vector<float> attributes;
+        pointDb.query(box, position, attributes);
+        REQUIRE(position.size() == 3*expected.size());
+        REQUIRE(attributes.size() == numComponents*expected.size());
+        std::vector<TestPoint> flatPoints;
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            TestPoint p = {V3f(position[3*i], position[3*i+1], position[3*i+2]),
+                           attributes[2*i], attributes[2*i+1]};
+            flatPoints.push_back(p);
+        }
+
+        std::vector<PointSpan> spans;
+        pointDb.query(box, spans);
+        // Query another region to push the tiles out of the cache; the spans
+        // must still be usable.
+        pointDb.query(Imath::Box3d(V3d(-1), V3d(11)), position, attributes);
+        std::vector<TestPoint> spanPoints;
+        for (const PointSpan& span : spans)
+        {
+            for (size_t i = 0; i < span.numPoints; ++i)
+            {
+                const float* P = span.position + 3*i;
+                TestPoint p = {V3f(P[0], P[1], P[2]),
+                               span.attributes[2*i], span.attributes[2*i+1]};
+                spanPoints.push_back(p);
+            }
+        }
+
+        std::sort(flatPoints.begin(), flatPoints.end());
+        std::sort(spanPoints.begin(), spanPoints.end());
+        REQUIRE(spanPoints.size() == expected.size());
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            CHECK(flatPoints[i].P == expected[i].P);
+            CHECK(flatPoints[i].intensity == expected[i].intensity);
+            CHECK(flatPoints[i].returnNumber == expected[i].returnNumber);
+            CHECK(spanPoints[i].P == expected[i].P);
+            CHECK(spanPoints[i].intensity == expected[i].intensity);
+            CHECK(spanPoints[i].returnNumber == expected[i].returnNumber);
+        }
+    }
+
+    std::filesystem::remove_all(dbName);
+}
+
+
+TEST_CASE("Point database concurrent queries")
+{
+    // 4x4 tiles, with a cache which only holds a few of them
+    std::string dbName = "pointdb_test_mt.pointdb";
+    std::filesystem::remove_all(dbName);
+    std::filesystem::create_directory(dbName);
+    const int tilePoints = 400;
+    const size_t tileBytes = tilePoints*4*sizeof(float);
+    const size_t cacheSize = 3*tileBytes;
+    std::vector<V3f> allPoints;
+    {
+        std::ofstream config(dbName + "/config.txt");
+        config << "10\n0 0 0 40 40 10\n0 0 0\n";
+        for (int ty = 0; ty < 4; ++ty)
+        for (int tx = 0; tx < 4; ++tx)
+        {
+            config << tx << " " << ty << " 0 " << tilePoints << "\n";
+            std::vector<float> position;
+            std::vector<float> intensity;
+            for (int i = 0; i < tilePoints; ++i)
+            {
+                V3f P(10*tx + 0.5f*(i % 20) + 0.1f, 10*ty + 0.5f*(i / 20) + 0.1f, 0.01f*i);
+                position.insert(position.end(), &P.x, &P.x + 3);
+                intensity.push_back(float(tx + 4*ty));
+                allPoints.push_back(P);
+            }
+            std::ofstream tileFile(tfm::format("%s/%d_%d_0.dat", dbName, tx, ty),
+                                   std::ios::binary);
+            PointDbTileHeader(tilePoints, 1).write(tileFile);
+            tileFile.write((const char*)position.data(), position.size()*sizeof(float));
+            tileFile.write((const char*)intensity.data(), intensity.size()*sizeof(float));
+        }
+    }
+
+    StreamLogger logger(std::cerr);
+    logger.setLogLevel(Logger::Warning);
+    SimplePointDb pointDb(dbName, cacheSize, logger);
+
+    const int numThreads = 4;
+    std::atomic<int> numMismatches(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::mt19937 rng(t);
+            std::uniform_real_distribution<double> uniform(-5, 40);
+            std::vector<float> position;
+            std::vector<float> intensity;
+            for (int q = 0; q < 200; ++q)
+            {
+                V3d min(uniform(rng), uniform(rng), -1);
+                Imath::Box3d box(min, min + V3d(12, 12, 12));
+                if (q % 10 == 0)
+                    pointDb.prefetch(Imath::Box3d(box.min + V3d(10, 0, 0), box.max + V3d(10, 0, 0)));
+                pointDb.query(box, position, intensity);
+                size_t expected = 0;
+                for (const V3f& P : allPoints)
+                    expected += box.intersects(V3d(P)) && P.x < box.max.x && P.y < box.max.y;
+                bool ok = position.size() == 3*expected && intensity.size() == expected;
+                for (size_t i = 0; ok && i < expected; ++i)
+                {
+                    int tx = (int)floor(position[3*i]/10);
+                    int ty = (int)floor(position[3*i+1]/10);
+                    ok = intensity[i] == float(tx + 4*ty);
+                }
+                if (!ok)
+                    ++numMismatches;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    CHECK(numMismatches == 0);
+    // Tiles pinned by queries running at the time of a trim may be left
+    // over, but no more than that.
+    CHECK(pointDb.cacheSizeBytes() <= cacheSize + numThreads*tileBytes);
+
+    std::filesystem::remove_all(dbName);
+}
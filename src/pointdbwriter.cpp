@@ -11,6 +11,9 @@
 #include <QFileInfo>
 #include <QDir>
 
+#include "OrderedWorkQueue.h"
+#include "pointdb.h"
+
 // Use laslib
 #ifdef _MSC_VER
 #   pragma warning(push)
@@ -33,39 +36,87 @@ class MonkeyChops { MonkeyChops() { (void)LAS_TOOLS_FORMAT_NAMES; } };
 #endif
 #endif
 
-struct PointDbWriter::PointDbTile
-{
-    PointDbTile(TilePos tilePos) : tilePos(tilePos), recentlyUsed(false) {}
+PointDbBatch::PointDbBatch(double tileSize, const Imath::V3d& offset, int numComponents)
+    : m_tileSize(tileSize),
+    m_offset(offset),
+    m_numComponents(numComponents),
+    m_prevTile(nullptr),
+    m_numPoints(0)
+{ }
 
-    TilePos tilePos;
-    std::vector<float> position;
-    std::vector<float> intensity;
 
-    bool recentlyUsed;
+void PointDbBatch::addPoint(const Imath::V3d& P, const float* attributes)
+{
+    TilePos pos((int)floor(P.x/m_tileSize),
+                (int)floor(P.y/m_tileSize),
+                (int)floor(P.z/m_tileSize));
+    // Consecutive points usually fall in the same tile
+    if (!m_prevTile || pos != m_prevPos)
+    {
+        m_prevTile = &m_tiles[pos];
+        m_prevPos = pos;
+    }
+    m_prevTile->position.push_back(P.x - m_offset.x);
+    m_prevTile->position.push_back(P.y - m_offset.y);
+    m_prevTile->position.push_back(P.z - m_offset.z);
+    m_prevTile->attributes.insert(m_prevTile->attributes.end(), attributes,
+                                  attributes + m_numComponents);
+    m_bounds.extendBy(P);
+    ++m_numPoints;
+}
 
-    size_t numPoints() const { return position.size()/3; }
 
-    size_t sizeBytes() const
+void PointDbBatch::clear()
+{
+    // Drop tiles which weren't used by the last batch, and keep the rest
+    for (auto it = m_tiles.begin(); it != m_tiles.end();)
     {
-        return sizeof(float)*position.capacity() +
-               sizeof(float)*intensity.capacity();
+        if (it->second.position.empty())
+        {
+            it = m_tiles.erase(it);
+            continue;
+        }
+        it->second.position.clear();
+        it->second.attributes.clear();
+        ++it;
     }
+    m_prevTile = nullptr;
+    m_bounds.makeEmpty();
+    m_numPoints = 0;
+}
 
-    bool empty() const { return position.empty(); }
+
+//------------------------------------------------------------------------------
+/// Limit on tile files held open by the writer at once
+static const int maxOpenTileFiles = 128;
+
+
+struct PointDbWriter::PointDbTile
+{
+    PointDbTile(TilePos tilePos) : tilePos(tilePos), totalPoints(0) {}
+
+    TilePos tilePos;
+    uint64_t totalPoints;
 };
 
 
 PointDbWriter::PointDbWriter(const std::string& dirName, const Imath::Box3d& boundingBox,
-                             double tileSize, size_t flushInterval, Logger& logger)
+                             double tileSize, size_t tileBufferBytes,
+                             size_t maxBufferBytes,
+                             const std::vector<HCloudAttribute>& attributes,
+                             Logger& logger)
     : m_dirName(dirName),
     m_boundingBox(boundingBox),
     m_tileSize(tileSize),
+    m_attributes(attributes),
+    m_numComponents(attributeComponentCount(attributes)),
     m_offset(0),
     m_computeBounds(boundingBox.isEmpty()),
-    m_flushInterval(flushInterval),
     m_haveOffset(false),
     m_prevTile(nullptr),
     m_pointsWritten(0),
+    m_spiller(dirName, m_numComponents, tileBufferBytes, maxBufferBytes,
+              maxOpenTileFiles),
     m_logger(logger)
 {
     QString qdirName = QString::fromUtf8(dirName.c_str(), dirName.size());
@@ -76,16 +127,17 @@ PointDbWriter::PointDbWriter(const std::string& dirName, const Imath::Box3d& bou
 }
 
 
+// Declared here to keep definition of PointDbTile out of header
+PointDbWriter::~PointDbWriter() {}
+
+
 size_t PointDbWriter::cacheSizeBytes() const
 {
-    size_t bytes = 0;
-    for (auto it = m_cache.begin(); it != m_cache.end(); ++it)
-        bytes += it->second.sizeBytes();
-    return bytes;
+    return m_spiller.bufferedBytes();
 }
 
 
-void PointDbWriter::writePoint(Imath::V3d P, float intensity)
+void PointDbWriter::writePoint(Imath::V3d P, const float* attributes)
 {
     if (!m_haveOffset)
     {
@@ -99,19 +151,54 @@ void PointDbWriter::writePoint(Imath::V3d P, float intensity)
     if (m_computeBounds)
         m_boundingBox.extendBy(P);
     assert(m_boundingBox.intersects(P));
-    tile.position.push_back(P.x - m_offset.x);
-    tile.position.push_back(P.y - m_offset.y);
-    tile.position.push_back(P.z - m_offset.z);
-    tile.intensity.push_back(intensity);
+    float position[3] = {float(P.x - m_offset.x), float(P.y - m_offset.y),
+                         float(P.z - m_offset.z)};
+    m_spiller.append(tilePos, position, attributes, 1);
+    tile.totalPoints += 1;
     m_pointsWritten += 1;
-    if (m_pointsWritten % m_flushInterval == 0)
-        flushTiles();
+}
+
+
+void PointDbWriter::setOffset(const Imath::V3d& offset)
+{
+    assert(m_pointsWritten == 0);
+    m_offset = offset;
+    m_haveOffset = true;
+}
+
+
+void PointDbWriter::writeBatch(PointDbBatch& batch)
+{
+    assert(m_haveOffset && batch.m_offset == m_offset);
+    assert(batch.m_tileSize == m_tileSize && batch.m_numComponents == m_numComponents);
+    std::lock_guard<std::mutex> lock(m_batchMutex);
+    for (auto& it : batch.m_tiles)
+    {
+        const PointDbBatch::Tile& batchTile = it.second;
+        if (batchTile.position.empty())
+            continue;
+        size_t numPoints = batchTile.position.size()/3;
+        PointDbTile& tile = findTile(it.first);
+        tile.totalPoints += numPoints;
+        m_spiller.append(it.first, batchTile.position.data(),
+                         batchTile.attributes.data(), numPoints);
+    }
+    if (m_computeBounds)
+        m_boundingBox.extendBy(batch.m_bounds);
+    m_pointsWritten += batch.numPoints();
+    batch.clear();
 }
 
 
 void PointDbWriter::close()
 {
-    flushTiles(true);
+    m_spiller.flush();
+    for (auto it = m_cache.begin(); it != m_cache.end(); ++it)
+    {
+        const TilePos& pos = it->second.tilePos;
+        m_spiller.finishTile(pos, tfm::format("%s/%d_%d_%d.dat", m_dirName,
+                                              pos.x, pos.y, pos.z));
+    }
     // Write config file
     std::ofstream dbConfig(tfm::format("%s/config.txt", m_dirName));
     tfm::format(dbConfig,
@@ -124,10 +211,22 @@ void PointDbWriter::close()
         m_offset.x, m_offset.y, m_offset.z
     );
 
+    // Tile positions and point counts, one per line
     for (auto it = m_cache.begin(); it != m_cache.end(); ++it)
     {
-        tfm::format(dbConfig, "%d %d %d\n", it->second.tilePos.x,
-                    it->second.tilePos.y, it->second.tilePos.z);
+        tfm::format(dbConfig, "%d %d %d %d\n", it->second.tilePos.x,
+                    it->second.tilePos.y, it->second.tilePos.z,
+                    it->second.totalPoints);
+    }
+
+    // Attribute list, one per line
+    std::ofstream attrConfig(tfm::format("%s/attributes.txt", m_dirName));
+    for (const HCloudAttribute& attr : m_attributes)
+    {
+        tfm::format(attrConfig, "%s %d %d %d %d %d %d\n", attr.name,
+                    (int)attr.spec.type, attr.spec.elsize, attr.spec.count,
+                    (int)attr.spec.semantics, (int)attr.spec.fixedPoint,
+                    (int)attr.categorical);
     }
 }
 
@@ -135,101 +234,151 @@ void PointDbWriter::close()
 PointDbWriter::PointDbTile& PointDbWriter::findTile(const TilePos& pos)
 {
     if (m_prevTile && m_prevTile->tilePos == pos)
-    {
-        m_prevTile->recentlyUsed = true;
         return *m_prevTile;
-    }
     auto it = m_cache.find(pos);
     if (it == m_cache.end())
     {
         // Create new empty tile
         it = m_cache.insert(std::make_pair(pos, PointDbTile(pos))).first;
     }
-    it->second.recentlyUsed = true;
     m_prevTile = &it->second;
     return it->second;
 }
 
 
-void PointDbWriter::flushTiles(bool forceFlushAll)
+//------------------------------------------------------------------------------
+inline void fixLasFileName(std::string& fileName)
 {
-    for (auto it = m_cache.begin(); it != m_cache.end(); ++it)
-    {
-        PointDbTile& tile = it->second;
-        if ((forceFlushAll || !tile.recentlyUsed) && !tile.empty())
-            flushToDisk(tile);
-        tile.recentlyUsed = false;
-    }
+#   ifdef _WIN32
+    // Hack: liblas doesn't like forward slashes as path separators on windows
+    std::replace(fileName.begin(), fileName.end(), '/', '\\');
+#   endif
 }
 
 
-void PointDbWriter::flushToDisk(PointDbTile& tile)
+/// Range of points within a LAS file, decoded as a unit by one thread
+struct LasChunk
 {
-    assert(!tile.empty());
-    std::string fileName = tfm::format("%s/%d_%d_%d.dat", m_dirName,
-                                        tile.tilePos.x, tile.tilePos.y, tile.tilePos.z);
-    std::ofstream file(fileName.c_str(), std::ios::binary | std::ios::app | std::ios::ate);
-    if (file.tellp() > 0)
-    {
-        m_logger.debug("Reopening file %s to flush %d points",
-                        fileName, tile.numPoints());
-    }
-    for (size_t i = 0; i < tile.numPoints(); ++i)
-    {
-        file.write((const char*)&tile.position[3*i], 3*sizeof(float));
-        file.write((const char*)&tile.intensity[i], sizeof(float));
-    }
-    tile.position.clear();
-    tile.position.shrink_to_fit();
-    tile.intensity.clear();
-    tile.intensity.shrink_to_fit();
-}
+    std::string fileName;
+    uint64_t begin;
+    uint64_t count;
+};
 
 
-//------------------------------------------------------------------------------
-inline void fixLasFileName(std::string& fileName)
+static std::unique_ptr<LASreader> openLasFile(const std::string& fileName)
 {
-#   ifdef _WIN32
-    // Hack: liblas doesn't like forward slashes as path separators on windows
-    std::replace(fileName.begin(), fileName.end(), '/', '\\');
-#   endif
+    LASreadOpener lasReadOpener;
+    lasReadOpener.set_file_name(fileName.c_str());
+    std::unique_ptr<LASreader> lasReader(lasReadOpener.open());
+    if(!lasReader)
+        throw DisplazError("Could not open file: %s", fileName);
+    return lasReader;
 }
 
 
 void convertLasToPointDb(const std::string& outDirName,
                          const std::vector<std::string>& lasFileNames,
                          const Imath::Box3d& boundingBox, double tileSize,
-                         Logger& logger)
+                         size_t tileBufferBytes, size_t maxBufferBytes,
+                         int numThreads, Logger& logger)
 {
-    PointDbWriter dbWriter(outDirName, boundingBox, tileSize, 1000000, logger);
-    bool useBounds = !boundingBox.isEmpty();
+    if (lasFileNames.empty())
+        return;
+    // Read all the file headers up front, to fix the attribute list and the
+    // offset before any points are decoded.  Large files are split into
+    // chunks so that the work can be spread over the threads even with only
+    // a few input files.
+    const uint64_t chunkPointCount = 10000000;
+    std::vector<LasChunk> chunks;
+    Imath::Box3d headerBounds;
+    bool haveColor = false;
+    uint64_t totPoints = 0;
     for (size_t fileIdx = 0; fileIdx < lasFileNames.size(); ++fileIdx)
     {
         std::string fileName = lasFileNames[fileIdx];
         fixLasFileName(fileName);
-        LASreadOpener lasReadOpener;
-        lasReadOpener.set_file_name(fileName.c_str());
-        std::unique_ptr<LASreader> lasReader(lasReadOpener.open());
-        if(!lasReader)
-            throw DisplazError("Could not open file: %s", fileName);
-        uint64_t totPoints = std::max<uint64_t>(lasReader->header.extended_number_of_point_records,
-                                                lasReader->header.number_of_point_records);
-        logger.info("File %s: %d points", fileName, totPoints);
-        logger.progress("Ingest file %d", fileIdx);
-        uint64_t pointsRead = 0;
-        while (lasReader->read_point())
+        std::unique_ptr<LASreader> lasReader = openLasFile(fileName);
+        const LASheader& header = lasReader->header;
+        uint64_t numPoints = std::max<uint64_t>(header.extended_number_of_point_records,
+                                                header.number_of_point_records);
+        logger.info("File %s: %d points", fileName, numPoints);
+        headerBounds.extendBy(V3d(header.min_x, header.min_y, header.min_z));
+        headerBounds.extendBy(V3d(header.max_x, header.max_y, header.max_z));
+        haveColor |= lasReader->point.have_rgb != 0;
+        for (uint64_t begin = 0; begin < numPoints; begin += chunkPointCount)
         {
-            const LASpoint& point = lasReader->point;
-            V3d P = V3d(point.get_x(), point.get_y(), point.get_z());
-            pointsRead += 1;
-            logger.progress(double(pointsRead)/totPoints);
-            if (pointsRead % 1000000 == 0)
-                logger.debug("Cache size: %.2fMB", dbWriter.cacheSizeBytes()/1000000.0);
-            if (useBounds && !boundingBox.intersects(P))
-                continue;
-            dbWriter.writePoint(P, point.intensity);
+            LasChunk chunk = {fileName, begin, std::min(chunkPointCount, numPoints - begin)};
+            chunks.push_back(chunk);
         }
+        totPoints += numPoints;
+    }
+
+    std::vector<HCloudAttribute> attributes;
+    attributes.push_back(HCloudAttribute("intensity", TypeSpec::uint16_i()));
+    attributes.push_back(HCloudAttribute("classification", TypeSpec::uint8_i(), true));
+    if (haveColor)
+    {
+        attributes.push_back(HCloudAttribute("color",
+            TypeSpec(TypeSpec::Uint,2,3,TypeSpec::Color)));
+    }
+    const int numComponents = attributeComponentCount(attributes);
+    bool useBounds = !boundingBox.isEmpty();
+    // Center of the data keeps the float point positions small
+    Imath::V3d offset = useBounds ? boundingBox.center() : headerBounds.center();
+    PointDbWriter dbWriter(outDirName, boundingBox, tileSize, tileBufferBytes,
+                           maxBufferBytes, attributes, logger);
+    dbWriter.setOffset(offset);
+
+    // Each thread decodes a chunk into its own batch of tiles, and appends
+    // the batch to the database whenever it fills up.
+    const size_t batchPointCount = 1000000;
+    OrderedWorkQueue<uint64_t> chunkQueue((int)chunks.size(), numThreads, 2*numThreads,
+        [&](int chunkIdx)
+        {
+            const LasChunk& chunk = chunks[chunkIdx];
+            std::unique_ptr<LASreader> lasReader = openLasFile(chunk.fileName);
+            if (chunk.begin > 0 && !lasReader->seek(chunk.begin))
+            {
+                throw DisplazError("Could not seek to point %d in file %s",
+                                   chunk.begin, chunk.fileName);
+            }
+            PointDbBatch batch(tileSize, offset, numComponents);
+            uint64_t pointsRead = 0;
+            while (pointsRead < chunk.count && lasReader->read_point())
+            {
+                const LASpoint& point = lasReader->point;
+                V3d P = V3d(point.get_x(), point.get_y(), point.get_z());
+                pointsRead += 1;
+                if (useBounds && !boundingBox.intersects(P))
+                    continue;
+                float attrs[5] = {
+                    (float)point.intensity,
+                    (float)(point.extended_point_type ? point.extended_classification
+                                                      : point.classification),
+                    0, 0, 0
+                };
+                // Points from files without color are left black
+                if (haveColor && point.have_rgb)
+                {
+                    attrs[2] = point.rgb[0];
+                    attrs[3] = point.rgb[1];
+                    attrs[4] = point.rgb[2];
+                }
+                batch.addPoint(P, attrs);
+                if (batch.numPoints() >= batchPointCount)
+                    dbWriter.writeBatch(batch);
+            }
+            dbWriter.writeBatch(batch);
+            return std::unique_ptr<uint64_t>(new uint64_t(pointsRead));
+        });
+    logger.info("Ingesting %d points in %d chunks with %d threads",
+                totPoints, chunks.size(), numThreads);
+    logger.progress("Ingest points");
+    uint64_t pointsRead = 0;
+    for (size_t chunkIdx = 0; chunkIdx < chunks.size(); ++chunkIdx)
+    {
+        pointsRead += *chunkQueue.next();
+        logger.progress(double(pointsRead)/std::max<uint64_t>(1, totPoints));
     }
     dbWriter.close();
 }
-
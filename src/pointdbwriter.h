@@ -6,23 +6,74 @@
 
 #include <cstdint>
 #include <map>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
+#include "hcloud.h"
+#include "tilespiller.h"
 #include "util.h"
 
 #include "logger.h"
 
+/// Points binned into point database tiles, for writing in bulk with
+/// PointDbWriter::writeBatch()
+///
+/// Batches are independent of the writer, so several threads can each fill
+/// their own batch at once.
+class PointDbBatch
+{
+    public:
+        PointDbBatch(double tileSize, const Imath::V3d& offset, int numComponents);
+
+        /// Add point with position `P` and numComponents attribute values
+        void addPoint(const Imath::V3d& P, const float* attributes);
+
+        /// Return number of points in batch
+        size_t numPoints() const { return m_numPoints; }
+
+        /// Remove all points, keeping the tile buffers for reuse
+        void clear();
+
+    private:
+        friend class PointDbWriter;
+
+        struct Tile
+        {
+            std::vector<float> position;
+            std::vector<float> attributes; ///< Per point attributes, point-major
+        };
+
+        double m_tileSize;
+        Imath::V3d m_offset;
+        int m_numComponents;
+        std::unordered_map<TilePos, Tile, TilePosHash> m_tiles;
+        TilePos m_prevPos;
+        Tile* m_prevTile;
+        Imath::Box3d m_bounds;
+        size_t m_numPoints;
+};
+
+
 /// Writer for a simple on-disk point database format
 ///
 /// The idea here is to create a very simple database which allows spatial
 /// bounding box queries from an unordered set of points.  This is done by
 /// tiling them into files, working on the assumption that the full set of
-/// points may exceed available memory.
+/// points may exceed available memory.  Each point carries the per-point
+/// attribute channels described by `attributes`, stored as floats.
+///
+/// Points are collected in per-tile write buffers of tileBufferBytes, using
+/// at most maxBufferBytes in total, before being spilled to disk.
 class PointDbWriter
 {
     public:
         PointDbWriter(const std::string& dirName, const Imath::Box3d& boundingBox,
-                      double tileSize, size_t flushInterval, Logger& logger);
+                      double tileSize, size_t tileBufferBytes, size_t maxBufferBytes,
+                      const std::vector<HCloudAttribute>& attributes,
+                      Logger& logger);
+
+        ~PointDbWriter();
 
         /// Compute current memory usage in bytes of the internal cache
         size_t cacheSizeBytes() const;
@@ -31,8 +82,19 @@ class PointDbWriter
         uint64_t pointsWritten() const { return m_pointsWritten; }
 
         /// Write a single point to the database with given position and
-        /// intensity
-        void writePoint(Imath::V3d P, float intensity);
+        /// attribute values.  `attributes` holds attributeComponentCount()
+        /// floats in the order of the attribute list.
+        void writePoint(Imath::V3d P, const float* attributes);
+
+        /// Set offset subtracted from point positions before storing them
+        /// as floats.  By default the first point written is used.
+        void setOffset(const Imath::V3d& offset);
+
+        /// Append all points of `batch` to the database, and clear it.  The
+        /// batch must use the same tile size, offset and attributes as the
+        /// writer.  Unlike writePoint(), this may be called from several
+        /// threads at once.
+        void writeBatch(PointDbBatch& batch);
 
         /// Close database, and write config file
         void close();
@@ -42,29 +104,33 @@ class PointDbWriter
 
         PointDbTile& findTile(const TilePos& pos);
 
-        void flushTiles(bool forceFlushAll = false);
-
-        void flushToDisk(PointDbTile& tile);
-
         std::string m_dirName;
         Imath::Box3d m_boundingBox;
         double m_tileSize;
+        std::vector<HCloudAttribute> m_attributes;
+        int m_numComponents;
         Imath::V3d m_offset;
         std::map<TilePos, PointDbTile, TilePosLess> m_cache;
         bool m_computeBounds;
-        size_t m_flushInterval;
         bool m_haveOffset;
         PointDbTile* m_prevTile;
         uint64_t m_pointsWritten;
+        std::mutex m_batchMutex;
+        TileSpiller m_spiller;
         Logger& m_logger;
 };
 
 
 /// Convert a list of las files to PointDb format
+///
+/// Files are decoded in chunks of points on `numThreads` threads.  If
+/// `boundingBox` is not empty, only points inside it are kept.  See
+/// PointDbWriter for the buffer sizes.
 void convertLasToPointDb(const std::string& outDirName,
                          const std::vector<std::string>& lasFileNames,
                          const Imath::Box3d& boundingBox, double tileSize,
-                         Logger& logger);
+                         size_t tileBufferBytes, size_t maxBufferBytes,
+                         int numThreads, Logger& logger);
 
 
 #endif // DISPLAZ_POINTDBWRITER_H_INCLUDED
@@ -28,6 +28,10 @@ class Annotation
 
         QString label() const { return m_label; }
 
+        /// Size of the rendered text in pixels
+        int width() const { return m_texture->width(); }
+        int height() const { return m_texture->height(); }
+
         /// Draw the annotation using the given shader program
         ///
         /// Requires that `annotationShaderProg` is already bound and that
@@ -74,6 +74,19 @@ class ClipBox
             return false;
         }
 
+        /// Determine whether any part of `box` lies in front of the near
+        /// clipping plane, so that a drawing of the box would be clipped
+        /// there.  This is always the case when the box contains the camera.
+        bool crossesNearPlane(const Imath::Box3f& box) const
+        {
+            // The corner furthest along the negative plane normal is the
+            // one closest to being clipped
+            V3f p((normal[4].x < 0) ? box.max.x : box.min.x,
+                  (normal[4].y < 0) ? box.max.y : box.min.y,
+                  (normal[4].z < 0) ? box.max.z : box.min.z);
+            return normal[4].dot(p) + distance[4] < 0.0;
+        }
+
     private:
         // Plane equation coeffs:  normal[j].dot(v) + distance[j] == 0
         Imath::V3f normal[6];
@@ -0,0 +1,50 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#ifndef DISPLAZ_DRAWCOUNT_H_INCLUDED
+#define DISPLAZ_DRAWCOUNT_H_INCLUDED
+
+/// Estimate of amount of geometry drawn in a frame
+///
+/// `numVertices` is the number of point vertices shaded
+/// `numDrawCalls` is the number of OpenGL draw calls issued
+/// `numBytesUploaded` is the amount of vertex data uploaded to the GPU
+/// `numMeshes` is the number of meshes drawn
+/// `numNodes` is the number of spatial hierarchy nodes visited
+/// `numOccludedNodes` is the number of nodes skipped as hidden behind other
+///   geometry, along with their subtrees
+/// `moreToDraw` indicates whether the geometry is completely drawn
+/// `fetchPending` indicates that some data to draw is still being read in
+///   the background; a later full frame is needed to draw it
+struct DrawCount
+{
+    double numVertices;
+    double numDrawCalls;
+    double numBytesUploaded;
+    double numMeshes;
+    double numNodes;
+    double numOccludedNodes;
+    bool   moreToDraw;
+    bool   fetchPending;
+
+    DrawCount()
+        : numVertices(0), numDrawCalls(0), numBytesUploaded(0), numMeshes(0),
+        numNodes(0), numOccludedNodes(0), moreToDraw(false), fetchPending(false)
+    { }
+
+    DrawCount& operator+=(const DrawCount& rhs)
+    {
+        numVertices += rhs.numVertices;
+        numDrawCalls += rhs.numDrawCalls;
+        numBytesUploaded += rhs.numBytesUploaded;
+        numMeshes += rhs.numMeshes;
+        numNodes += rhs.numNodes;
+        numOccludedNodes += rhs.numOccludedNodes;
+        moreToDraw |= rhs.moreToDraw;
+        fetchPending |= rhs.fetchPending;
+        return *this;
+    }
+};
+
+
+#endif // DISPLAZ_DRAWCOUNT_H_INCLUDED
@@ -1,7 +1,5 @@
 #include "FrameRate.h"
 
-#include <iostream>
-
 #include <tinyformat.h>
 
 FrameRate::FrameRate()
@@ -27,8 +25,6 @@ FrameRate::operator++()
             m_lastFrameTime = double(m_buffer.back() - m_buffer.front()) / (1000.0 * (m_buffer.size()-1));
             m_lastFrameRate = 1.0 / m_lastFrameTime;
             m_buffer.clear();
-
-            std::cout << detailed() << std::endl;
         }
     }
 
@@ -28,6 +28,8 @@ public:
     double frameRate() const;
     /// Get the (averaged) time per frame
     double frameTime() const;
+    /// Get the time at which the averages were last recalculated (ms)
+    int64_t lastUpdateTime() const { return m_lastCalc; }
 
     /// Summary frame rate information
     std::string summary() const;
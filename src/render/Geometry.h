@@ -13,6 +13,7 @@
 #include <QString>
 #include <QMetaType>
 
+#include "DrawCount.h"
 #include "GeometryMutator.h"
 
 class ShaderProgram;
@@ -20,26 +21,6 @@ class QOpenGLShaderProgram;
 struct TransformState;
 
 
-/// Estimate of amount of geometry drawn in a frame
-///
-/// `numVertices` is the number of vertices
-/// `moreToDraw` indicates whether the geometry is completely drawn
-struct DrawCount
-{
-    double numVertices;
-    bool   moreToDraw;
-
-    DrawCount() : numVertices(0), moreToDraw(false) { }
-
-    DrawCount& operator+=(const DrawCount& rhs)
-    {
-        numVertices += rhs.numVertices;
-        moreToDraw |= rhs.moreToDraw;
-        return *this;
-    }
-};
-
-
 /// Shared interface for all displaz geometry types
 class Geometry : public QObject
 {
@@ -73,12 +54,34 @@ class Geometry : public QObject
 
         //--------------------------------------------------
         /// Draw geometry using current OpenGL context
-        virtual void draw(const TransformState& transState, double quality) const {}
+        ///
+        /// quality is as for drawPoints(); the returned DrawCount is an
+        /// estimate of the amount drawn, for the frame cost model.
+        virtual DrawCount draw(const TransformState& transState, double quality) const { return DrawCount(); }
 
         /// Initialize (or reinitialize) any openGL state associated with the
         /// geometry
         virtual void initializeGL();
 
+        //--------------------------------------------------
+        /// Determine which parts of the geometry are visible with the
+        /// camera transform `transState`, ready for estimateCost() and the
+        /// draw functions.
+        ///
+        /// Geometry which culls lazily need not implement this; calling it
+        /// first lets the cost of culling be measured separately.
+        virtual void cull(const TransformState& transState) const {}
+
+        /// Enable or disable skipping parts of the geometry which were found
+        /// to be hidden behind other geometry in previous frames.  Geometry
+        /// without a spatial hierarchy may ignore this.
+        virtual void setOcclusionCulling(bool enable) {}
+
+        /// Set target density of points per pixel of projected screen area
+        /// for screen space level of detail at quality 1.  Geometry without
+        /// level of detail may ignore this.
+        virtual void setLodPointsPerPixel(double pointsPerPixel) {}
+
         //--------------------------------------------------
         /// Draw points using given openGL shader program
         ///
@@ -97,24 +100,25 @@ class Geometry : public QObject
                                      const TransformState& transState, double quality,
                                      bool incrementalDraw) const { return DrawCount(); }
 
-        /// Draw edges with the given shader
-        virtual void drawEdges(QOpenGLShaderProgram& edgeShaderProg,
-                               const TransformState& transState) const {}
-        /// Draw faces with the given shader
-        virtual void drawFaces(QOpenGLShaderProgram& faceShaderProg,
-                               const TransformState& transState) const {}
+        /// Draw edges with the given shader, returning the amount drawn
+        virtual DrawCount drawEdges(QOpenGLShaderProgram& edgeShaderProg,
+                                    const TransformState& transState) const { return DrawCount(); }
+        /// Draw faces with the given shader, returning the amount drawn
+        virtual DrawCount drawFaces(QOpenGLShaderProgram& faceShaderProg,
+                                    const TransformState& transState) const { return DrawCount(); }
 
         /// Return total number of vertices
         virtual size_t pointCount() const = 0;
 
-        /// Estimate the number of vertices which would be shaded when
-        /// the draw() functions are called with the given quality settings.
+        /// Estimate the amount of geometry which would be drawn when the
+        /// draw() functions are called with the given quality settings.
         ///
         /// transState and incrementalDraw are as in drawPoints.
         ///
-        /// `drawCounts[i]` should be filled with an estimate of the count of
-        /// verts drawn at the given quality `qualities[i]`.  `numEstimates` is
-        /// the number of elements in the qualities array.
+        /// `drawCounts[i]` should be incremented by an estimate of the
+        /// vertices, draw calls, uploaded bytes and meshes drawn at the given
+        /// quality `qualities[i]`.  `numEstimates` is the number of elements
+        /// in the qualities array.
         virtual void estimateCost(const TransformState& transState,
                                   bool incrementalDraw, const double* qualities,
                                   DrawCount* drawCounts, int numEstimates) const = 0;
@@ -174,6 +178,10 @@ class Geometry : public QObject
         void loadProgress(int percentLoaded);
         /// Emitted at the end of point loading
         void loadStepComplete();
+        /// Emitted when more data has become available to draw, for
+        /// geometry which loads data in the background.  May be emitted
+        /// from any thread.
+        void redrawNeeded();
 
     protected:
         void setFileName(const QString& fileName) { m_fileName = fileName; }
@@ -3,111 +3,173 @@
 
 #include "HCloudView.h"
 
+#include <algorithm>
+#include <cassert>
 #include <cfloat>
+#include <cmath>
+
+#include <QFileInfo>
 
 #include "hcloud.h"
 #include "ClipBox.h"
 #include "glutil.h"
 #include "QtLogger.h"
+#include "ResidencyManager.h"
 #include "Shader.h"
 #include "ShaderProgram.h"
 #include "streampagecache.h"
 #include "util.h"
 
 //------------------------------------------------------------------------------
+/// Runtime state for a node of the index.  This only exists while the point
+/// data for the node is in memory.
 struct HCloudNode
 {
-    HCloudNode* children[8]; ///< Child nodes - order (x + 2*y + 4*z)
-    Imath::Box3f bbox;       ///< Bounding box of node
-
+    uint64_t index;          ///< Record number in the HCloudIndex
     NodeIndexData idata;
-    bool isLeaf;
+    /// Residency manager entry for point data while cached
+    ResidencyManager::Handle residency;
+    /// Vertex buffer holding point data on the GPU, or zero
+    GLuint vbo;
+    GLsizeiptr vboCapacity;
+    /// GPU residency manager entry for vbo
+    ResidencyManager::Handle gpuResidency;
 
     // List of non-empty voxels inside the node
     std::unique_ptr<float[]> position;
-    std::unique_ptr<float[]> intensity;
     std::unique_ptr<float[]> coverage;
-
-    HCloudNode(const Box3f& bbox)
-        : bbox(bbox),
-        isLeaf(false)
+    /// Attribute channels in the layout of decodeNodeData()
+    std::unique_ptr<float[]> attributes;
+
+    HCloudNode(uint64_t index, const NodeIndexData& idata)
+        : index(index),
+        idata(idata),
+        residency(0),
+        vbo(0),
+        vboCapacity(0),
+        gpuResidency(0)
+    { }
+
+    /// Size of point data arrays in bytes, for nodes with `numComponents`
+    /// attribute components per point
+    uint64_t sizeBytes(int numComponents) const
     {
-        for (int i = 0; i < 8; ++i)
-            children[i] = 0;
+        return bufferLayout(numComponents).sizeBytes;
     }
 
-    ~HCloudNode()
+    /// Layout of point data in the node's vertex buffer
+    NodeBufferLayout bufferLayout(int numComponents) const
     {
-        for (int i = 0; i < 8; ++i)
-            delete children[i];
+        return NodeBufferLayout(idata.flags, idata.numPoints, numComponents);
     }
 
-    bool isCached() const { return position.get() != 0; }
-
-    float radius() const { return bbox.max.x - bbox.min.x; }
-
     /// Allocate arrays for storing point data
-    ///
-    /// (TODO: need some sort of LRU cache)
-    void allocateArrays()
+    void allocateArrays(int numComponents)
     {
         position.reset(new float[3*idata.numPoints]);
-        intensity.reset(new float[idata.numPoints]);
+        attributes.reset(new float[numComponents*idata.numPoints]);
         if (idata.flags == IndexFlags_Voxels)
             coverage.reset(new float[idata.numPoints]);
     }
+};
 
-    void freeArrays()
-    {
-        position.reset();
-        intensity.reset();
-        coverage.reset();
-    }
+
+/// Position of a node in the tree during traversal of the index
+struct NodeRef
+{
+    uint64_t index;
+    Imath::Box3f bbox;
+    int level;
+
+    NodeRef(uint64_t index, const Imath::Box3f& bbox, int level)
+        : index(index), bbox(bbox), level(level) {}
+
+    float radius() const { return bbox.max.x - bbox.min.x; }
 };
 
 
-static HCloudNode* readHCloudIndex(std::istream& in, const Box3f& bbox)
+/// Push the children of `node` onto `nodeStack`
+static void pushChildren(const HCloudIndex& index, const NodeRef& node,
+                         std::vector<NodeRef>& nodeStack)
 {
-    HCloudNode* node = new HCloudNode(bbox);
-    node->idata.flags      = IndexFlags(readLE<uint8_t>(in));
-    node->idata.dataOffset = readLE<uint64_t>(in);
-    node->idata.numPoints  = readLE<uint32_t>(in);
-    uint8_t childNodeMask  = readLE<uint8_t>(in);
-    V3f center = bbox.center();
-    node->isLeaf = (childNodeMask == 0);
+    uint8_t childMask = index.childMask(node.index);
     for (int i = 0; i < 8; ++i)
     {
-        if (!((childNodeMask >> i) & 1))
+        if (!((childMask >> i) & 1))
             continue;
-        Box3f b = bbox;
-        if (i % 2 == 0)
-            b.max.x = center.x;
-        else
-            b.min.x = center.x;
-        if ((i/2) % 2 == 0)
-            b.max.y = center.y;
-        else
-            b.min.y = center.y;
-        if ((i/4) % 2 == 0)
-            b.max.z = center.z;
-        else
-            b.min.z = center.z;
-//        tfm::printf("Read %d: %.3f - %.3f\n", childNodeMask, b.min, b.max);
-        HCloudNode* child = readHCloudIndex(in, b);
+        uint64_t child = index.child(node.index, i);
         // Special case for leaf node points: there's a single child node and
         // it shares the parent bounding box.
-        if (child->idata.flags == IndexFlags_Points)
-            child->bbox = bbox;
-        node->children[i] = child;
+        Box3f bbox = (index.nodeData(child).flags == IndexFlags_Points) ?
+                     node.bbox : childBoundingBox(node.bbox, i);
+        nodeStack.push_back(NodeRef(child, bbox, node.level + 1));
     }
-    return node;
 }
 
 
-HCloudView::HCloudView() : m_sizeBytes(0) { }
+/// Residency of node data and file pages for all hcloud files, so that the
+/// memory budget applies to the application as a whole.
+static ResidencyManager& hcloudResidency()
+{
+    static ResidencyManager residency(1024*1024*1024);
+    return residency;
+}
+
+/// Residency of node vertex buffers for all hcloud files
+static ResidencyManager& hcloudGpuResidency()
+{
+    static ResidencyManager residency(512*1024*1024);
+    return residency;
+}
+
+/// Maximum size of unused vertex buffers kept for reuse by each view
+static const uint64_t maxFreeBufferBytes = 64*1024*1024;
+
+
+HCloudView::HCloudView()
+    : m_indexMap(nullptr),
+    m_fileSize(0),
+    m_attributeComponents(0),
+    m_sizeBytes(0),
+    m_gpuSizeBytes(0),
+    m_freeBufferBytes(0)
+{ }
+
+
+HCloudView::~HCloudView()
+{
+    // Stop I/O threads before anything they might call back into
+    m_inputCache.reset();
+    destroyNodeBuffers();
+    for (auto& node : m_nodes)
+        hcloudResidency().remove(node.second->residency);
+    if (m_indexMap)
+        m_indexFile.unmap(m_indexMap);
+}
+
+
+void HCloudView::setMemoryBudget(uint64_t bytes)
+{
+    hcloudResidency().setBudget(bytes);
+}
+
+
+uint64_t HCloudView::memoryBudget()
+{
+    return hcloudResidency().budget();
+}
+
+
+void HCloudView::setGpuMemoryBudget(uint64_t bytes)
+{
+    hcloudGpuResidency().setBudget(bytes);
+}
 
 
-HCloudView::~HCloudView() { }
+uint64_t HCloudView::gpuMemoryBudget()
+{
+    return hcloudGpuResidency().budget();
+}
 
 
 bool HCloudView::loadFile(QString fileName, size_t maxVertexCount)
@@ -115,12 +177,56 @@ bool HCloudView::loadFile(QString fileName, size_t maxVertexCount)
     m_input.open(fileName.toUtf8(), std::ios::binary);
     m_header.read(m_input);
     g_logger.info("Header:\n%s", m_header);
+    m_attributeComponents = attributeComponentCount(m_header.attributes);
+    for (const HCloudAttribute& attr : m_header.attributes)
+    {
+        if (attr.spec.count > 4)
+        {
+            g_logger.warning("hcloud attribute \"%s\" has %d components; only up to 4 can be drawn",
+                             attr.name, attr.spec.count);
+        }
+    }
 
-    Box3f offsetBox(m_header.boundingBox.min - m_header.offset,
-                    m_header.boundingBox.max - m_header.offset);
-    m_input.seekg(m_header.indexOffset);
-    m_rootNode.reset(readHCloudIndex(m_input, offsetBox));
-    m_inputCache.reset(new StreamPageCache(m_input));
+    m_rootBound = Box3f(m_header.boundingBox.min - m_header.offset,
+                        m_header.boundingBox.max - m_header.offset);
+    // The index is used in place from a memory mapping of the file, so
+    // opening takes the same time however large the tree.  Nodes are only
+    // touched, and their records checked, when a traversal visits them.
+    m_fileSize = QFileInfo(fileName).size();
+    if (m_header.version >= 3)
+    {
+        if (m_header.numIndexNodes == 0 || m_header.indexOffset > m_fileSize ||
+            m_header.numIndexNodes > (m_fileSize - m_header.indexOffset)/HCLOUD_INDEX_RECORD_SIZE)
+        {
+            g_logger.error("Corrupt hcloud index in %s: index outside the file", fileName);
+            return false;
+        }
+        m_indexFile.setFileName(fileName);
+        if (m_indexFile.open(QIODevice::ReadOnly))
+        {
+            m_indexMap = m_indexFile.map(m_header.indexOffset,
+                m_header.numIndexNodes*HCLOUD_INDEX_RECORD_SIZE);
+        }
+    }
+    if (m_indexMap && m_header.numIndexNodes > 0)
+        m_index = HCloudIndex((const char*)m_indexMap, m_header.numIndexNodes);
+    else
+    {
+        // Older depth first indices (or a failed mapping) are read in full
+        m_input.seekg(m_header.indexOffset);
+        m_index.read(m_input, m_header);
+    }
+    std::string indexError;
+    if (!m_index.validateNode(0, m_fileSize, &indexError))
+    {
+        g_logger.error("Corrupt hcloud index in %s: %s", fileName, indexError);
+        return false;
+    }
+    m_inputCache.reset(new StreamPageCache(fileName.toUtf8().constData()));
+    m_inputCache->setResidencyManager(&hcloudResidency());
+    // Pages are fetched in the background; draw again with the new data
+    // whenever some arrives.
+    m_inputCache->setPageReadyCallback([this]() { emit redrawNeeded(); });
 
 //    fields.push_back(GeomField(TypeSpec::vec3float32(), "position", npoints));
 //    fields.push_back(GeomField(TypeSpec::float32(), "intensity", npoints));
@@ -138,48 +244,215 @@ bool HCloudView::loadFile(QString fileName, size_t maxVertexCount)
 
 void HCloudView::initializeGL()
 {
+    Geometry::initializeGL();
+    // Buffers from any previous context are no longer valid
+    destroyNodeBuffers();
+
     m_shader.reset(new ShaderProgram());
     m_shader->setShaderFromSourceFile("shaders:las_points_lod.glsl");
+
+    GLuint vao;
+    glGenVertexArrays(1, &vao);
+    setVAO("hcloud", vao);
+
+    GLuint vbo;
+    glGenBuffers(1, &vbo);
+    setVBO("simplify_threshold", vbo);
+    m_simplifyThreshold.clear();
+}
+
+static void drawBounds(QOpenGLShaderProgram& prog, const HCloudIndex& index,
+                       const NodeRef& node, const TransformState& transState)
+{
+    drawBox(transState, node.bbox, Imath::C3f(1), prog.programId());
+    std::vector<NodeRef> children;
+    pushChildren(index, node, children);
+    for (const NodeRef& child : children)
+        drawBounds(prog, index, child, transState);
 }
 
-static void drawBounds(QOpenGLShaderProgram& prog, HCloudNode* node, const TransformState& transState)
+HCloudNode* HCloudView::cachedNode(uint64_t index) const
 {
-    drawBox(transState, node->bbox, Imath::C3f(1), prog.programId());
+    auto it = m_nodes.find(index);
+    return (it != m_nodes.end()) ? it->second.get() : nullptr;
+}
+
+
+bool HCloudView::childrenCached(uint64_t index) const
+{
+    uint8_t childMask = m_index.childMask(index);
     for (int i = 0; i < 8; ++i)
     {
-        if (node->children[i])
-            drawBounds(prog, node->children[i], transState);
+        if (((childMask >> i) & 1) && !cachedNode(m_index.child(index, i)))
+            return false;
     }
+    return true;
 }
 
-/// Read hcloud point data for node
-///
-/// If the underlying data isn't cached, return false.
-static bool readNodeData(HCloudNode* node, const HCloudHeader& header,
-                         StreamPageCache& inputCache, double priority)
+
+HCloudNode* HCloudView::readNode(uint64_t index, double priority) const
 {
-    node->allocateArrays();
-    uint64_t offset = node->idata.dataOffset;
-    PageCacheReader reader(inputCache, offset);
-    int numPoints = node->idata.numPoints;
-    reader.read(node->position, 3*numPoints);
-    if (node->idata.flags == IndexFlags_Voxels)
-        reader.read(node->coverage, numPoints);
-    reader.read(node->intensity, numPoints);
-    if (reader.bad())
+    // Checking here means no traversal can follow a corrupt record: nodes
+    // are only descended into once their data has been read.
+    if (m_corruptNodes.count(index))
+        return nullptr;
+    std::string indexError;
+    if (!m_index.validateNode(index, m_fileSize, &indexError))
     {
-        inputCache.prefetch(offset, reader.attemptedBytesRead(), priority);
-        node->freeArrays();
-        return false;
+        g_logger.error("Corrupt hcloud index in %s: %s", fileName(), indexError);
+        m_corruptNodes.insert(index);
+        return nullptr;
     }
-    return true;
+    NodeIndexData idata = m_index.nodeData(index);
+    uint64_t offset = idata.dataOffset;
+    uint32_t dataSize = idata.dataSize;
+    std::unique_ptr<char[]> data(new char[dataSize]);
+    if (dataSize > 0 && !m_inputCache->read(data.get(), offset, dataSize))
+    {
+        m_inputCache->prefetch(offset, dataSize, priority);
+        return nullptr;
+    }
+    std::unique_ptr<HCloudNode> node(new HCloudNode(index, idata));
+    node->allocateArrays(m_attributeComponents);
+    if (!decodeNodeData(node->idata, m_header.attributes, data.get(),
+                        node->position.get(), node->coverage.get(),
+                        node->attributes.get()))
+    {
+        g_logger.error("Could not decode hcloud node data at offset %d", offset);
+        // Leave the node with no points rather than failing repeatedly
+        node->idata.numPoints = 0;
+        node->allocateArrays(m_attributeComponents);
+    }
+    HCloudNode* n = node.get();
+    m_nodes[index] = std::move(node);
+    makeResident(n);
+    return n;
 }
 
 
-void HCloudView::draw(const TransformState& transStateIn, double quality) const
+void HCloudView::makeResident(HCloudNode* node) const
+{
+    uint64_t nodeBytes = node->sizeBytes(m_attributeComponents);
+    m_sizeBytes += nodeBytes;
+    node->residency = hcloudResidency().add(nodeBytes, [this,node,nodeBytes]() {
+        m_sizeBytes -= nodeBytes;
+        // GPU data is only kept for nodes which are cached in memory
+        releaseNodeBuffer(node);
+        m_nodes.erase(node->index);
+    });
+}
+
+
+/// Round vertex buffer sizes up to a power of two, so that buffers freed by
+/// one node may be reused by another of similar size.
+static GLsizeiptr nodeBufferCapacity(uint64_t bytes)
+{
+    GLsizeiptr capacity = 4096;
+    while (capacity < (GLsizeiptr)bytes)
+        capacity *= 2;
+    return capacity;
+}
+
+
+uint64_t HCloudView::uploadNodeBuffer(HCloudNode* node) const
+{
+    NodeBufferLayout layout = node->bufferLayout(m_attributeComponents);
+    uint64_t nodeBytes = layout.sizeBytes;
+    GLsizeiptr capacity = nodeBufferCapacity(nodeBytes);
+    auto freeBuffer = m_freeBuffers.find(capacity);
+    if (freeBuffer != m_freeBuffers.end())
+    {
+        node->vbo = freeBuffer->second;
+        m_freeBuffers.erase(freeBuffer);
+        m_freeBufferBytes -= capacity;
+        glBindBuffer(GL_ARRAY_BUFFER, node->vbo);
+    }
+    else
+    {
+        glGenBuffers(1, &node->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, node->vbo);
+        glBufferData(GL_ARRAY_BUFFER, capacity, NULL, GL_STATIC_DRAW);
+    }
+    node->vboCapacity = capacity;
+    GLsizeiptr n = node->idata.numPoints;
+    glBufferSubData(GL_ARRAY_BUFFER, 0, 3*n*sizeof(float), node->position.get());
+    if (node->coverage)
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, layout.coverageOffset, n*sizeof(float),
+                        node->coverage.get());
+    }
+    glBufferSubData(GL_ARRAY_BUFFER, layout.attributeOffset,
+                    m_attributeComponents*n*sizeof(float), node->attributes.get());
+    m_gpuSizeBytes += capacity;
+    node->gpuResidency = hcloudGpuResidency().add(capacity, [this,node]() {
+        releaseNodeBuffer(node);
+    });
+    return nodeBytes;
+}
+
+
+void HCloudView::releaseNodeBuffer(HCloudNode* node) const
+{
+    if (!node->vbo)
+        return;
+    hcloudGpuResidency().remove(node->gpuResidency);
+    m_gpuSizeBytes -= node->vboCapacity;
+    if (m_freeBufferBytes + node->vboCapacity <= maxFreeBufferBytes)
+    {
+        m_freeBuffers.insert(std::make_pair(node->vboCapacity, node->vbo));
+        m_freeBufferBytes += node->vboCapacity;
+    }
+    else
+        glDeleteBuffers(1, &node->vbo);
+    node->vbo = 0;
+    node->vboCapacity = 0;
+    node->gpuResidency = 0;
+}
+
+
+void HCloudView::destroyNodeBuffers() const
+{
+    for (auto& n : m_nodes)
+    {
+        HCloudNode* node = n.second.get();
+        if (node->vbo)
+        {
+            hcloudGpuResidency().remove(node->gpuResidency);
+            glDeleteBuffers(1, &node->vbo);
+            node->vbo = 0;
+            node->vboCapacity = 0;
+            node->gpuResidency = 0;
+        }
+    }
+    for (auto& buffer : m_freeBuffers)
+        glDeleteBuffers(1, &buffer.second);
+    m_freeBuffers.clear();
+    m_freeBufferBytes = 0;
+    m_gpuSizeBytes = 0;
+}
+
+
+/// Angular size in radians below which nodes are drawn rather than refined
+/// into their children, for nodes of `brickSize` voxels across.
+///
+/// The number of voxels drawn for a surface goes roughly as the inverse
+/// square of the limit, so the limit is scaled by 1/sqrt(quality) to make the
+/// amount drawn proportional to quality.
+static double lodAngularSizeLimit(const TransformState& transState, double quality,
+                                  int brickSize)
+{
+    const double pixelsPerVoxel = 2;
+    // Pixels per radian at the centre of the view, from the projection's
+    // vertical field of view
+    double pixelsPerRadian = 0.5*transState.viewSize.y*transState.projMatrix[1][1];
+    return pixelsPerVoxel*brickSize/(pixelsPerRadian*std::sqrt(std::max(quality, 1e-3)));
+}
+
+
+DrawCount HCloudView::draw(const TransformState& transStateIn, double quality) const
 {
     TransformState transState = transStateIn.translate(offset());
-    //drawBounds(m_rootNode.get(), transState);
+    //drawBounds(prog, m_index, NodeRef(0, m_rootBound, 0), transState);
 
     V3f cameraPos = V3d(0) * transState.modelViewMatrix.inverse();
     QOpenGLShaderProgram& prog = m_shader->shaderProgram();
@@ -189,68 +462,80 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
     transState.setUniforms(prog.programId());
     prog.setUniformValue("pointPixelScale", (GLfloat)(0.5 * transState.viewSize.x *
                                                       transState.projMatrix[0][0]));
+    // Node data is drawn from vertex buffers uploaded once per node, so a
+    // static view doesn't send any vertex data to the GPU.
+    glBindVertexArray(getVAO("hcloud"));
     prog.enableAttributeArray("position");
     prog.enableAttributeArray("coverage");
-    prog.enableAttributeArray("intensity");
+    for (const HCloudAttribute& attr : m_header.attributes)
+        prog.enableAttributeArray(attr.name.c_str());
     prog.enableAttributeArray("simplifyThreshold");
+    GLuint simplifyBuffer = getVBO("simplify_threshold");
+    glBindBuffer(GL_ARRAY_BUFFER, simplifyBuffer);
+    prog.setAttributeBuffer("simplifyThreshold", GL_FLOAT, 0, 1);
 
-    // TODO: Ultimately should scale angularSizeLimit with the quality, something
-    // like this:
-    // const double angularSizeLimit = 0.01/std::min(1.0, quality);
-    // g_logger.info("quality = %f", quality);
-    const double pixelsPerVoxel = 2;
-    const double fieldOfView = 60*M_PI/180; // FIXME - shouldn't be hardcoded...
-    double pixelsPerRadian = transStateIn.viewSize.y / fieldOfView;
-    const double angularSizeLimit = pixelsPerVoxel*m_header.brickSize/pixelsPerRadian;
+    const double angularSizeLimit = lodAngularSizeLimit(transState, quality,
+                                                        m_header.brickSize);
 
+    size_t nodesVisited = 0;
     size_t nodesRendered = 0;
     size_t voxelsRendered = 0;
+    uint64_t bytesUploaded = 0;
+    bool fetchPending = false;
+
+    // Pages are requested afresh by the traversal below, with priorities
+    // for the current view.  Drawing never waits for them: nodes are drawn
+    // at lower resolution until the I/O threads have fetched their children.
+    m_inputCache->clearPending();
 
-    const size_t fetchQuota = 10;
-    size_t fetchedPages = m_inputCache->fetchNow(fetchQuota);
+    // Nodes used in the previous frame may now be evicted, unless they're
+    // used again in this one.
+    ResidencyManager& residency = hcloudResidency();
+    for (HCloudNode* node : m_pinnedNodes)
+        residency.unpin(node->residency);
+    m_pinnedNodes.clear();
 
     ClipBox clipBox(transState);
 
     // Render out nodes which are cached or can now be read from the page cache
     const double rootPriority = 1000;
-    std::vector<HCloudNode*> nodeStack;
-    std::vector<int> levelStack;
-    if (m_rootNode->isCached())
-    {
-        levelStack.push_back(0);
-        nodeStack.push_back(m_rootNode.get());
-    }
-    else if (readNodeData(m_rootNode.get(), m_header, *m_inputCache, rootPriority))
-    {
-        nodeStack.push_back(m_rootNode.get());
-        levelStack.push_back(0);
-        m_sizeBytes += 5*sizeof(float)*m_rootNode->idata.numPoints;
-    }
+    std::vector<NodeRef> nodeStack;
+    if (m_index.size() > 0 && (cachedNode(0) || readNode(0, rootPriority)))
+        nodeStack.push_back(NodeRef(0, m_rootBound, 0));
+    else if (m_index.size() > 0)
+        fetchPending = true;
     while (!nodeStack.empty())
     {
-        HCloudNode* node = nodeStack.back();
+        NodeRef ref = nodeStack.back();
         nodeStack.pop_back();
-        int level = levelStack.back();
-        levelStack.pop_back();
 
-        if (clipBox.canCull(node->bbox))
+        if (clipBox.canCull(ref.bbox))
             continue;
 
-        double angularSize = node->radius()/(node->bbox.center() - cameraPos).length();
-        bool drawNode = angularSize < angularSizeLimit || node->isLeaf;
+        // Only nodes with data in memory are pushed
+        HCloudNode* node = cachedNode(ref.index);
+        assert(node);
+        // Keep the path to every drawn node resident
+        residency.pin(node->residency);
+        m_pinnedNodes.push_back(node);
+        nodesVisited++;
+
+        double angularSize = ref.radius()/(ref.bbox.center() - cameraPos).length();
+        bool drawNode = angularSize < angularSizeLimit || m_index.isLeaf(ref.index);
         if (!drawNode)
         {
             // Want to descend into child nodes - try to cache them and if we
             // can't, force current node to be drawn.
+            uint8_t childMask = m_index.childMask(ref.index);
             for (int i = 0; i < 8; ++i)
             {
-                HCloudNode* n = node->children[i];
-                if (n && !n->isCached())
+                if (!((childMask >> i) & 1))
+                    continue;
+                uint64_t child = m_index.child(ref.index, i);
+                if (!cachedNode(child) && !readNode(child, angularSize))
                 {
-                    if (readNodeData(n, m_header, *m_inputCache, angularSize))
-                        m_sizeBytes += 5*sizeof(float)*node->idata.numPoints;
-                    else
-                        drawNode = true;
+                    drawNode = true;
+                    fetchPending |= !m_corruptNodes.count(child);
                 }
             }
         }
@@ -271,8 +556,18 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
                 m_simplifyThreshold.resize(nvox);
                 for (int i = nsimp; i < nvox; ++i)
                     m_simplifyThreshold[i] = float(rand())/RAND_MAX;
+                glBindBuffer(GL_ARRAY_BUFFER, simplifyBuffer);
+                glBufferData(GL_ARRAY_BUFFER, nvox*sizeof(float),
+                             m_simplifyThreshold.data(), GL_STATIC_DRAW);
+                bytesUploaded += nvox*sizeof(float);
             }
 
+            if (!node->vbo)
+                bytesUploaded += uploadNodeBuffer(node);
+            hcloudGpuResidency().touch(node->gpuResidency);
+            glBindBuffer(GL_ARRAY_BUFFER, node->vbo);
+            NodeBufferLayout layout = node->bufferLayout(m_attributeComponents);
+
             if (node->idata.flags == IndexFlags_Points)
             {
                 prog.disableAttributeArray("coverage");
@@ -283,8 +578,8 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
             }
             else
             {
-                prog.setUniformValue("lodMultiplier", GLfloat(0.5*node->radius()/m_header.brickSize));
-                prog.setAttributeArray("coverage",  node->coverage.get(),  1);
+                prog.setUniformValue("lodMultiplier", GLfloat(0.5*ref.radius()/m_header.brickSize));
+                prog.setAttributeBuffer("coverage", GL_FLOAT, layout.coverageOffset, 1);
                 // Draw voxels as billboards (not spheres) when drawing MIP
                 // levels: the point radius represents a screen coverage in
                 // this case, with no sensible interpreation as a radius toward
@@ -294,10 +589,17 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
                 prog.setUniformValue("markerShape", GLint(0));
             }
             // Debug - draw octree levels
-            // prog.setUniformValue("level", level);
-            prog.setAttributeArray("position",  node->position.get(),  3);
-            prog.setAttributeArray("intensity", node->intensity.get(), 1);
-            prog.setAttributeArray("simplifyThreshold", m_simplifyThreshold.data(), 1);
+            // prog.setUniformValue("level", ref.level);
+            prog.setAttributeBuffer("position",  GL_FLOAT, 0, 3);
+            // Attribute channels are bound by name, so any the shader
+            // doesn't declare are ignored
+            int attrOffset = (int)layout.attributeOffset;
+            for (const HCloudAttribute& attr : m_header.attributes)
+            {
+                if (attr.spec.count <= 4)
+                    prog.setAttributeBuffer(attr.name.c_str(), GL_FLOAT, attrOffset, attr.spec.count);
+                attrOffset += attr.spec.count*nvox*sizeof(float);
+            }
             glDrawArrays(GL_POINTS, 0, nvox);
             if (node->idata.flags == IndexFlags_Points)
                 prog.enableAttributeArray("coverage");
@@ -305,45 +607,99 @@ void HCloudView::draw(const TransformState& transStateIn, double quality) const
             voxelsRendered += nvox;
         }
         else
-        {
-            for (int i = 0; i < 8; ++i)
-            {
-                HCloudNode* n = node->children[i];
-                if (n)
-                {
-                    nodeStack.push_back(n);
-                    levelStack.push_back(level+1);
-                }
-            }
-        }
+            pushChildren(m_index, ref, nodeStack);
     }
 
     prog.disableAttributeArray("position");
     prog.disableAttributeArray("coverage");
-    prog.disableAttributeArray("intensity");
+    for (const HCloudAttribute& attr : m_header.attributes)
+        prog.disableAttributeArray(attr.name.c_str());
     prog.disableAttributeArray("simplifyThreshold");
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
 
     glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
     // prog.release();
 
-    g_logger.info("hcloud: %.1fMB, #nodes = %d, fetched pages = %d, mean voxel size = %.0f",
-                  m_sizeBytes/1e6, nodesRendered, fetchedPages,
+    size_t numEvicted = residency.enforceBudget();
+    ResidencyStats stats = residency.stats();
+    hcloudGpuResidency().enforceBudget();
+
+    g_logger.info("hcloud: %.1fMB, #nodes = %d, fetched pages = %d, pending pages = %d, mean voxel size = %.0f",
+                  m_sizeBytes/1e6, nodesRendered, m_inputCache->fetchedPageCount(),
+                  m_inputCache->pendingPageCount(),
                   nodesRendered ? double(voxelsRendered)/nodesRendered : 0.0);
+    g_logger.debug("hcloud residency: %.1f / %.1f MB (%.1f MB pinned), evicted %d this frame, %d total (%.1f MB)",
+                  stats.residentBytes/1e6, residency.budget()/1e6, stats.pinnedBytes/1e6,
+                  numEvicted, stats.numEvictions, stats.evictedBytes/1e6);
+    g_logger.debug("hcloud gpu: %.1f / %.1f MB in vertex buffers, %.1f MB uploaded this frame",
+                  m_gpuSizeBytes/1e6, hcloudGpuResidency().budget()/1e6, bytesUploaded/1e6);
+
+    // Incremental frames don't draw hcloud data, so nodes still being read
+    // need another full frame.  Interactive views get one when
+    // redrawNeeded() is emitted as the data arrives, while offscreen renders
+    // poll using fetchPending.
+    DrawCount drawCount;
+    drawCount.moreToDraw = fetchPending;
+    drawCount.fetchPending = fetchPending;
+    drawCount.numVertices = voxelsRendered;
+    drawCount.numDrawCalls = nodesRendered;
+    drawCount.numBytesUploaded = bytesUploaded;
+    drawCount.numNodes = nodesVisited;
+    return drawCount;
 }
 
 
 size_t HCloudView::pointCount() const
 {
-    // FIXME
-    return 0;
+    return m_header.numPoints;
 }
 
 
-void HCloudView::estimateCost(const TransformState& transState,
+void HCloudView::estimateCost(const TransformState& transStateIn,
                               bool incrementalDraw, const double* qualities,
                               DrawCount* drawCounts, int numEstimates) const
 {
-    // FIXME
+    // Only full frames draw hcloud data
+    if (incrementalDraw || !cachedNode(0))
+        return;
+    TransformState transState = transStateIn.translate(offset());
+    V3f cameraPos = V3d(0) * transState.modelViewMatrix.inverse();
+    ClipBox clipBox(transState);
+    // Mirror the traversal in draw().  Nodes with children which haven't
+    // been read yet are drawn in their place, as in draw().
+    std::vector<NodeRef> nodeStack;
+    for (int i = 0; i < numEstimates; ++i)
+    {
+        DrawCount& drawCount = drawCounts[i];
+        const double angularSizeLimit = lodAngularSizeLimit(transState, qualities[i],
+                                                            m_header.brickSize);
+        nodeStack.push_back(NodeRef(0, m_rootBound, 0));
+        while (!nodeStack.empty())
+        {
+            NodeRef ref = nodeStack.back();
+            nodeStack.pop_back();
+            if (clipBox.canCull(ref.bbox))
+                continue;
+            drawCount.numNodes += 1;
+            double angularSize = ref.radius()/(ref.bbox.center() - cameraPos).length();
+            bool isLeaf = m_index.isLeaf(ref.index);
+            bool drawNode = angularSize < angularSizeLimit || isLeaf ||
+                            !childrenCached(ref.index);
+            if (drawNode)
+            {
+                const HCloudNode* node = cachedNode(ref.index);
+                drawCount.numVertices += node->idata.numPoints;
+                drawCount.numDrawCalls += 1;
+                if (!node->vbo)
+                    drawCount.numBytesUploaded += node->sizeBytes(m_attributeComponents);
+                // Higher quality would refine any non-leaf node
+                drawCount.moreToDraw |= !isLeaf;
+            }
+            else
+                pushChildren(m_index, ref, nodeStack);
+        }
+    }
 }
 
 
@@ -357,34 +713,20 @@ bool HCloudView::pickVertex(const V3d& cameraPos,
     // draw()
     const double angularSizeLimit = 0.01;
     double minDist = DBL_MAX;
-    std::vector<HCloudNode*> nodeStack;
-    std::vector<int> levelStack;
+    std::vector<NodeRef> nodeStack;
     bool foundVertex = false;
-    levelStack.push_back(0);
-    if (m_rootNode->isCached())
-        nodeStack.push_back(m_rootNode.get());
+    if (cachedNode(0))
+        nodeStack.push_back(NodeRef(0, m_rootBound, 0));
     while (!nodeStack.empty())
     {
-        HCloudNode* node = nodeStack.back();
+        NodeRef ref = nodeStack.back();
         nodeStack.pop_back();
-        int level = levelStack.back();
-        levelStack.pop_back();
-        double angularSize = node->radius()/(node->bbox.center() + offset() - cameraPos).length();
-        bool useNode = angularSize < angularSizeLimit || node->isLeaf;
-        if (!useNode)
-        {
-            bool childrenCached = true;
-            for (int i = 0; i < 8; ++i)
-            {
-                HCloudNode* n = node->children[i];
-                if (n && !n->isCached())
-                    childrenCached = false;
-            }
-            if (!childrenCached)
-                useNode = true;
-        }
+        double angularSize = ref.radius()/(ref.bbox.center() + offset() - cameraPos).length();
+        bool useNode = angularSize < angularSizeLimit || m_index.isLeaf(ref.index) ||
+                       !childrenCached(ref.index);
         if (useNode)
         {
+            const HCloudNode* node = cachedNode(ref.index);
             double dist = DBL_MAX;
             const V3f* P = reinterpret_cast<const V3f*>(node->position.get());
             size_t idx = distFunc.findNearest(offset(), P, node->idata.numPoints, &dist);
@@ -396,17 +738,7 @@ bool HCloudView::pickVertex(const V3d& cameraPos,
             }
         }
         else
-        {
-            for (int i = 0; i < 8; ++i)
-            {
-                HCloudNode* n = node->children[i];
-                if (n)
-                {
-                    nodeStack.push_back(n);
-                    levelStack.push_back(level+1);
-                }
-            }
-        }
+            pushChildren(m_index, ref, nodeStack);
     }
     return foundVertex;
 }
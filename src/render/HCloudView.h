@@ -6,6 +6,10 @@
 #define DISPLAZ_HCLOUDVIEW_H_INCLUDED
 
 #include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <QFile>
 
 #include "Geometry.h"
 #include "hcloud.h"
@@ -30,7 +34,7 @@ class HCloudView : public Geometry
 
         virtual void initializeGL();
 
-        virtual void draw(const TransformState& transState, double quality) const;
+        virtual DrawCount draw(const TransformState& transState, double quality) const;
 
         virtual size_t pointCount() const;
 
@@ -44,17 +48,70 @@ class HCloudView : public Geometry
                                 double* distance = 0,
                                 std::string* info = 0) const;
 
+        /// Set maximum memory in bytes used for node data and file pages,
+        /// shared between all hcloud files.  Least recently drawn data is
+        /// evicted beyond this.
+        static void setMemoryBudget(uint64_t bytes);
+        static uint64_t memoryBudget();
+
+        /// Set maximum size in bytes of node vertex buffers, shared between
+        /// all hcloud files.  Least recently drawn buffers are freed beyond
+        /// this, and uploaded again when next needed.
+        static void setGpuMemoryBudget(uint64_t bytes);
+        static uint64_t gpuMemoryBudget();
+
 
     private:
+        /// Return runtime state for node `index` if its data is in memory,
+        /// or null
+        HCloudNode* cachedNode(uint64_t index) const;
+        /// Return true if the data for all children of node `index` is in
+        /// memory
+        bool childrenCached(uint64_t index) const;
+        /// Read point data for node `index` from the page cache, creating
+        /// runtime state for the node.  If the data isn't cached, request it
+        /// with the given priority and return null.  Nodes with corrupt
+        /// index records are never read, and also give null.
+        HCloudNode* readNode(uint64_t index, double priority) const;
+        /// Track memory for newly read node data, freeing it on eviction
+        void makeResident(HCloudNode* node) const;
+        /// Upload point data for node into a vertex buffer, returning the
+        /// number of bytes uploaded
+        uint64_t uploadNodeBuffer(HCloudNode* node) const;
+        /// Return vertex buffer of node to the pool of free buffers
+        void releaseNodeBuffer(HCloudNode* node) const;
+        /// Delete all vertex buffers, including free ones
+        void destroyNodeBuffers() const;
+
         HCloudHeader m_header; // TODO: Put in HCloudInput class
+        /// File mapping holding the index, for version 3 files
+        QFile m_indexFile;
+        uchar* m_indexMap;
+        HCloudIndex m_index;
+        /// Size of the hcloud file, for checking index records
+        uint64_t m_fileSize;
+        /// Nodes whose index records were found to be corrupt when first
+        /// read.  The parent is drawn in their place.
+        mutable std::unordered_set<uint64_t> m_corruptNodes;
+        /// Bounding box of the root node, relative to offset()
+        Imath::Box3f m_rootBound;
+        /// Number of float attribute components per point
+        int m_attributeComponents;
         // TODO: Do we really want all this mutable state?
         // Should draw() be logically non-const?
         mutable uint64_t m_sizeBytes;
+        mutable uint64_t m_gpuSizeBytes;
+        /// Unused node vertex buffers, by capacity
+        mutable std::multimap<GLsizeiptr, GLuint> m_freeBuffers;
+        mutable uint64_t m_freeBufferBytes;
         mutable std::ifstream m_input;
         mutable std::unique_ptr<StreamPageCache> m_inputCache;
-        std::unique_ptr<HCloudNode> m_rootNode;
+        /// Runtime state of nodes with data in memory, by index record number
+        mutable std::unordered_map<uint64_t, std::unique_ptr<HCloudNode>> m_nodes;
         std::unique_ptr<ShaderProgram> m_shader;
         mutable std::vector<float> m_simplifyThreshold;
+        /// Nodes used by the previous draw(), which must not be evicted
+        mutable std::vector<HCloudNode*> m_pinnedNodes;
 };
 
 
@@ -3,12 +3,13 @@
 
 #pragma once
 
-#include <memory>
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <random>
 #include <vector>
 
 #include "util.h"
-#include "glutil.h"
-#include "GeomField.h"
 
 //------------------------------------------------------------------------------
 /// Functor to compute octree child node index with respect to some given split
@@ -29,27 +30,24 @@ struct OctreeChildIdx
 };
 
 
+/// Compact octree node, stored by value in the breadth first node array of an
+/// Octree.
+///
+/// The children of a node are stored contiguously starting at `firstChild`,
+/// in order of increasing octant index (x + 2*y + 4*z) for the octants set in
+/// `childMask`.
 struct OctreeNode
 {
-    OctreeNode* children[8]; ///< Child nodes - order (x + 2*y + 4*z)
     size_t beginIndex;       ///< Begin index of points in this node
     size_t endIndex;         ///< End index of points in this node
     mutable size_t nextBeginIndex; ///< Next index for incremental rendering
-    Imath::Box3f bbox;       ///< Actual bounding box of points in node
-    V3f center;              ///< center of the node
-    float halfWidth;         ///< Half the axis-aligned width of the node.
+    uint32_t firstChild;     ///< Index of first child in Octree::nodes
+    uint8_t childMask;       ///< Bit i is set if octant i has a child
 
-    OctreeNode(const V3f& center, float halfWidth)
-        : beginIndex(0), endIndex(0), nextBeginIndex(0),
-        center(center), halfWidth(halfWidth)
-    {
-        std::fill(children, children + 8, nullptr);
-    }
-
-    ~OctreeNode()
-    {
-        std::for_each(children, children + 8, [](auto v) { delete v; });
-    }
+    OctreeNode(size_t beginIndex = 0)
+        : beginIndex(beginIndex), endIndex(beginIndex),
+        nextBeginIndex(beginIndex), firstChild(0), childMask(0)
+    { }
 
     size_t findNearest(const EllipticalDist& distFunc,
                        const V3d& offset, const V3f* p,
@@ -62,106 +60,147 @@ struct OctreeNode
 
     size_t size() const { return endIndex - beginIndex; }
 
-    bool isLeaf() const { return beginIndex != endIndex; }
+    bool isLeaf() const { return childMask == 0; }
 
-    /// Estimate cost of drawing a single leaf node with to given camera
-    /// position, quality, and incremental settings.
-    ///
-    /// Returns estimate of primitive draw count and whether there's anything
-    /// more to draw.
-    DrawCount drawCount(const V3f& relCamera,
-                        double quality, bool incrementalDraw) const
-    {
-        assert(isLeaf());
-        const double drawAllDist = 100;
-        double dist = (this->bbox.center() - relCamera).length();
-        double diagRadius = this->bbox.size().length()/2;
-        // Subtract bucket diagonal dist, since we really want an approx
-        // distance to closest point in the bucket, rather than dist to center.
-        dist = std::max(10.0, dist - diagRadius);
-        double desiredFraction = std::min(1.0, quality*pow(drawAllDist/dist, 2));
-        size_t chunkSize = (size_t)ceil(this->size()*desiredFraction);
-        DrawCount drawCount;
-        drawCount.numVertices = chunkSize;
-        if (incrementalDraw)
-        {
-            drawCount.numVertices = (this->nextBeginIndex >= this->endIndex) ? 0 :
-                std::min(chunkSize, this->endIndex - this->nextBeginIndex);
-        }
-        drawCount.moreToDraw = this->nextBeginIndex < this->endIndex;
-        return drawCount;
-    }
+    size_t numChildren() const { return std::bitset<8>(childMask).count(); }
+
+    /// Index one past the last child in Octree::nodes
+    size_t endChild() const { return firstChild + numChildren(); }
 };
 
 
-struct ProgressFunc
+/// Octree stored as a contiguous breadth first array of nodes.
+///
+/// Node bounding boxes are kept in a separate array so that traversals which
+/// don't need them stay compact in cache.  Both arrays contain only plain
+/// data and could be written out and mapped back into memory as-is.
+struct Octree
 {
-    PointArray& points;
-    size_t totProcessed;
-
-    ProgressFunc(PointArray& points) : points(points), totProcessed(0) {}
+    std::vector<OctreeNode> nodes;    ///< Nodes in breadth first order; nodes[0] is the root
+    std::vector<Imath::Box3f> bboxes; ///< Actual bounding box of points in each node
+    V3f center = V3f(0);              ///< Center of the root node cell
+    float halfWidth = 0;              ///< Half the axis-aligned width of the root node cell
 
-    void operator()(size_t additionalProcessed)
-    {
-        totProcessed += additionalProcessed;
-        emit points.loadProgress(int(100*totProcessed/points.pointCount()));
-    }
+    bool empty() const { return nodes.empty(); }
 };
 
+
 /// Create an octree over the given set of points with position P
 ///
-/// The points for consideration in the current node are the set
-/// P[inds[beginIndex..endIndex]]; the tree building process sorts the inds
-/// array in place so that points for the output leaf nodes are held in
-/// the range P[inds[node.beginIndex, node.endIndex)]].  center is the central
-/// split point for splitting children of the current node; radius is the
-/// current node radius measured along one of the axes.
-OctreeNode* makeTree(int depth, size_t* inds,
-                     size_t beginIndex, size_t endIndex,
-                     const V3f* P, const V3f& center,
-                     float halfWidth, ProgressFunc& progressFunc)
+/// The points for consideration are the set P[inds[0..numPoints]]; the tree
+/// building process sorts the inds array in place so that points for each
+/// output node are held in the range P[inds[node.beginIndex, node.endIndex)]].
+/// Interior nodes hold a spatially uniform subsample of their subtree, and
+/// leaves hold the remainder.  center is the central split point of the root
+/// node; halfWidth is the root node radius measured along one of the axes.
+///
+/// Nodes with no more than `pointsPerNode` points in their subtree become
+/// leaves.  Interior nodes keep the first point found in each cell of a
+/// `sampleGridRes`^3 grid.
+template<typename ProgressFuncT>
+void makeTree(Octree& tree, size_t* inds, size_t numPoints, const V3f* P,
+              const V3f& center, float halfWidth, ProgressFuncT& progressFunc,
+              size_t pointsPerNode = 100000, int sampleGridRes = 32)
 {
-    OctreeNode* node = new OctreeNode(center, halfWidth);
-    const size_t pointsPerNode = 100000;
     // Limit max depth of tree to prevent infinite recursion when
     // greater than pointsPerNode points lie at the same position in
     // space.  floats effectively have 24 bit of precision in the
     // mantissa, so there's never any point splitting more than 24 times.
     const int maxDepth = 24;
-    size_t* beginPtr = inds + beginIndex;
-    size_t* endPtr = inds + endIndex;
-    if (endIndex - beginIndex <= pointsPerNode || depth >= maxDepth)
+    static std::random_device rd;
+    static std::mt19937 g(rd());
+
+    // Node cell geometry and end of point range, only needed during
+    // construction
+    struct NodeCell
     {
-        static std::random_device rd;
-        static std::mt19937 g(rd());
-        std::shuffle(beginPtr, endPtr, g);
-
-        // Leaf node: set up indices into point list 
-        for (size_t i = beginIndex; i < endIndex; ++i)
-            node->bbox.extendBy(P[inds[i]]);
-        node->beginIndex = beginIndex;
-        node->endIndex = endIndex;
-        progressFunc(endIndex - beginIndex);
-        return node;
-    }
-    // Partition points into the 8 child nodes
-    size_t* childRanges[9] = {0};
-    multi_partition(beginPtr, endPtr, OctreeChildIdx(P, center), &childRanges[1], 8);
-    childRanges[0] = beginPtr;
-    // Recursively generate child nodes
-    float h = halfWidth/2;
-    for (int i = 0; i < 8; ++i)
+        V3f center;
+        float halfWidth;
+        int depth;
+        size_t endIndex;
+    };
+    std::vector<NodeCell> cells;
+
+    tree.nodes.clear();
+    tree.bboxes.clear();
+    tree.center = center;
+    tree.halfWidth = halfWidth;
+    tree.nodes.push_back(OctreeNode(0));
+    cells.push_back(NodeCell{center, halfWidth, 0, numPoints});
+    std::vector<bool> usedCells;
+    // Nodes are appended as their parents are processed, which results in
+    // breadth first order with siblings stored contiguously.
+    for (size_t n = 0; n < tree.nodes.size(); ++n)
     {
-        size_t childBeginIndex = childRanges[i]   - inds;
-        size_t childEndIndex   = childRanges[i+1] - inds;
-        if (childEndIndex == childBeginIndex)
+        const NodeCell cell = cells[n];
+        const size_t beginIndex = tree.nodes[n].beginIndex;
+        const size_t endIndex = cell.endIndex;
+        size_t* beginPtr = inds + beginIndex;
+        size_t* endPtr = inds + endIndex;
+        if (endIndex - beginIndex <= pointsPerNode || cell.depth >= maxDepth)
+        {
+            // Leaf node: set up indices into point list
+            std::shuffle(beginPtr, endPtr, g);
+            tree.nodes[n].endIndex = endIndex;
+            progressFunc(endIndex - beginIndex);
             continue;
-        V3f c = center + V3f((i     % 2 == 0) ? -h : h,
-                             ((i/2) % 2 == 0) ? -h : h,
-                             ((i/4) % 2 == 0) ? -h : h);
-        node->children[i] = makeTree(depth+1, inds, childBeginIndex,
-                                     childEndIndex, P, c, h, progressFunc);
-        node->bbox.extendBy(node->children[i]->bbox);
+        }
+        // Interior node: keep a spatially uniform subsample of the points in
+        // the subtree, consisting of the first point found in each cell of a
+        // regular grid over the node.  The samples are moved to the front of
+        // the range and only the remaining points are passed to the children,
+        // so each point is stored in exactly one node.
+        usedCells.assign(sampleGridRes*sampleGridRes*sampleGridRes, false);
+        V3f cellOrigin = cell.center - V3f(cell.halfWidth);
+        float cellScale = cell.halfWidth > 0 ? sampleGridRes/(2*cell.halfWidth) : 0;
+        size_t* samplesEnd = beginPtr;
+        for (size_t* p = beginPtr; p < endPtr; ++p)
+        {
+            V3f c = (P[*p] - cellOrigin)*cellScale;
+            int x = std::clamp(int(c.x), 0, sampleGridRes-1);
+            int y = std::clamp(int(c.y), 0, sampleGridRes-1);
+            int z = std::clamp(int(c.z), 0, sampleGridRes-1);
+            int cellIdx = x + sampleGridRes*(y + sampleGridRes*z);
+            if (usedCells[cellIdx])
+                continue;
+            usedCells[cellIdx] = true;
+            std::swap(*p, *samplesEnd++);
+        }
+        std::shuffle(beginPtr, samplesEnd, g);
+        tree.nodes[n].endIndex = samplesEnd - inds;
+        progressFunc(tree.nodes[n].size());
+        // Partition remaining points into the 8 child nodes
+        size_t* childRanges[9] = {0};
+        multi_partition(samplesEnd, endPtr, OctreeChildIdx(P, cell.center),
+                        &childRanges[1], 8);
+        childRanges[0] = samplesEnd;
+        // Append child nodes, to be processed once we reach them
+        float h = cell.halfWidth/2;
+        tree.nodes[n].firstChild = (uint32_t)tree.nodes.size();
+        for (int i = 0; i < 8; ++i)
+        {
+            size_t childBeginIndex = childRanges[i]   - inds;
+            size_t childEndIndex   = childRanges[i+1] - inds;
+            if (childEndIndex == childBeginIndex)
+                continue;
+            V3f c = cell.center + V3f((i     % 2 == 0) ? -h : h,
+                                      ((i/2) % 2 == 0) ? -h : h,
+                                      ((i/4) % 2 == 0) ? -h : h);
+            tree.nodes[n].childMask |= 1 << i;
+            tree.nodes.push_back(OctreeNode(childBeginIndex));
+            cells.push_back(NodeCell{c, h, cell.depth + 1, childEndIndex});
+        }
+    }
+    // Compute bounding boxes bottom up; children always come after their
+    // parent in breadth first order.
+    tree.bboxes.resize(tree.nodes.size());
+    for (size_t n = tree.nodes.size(); n-- > 0;)
+    {
+        const OctreeNode& node = tree.nodes[n];
+        Imath::Box3f& bbox = tree.bboxes[n];
+        for (size_t i = node.beginIndex; i < node.endIndex; ++i)
+            bbox.extendBy(P[inds[i]]);
+        for (size_t c = node.firstChild; c < node.endChild(); ++c)
+            bbox.extendBy(tree.bboxes[c]);
     }
-    return node;
 }
@@ -22,7 +22,6 @@
 #include <random>
 #include <queue>
 #include <array>
-#include <stack>
 
 #include <cfloat>
 
@@ -30,6 +29,142 @@
 
 #include "ClipBox.h"
 #include "OctreeNode.h"
+
+
+//------------------------------------------------------------------------------
+/// Node which survived frustum culling for a particular camera transform,
+/// along with the view dependent parameters needed to compute its level of
+/// detail.
+///
+/// Visible nodes are stored in depth first preorder; `subtreeEnd` is the
+/// position just past the last visible descendant so that traversal can skip
+/// the subtree when the node itself provides enough detail.
+struct VisibleNode
+{
+    const OctreeNode* node;
+    size_t index;      ///< Index of node in Octree::nodes
+    double dist;       ///< Camera distance, from cameraDistance()
+    double screenArea; ///< Projected area in pixels, from screenArea()
+    size_t subtreeEnd;
+    /// False if the node bounding box is clipped by the near plane, in which
+    /// case occlusion queries can't be trusted.
+    bool occlusionTestable;
+
+    VisibleNode(const OctreeNode* node, size_t index, double dist,
+                double screenArea, bool occlusionTestable)
+        : node(node), index(index), dist(dist), screenArea(screenArea),
+        subtreeEnd(0), occlusionTestable(occlusionTestable) {}
+
+    /// Return fraction of points in the node to draw at the given quality
+    ///
+    /// For the screen space metric, `pointsPerPixel` is the density to aim
+    /// for over the projected node area at quality 1.
+    double drawFraction(LodMetric metric, double pointsPerPixel, double quality) const
+    {
+        if (metric == LodMetric::Distance)
+        {
+            const double drawAllDist = 100;
+            return std::min(1.0, quality*pow(drawAllDist/dist, 2));
+        }
+        return std::min(1.0, quality*pointsPerPixel*screenArea/node->size());
+    }
+
+    /// Return true if drawing `desiredFraction` of the points in the node
+    /// with the given incremental settings will complete the node.
+    ///
+    /// Interior nodes hold a coarse subsample of their subtree, so children
+    /// only need to be drawn once their parent is complete.
+    bool completesDraw(double desiredFraction, bool incrementalDraw) const
+    {
+        size_t chunkSize = (size_t)ceil(node->size()*desiredFraction);
+        size_t begin = incrementalDraw ? node->nextBeginIndex : node->beginIndex;
+        return begin + chunkSize >= node->endIndex;
+    }
+
+    /// Estimate cost of drawing `desiredFraction` of the points in the node
+    /// with the given incremental settings, when each vertex requires
+    /// uploading `perVertexBytes`.
+    ///
+    /// Returns estimate of primitive draw count and whether there's anything
+    /// more to draw.
+    DrawCount drawCount(double desiredFraction, bool incrementalDraw,
+                        size_t perVertexBytes) const
+    {
+        size_t chunkSize = (size_t)ceil(node->size()*desiredFraction);
+        DrawCount drawCount;
+        drawCount.numNodes = 1;
+        drawCount.numVertices = chunkSize;
+        if (incrementalDraw)
+        {
+            drawCount.numVertices = (node->nextBeginIndex >= node->endIndex) ? 0 :
+                std::min(chunkSize, node->endIndex - node->nextBeginIndex);
+        }
+        if (drawCount.numVertices > 0)
+        {
+            drawCount.numDrawCalls = 1;
+            drawCount.numBytesUploaded = drawCount.numVertices*perVertexBytes;
+        }
+        drawCount.moreToDraw = node->nextBeginIndex < node->endIndex;
+        return drawCount;
+    }
+};
+
+
+/// Hardware occlusion query state for an octree node.
+///
+/// Queries are issued after the node's geometry has been drawn and read back
+/// in a later frame, so that the CPU never waits on the GPU.  Visibility is
+/// assumed to be coherent between frames; a stale result is used to skip the
+/// node until a fresh query says otherwise.
+struct NodeOcclusion
+{
+    GLuint query = 0;        ///< Query object, created on first use
+    bool pending = false;    ///< Query issued but result not read yet
+    bool occluded = false;   ///< No samples of the bounding box passed the depth test
+    uint64_t queryEpoch = 0; ///< Epoch when the pending query was issued
+    uint64_t resultEpoch = 0;///< Epoch of the query which gave `occluded`
+};
+
+
+/// Return approximate distance from `relCamera` to the closest point in
+/// `bbox`.
+static double cameraDistance(const Imath::Box3f& bbox, const V3f& relCamera)
+{
+    double dist = (bbox.center() - relCamera).length();
+    double diagRadius = bbox.size().length()/2;
+    // Subtract bucket diagonal dist, since we really want an approx
+    // distance to closest point in the bucket, rather than dist to center.
+    return std::max(10.0, dist - diagRadius);
+}
+
+
+/// Return approximate area of `bbox` projected onto the screen, in pixels.
+static double screenArea(const Imath::Box3f& bbox, const TransformState& relativeTrans,
+                         const V3f& relCamera)
+{
+    double dist = (bbox.center() - relCamera).length();
+    double diagRadius = bbox.size().length()/2;
+    double radius = diagRadius*relativeTrans.pixelsPerUnit(dist);
+    double viewArea = double(relativeTrans.viewSize.x)*relativeTrans.viewSize.y;
+    // Nodes containing or very close to the camera fill the entire view
+    return std::min(viewArea, M_PI*radius*radius);
+}
+
+
+struct ProgressFunc
+{
+    PointArray& points;
+    size_t totProcessed;
+
+    ProgressFunc(PointArray& points) : points(points), totProcessed(0) {}
+
+    void operator()(size_t additionalProcessed)
+    {
+        totProcessed += additionalProcessed;
+        emit points.loadProgress(int(100*totProcessed/points.pointCount()));
+    }
+};
+
 //------------------------------------------------------------------------------
 // PointArray implementation
 
@@ -39,6 +174,7 @@ PointArray::PointArray()
 
 PointArray::~PointArray()
 {
+    destroyOcclusionQueries();
 }
 
 /// Load point cloud in text format, assuming fields XYZ
@@ -112,6 +248,7 @@ bool PointArray::loadFile(QString fileName, size_t maxPointCount)
     QElapsedTimer loadTimer;
     loadTimer.start();
     setFileName(fileName);
+    invalidateVisibleNodes();
     // Read file into point data fields.  Use very basic file type detection
     // based on extension.
     uint64_t totalPoints = 0;
@@ -197,9 +334,11 @@ bool PointArray::loadFile(QString fileName, size_t maxPointCount)
     g_logger.info("Loaded %d of %d points from file %s in %.2f seconds",
                   m_npoints, totalPoints, fileName, loadTimer.elapsed()/1000.0);
     g_logger.info("Offset is %0.3f", offset);
+    m_octree.reset(new Octree());
     if (totalPoints == 0)
     {
-        m_rootNode.reset(new OctreeNode(V3f(0), 1));
+        m_octree->nodes.push_back(OctreeNode());
+        m_octree->bboxes.push_back(Imath::Box3f());
         return true;
     }
 
@@ -215,8 +354,8 @@ bool PointArray::loadFile(QString fileName, size_t maxPointCount)
     V3f diag = rootBound.size();
     float rootRadius = std::max(std::max(diag.x, diag.y), diag.z) / 2;
     ProgressFunc progressFunc(*this);
-    m_rootNode.reset(makeTree(0, &inds[0], 0, m_npoints, &m_P[0],
-                              rootBound.center(), rootRadius, progressFunc));
+    makeTree(*m_octree, &inds[0], m_npoints, &m_P[0],
+             rootBound.center(), rootRadius, progressFunc);
     // Reorder point fields into octree order
     emit loadStepStarted("Reordering fields");
     for (size_t i = 0; i < m_fields.size(); ++i)
@@ -261,6 +400,8 @@ void PointArray::mutate(std::shared_ptr<GeometryMutator> mutator)
         }
     }
 
+    invalidateVisibleNodes();
+
     for (size_t mutFieldIdx = 0; mutFieldIdx < mutFields.size(); ++mutFieldIdx)
     {
         if (mutFields[mutFieldIdx].name == "index")
@@ -335,14 +476,15 @@ bool PointArray::pickVertex(const V3d& cameraPos,
     double closestDist = DBL_MAX;
     size_t closestIdx = 0;
 
-    typedef std::pair<double, const OctreeNode*> PriorityNode;
+    typedef std::pair<double, size_t> PriorityNode;
 
-    auto makePriortyNode = [&](const OctreeNode* node)
+    auto makePriortyNode = [&](size_t nodeIdx)
     {
         // Create (priority,node) pair with priority given by lower bound of
         // distance for pickVertex() vertex search.
-        Box3d bbox(offset() + node->bbox.min, offset() + node->bbox.max);
-        return PriorityNode(distFunc.boundNearest(bbox), node);
+        const Imath::Box3f& nodeBox = m_octree->bboxes[nodeIdx];
+        Box3d bbox(offset() + nodeBox.min, offset() + nodeBox.max);
+        return PriorityNode(distFunc.boundNearest(bbox), nodeIdx);
     };
 
     // Search for the closest point by putting nodes into a priority queue,
@@ -351,26 +493,20 @@ bool PointArray::pickVertex(const V3d& cameraPos,
     // this, we're done.
     std::priority_queue<PriorityNode, std::vector<PriorityNode>,
                         std::greater<PriorityNode>> pendingNodes;
-    pendingNodes.push(makePriortyNode(m_rootNode.get()));
+    pendingNodes.push(makePriortyNode(0));
     while (!pendingNodes.empty())
     {
         auto nextNode = pendingNodes.top();
         double nextMinDist = nextNode.first;
         if (nextMinDist > closestDist)
             break;
-        const OctreeNode* node = nextNode.second;
+        const OctreeNode* node = &m_octree->nodes[nextNode.second];
         pendingNodes.pop();
 
-        if (!node->isLeaf())
-        {
-            for (int i = 0; i < 8; ++i)
-            {
-                OctreeNode* n = node->children[i];
-                if (n)
-                    pendingNodes.push(makePriortyNode(n));
-            }
-        }
-        else
+        for (size_t c = node->firstChild; c < node->endChild(); ++c)
+            pendingNodes.push(makePriortyNode(c));
+        // Interior nodes hold points as well as leaves
+        if (node->size() > 0)
         {
             double dist = 0;
             size_t idx = node->findNearest(distFunc, offset(), m_P, dist);
@@ -421,51 +557,237 @@ void PointArray::estimateCost(const TransformState& transState,
                               bool incrementalDraw, const double* qualities,
                               DrawCount* drawCounts, int numEstimates) const
 {
+    const std::vector<VisibleNode>& nodes = visibleNodes(transState);
+    const size_t perVertexBytes = bytes<size_t>(m_fields.begin(), m_fields.end());
+    // Non-incremental frames start a new occlusion epoch in drawPoints()
+    const uint64_t epoch = incrementalDraw ? m_occlusionEpoch : m_occlusionEpoch + 1;
+    for (int i = 0; i < numEstimates; ++i)
+    {
+        for (size_t j = 0; j < nodes.size();)
+        {
+            const VisibleNode& vnode = nodes[j];
+            // Each occlusion query costs about as much as a draw call
+            if (needsOcclusionQuery(vnode, epoch))
+                drawCounts[i].numDrawCalls += 1;
+            if (isOccluded(vnode))
+            {
+                drawCounts[i].numOccludedNodes += 1;
+                drawCounts[i].moreToDraw |= m_occlusion[vnode.index].resultEpoch != epoch;
+                j = vnode.subtreeEnd;
+                continue;
+            }
+            double fraction = vnode.drawFraction(m_lodMetric, m_lodPointsPerPixel, qualities[i]);
+            drawCounts[i] += vnode.drawCount(fraction, incrementalDraw, perVertexBytes);
+            j = vnode.completesDraw(fraction, incrementalDraw) ?
+                j + 1 : vnode.subtreeEnd;
+        }
+    }
+}
+
+
+/// Append nodes in the subtree of `tree.nodes[nodeIdx]` which intersect
+/// `clipBox` to `visibleNodes` in depth first preorder.
+static void collectVisibleNodes(std::vector<VisibleNode>& visibleNodes,
+                                const Octree& tree, size_t nodeIdx,
+                                const ClipBox& clipBox,
+                                const TransformState& relativeTrans,
+                                const V3f& relCamera)
+{
+    const Imath::Box3f& bbox = tree.bboxes[nodeIdx];
+    if (clipBox.canCull(bbox))
+        return;
+    const OctreeNode& node = tree.nodes[nodeIdx];
+    size_t visibleIdx = visibleNodes.size();
+    visibleNodes.emplace_back(&node, nodeIdx, cameraDistance(bbox, relCamera),
+                              screenArea(bbox, relativeTrans, relCamera),
+                              !clipBox.crossesNearPlane(bbox));
+    for (size_t c = node.firstChild; c < node.endChild(); ++c)
+        collectVisibleNodes(visibleNodes, tree, c, clipBox, relativeTrans, relCamera);
+    visibleNodes[visibleIdx].subtreeEnd = visibleNodes.size();
+}
+
+
+const std::vector<VisibleNode>& PointArray::visibleNodes(const TransformState& transState) const
+{
+    if (m_visibleNodesTrans && *m_visibleNodesTrans == transState)
+        return m_visibleNodes;
+
     TransformState relativeTrans = transState.translate(offset());
     V3f relCamera = relativeTrans.cameraPos();
     ClipBox clipBox(relativeTrans);
 
-    std::vector<const OctreeNode*> nodeStack;
-    nodeStack.push_back(m_rootNode.get());
-    while (!nodeStack.empty())
+    m_visibleNodes.clear();
+    if (m_octree && !m_octree->empty())
+        collectVisibleNodes(m_visibleNodes, *m_octree, 0, clipBox,
+                            relativeTrans, relCamera);
+    m_visibleNodesTrans = transState;
+    return m_visibleNodes;
+}
+
+
+void PointArray::cull(const TransformState& transState) const
+{
+    visibleNodes(transState);
+    collectOcclusionQueries();
+}
+
+
+void PointArray::setOcclusionCulling(bool enable)
+{
+    m_occlusionCulling = enable;
+}
+
+
+bool PointArray::isOccluded(const VisibleNode& vnode) const
+{
+    return m_occlusionCulling && vnode.occlusionTestable &&
+           vnode.index < m_occlusion.size() && m_occlusion[vnode.index].occluded;
+}
+
+
+bool PointArray::needsOcclusionQuery(const VisibleNode& vnode, uint64_t epoch) const
+{
+    if (!m_occlusionCulling || !vnode.occlusionTestable ||
+        vnode.index >= m_occlusion.size())
+        return false;
+    const NodeOcclusion& state = m_occlusion[vnode.index];
+    // Within an epoch the depth buffer only accumulates more geometry, so
+    // a node which is hidden stays hidden.
+    return !state.pending && !(state.occluded && state.resultEpoch == epoch);
+}
+
+
+void PointArray::collectOcclusionQueries() const
+{
+    size_t numPending = 0;
+    for (size_t idx : m_pendingQueries)
     {
-        const OctreeNode* node = nodeStack.back();
-        nodeStack.pop_back();
-        if (clipBox.canCull(node->bbox))
-            continue;
-        if (!node->isLeaf())
+        NodeOcclusion& state = m_occlusion[idx];
+        GLuint available = 0;
+        glGetQueryObjectuiv(state.query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
         {
-            for (int i = 0; i < 8; ++i)
-            {
-                OctreeNode* n = node->children[i];
-                if (n)
-                    nodeStack.push_back(n);
-            }
+            m_pendingQueries[numPending++] = idx;
             continue;
         }
-        for (int i = 0; i < numEstimates; ++i)
-        {
-            drawCounts[i] += node->drawCount(relCamera, qualities[i],
-                                             incrementalDraw);
-        }
+        GLuint samplesPassed = 0;
+        glGetQueryObjectuiv(state.query, GL_QUERY_RESULT, &samplesPassed);
+        state.pending = false;
+        state.occluded = samplesPassed == 0;
+        state.resultEpoch = state.queryEpoch;
+    }
+    m_pendingQueries.resize(numPending);
+}
+
+
+void PointArray::issueOcclusionQueries(const TransformState& relativeTrans,
+                                       const std::vector<const VisibleNode*>& nodes) const
+{
+    GLuint boxShader = shaderId("boundingbox");
+    if (nodes.empty() || !boxShader)
+        return;
+
+    // Test bounding boxes against the depth buffer without drawing them.
+    // The stencil test used to avoid overdraw in incremental frames must be
+    // off, since it rejects pixels which are already covered.
+    GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+    GLboolean stencilTest = glIsEnabled(GL_STENCIL_TEST);
+    glEnable(GL_DEPTH_TEST);
+    glDisable(GL_STENCIL_TEST);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    glUseProgram(boxShader);
+    glBindVertexArray(getVAO("occlusion_box"));
+
+    for (const VisibleNode* vnode : nodes)
+    {
+        NodeOcclusion& state = m_occlusion[vnode->index];
+        if (!state.query)
+            glGenQueries(1, &state.query);
+        // Points lie on the surface of flat bounding boxes, so pad the
+        // box slightly to make the test conservative.
+        Imath::Box3f bbox = m_octree->bboxes[vnode->index];
+        V3f pad = V3f(1e-3f*bbox.size().length() + 1e-3f);
+        bbox.min -= pad;
+        bbox.max += pad;
+        relativeTrans.translate(V3d(bbox.min)).scale(V3d(bbox.size())).setUniforms(boxShader);
+        glBeginQuery(GL_SAMPLES_PASSED, state.query);
+        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, 0);
+        glEndQuery(GL_SAMPLES_PASSED);
+        state.pending = true;
+        state.queryEpoch = m_occlusionEpoch;
+        m_pendingQueries.push_back(vnode->index);
+    }
+
+    glBindVertexArray(0);
+    glDepthMask(GL_TRUE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    if (!depthTest)
+        glDisable(GL_DEPTH_TEST);
+    if (stencilTest)
+        glEnable(GL_STENCIL_TEST);
+}
+
+
+void PointArray::destroyOcclusionQueries()
+{
+    for (const NodeOcclusion& state : m_occlusion)
+    {
+        if (state.query)
+            glDeleteQueries(1, &state.query);
     }
+    m_occlusion.clear();
+    m_pendingQueries.clear();
+}
+
+
+void PointArray::setLodMetric(LodMetric metric)
+{
+    m_lodMetric = metric;
+}
+
+
+void PointArray::setLodPointsPerPixel(double pointsPerPixel)
+{
+    m_lodPointsPerPixel = std::max(0.0, pointsPerPixel);
+}
+
+
+void PointArray::invalidateVisibleNodes() const
+{
+    m_visibleNodes.clear();
+    m_visibleNodesTrans.reset();
 }
 
 
-static void drawTree(QOpenGLShaderProgram& prog, const TransformState& transState, const OctreeNode* node)
+static void drawTree(QOpenGLShaderProgram& prog, const TransformState& transState,
+                     const Octree& tree, size_t nodeIdx,
+                     const V3f& center, float halfWidth)
 {
-    Imath::Box3f bbox(node->center - Imath::V3f(node->halfWidth),
-                      node->center + Imath::V3f(node->halfWidth));
+    Imath::Box3f bbox(center - Imath::V3f(halfWidth),
+                      center + Imath::V3f(halfWidth));
 
     drawBox(transState, bbox, Imath::C3f(1), prog.programId());
-    drawBox(transState, node->bbox, Imath::C3f(1,0,0), prog.programId());
+    drawBox(transState, tree.bboxes[nodeIdx], Imath::C3f(1,0,0), prog.programId());
 
-    std::for_each(node->children, node->children + 8, [&](auto n) { if (n) drawTree(prog, transState, n); });
+    const OctreeNode& node = tree.nodes[nodeIdx];
+    float h = halfWidth/2;
+    size_t c = node.firstChild;
+    for (int i = 0; i < 8; ++i)
+    {
+        if (!(node.childMask & (1 << i)))
+            continue;
+        V3f childCenter = center + V3f((i     % 2 == 0) ? -h : h,
+                                       ((i/2) % 2 == 0) ? -h : h,
+                                       ((i/4) % 2 == 0) ? -h : h);
+        drawTree(prog, transState, tree, c++, childCenter, h);
+    }
 }
 
 void PointArray::drawTree(QOpenGLShaderProgram& prog, const TransformState& transState) const
 {
-    ::drawTree(prog, transState, m_rootNode.get());
+    if (m_octree && !m_octree->empty())
+        ::drawTree(prog, transState, *m_octree, 0, m_octree->center, m_octree->halfWidth);
 }
 
 void PointArray::initializeGL()
@@ -479,10 +801,46 @@ void PointArray::initializeGL()
     GLuint vbo;
     glGenBuffers(1, &vbo);
     setVBO("point_buffer", vbo);
+
+    destroyOcclusionQueries();
+    if (m_octree)
+        m_occlusion.resize(m_octree->nodes.size());
+
+    // Unit cube for testing node bounding boxes with occlusion queries
+    GLuint boxShader = shaderId("boundingbox");
+    if (!boxShader)
+        return;
+    const GLfloat verts[] = {
+        0,0,0,  1,0,0,  0,1,0,  1,1,0,
+        0,0,1,  1,0,1,  0,1,1,  1,1,1
+    };
+    const GLubyte inds[] = {
+        0,2,1, 1,2,3,  4,5,6, 5,7,6,  // -z, +z
+        0,1,4, 1,5,4,  2,6,3, 3,6,7,  // -y, +y
+        0,4,2, 2,4,6,  1,3,5, 3,7,5   // -x, +x
+    };
+    GLuint boxVertexArray;
+    glGenVertexArrays(1, &boxVertexArray);
+    glBindVertexArray(boxVertexArray);
+    setVAO("occlusion_box", boxVertexArray);
+
+    GlBuffer positionBuffer;
+    positionBuffer.bind(GL_ARRAY_BUFFER);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+    GLint positionAttribute = glGetAttribLocation(boxShader, "position");
+    glVertexAttribPointer(positionAttribute, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (const GLvoid *)0);
+    glEnableVertexAttribArray(positionAttribute);
+
+    GlBuffer elementBuffer;
+    elementBuffer.bind(GL_ELEMENT_ARRAY_BUFFER);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(inds), inds, GL_STATIC_DRAW);
+
+    glBindVertexArray(0);
 }
 
-void PointArray::draw(const TransformState& transState, double quality) const
+DrawCount PointArray::draw(const TransformState& transState, double quality) const
 {
+    return DrawCount();
 }
 
 DrawCount PointArray::drawPoints(QOpenGLShaderProgram& prog, const TransformState& transState,
@@ -536,32 +894,42 @@ DrawCount PointArray::drawPoints(QOpenGLShaderProgram& prog, const TransformStat
     const size_t perVertexBytes = bytes<size_t>(m_fields.begin(), m_fields.end());
 
     DrawCount drawCount;
-    ClipBox clipBox(relativeTrans);
-
-    std::array<size_t, 8> nodeOrder;
-    std::iota(nodeOrder.begin(), nodeOrder.end(), 0);  // Order does not matter
 
-    // Draw points in each bucket, with total number drawn depending on how far
-    // away the bucket is.  Since the points are shuffled, this corresponds to
-    // a stochastic simplification of the full point cloud.
-    V3f relCamera = relativeTrans.cameraPos();
-    std::vector<const OctreeNode*> nodeStack;
-    nodeStack.push_back(m_rootNode.get());
-    while (!nodeStack.empty())
+    const std::vector<VisibleNode>& nodes = visibleNodes(transState);
+    if (!incrementalDraw)
     {
-        const OctreeNode* node = nodeStack.back();
-        nodeStack.pop_back();
-        if (clipBox.canCull(node->bbox))
-            continue;
-        if (!node->isLeaf())
+        for (const VisibleNode& vnode : nodes)
+            vnode.node->nextBeginIndex = vnode.node->beginIndex;
+        ++m_occlusionEpoch;
+    }
+    collectOcclusionQueries();
+    std::vector<const VisibleNode*> queryNodes;
+
+    // Draw points in each bucket, with total number drawn depending on the
+    // screen space size of the bucket.  Since the points are shuffled, this
+    // corresponds to a stochastic simplification of the full point cloud.
+    // Interior nodes hold a coarse subsample of their subtree, so we only
+    // descend into the children of nodes which are completely drawn.
+    for (size_t j = 0; j < nodes.size();)
+    {
+        const VisibleNode& vnode = nodes[j];
+        const OctreeNode* node = vnode.node;
+
+        // Nodes hidden in a previous frame are skipped along with their
+        // subtree, but retested against the geometry drawn this frame.
+        if (needsOcclusionQuery(vnode, m_occlusionEpoch))
+            queryNodes.push_back(&vnode);
+        if (isOccluded(vnode))
         {
-            std::for_each(std::begin(nodeOrder), std::end(nodeOrder), [&](const auto& i) { if (node->children[i]) nodeStack.push_back(node->children[i]); });
+            drawCount.numOccludedNodes += 1;
+            drawCount.moreToDraw |= m_occlusion[vnode.index].resultEpoch != m_occlusionEpoch;
+            j = vnode.subtreeEnd;
             continue;
         }
-        if (!incrementalDraw)
-            node->nextBeginIndex = node->beginIndex;
 
-        DrawCount nodeDrawCount = node->drawCount(relCamera, quality, incrementalDraw);
+        double fraction = vnode.drawFraction(m_lodMetric, m_lodPointsPerPixel, quality);
+        j = vnode.completesDraw(fraction, incrementalDraw) ? j + 1 : vnode.subtreeEnd;
+        DrawCount nodeDrawCount = vnode.drawCount(fraction, incrementalDraw, perVertexBytes);
         drawCount += nodeDrawCount;
 
         if (nodeDrawCount.numVertices == 0)
@@ -606,15 +974,15 @@ DrawCount PointArray::drawPoints(QOpenGLShaderProgram& prog, const TransformStat
             // just uploaded.  This should be a single call, but OpenGL spec
             // insanity says we need `arraySize` calls (though arraySize=1
             // for most usage.)
-            for (int j = 0; j < arraySize; ++j)
+            for (int elem = 0; elem < arraySize; ++elem)
             {
-                const ShaderAttribute* attr = attributes[k+j];
+                const ShaderAttribute* attr = attributes[k+elem];
                 if (!attr)
                 {
                     continue;
                 }
 
-                GLintptr arrayElementOffset = bufferOffset + j*field.spec.elsize;
+                GLintptr arrayElementOffset = bufferOffset + elem*field.spec.elsize;
 
                 if (attr->baseType == TypeSpec::Int || attr->baseType == TypeSpec::Uint)
                 {
@@ -647,6 +1015,13 @@ DrawCount PointArray::drawPoints(QOpenGLShaderProgram& prog, const TransformStat
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
 
+    if (!queryNodes.empty())
+    {
+        issueOcclusionQueries(relativeTrans, queryNodes);
+        drawCount.numDrawCalls += queryNodes.size();
+        prog.bind();
+    }
+
     return drawCount;
 }
 
@@ -677,68 +1052,45 @@ std::vector<std::pair<V3d, std::string>> PointArray::getPointsByClassification(u
         return result;
     }
 
-    if (!m_rootNode)
+    if (!m_octree)
     {
-        std::cerr << "Root node is null\n";
+        std::cerr << "Octree is null\n";
         return result;
     }
 
-    std::stack<const OctreeNode*> nodes;
-    nodes.push(m_rootNode.get());
-
     size_t totalPointsChecked = 0;
     size_t totalPointsMatched = 0;
 
-    while (!nodes.empty())
+    for (const OctreeNode& node : m_octree->nodes)
     {
-        const OctreeNode* node = nodes.top();
-        nodes.pop();
-
-        if (!node)
-            continue;
-
-        if (!node->isLeaf())
-        {
-            for (int i = 0; i < 8; ++i)
-            {
-                if (node->children[i])
-                    nodes.push(node->children[i]);
-            }
-        }
-        else
+        for (size_t idx = node.beginIndex; idx < node.endIndex; ++idx)
         {
-            size_t leafPointCount = node->endIndex - node->beginIndex;
-            std::cerr << "Leaf node with " << leafPointCount << " points\n";
+            totalPointsChecked++;
+            if (classData[idx] != targetClass)
+                continue;
 
-            for (size_t idx = node->beginIndex; idx < node->endIndex; ++idx)
-            {
-                totalPointsChecked++;
-                if (classData[idx] != targetClass)
-                    continue;
-
-                totalPointsMatched++;
+            totalPointsMatched++;
 
-                V3d pos = V3d(m_P[idx]) + offset();
+            V3d pos = V3d(m_P[idx]) + offset();
 
-                std::ostringstream out;
-                for (const auto& field : m_fields)
+            std::ostringstream out;
+            for (const auto& field : m_fields)
+            {
+                tfm::format(out, "  %s = ", field.name);
+                if (field.name == "position")
                 {
-                    tfm::format(out, "  %s = ", field.name);
-                    if (field.name == "position")
-                    {
-                        const float* p = reinterpret_cast<const float*>(field.data.get() + idx * field.spec.size());
-                        tfm::format(out, "%.3f %.3f %.3f\n",
-                                    p[0] + offset().x, p[1] + offset().y, p[2] + offset().z);
-                    }
-                    else
-                    {
-                        field.format(out, idx);
-                        out << "\n";
-                    }
+                    const float* p = reinterpret_cast<const float*>(field.data.get() + idx * field.spec.size());
+                    tfm::format(out, "%.3f %.3f %.3f\n",
+                                p[0] + offset().x, p[1] + offset().y, p[2] + offset().z);
+                }
+                else
+                {
+                    field.format(out, idx);
+                    out << "\n";
                 }
-
-                result.emplace_back(pos, out.str());
             }
+
+            result.emplace_back(pos, out.str());
         }
     }
 
@@ -6,17 +6,31 @@
 #include <cassert>
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <vector>
 
 #include "Geometry.h"
 #include "typespec.h"
 #include "GeomField.h"
 #include "GeometryMutator.h"
+#include "TransformState.h"
 
 class QOpenGLShaderProgram;
 
-struct OctreeNode;
-struct TransformState;
+struct Octree;
+struct VisibleNode;
+struct NodeOcclusion;
+
+/// Metric used to choose the level of detail for each octree node
+enum class LodMetric
+{
+    /// Draw fraction falls off with the square of camera distance in model
+    /// units; independent of field of view and viewport size.
+    Distance,
+    /// Draw enough points to cover the projected screen area of the node at
+    /// a target density.
+    ScreenSpace
+};
 
 //------------------------------------------------------------------------------
 /// Container for points to be displayed in the View3D interface
@@ -33,16 +47,27 @@ class PointArray : public Geometry
 
         virtual void mutate(std::shared_ptr<GeometryMutator> mutator);
 
-        virtual void draw(const TransformState& transState, double quality) const;
+        virtual DrawCount draw(const TransformState& transState, double quality) const;
 
         virtual void initializeGL();
 
+        virtual void cull(const TransformState& transState) const;
+
+        virtual void setOcclusionCulling(bool enable);
+
         virtual DrawCount drawPoints(QOpenGLShaderProgram& prog,
                                     const TransformState& transState,
                                     double quality, bool incrementalDraw) const override;
 
         virtual size_t pointCount() const { return m_npoints; }
 
+        /// Set the metric used to select level of detail when drawing
+        void setLodMetric(LodMetric metric);
+        LodMetric lodMetric() const { return m_lodMetric; }
+
+        virtual void setLodPointsPerPixel(double pointsPerPixel) override;
+        double lodPointsPerPixel() const { return m_lodPointsPerPixel; }
+
         virtual void estimateCost(const TransformState& transState,
                                   bool incrementalDraw, const double* qualities,
                                   DrawCount* drawCounts, int numEstimates) const;
@@ -72,16 +97,65 @@ class PointArray : public Geometry
                      std::vector<GeomField>& fields, V3d& offset,
                      size_t& npoints, uint64_t& totalPoints);
 
+        /// Return the set of octree nodes visible with the given camera
+        /// transform.
+        ///
+        /// Culling the full tree is only done when the transform differs
+        /// from the previous call; otherwise a cached result is returned.
+        const std::vector<VisibleNode>& visibleNodes(const TransformState& transState) const;
+
+        /// Discard cached visible node set after a change to the geometry
+        void invalidateVisibleNodes() const;
+
+        /// Return true if `vnode` and its subtree were hidden behind other
+        /// geometry when last tested.
+        bool isOccluded(const VisibleNode& vnode) const;
+
+        /// Return true if the visibility of `vnode` should be tested again
+        /// to have an up to date result for the given epoch.
+        bool needsOcclusionQuery(const VisibleNode& vnode, uint64_t epoch) const;
+
+        /// Read back results of occlusion queries issued in previous frames
+        void collectOcclusionQueries() const;
+
+        /// Issue occlusion queries for the bounding boxes of `nodes` against
+        /// the current depth buffer, to be collected in a later frame.
+        void issueOcclusionQueries(const TransformState& relativeTrans,
+                                   const std::vector<const VisibleNode*>& nodes) const;
+
+        /// Delete all occlusion query objects and results
+        void destroyOcclusionQueries();
+
         friend struct ProgressFunc;
 
         /// Total number of loaded points
         size_t m_npoints = 0;
         /// Spatial hierarchy
-        std::unique_ptr<OctreeNode> m_rootNode;
+        std::unique_ptr<Octree> m_octree;
         /// Point data field storage
         std::vector<GeomField> m_fields;
         /// A position field is required.  Alias for convenience:
         int m_positionFieldIdx = -1;
         V3f* m_P = nullptr;
         std::unique_ptr<uint32_t[]> m_inds;
+        LodMetric m_lodMetric = LodMetric::ScreenSpace;
+        /// Target points per pixel of projected node area at quality 1, for
+        /// LodMetric::ScreenSpace
+        double m_lodPointsPerPixel = 1;
+        /// Nodes passing frustum culling for m_visibleNodesTrans.  This
+        /// is shared between estimateCost() and drawPoints(), and across
+        /// incremental frames.
+        mutable std::vector<VisibleNode> m_visibleNodes;
+        mutable std::optional<TransformState> m_visibleNodesTrans;
+        bool m_occlusionCulling = true;
+        /// Occlusion query state for each octree node, indexed as
+        /// m_octree->nodes.  Empty until initializeGL() is called.
+        mutable std::vector<NodeOcclusion> m_occlusion;
+        /// Indices of nodes with occlusion queries in flight
+        mutable std::vector<size_t> m_pendingQueries;
+        /// Incremented whenever the depth buffer is cleared for a new
+        /// frame.  Query results from earlier epochs are stale: they're used
+        /// to predict visibility, but must be confirmed before drawing is
+        /// considered complete.
+        mutable uint64_t m_occlusionEpoch = 0;
 };
@@ -5,6 +5,8 @@
 
 #include <GL/glew.h>
 
+#include <algorithm>
+
 #include "util.h"
 
 //------------------------------------------------------------------------------
@@ -22,12 +24,35 @@ struct TransformState
         modelViewMatrix(modelViewMatrix)
     { }
 
+    /// Return true if all transformation state is identical to `rhs`
+    bool operator==(const TransformState& rhs) const
+    {
+        return viewSize == rhs.viewSize &&
+               projMatrix == rhs.projMatrix &&
+               modelViewMatrix == rhs.modelViewMatrix;
+    }
+
+    bool operator!=(const TransformState& rhs) const { return !(*this == rhs); }
+
     /// Return position of camera in model space
     V3d cameraPos() const
     {
         return V3d(0)*modelViewMatrix.inverse();
     }
 
+    /// Return approximate number of pixels spanned vertically by a unit
+    /// length in model space at the given distance from the camera.
+    ///
+    /// For orthographic projections the distance is ignored.
+    double pixelsPerUnit(double dist) const
+    {
+        double scale = 0.5*viewSize.y*projMatrix[1][1];
+        // Perspective projections have w = -z, so that [3][3] is zero
+        if (projMatrix[3][3] == 0)
+            scale /= std::max(dist, 1e-6);
+        return scale;
+    }
+
     /// Translate model by given offset
     TransformState translate(const Imath::V3d& offset) const;
 
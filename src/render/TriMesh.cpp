@@ -368,10 +368,11 @@ bool TriMesh::loadFile(QString fileName, size_t /*maxVertexCount*/)
     return true;
 }
 
-void TriMesh::draw(const TransformState& transState, double quality) const
+DrawCount TriMesh::draw(const TransformState& transState, double quality) const
 {
     // unsigned int vertArray = getVAO("vertexArray");
     // unsigned int shaderId = shaderId("vertexArray");
+    return DrawCount();
 }
 
 void TriMesh::initializeGL()
@@ -475,8 +476,8 @@ void TriMesh::initializeVertexGL(const char * vertArrayName, const std::vector<u
     glBindVertexArray(0);
 }
 
-void TriMesh::drawFaces(QOpenGLShaderProgram& prog,
-                        const TransformState& transState) const
+DrawCount TriMesh::drawFaces(QOpenGLShaderProgram& prog,
+                             const TransformState& transState) const
 {
     // TODO: The hasTexture uniform shader variable would be unnecessary if we
     // supported more than one mesh face shader...
@@ -497,11 +498,13 @@ void TriMesh::drawFaces(QOpenGLShaderProgram& prog,
     glBindVertexArray(vertexArray);
     glDrawElements(GL_TRIANGLES, (GLsizei)m_triangles.size(), GL_UNSIGNED_INT, 0);
     glBindVertexArray(0);
+
+    return facesDrawCount();
 }
 
 
-void TriMesh::drawEdges(QOpenGLShaderProgram& prog,
-                        const TransformState& transState) const
+DrawCount TriMesh::drawEdges(QOpenGLShaderProgram& prog,
+                             const TransformState& transState) const
 {
     unsigned int vertexShaderId = shaderId("meshedge");
     unsigned int vertexArray = getVAO("meshedge");
@@ -511,6 +514,8 @@ void TriMesh::drawEdges(QOpenGLShaderProgram& prog,
     glBindVertexArray(vertexArray);
     glDrawElements(GL_LINES, (GLsizei)m_edges.size(), GL_UNSIGNED_INT, 0);
     glBindVertexArray(0);
+
+    return edgesDrawCount();
 }
 
 
@@ -518,9 +523,36 @@ void TriMesh::estimateCost(const TransformState& transState,
                            bool incrementalDraw, const double* qualities,
                            DrawCount* drawCounts, int numEstimates) const
 {
-    // FIXME - we need a way to incorporate meshes into the cost model, even
-    // though simplifying them in a similar way to point clouds isn't really
-    // possible.
+    // Meshes can't be simplified in a similar way to point clouds, so the
+    // cost is independent of quality.  They're only drawn on the first frame
+    // of an incremental sequence.
+    if (incrementalDraw)
+        return;
+    DrawCount meshCount = facesDrawCount();
+    meshCount += edgesDrawCount();
+    for (int i = 0; i < numEstimates; ++i)
+        drawCounts[i] += meshCount;
+}
+
+
+DrawCount TriMesh::facesDrawCount() const
+{
+    DrawCount drawCount;
+    if (!m_triangles.empty())
+    {
+        drawCount.numDrawCalls = 1;
+        drawCount.numMeshes = 1;
+    }
+    return drawCount;
+}
+
+
+DrawCount TriMesh::edgesDrawCount() const
+{
+    DrawCount drawCount;
+    if (!m_edges.empty())
+        drawCount.numDrawCalls = 1;
+    return drawCount;
 }
 
 
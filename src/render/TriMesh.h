@@ -24,14 +24,14 @@ class TriMesh : public Geometry
     public:
         virtual bool loadFile(QString fileName, size_t maxVertexCount);
 
-        virtual void draw(const TransformState& transState, double quality) const;
+        virtual DrawCount draw(const TransformState& transState, double quality) const;
 
         virtual void initializeGL();
 
-        virtual void drawFaces(QOpenGLShaderProgram& prog,
-                               const TransformState& transState) const override;
-        virtual void drawEdges(QOpenGLShaderProgram& prog,
-                               const TransformState& transState) const override;
+        virtual DrawCount drawFaces(QOpenGLShaderProgram& prog,
+                                    const TransformState& transState) const override;
+        virtual DrawCount drawEdges(QOpenGLShaderProgram& prog,
+                                    const TransformState& transState) const override;
 
         virtual size_t pointCount() const { return 0; }
 
@@ -57,6 +57,10 @@ class TriMesh : public Geometry
         static void makeEdges(std::vector<unsigned int>& edges,
                               const std::vector<unsigned int>& faces);
 
+        /// Amount drawn by drawFaces() and drawEdges() respectively
+        DrawCount facesDrawCount() const;
+        DrawCount edgesDrawCount() const;
+
         /// xyz triples
         std::vector<float> m_verts;
         /// Per-vertex color
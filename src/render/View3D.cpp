@@ -14,12 +14,16 @@
 #include <QTimer>
 #include <QAction>
 #include <QElapsedTimer>
+#include <QGuiApplication>
+#include <QImage>
 #include <QKeyEvent>
 #include <QLayout>
 #include <QItemSelectionModel>
 #include <QMessageBox>
-#include <QGLFormat>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
 #include <QSettings>
+#include <QThread>
 
 #include "config.h"
 #include "fileloader.h"
@@ -34,8 +38,9 @@
 #include "util.h"
 
 //------------------------------------------------------------------------------
-View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWindow *parent, DataSetUI *dataSet)
-    : QGLWidget(format, parent),
+View3D::View3D(GeometryCollection* geometries, MainWindow *parent, DataSetUI *dataSet,
+               bool offscreen)
+    : QOpenGLWidget(parent),
     m_mainWindow(parent),
     m_dataSet(dataSet),
     m_mouseButton(Qt::NoButton),
@@ -46,6 +51,7 @@ View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWind
     m_geometries(geometries),
     m_shaderParamsUI(0),
     m_incrementalFrameTimer(0),
+    m_geometryRedrawTimer(0),
     m_incrementalDraw(false),
     m_devicePixelRatio(1.0)
 {
@@ -54,6 +60,7 @@ View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWind
     connect(m_geometries, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(geometryChanged()));
     connect(m_geometries, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, SLOT(dataChanged(QModelIndex,QModelIndex)));
     connect(m_geometries, SIGNAL(rowsInserted(QModelIndex,int,int)),    this, SLOT(geometryInserted(const QModelIndex&, int,int)));
+    connect(m_geometries, SIGNAL(rowsAboutToBeRemoved(QModelIndex,int,int)), this, SLOT(geometryAboutToBeRemoved()));
     connect(m_geometries, SIGNAL(rowsRemoved(QModelIndex,int,int)),     this, SLOT(geometryChanged()));
 
     setSelectionModel(new QItemSelectionModel(m_geometries, this));
@@ -65,7 +72,23 @@ View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWind
     connect(&m_camera, SIGNAL(projectionChanged()), this, SLOT(restartRender()));
     connect(&m_camera, SIGNAL(viewChanged()), this, SLOT(restartRender()));
 
-    makeCurrent();
+    if (offscreen)
+    {
+        // QOffscreenSurface is a pbuffer or surfaceless EGL surface on
+        // platforms without a window system; all drawing goes to
+        // m_incrementalFramebuffer anyway.
+        m_offscreenSurface = std::make_unique<QOffscreenSurface>();
+        m_offscreenSurface->setFormat(QSurfaceFormat::defaultFormat());
+        m_offscreenSurface->create();
+        m_offscreenContext = std::make_unique<QOpenGLContext>();
+        m_offscreenContext->setFormat(QSurfaceFormat::defaultFormat());
+        if (!m_offscreenSurface->isValid() || !m_offscreenContext->create())
+        {
+            g_logger.error("%s", "Could not create an offscreen OpenGL context");
+            m_badOpenGL = true;
+        }
+    }
+
     m_shaderProgram = std::make_unique<ShaderProgram>();
     connect(m_shaderProgram.get(), SIGNAL(uniformValuesChanged()),
             this, SLOT(restartRender()));
@@ -77,7 +100,12 @@ View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWind
 
     m_incrementalFrameTimer = new QTimer(this);
     m_incrementalFrameTimer->setSingleShot(false);
-    connect(m_incrementalFrameTimer, SIGNAL(timeout()), this, SLOT(updateGL()));
+    connect(m_incrementalFrameTimer, SIGNAL(timeout()), this, SLOT(update()));
+    m_geometryRedrawTimer = new QTimer(this);
+    m_geometryRedrawTimer->setSingleShot(true);
+    m_geometryRedrawTimer->setInterval(100);
+    connect(m_geometryRedrawTimer, SIGNAL(timeout()), this, SLOT(redrawGeometry()));
+    m_idleTimer.start();
 
     // Actions
 
@@ -105,6 +133,16 @@ View3D::View3D(GeometryCollection* geometries, const QGLFormat& format, MainWind
     m_annotationAction->setCheckable(true);
     m_annotationAction->setChecked(m_drawAnnotations);
     connect(m_annotationAction, SIGNAL(toggled(bool)), this, SLOT(setAnnotations(bool)));
+
+    m_renderStatsAction = new QAction(tr("Draw Render &Statistics"), this);
+    m_renderStatsAction->setCheckable(true);
+    m_renderStatsAction->setChecked(m_drawRenderStats);
+    connect(m_renderStatsAction, SIGNAL(toggled(bool)), this, SLOT(setRenderStats(bool)));
+
+    m_occlusionCullingAction = new QAction(tr("&Occlusion Culling"), this);
+    m_occlusionCullingAction->setCheckable(true);
+    m_occlusionCullingAction->setChecked(m_occlusionCulling);
+    connect(m_occlusionCullingAction, SIGNAL(toggled(bool)), this, SLOT(setOcclusionCulling(bool)));
 }
 
 
@@ -125,6 +163,7 @@ Geometry* View3D::currentGeometry() const
 void View3D::restartRender()
 {
     m_incrementalDraw = false;
+    m_idleTimer.restart();
     update();
 }
 
@@ -133,13 +172,33 @@ void View3D::geometryChanged()
     restartRender();
 }
 
+/// Geometry streaming in data asks for a redraw as each piece arrives.
+/// Arrivals are batched into one full frame at most every 100 ms, and unlike
+/// user changes don't reset the idle time used to throttle refinement.
+void View3D::geometryRedrawNeeded()
+{
+    if (!m_geometryRedrawTimer->isActive())
+        m_geometryRedrawTimer->start();
+}
+
+void View3D::redrawGeometry()
+{
+    m_incrementalDraw = false;
+    update();
+}
+
 /// Initialize all geometry in m_geometries for indices i in [begin,end)
 void View3D::initializeGLGeometry(int begin, int end)
 {
     const GeometryCollection::GeometryVec& geoms = m_geometries->get();
+    // Geometry loaded before the GL context exists is initialized later by
+    // initializeGL()
+    bool haveGL = m_boundingBoxShader && makeRenderCurrent();
     for (int i = begin; i < end; ++i)
     {
-        if (m_boundingBoxShader->isValid())
+        connect(geoms[i].get(), SIGNAL(redrawNeeded()),
+                this, SLOT(geometryRedrawNeeded()), Qt::UniqueConnection);
+        if (haveGL && m_boundingBoxShader->isValid())
         {
             // TODO: build a shader manager for this
             geoms[i]->setShaderId("boundingbox", m_boundingBoxShader->shaderProgram().programId());
@@ -147,6 +206,8 @@ void View3D::initializeGLGeometry(int begin, int end)
             geoms[i]->setShaderId("meshedge", m_meshEdgeShader->shaderProgram().programId());
             geoms[i]->setShaderId("annotation", m_annotationShader->shaderProgram().programId());
             geoms[i]->setShaderId("sphere", m_sphereShader->shaderProgram().programId());
+            geoms[i]->setOcclusionCulling(m_occlusionCulling);
+            geoms[i]->setLodPointsPerPixel(m_lodPointsPerPixel);
             geoms[i]->initializeGL();
         }
     }
@@ -170,6 +231,12 @@ void View3D::geometryInserted(const QModelIndex& /*unused*/, int firstRow, int l
     geometryChanged();
 }
 
+void View3D::geometryAboutToBeRemoved()
+{
+    // Removed geometry frees its GL buffers on destruction
+    makeRenderCurrent();
+}
+
 
 void View3D::setShaderParamsUIWidget(QWidget* widget)
 {
@@ -210,6 +277,7 @@ void View3D::setSelectionModel(QItemSelectionModel* selectionModel)
 void View3D::addAnnotation(const QString& label, const QString& text,
                            const Imath::V3d& pos)
 {
+    makeRenderCurrent();
     GLuint programId = m_annotationShader->shaderProgram().programId();
     auto annotation = std::make_shared<Annotation>(label, programId, text, pos);
     m_annotations.append(annotation);
@@ -218,6 +286,7 @@ void View3D::addAnnotation(const QString& label, const QString& text,
 
 void View3D::addSphere(const Imath::V3d& pos)
 {
+    makeRenderCurrent();
     GLuint programId = m_sphereShader->shaderProgram().programId();
     auto sphere = std::make_shared<Sphere>(programId, pos);
     m_spheres.append(sphere);
@@ -275,6 +344,28 @@ void View3D::setAnnotations(bool enable)
     restartRender();
 }
 
+void View3D::setRenderStats(bool enable)
+{
+    m_drawRenderStats = enable;
+    restartRender();
+}
+
+void View3D::setOcclusionCulling(bool enable)
+{
+    m_occlusionCulling = enable;
+    for (const auto& geom : m_geometries->get())
+        geom->setOcclusionCulling(enable);
+    restartRender();
+}
+
+void View3D::setLodPointsPerPixel(double pointsPerPixel)
+{
+    m_lodPointsPerPixel = pointsPerPixel;
+    for (const auto& geom : m_geometries->get())
+        geom->setLodPointsPerPixel(pointsPerPixel);
+    restartRender();
+}
+
 void View3D::centerOnGeometry(const QModelIndex& index)
 {
     const Geometry& geom = *m_geometries->get()[index.row()];
@@ -308,7 +399,14 @@ double View3D::getDevicePixelRatio()
 
 void View3D::initializeGL()
 {
-    if (glewInit() != GLEW_OK)
+    GLenum glewStatus = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    // GLEW built for GLX still loads the core entry points for an EGL
+    // context, but then fails to find a GLX display.
+    if (glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)
+        glewStatus = GLEW_OK;
+#endif
+    if (glewStatus != GLEW_OK)
     {
         g_logger.error("%s", "Failed to initialize GLEW");
         m_badOpenGL = true;
@@ -327,12 +425,12 @@ void View3D::initializeGL()
                   (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION),
                   (const char*)glewGetString(GLEW_VERSION));
 
-    g_logger.info("OpenGL format: %s%s%s%s%s",
-                  format().doubleBuffer() ? "double " : "",
-                  format().stencil() ? "stencil " : "",
-                  format().alpha() ? "alpha " : "",
-                  format().accum() ? "accum " : "",
-                  format().stereo() ? "stereo " : "");
+    QSurfaceFormat format = QOpenGLContext::currentContext()->format();
+    g_logger.info("OpenGL format: %s%s%s%s",
+                  format.swapBehavior() == QSurfaceFormat::DoubleBuffer ? "double " : "",
+                  format.stencilBufferSize() > 0 ? "stencil " : "",
+                  format.alphaBufferSize() > 0 ? "alpha " : "",
+                  format.stereo() ? "stereo " : "");
 
     // GL_CHECK has to be defined for this to actually do something
     glCheckError();
@@ -379,11 +477,21 @@ void View3D::initializeGL()
 }
 
 
-void View3D::resizeGL(int w, int h)
+void View3D::resizeGL(int /*w*/, int /*h*/)
+{
+    // QOpenGLWidget passes the size in device independent pixels, while the
+    // framebuffer and viewport need device pixels.
+    double dPR = getDevicePixelRatio();
+    resizeFramebuffer(width()*dPR, height()*dPR);
+}
+
+
+/// Resize the viewport and incremental framebuffer to `w`x`h` device pixels
+void View3D::resizeFramebuffer(int w, int h)
 {
-    //Note: This function receives "device pixel sizes" for correct OpenGL viewport setup
-    //      Under OS X with retina display, this becomes important as it is 2x the width() or height()
-    //      of the normal window (there is a devicePixelRatio() function to deal with this).
+    //Note: Under OS X with retina display, the device pixel size is 2x the
+    //      width() or height() of the normal window (there is a
+    //      devicePixelRatio() function to deal with this).
 
     if (m_badOpenGL)
         return;
@@ -414,18 +522,24 @@ void View3D::paintGL()
     double dPR = getDevicePixelRatio();
     int w = width() * dPR;
     int h = height() * dPR;
+    if (m_renderImageSize.isValid())
+    {
+        w = m_renderImageSize.width();
+        h = m_renderImageSize.height();
+    }
 
     // detecting a change in the device pixel ratio, since only the new QWindow (Qt5) would
     // provide a signal for screen changes and this is the easiest solution
     if (dPR != m_devicePixelRatio)
     {
         m_devicePixelRatio = dPR;
-        resizeGL(w, h);
+        resizeFramebuffer(w, h);
     }
 
     glCheckError();
 
     glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_incrementalFramebuffer.id());
+    glViewport(0, 0, w, h);
 
     //--------------------------------------------------
     // Draw main scene
@@ -446,45 +560,77 @@ void View3D::paintGL()
 
     std::vector<const Geometry*> geoms = selectedGeometry();
 
-    // Aim for 40ms frame time - an ok tradeoff for desktop usage
-    const double targetMillisecs = 40;
+    // Interactive frames must keep up with the user, while refinement frames
+    // can be throttled when nobody is watching closely.
+    double refineMillisecs = m_refineFrameMillisecs;
+    int refineInterval = 10;
+    governRefinement(&refineMillisecs, &refineInterval);
+    const double targetMillisecs = m_incrementalDraw ? refineMillisecs
+                                                     : m_interactiveFrameMillisecs;
+
+    FrameStats stats;
+    stats.frameNumber = m_frameRate.totalFrames();
+    stats.incremental = m_incrementalDraw;
+    stats.targetMillisecs = targetMillisecs;
+    QElapsedTimer stageTimer;
+    stageTimer.start();
+    for (const Geometry* geom : geoms)
+        geom->cull(transState);
+    stats.cullMillisecs = stageTimer.nsecsElapsed()/1e6;
+    stageTimer.restart();
+
     double quality = m_drawCostModel.quality(targetMillisecs, geoms, transState,
                                              m_incrementalDraw);
+    stats.quality = quality;
+    stats.estimateMillisecs = stageTimer.nsecsElapsed()/1e6;
+    stageTimer.restart();
 
     // Render points
-    DrawCount drawCount = drawPoints(transState, geoms, quality, m_incrementalDraw);
+    DrawCount drawCount = drawPoints(transState, geoms, quality, m_incrementalDraw,
+                                     &stats.geomPointCounts);
 
     // Draw meshes and lines
     if (!m_incrementalDraw)
     {
-        drawMeshes(transState, geoms);
+        drawCount += drawMeshes(transState, geoms);
         // Generic draw for any other geometry
         // (TODO: make all geometries use this interface, or something similar)
-        // FIXME - Do generic quality scaling
-        const double quality = 1;
         for (size_t i = 0; i < geoms.size(); ++i)
-            geoms[i]->draw(transState, quality);
+            drawCount += geoms[i]->draw(transState, quality);
     }
 
     // Measure frame time to update estimate for how much geometry we can draw
     // with a reasonable frame rate
     glFinish();
-    int frameTime = frameTimer.elapsed();
+    double frameTime = frameTimer.nsecsElapsed()/1e6;
+    stats.drawMillisecs = stageTimer.nsecsElapsed()/1e6;
 
     glCheckError();
 
     if (!geoms.empty())
         m_drawCostModel.addSample(drawCount, frameTime);
 
-    // Debug: print bar showing how well we're sticking to the frame time
-//    int barSize = 40;
-//    std::string s = std::string(barSize*frameTime/targetMillisecs, '=');
-//    if ((int)s.size() > barSize)
-//        s[barSize] = '|';
-//    tfm::printfln("%12f %4d %s", quality, frameTime, s);
+    stats.frameMillisecs = frameTime;
+    stats.drawCount = drawCount;
+    m_renderStats.addFrame(stats);
+    ++m_frameRate;
+
+    // Set up timer to draw a high quality frame if necessary
+    if (!drawCount.moreToDraw)
+        m_incrementalFrameTimer->stop();
+    else
+        m_incrementalFrameTimer->start(refineInterval);
+
+    m_incrementalDraw = true;
+
+    // Offscreen images are read back from the incremental framebuffer
+    // without overlays, and a windowless context has no default framebuffer
+    // to blit to.
+    if (m_renderImageSize.isValid())
+        return;
 
     // TODO: this should really render a texture onto a quad and not use glBlitFramebuffer
-    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
     glBindFramebuffer(GL_READ_FRAMEBUFFER, m_incrementalFramebuffer.id());
     glBlitFramebuffer(0,0,w,h, 0,0,w,h,
                       GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT, GL_NEAREST); // has to be GL_NEAREST to work with DEPTH
@@ -543,20 +689,57 @@ void View3D::paintGL()
         drawAnnotations(transState, w, h);
     }
 
+    if (m_drawRenderStats && m_annotationShader->isValid())
+    {
+        drawRenderStats(w, h);
+    }
+}
 
-    // Set up timer to draw a high quality frame if necessary
-    if (!drawCount.moreToDraw)
-        m_incrementalFrameTimer->stop();
-    else
-        m_incrementalFrameTimer->start(10);
-
-    m_incrementalDraw = true;
-
+void View3D::drawRenderStats(int viewportPixelWidth, int viewportPixelHeight)
+{
+    if (m_renderStats.size() == 0)
+        return;
+    // Rendering the text to a texture is relatively expensive, so only update
+    // it when the averaged frame rate is recalculated.
+    if (!m_renderStatsOverlay || m_renderStatsOverlayTime != m_frameRate.lastUpdateTime())
+    {
+        const FrameStats& stats = m_renderStats.recent(0);
+        const DrawCount& dc = stats.drawCount;
+        std::string text = tfm::format(
+            "%s | %.1f / %.0f ms | cull %.1f  cost %.1f  draw %.1f ms | "
+            "quality %.3g | %.2fM points  %.0f nodes  %.0f occluded  %.0f calls  %.1f MB",
+            m_frameRate.summary(), stats.frameMillisecs, stats.targetMillisecs,
+            stats.cullMillisecs, stats.estimateMillisecs, stats.drawMillisecs,
+            stats.quality, dc.numVertices/1e6, dc.numNodes, dc.numOccludedNodes,
+            dc.numDrawCalls, dc.numBytesUploaded/1e6);
+        m_renderStatsOverlay = std::make_unique<Annotation>(
+            "renderStats", m_annotationShader->shaderProgram().programId(),
+            QString::fromStdString(text), V3d(0));
+        m_renderStatsOverlayTime = m_frameRate.lastUpdateTime();
+    }
+    // Position the text in the top left corner, using an identity camera
+    // transform so that positions are in normalized device coordinates.
+    const int margin = 10;
+    V3d pos(-1 + double(m_renderStatsOverlay->width()  + 2*margin)/viewportPixelWidth,
+             1 - double(m_renderStatsOverlay->height() + 2*margin)/viewportPixelHeight, 0);
+    TransformState screenTrans(Imath::V2i(viewportPixelWidth, viewportPixelHeight),
+                               M44d(), M44d());
+    QOpenGLShaderProgram& annotationShader = m_annotationShader->shaderProgram();
+    annotationShader.bind();
+    annotationShader.setUniformValue("viewportSize",
+                                     viewportPixelWidth,
+                                     viewportPixelHeight);
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    m_renderStatsOverlay->draw(annotationShader, screenTrans.translate(pos));
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
 }
 
-void View3D::drawMeshes(const TransformState& transState,
-                        const std::vector<const Geometry*>& geoms) const
+DrawCount View3D::drawMeshes(const TransformState& transState,
+                             const std::vector<const Geometry*>& geoms) const
 {
+    DrawCount drawCount;
     // Draw faces
     if (m_meshFaceShader->isValid())
     {
@@ -569,7 +752,7 @@ void View3D::drawMeshes(const TransformState& transState,
         V3d lightDir = V3d(1,1,-1).normalized() * worldToEyeVecTransform;
         meshFaceShader.setUniformValue("lightDir_eye", lightDir.x, lightDir.y, lightDir.z);
         for (size_t i = 0; i < geoms.size(); ++i)
-            geoms[i]->drawFaces(meshFaceShader, transState);
+            drawCount += geoms[i]->drawFaces(meshFaceShader, transState);
     }
 
     // Draw edges
@@ -579,8 +762,9 @@ void View3D::drawMeshes(const TransformState& transState,
         glLineWidth(1.0f);
         meshEdgeShader.bind();
         for (size_t i = 0; i < geoms.size(); ++i)
-            geoms[i]->drawEdges(meshEdgeShader, transState);
+            drawCount += geoms[i]->drawEdges(meshEdgeShader, transState);
     }
+    return drawCount;
 }
 
 void View3D::drawAnnotations(const TransformState& transState,
@@ -625,6 +809,7 @@ void View3D::mouseDoubleClickEvent(QMouseEvent* event)
 
 void View3D::mousePressEvent(QMouseEvent* event)
 {
+    m_idleTimer.restart();
     m_mouseButton = event->button();
     m_prevMousePos = event->pos();
 
@@ -755,6 +940,7 @@ void View3D::wheelEvent(QWheelEvent* event)
 
 void View3D::keyPressEvent(QKeyEvent *event)
 {
+    m_idleTimer.restart();
     // Centre camera on current cursor location
     if (event->key() == Qt::Key_C)
     {
@@ -1241,7 +1427,8 @@ void View3D::drawGrid() const
 /// Draw point cloud
 DrawCount View3D::drawPoints(const TransformState& transState,
                              const std::vector<const Geometry*>& geoms,
-                             double quality, bool incrementalDraw)
+                             double quality, bool incrementalDraw,
+                             std::vector<double>* geomPointCounts)
 {
     glCheckError();
 
@@ -1270,6 +1457,7 @@ DrawCount View3D::drawPoints(const TransformState& transState,
     for (size_t i = 0; i < geoms.size(); ++i)
     {
         const Geometry& geom = *geoms[i];
+        geomPointCounts->push_back(0);
         if (!geom.pointCount())
         {
             continue;
@@ -1278,7 +1466,9 @@ DrawCount View3D::drawPoints(const TransformState& transState,
         prog.setUniformValue("cursorPos", relCursor.x, relCursor.y, relCursor.z);
         prog.setUniformValue("fileNumber", (GLint)(selection[(int)i].row() + 1));
         prog.setUniformValue("pointPixelScale", (GLfloat)(0.5*width()*dPR*m_camera.projectionMatrix()[0][0]));
-        totDrawCount += geom.drawPoints(prog, transState, quality, incrementalDraw);
+        DrawCount drawCount = geom.drawPoints(prog, transState, quality, incrementalDraw);
+        geomPointCounts->back() = drawCount.numVertices;
+        totDrawCount += drawCount;
     }
 
     glEnable(GL_DEPTH_TEST);
@@ -1354,6 +1544,143 @@ bool View3D::snapToGeometry(const Imath::V3d& pos, double normalScaling,
 }
 
 
+/// Set target frame times for interactive and incremental refinement frames
+void View3D::setFrameBudget(double interactiveMillisecs, double refineMillisecs)
+{
+    // Very small budgets make the cost model draw almost nothing
+    m_interactiveFrameMillisecs = std::max(1.0, interactiveMillisecs);
+    m_refineFrameMillisecs = std::max(1.0, refineMillisecs);
+    restartRender();
+}
+
+/// Lower the GPU duty cycle of incremental refinement when the user isn't
+/// watching: once the view has been idle for a while refinement frames are
+/// smaller and further apart, and more so when the application is in the
+/// background.
+void View3D::governRefinement(double* targetMillisecs, int* timerInterval) const
+{
+    const qint64 idleMillisecs = 10000;
+    if (m_renderImageSize.isValid())
+    {
+        // Nobody is watching offscreen renders, but they still need to
+        // complete as quickly as possible.
+        return;
+    }
+    if (QGuiApplication::applicationState() != Qt::ApplicationActive)
+    {
+        *targetMillisecs *= 0.25;
+        *timerInterval = 500;
+    }
+    else if (m_idleTimer.elapsed() > idleMillisecs)
+    {
+        *targetMillisecs *= 0.5;
+        *timerInterval = 100;
+    }
+}
+
+/// Draw frames into the incremental framebuffer at `size`, refining until
+/// complete if `refine` is true, and read the result back into `image` if
+/// non-null.  Returns the number of frames drawn.
+int View3D::renderOffscreen(const QSize& size, bool refine, QImage* image)
+{
+    if (!makeRenderCurrent() || m_badOpenGL)
+    {
+        g_logger.error("%s", "No OpenGL context available for offscreen rendering");
+        return 0;
+    }
+    m_renderImageSize = size;
+    resizeFramebuffer(size.width(), size.height());
+    m_incrementalDraw = false;
+    // Refinement normally finishes in a handful of frames, but give up
+    // eventually in case geometry never reports that it's fully drawn.
+    const int maxFrames = 1000;
+    const qint64 maxMillisecs = 60000;
+    QElapsedTimer renderTimer;
+    renderTimer.start();
+    int numFrames = 0;
+    bool fetchPending = false;
+    do
+    {
+        bool fullFrame = !m_incrementalDraw;
+        paintGL();
+        ++numFrames;
+        if (fullFrame)
+            fetchPending = m_renderStats.recent(0).drawCount.fetchPending;
+        if (refine && fetchPending && !m_incrementalFrameTimer->isActive())
+        {
+            // Incremental frames only refine what's already loaded.  Give
+            // the I/O threads time to read the missing data, then draw it
+            // with another full frame.
+            QThread::msleep(10);
+            m_incrementalDraw = false;
+        }
+    }
+    while (refine && (m_incrementalFrameTimer->isActive() || fetchPending) &&
+           numFrames < maxFrames && renderTimer.elapsed() < maxMillisecs);
+    if (refine && (m_incrementalFrameTimer->isActive() || fetchPending))
+    {
+        g_logger.warning("Stopped offscreen render refinement after %d frames and %.1f s",
+                         numFrames, renderTimer.elapsed()/1000.0);
+    }
+    m_incrementalFrameTimer->stop();
+
+    if (image)
+    {
+        QImage rgba(size, QImage::Format_RGBA8888);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, m_incrementalFramebuffer.id());
+        glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE,
+                     rgba.bits());
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glCheckError();
+        // OpenGL images start at the bottom row
+        *image = rgba.mirrored().convertToFormat(QImage::Format_RGB888);
+    }
+
+    m_renderImageSize = QSize();
+    if (!m_offscreenContext)
+    {
+        double dPR = getDevicePixelRatio();
+        resizeFramebuffer(width()*dPR, height()*dPR);
+    }
+    restartRender();
+    return numFrames;
+}
+
+/// The windowless context is initialized here on first use, as there's no
+/// widget show event to do it.
+bool View3D::makeRenderCurrent()
+{
+    if (!m_offscreenContext)
+    {
+        makeCurrent();
+        return context() != nullptr;
+    }
+    if (m_badOpenGL || !m_offscreenContext->makeCurrent(m_offscreenSurface.get()))
+        return false;
+    if (!m_offscreenInitialized)
+    {
+        m_offscreenInitialized = true;
+        initializeGL();
+    }
+    return true;
+}
+
+/// Render a complete image offscreen at `size`
+QImage View3D::renderImage(const QSize& size)
+{
+    // Generous frame budgets reduce the number of refinement passes needed
+    // to draw everything.
+    double interactiveMillisecs = m_interactiveFrameMillisecs;
+    double refineMillisecs = m_refineFrameMillisecs;
+    m_interactiveFrameMillisecs = 1000;
+    m_refineFrameMillisecs = 1000;
+    QImage image;
+    renderOffscreen(size, true, &image);
+    m_interactiveFrameMillisecs = interactiveMillisecs;
+    m_refineFrameMillisecs = refineMillisecs;
+    return image;
+}
+
 /// Return list of currently selected geometry
 std::vector<const Geometry*> View3D::selectedGeometry() const
 {
@@ -1374,12 +1701,19 @@ void View3D::readSettings(const QSettings& settings)
     m_drawGrid          = settings.value("grid", m_drawGrid).toBool();
     m_drawAnnotations   = settings.value("annotations", m_drawAnnotations).toBool();
     m_backgroundColor   = settings.value("background", m_backgroundColor).value<QColor>();
+    m_drawRenderStats   = settings.value("renderStats", m_drawRenderStats).toBool();
+    bool occlusionCulling = settings.value("occlusionCulling", m_occlusionCulling).toBool();
+    setLodPointsPerPixel(settings.value("lodPointsPerPixel", m_lodPointsPerPixel).toDouble());
+    setFrameBudget(settings.value("interactiveFrameMillisecs", m_interactiveFrameMillisecs).toDouble(),
+                   settings.value("refineFrameMillisecs", m_refineFrameMillisecs).toDouble());
 
     m_boundingBoxAction->setChecked(m_drawBoundingBoxes);
     m_cursorAction->setChecked(m_drawCursor);
     m_axesAction->setChecked(m_drawAxes);
     m_gridAction->setChecked(m_drawGrid);
     m_annotationAction->setChecked(m_drawAnnotations);
+    m_renderStatsAction->setChecked(m_drawRenderStats);
+    m_occlusionCullingAction->setChecked(occlusionCulling);
 }
 
 void View3D::writeSettings(QSettings& settings) const
@@ -1389,7 +1723,12 @@ void View3D::writeSettings(QSettings& settings) const
     settings.setValue("axes", m_drawAxes);
     settings.setValue("grid", m_drawGrid);
     settings.setValue("annotations", m_drawAnnotations);
+    settings.setValue("renderStats", m_drawRenderStats);
+    settings.setValue("occlusionCulling", m_occlusionCulling);
+    settings.setValue("lodPointsPerPixel", m_lodPointsPerPixel);
     settings.setValue("background", QVariant(m_backgroundColor));
+    settings.setValue("interactiveFrameMillisecs", m_interactiveFrameMillisecs);
+    settings.setValue("refineFrameMillisecs", m_refineFrameMillisecs);
 }
 
 void View3D::setPoles(const std::vector<Eigen::Vector3d>& poles) {
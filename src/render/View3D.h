@@ -13,11 +13,14 @@
 
 
 #include <QVector>
-#include <QGLWidget>
+#include <QElapsedTimer>
+#include <QOpenGLWidget>
 #include <QModelIndex>
 #include <Eigen/Dense>
 
 #include "DrawCostModel.h"
+#include "FrameRate.h"
+#include "RenderStats.h"
 #include "InteractiveCamera.h"
 #include "geometrycollection.h"
 #include "Annotation.h"
@@ -28,7 +31,9 @@
 class QOpenGLShaderProgram;
 class QItemSelectionModel;
 class QTimer;
-class QGLFormat;
+class QOpenGLContext;
+class QOffscreenSurface;
+class QImage;
 class QSettings;
 
 class MainWindow;
@@ -39,11 +44,15 @@ struct TransformState;
 
 //------------------------------------------------------------------------------
 /// OpenGL-based viewer widget for point clouds
-class View3D : public QGLWidget
+class View3D : public QOpenGLWidget
 {
     Q_OBJECT
     public:
-        View3D(GeometryCollection* geometries, const QGLFormat& format, MainWindow *parent = nullptr, DataSetUI *dataSet = nullptr);
+        /// If `offscreen` is true the widget is never shown, and drawing
+        /// uses a windowless OpenGL context which is only created when first
+        /// needed.  Only renderOffscreen() produces images in this mode.
+        View3D(GeometryCollection* geometries, MainWindow *parent = nullptr,
+               DataSetUI *dataSet = nullptr, bool offscreen = false);
         ~View3D() = default;
 
         Enable& enable() const { return *m_enable; }
@@ -78,6 +87,8 @@ class View3D : public QGLWidget
         QAction* m_axesAction = nullptr;
         QAction* m_gridAction = nullptr;
         QAction* m_annotationAction = nullptr;
+        QAction* m_renderStatsAction = nullptr;
+        QAction* m_occlusionCullingAction = nullptr;
 
         /// Settings
         void readSettings(const QSettings& settings);
@@ -85,6 +96,44 @@ class View3D : public QGLWidget
 
         Geometry* currentGeometry() const;
 
+        /// Set target frame times in milliseconds for interactive frames
+        /// (drawn while the camera or geometry is changing) and for
+        /// incremental refinement frames (drawn while the view is static).
+        void setFrameBudget(double interactiveMillisecs, double refineMillisecs);
+        double interactiveFrameMillisecs() const { return m_interactiveFrameMillisecs; }
+        double refineFrameMillisecs() const { return m_refineFrameMillisecs; }
+
+        /// Set target points per pixel of projected screen area for level
+        /// of detail selection at quality 1
+        void setLodPointsPerPixel(double pointsPerPixel);
+        double lodPointsPerPixel() const { return m_lodPointsPerPixel; }
+
+        /// Render the scene offscreen at the given size in pixels.
+        ///
+        /// Unlike interactive rendering, frames are refined until all
+        /// visible geometry is drawn.  Interface overlays such as the cursor
+        /// and axes are not included.
+        QImage renderImage(const QSize& size);
+
+        /// Draw the scene offscreen at the given size in pixels, using the
+        /// current frame budgets.
+        ///
+        /// A single interactive frame is drawn, followed by refinement
+        /// frames until all visible geometry is drawn if `refine` is true.
+        /// Full frames are redrawn while streamed data is still being read,
+        /// stopping with a warning after 1000 frames or a minute.
+        /// Each frame is recorded in renderStats(), and the number of frames
+        /// is returned.  If `image` is non-null it's set to the final image.
+        int renderOffscreen(const QSize& size, bool refine, QImage* image = nullptr);
+
+        /// Make the OpenGL context current for work outside the paint
+        /// callbacks, such as compiling shaders.  Returns false if there is
+        /// no context yet.
+        bool makeRenderCurrent();
+
+        /// Statistics for recently rendered frames
+        RenderStats& renderStats() { return m_renderStats; }
+
         void setPoles(const std::vector<Eigen::Vector3d>& poles);
 
         size_t poleCount() const
@@ -129,20 +178,26 @@ class View3D : public QGLWidget
         void setupShaderParamUI();
 
         void geometryChanged();
+        void geometryRedrawNeeded();
+        void redrawGeometry();
         void dataChanged(const QModelIndex &topLeft, const QModelIndex &bottomRight);
         void geometryInserted(const QModelIndex&, int firstRow, int lastRow);
+        void geometryAboutToBeRemoved();
 
         void setBoundingBox(bool);
         void setCursor(bool);
         void setAxes(bool);
         void setGrid(bool);
         void setAnnotations(bool);
+        void setRenderStats(bool);
+        void setOcclusionCulling(bool);
 
     private:
         std::vector<Eigen::Vector3d> m_poles;
         void renderPoles();
         double getDevicePixelRatio();
         void initializeGLGeometry(int begin, int end);
+        void resizeFramebuffer(int w, int h);
 
         void initCursor(float cursorRadius, float centerPointRadius);
         void drawCursor(const TransformState& transState, const V3d& P, float centerPointRadius) const;
@@ -157,10 +212,11 @@ class View3D : public QGLWidget
 
         DrawCount drawPoints(const TransformState& transState,
                              const std::vector<const Geometry*>& geoms,
-                             double quality, bool incrementalDraw);
+                             double quality, bool incrementalDraw,
+                             std::vector<double>* geomPointCounts);
 
-        void drawMeshes(const TransformState& transState,
-                        const std::vector<const Geometry*>& geoms) const;
+        DrawCount drawMeshes(const TransformState& transState,
+                             const std::vector<const Geometry*>& geoms) const;
         void drawAnnotations(const TransformState& transState,
                              int viewportPixelWidth,
                              int viewportPixelHeight) const;
@@ -169,6 +225,8 @@ class View3D : public QGLWidget
                              int viewportPixelWidth,
                              int viewportPixelHeight) const;
 
+        void drawRenderStats(int viewportPixelWidth, int viewportPixelHeight);
+
         Imath::V3d guessClickPosition(const QPoint& clickPos);
 
         bool snapToGeometry(const Imath::V3d& pos, double normalScaling,
@@ -179,6 +237,8 @@ class View3D : public QGLWidget
         void snapToPoint(const Imath::V3d& pos);
         std::vector<const Geometry*> selectedGeometry() const;
 
+        void governRefinement(double* targetMillisecs, int* timerInterval) const;
+
         MainWindow* m_mainWindow = nullptr;
         DataSetUI* m_dataSet = nullptr;
         /// Mouse-based camera positioning
@@ -199,8 +259,18 @@ class View3D : public QGLWidget
         bool m_drawAxes = true;
         bool m_drawGrid = false;
         bool m_drawAnnotations = true;
+        bool m_drawRenderStats = false;
+        /// Skip drawing geometry hidden behind other geometry
+        bool m_occlusionCulling = true;
+        /// Target point density for screen space level of detail
+        double m_lodPointsPerPixel = 1;
         /// If true, OpenGL initialization didn't work properly
         bool m_badOpenGL;
+        /// Windowless context used in place of the widget's own context
+        /// when rendering offscreen
+        std::unique_ptr<QOffscreenSurface> m_offscreenSurface;
+        std::unique_ptr<QOpenGLContext> m_offscreenContext;
+        bool m_offscreenInitialized = false;
         /// Shader for point clouds
         std::unique_ptr<ShaderProgram> m_shaderProgram;
         std::unique_ptr<Enable>        m_enable;
@@ -218,10 +288,25 @@ class View3D : public QGLWidget
         QWidget* m_shaderParamsUI;
         /// Timer for next incremental frame
         QTimer* m_incrementalFrameTimer;
+        /// Timer coalescing redraws requested by geometry as data arrives
+        QTimer* m_geometryRedrawTimer;
         Framebuffer m_incrementalFramebuffer;
         bool m_incrementalDraw;
+        /// Target frame time for interactive and refinement frames
+        double m_interactiveFrameMillisecs = 40;
+        double m_refineFrameMillisecs = 40;
+        /// Size of offscreen image being rendered, or invalid when drawing
+        /// to the widget
+        QSize m_renderImageSize;
+        /// Time since last user input, for throttling refinement when idle
+        QElapsedTimer m_idleTimer;
         /// Controller for amount of geometry to draw
         DrawCostModel m_drawCostModel;
+        /// Frame statistics, and on screen display of the latest
+        RenderStats m_renderStats;
+        FrameRate m_frameRate;
+        std::unique_ptr<Annotation> m_renderStatsOverlay;
+        int64_t m_renderStatsOverlayTime = -1;
         /// GL textures
         std::unique_ptr<QOpenGLTexture> m_drawAxesBackground;
         std::unique_ptr<QOpenGLTexture> m_drawAxesLabelX;
@@ -0,0 +1,251 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "streampagecache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+StreamPageCache::StreamPageCache(std::istream& input, PosType pageSize)
+    : m_input(input),
+    m_pageSize(pageSize)
+{
+    m_input.seekg(0, std::ios::end);
+    m_fileSize = static_cast<PosType>(m_input.tellg());
+    m_input.seekg(0);
+    if (!m_input)
+        throw DisplazError("Page cache could not open file");
+}
+
+
+StreamPageCache::StreamPageCache(const std::string& fileName, int numThreads,
+                                 PosType pageSize)
+    : m_ownedInput(new std::ifstream(fileName, std::ios::binary)),
+    m_input(*m_ownedInput),
+    m_pageSize(pageSize)
+{
+    m_input.seekg(0, std::ios::end);
+    m_fileSize = static_cast<PosType>(m_input.tellg());
+    m_input.seekg(0);
+    if (!m_input)
+        throw DisplazError("Page cache could not open file \"%s\"", fileName);
+    // Open all file handles up front so that failure is reported here
+    // rather than silently on an I/O thread.
+    std::vector<std::unique_ptr<std::ifstream>> threadInputs;
+    for (int i = 0; i < numThreads; ++i)
+    {
+        threadInputs.emplace_back(new std::ifstream(fileName, std::ios::binary));
+        if (!*threadInputs.back())
+            throw DisplazError("Page cache could not open file \"%s\"", fileName);
+    }
+    for (auto& input : threadInputs)
+        m_ioThreads.emplace_back(&StreamPageCache::ioThreadMain, this, std::move(input));
+}
+
+
+StreamPageCache::~StreamPageCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_pagesPending.notify_all();
+    for (std::thread& thread : m_ioThreads)
+        thread.join();
+    if (m_residency)
+    {
+        for (auto& page : m_pages)
+            m_residency->remove(page.second.residencyHandle);
+    }
+}
+
+
+void StreamPageCache::setPageReadyCallback(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pageReadyCallback = callback;
+}
+
+
+void StreamPageCache::setResidencyManager(ResidencyManager* residency)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_residency = residency;
+}
+
+
+bool StreamPageCache::prefetch(PosType offset, PosType length, double priority)
+{
+    if (offset + length > m_fileSize)
+    {
+        throw DisplazError("Prefetch request at %d past end of file %d",
+                           offset+length, m_fileSize);
+    }
+    PosType pagesBegin = pageIndex(offset);
+    PosType pagesEnd = pageIndex(offset + length - 1) + 1;
+    bool inCache = true;
+    bool newPages = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
+        {
+            if (m_pages.find(pageIdx) != m_pages.end())
+                continue;
+            inCache = false;
+            if (m_fetchingPages.find(pageIdx) != m_fetchingPages.end())
+                continue;
+            auto pendingPage = m_pendingPages.find(pageIdx);
+            if (pendingPage == m_pendingPages.end())
+            {
+                m_pendingPages[pageIdx] = priority;
+                newPages = true;
+            }
+            else if (pendingPage->second < priority)
+                pendingPage->second = priority;
+        }
+    }
+    if (newPages)
+        m_pagesPending.notify_all();
+    return inCache;
+}
+
+
+bool StreamPageCache::read(char* buf, PosType offset, PosType length)
+{
+    PosType pagesBegin = pageIndex(offset);
+    PosType pagesEnd = pageIndex(offset + length - 1) + 1;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
+    {
+        if (m_pages.find(pageIdx) == m_pages.end())
+            return false;
+    }
+    for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
+    {
+        const Page& page = m_pages[pageIdx];
+        if (m_residency)
+            m_residency->touch(page.residencyHandle);
+        PosType pageOffsetBegin = pageIdx * m_pageSize;
+        PosType pageOffsetEnd   = (pageIdx+1) * m_pageSize;
+        // Range of bytes to copy within page
+        PosType byteBegin = (pageOffsetBegin < offset) ?
+                            offset - pageOffsetBegin : 0;
+        PosType byteEnd   = (pageOffsetEnd > offset + length) ?
+                            offset + length - pageOffsetBegin : m_pageSize;
+        PosType nbytes = byteEnd - byteBegin;
+        memcpy(buf, page.data.get() + byteBegin, nbytes);
+        buf += nbytes;
+    }
+    return true;
+}
+
+
+void StreamPageCache::clearPending()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pendingPages.clear();
+}
+
+
+size_t StreamPageCache::fetchNow(size_t numFetch)
+{
+    size_t numFetched = 0;
+    for (; numFetched < numFetch; ++numFetched)
+    {
+        PosType pageIdx = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!takePendingPage(pageIdx))
+                break;
+        }
+        std::lock_guard<std::mutex> inputLock(m_inputMutex);
+        fetchPage(m_input, pageIdx);
+    }
+    return numFetched;
+}
+
+
+size_t StreamPageCache::pendingPageCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pendingPages.size();
+}
+
+
+size_t StreamPageCache::fetchedPageCount() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_fetchedCount;
+}
+
+
+bool StreamPageCache::takePendingPage(PosType& pageIdx)
+{
+    if (m_pendingPages.empty())
+        return false;
+    auto page = std::max_element(m_pendingPages.begin(), m_pendingPages.end(),
+        [](const std::pair<const PosType, double>& a,
+           const std::pair<const PosType, double>& b)
+        {
+            return a.second < b.second;
+        });
+    pageIdx = page->first;
+    m_pendingPages.erase(page);
+    m_fetchingPages.insert(pageIdx);
+    return true;
+}
+
+
+void StreamPageCache::fetchPage(std::istream& input, PosType pageIdx)
+{
+    std::unique_ptr<char[]> buf(new char[m_pageSize]);
+    PosType pageOffset = pageIdx*m_pageSize;
+    input.seekg(pageOffset);
+    input.read(buf.get(), std::min(m_pageSize, m_fileSize - pageOffset));
+    input.clear();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    assert(m_pages.find(pageIdx) == m_pages.end());
+    Page& page = m_pages[pageIdx];
+    page.data = std::move(buf);
+    if (m_residency)
+    {
+        page.residencyHandle = m_residency->add(m_pageSize,
+                                                [this,pageIdx]() { evictPage(pageIdx); });
+    }
+    m_fetchingPages.erase(pageIdx);
+    ++m_fetchedCount;
+}
+
+
+void StreamPageCache::evictPage(PosType pageIdx)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pages.erase(pageIdx);
+}
+
+
+void StreamPageCache::ioThreadMain(std::unique_ptr<std::ifstream> input)
+{
+    while (true)
+    {
+        PosType pageIdx = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_pagesPending.wait(lock, [this]{
+                return m_stopping || !m_pendingPages.empty();
+            });
+            if (m_stopping)
+                return;
+            takePendingPage(pageIdx);
+        }
+        fetchPage(*input, pageIdx);
+        std::function<void()> callback;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            callback = m_pageReadyCallback;
+        }
+        if (callback)
+            callback();
+    }
+}
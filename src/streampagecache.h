@@ -4,39 +4,54 @@
 #ifndef STREAM_PAGE_CACHE_H_INCLUDED
 #define STREAM_PAGE_CACHE_H_INCLUDED
 
-#include <algorithm>
-#include <cassert>
+#include <condition_variable>
 #include <cstdint>
 #include <fstream>
 #include <functional>
 #include <memory>
-#include <string.h>
-#include <stdexcept>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "ResidencyManager.h"
 #include "util.h"
 
 /// Application controlled page cache for access to raw file data
 ///
 /// This interface allows the application to specify data to be fetched, along
-/// with a priority for the data.
+/// with a priority for the data.  Pages may be fetched synchronously with
+/// fetchNow(), or by a pool of background I/O threads which service pending
+/// pages in priority order.  prefetch() and read() are threadsafe.
 class StreamPageCache
 {
     public:
         typedef uint64_t PosType;
 
-        StreamPageCache(std::istream& input, PosType pageSize = 512*1024)
-            : m_input(input),
-            m_pageSize(pageSize)
-        {
-            m_input.seekg(0, std::ios::end);
-            m_fileSize = static_cast<PosType>(m_input.tellg());
-            m_input.seekg(0);
-            if (!m_input)
-                throw DisplazError("Page cache could not open file");
-        }
+        /// Create cache reading from `input`.  Pages are only fetched when
+        /// fetchNow() is called.
+        StreamPageCache(std::istream& input, PosType pageSize = 512*1024);
+
+        /// Create cache reading from file `fileName`, with `numThreads`
+        /// background threads fetching pending pages.  Each thread reads
+        /// through its own file handle, so throughput scales with the number
+        /// of outstanding requests the storage can service at once.
+        StreamPageCache(const std::string& fileName, int numThreads = 4,
+                        PosType pageSize = 512*1024);
+
+        ~StreamPageCache();
+
+        /// Set function to be called whenever a background thread has
+        /// fetched a page.  The callback is run on the I/O thread.
+        void setPageReadyCallback(std::function<void()> callback);
+
+        /// Track memory used by fetched pages with `residency`, so that
+        /// least recently read pages may be evicted.  Without a residency
+        /// manager, pages are kept forever.  Must be called before any pages
+        /// are fetched, and `residency` must outlive the cache.
+        void setResidencyManager(ResidencyManager* residency);
 
         /// Mark pages overlapping the given range for fetching
         ///
@@ -46,89 +61,29 @@ class StreamPageCache
         /// prefetch() does not do any actual fetching of data;  it returns
         /// immediately with status indicating whether the data is already
         /// present in the cache.
-        bool prefetch(PosType offset, PosType length, double priority = 0)
-        {
-            if (offset + length > m_fileSize)
-            {
-                throw DisplazError("Prefetch request at %d past end of file %d",
-                                   offset+length, m_fileSize);
-            }
-            PosType pagesBegin = pageIndex(offset);
-            PosType pagesEnd = pageIndex(offset + length - 1) + 1;
-            bool inCache = true;
-            for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
-            {
-                auto page = m_pages.find(pageIdx);
-                if (page == m_pages.end())
-                {
-                    auto pendingPage = m_pendingPages.find(pageIdx);
-                    if (pendingPage == m_pendingPages.end())
-                        m_pendingPages[pageIdx] = priority;
-                    else if (pendingPage->second < priority)
-                        pendingPage->second = priority;
-                    inCache = false;
-                }
-            }
-            return inCache;
-        }
+        bool prefetch(PosType offset, PosType length, double priority = 0);
 
         /// Attempt to read length bytes into buf, starting at offset
         ///
         /// If the byte range is not in the cache, return false (the user may
         /// call prefetch() to bring these into cache)
-        bool read(char* buf, PosType offset, PosType length)
-        {
-            PosType pagesBegin = pageIndex(offset);
-            PosType pagesEnd = pageIndex(offset + length - 1) + 1;
-            //tfm::printf("read(): pagesBegin = %d, pagesEnd = %d\n", pagesBegin, pagesEnd);
-            for (PosType pageIdx = pagesBegin; pageIdx < pagesEnd; ++pageIdx)
-            {
-                auto page = m_pages.find(pageIdx);
-                if (page == m_pages.end())
-                {
-                    //tfm::printf("Didn't find page %d\n", pageIdx);
-                    return false;
-                }
-                PosType pageOffsetBegin = pageIdx * m_pageSize;
-                PosType pageOffsetEnd   = (pageIdx+1) * m_pageSize;
-                // Range of bytes to copy within page
-                PosType byteBegin = (pageOffsetBegin < offset) ?
-                                    offset - pageOffsetBegin : 0;
-                PosType byteEnd   = (pageOffsetEnd > offset + length) ?
-                                    offset + length - pageOffsetBegin : m_pageSize;
-                PosType nbytes = byteEnd - byteBegin;
-                //tfm::printf("read(): byteBegin = %d, byteEnd = %d\n", byteBegin, byteEnd);
-                memcpy(buf, page->second.get() + byteBegin, nbytes);
-                buf += nbytes;
-            }
-            return true;
-        }
+        bool read(char* buf, PosType offset, PosType length);
 
-        /// Fetch a bunch of pages which have been previously marked.
+        /// Discard requests for pages which haven't started fetching yet.
         ///
-        /// Eventually this will probably happen in the background
-        size_t fetchNow(size_t numFetch)
-        {
-            typedef std::pair<double, PosType> PendingPage;
-            std::vector<PendingPage> priorityPages;
-            for (auto p = m_pendingPages.begin(); p != m_pendingPages.end(); ++p)
-                priorityPages.push_back(PendingPage(p->second, p->first));
-            numFetch = std::min(numFetch, priorityPages.size());
-            std::nth_element(priorityPages.begin(), priorityPages.begin() + numFetch,
-                             priorityPages.end(), std::greater<PendingPage>());
-            for (size_t i = 0; i < numFetch; ++i)
-            {
-                PosType pageIdx = priorityPages[i].second;
-                std::unique_ptr<char[]>& buf = m_pages[pageIdx];
-                assert(!buf);
-                buf.reset(new char[m_pageSize]);
-                PosType pageOffset = pageIdx*m_pageSize;
-                m_input.seekg(pageOffset);
-                m_input.read(buf.get(), std::min(m_pageSize, m_fileSize - pageOffset));
-                m_pendingPages.erase(pageIdx);
-            }
-            return numFetch;
-        }
+        /// Useful when the set of wanted pages and their priorities are
+        /// recomputed from scratch, for example once per frame.
+        void clearPending();
+
+        /// Fetch up to numFetch of the highest priority pending pages on the
+        /// calling thread, returning the number fetched.
+        size_t fetchNow(size_t numFetch);
+
+        /// Return number of pages waiting to be fetched
+        size_t pendingPageCount() const;
+
+        /// Return total number of pages fetched so far
+        size_t fetchedPageCount() const;
 
     private:
         PosType pageIndex(PosType address) const
@@ -136,11 +91,41 @@ class StreamPageCache
             return address/m_pageSize;
         }
 
+        /// Remove highest priority page from the pending set and mark it as
+        /// being fetched.  Requires m_mutex to be held.
+        bool takePendingPage(PosType& pageIdx);
+
+        /// Read page from `input` and add it to the cache
+        void fetchPage(std::istream& input, PosType pageIdx);
+
+        /// Drop page from cache after eviction by the residency manager
+        void evictPage(PosType pageIdx);
+
+        struct Page
+        {
+            std::unique_ptr<char[]> data;
+            ResidencyManager::Handle residencyHandle = 0;
+        };
+
+        void ioThreadMain(std::unique_ptr<std::ifstream> input);
+
+        std::unique_ptr<std::ifstream> m_ownedInput;
         std::istream& m_input;
+        std::mutex m_inputMutex; ///< Protects m_input
         PosType m_pageSize;
         PosType m_fileSize;
+
+        mutable std::mutex m_mutex; ///< Protects all members below
+        std::condition_variable m_pagesPending;
+        bool m_stopping = false;
+        size_t m_fetchedCount = 0;
         std::unordered_map<PosType, double> m_pendingPages;
-        std::unordered_map<PosType, std::unique_ptr<char[]>> m_pages;
+        std::unordered_set<PosType> m_fetchingPages;
+        std::unordered_map<PosType, Page> m_pages;
+        std::function<void()> m_pageReadyCallback;
+        ResidencyManager* m_residency = nullptr;
+
+        std::vector<std::thread> m_ioThreads;
 };
 
 
@@ -3,8 +3,11 @@
 
 #include <catch.hpp>
 
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <iostream>
+#include <thread>
 
 #include "streampagecache.h"
 
@@ -45,3 +48,81 @@ TEST_CASE("Test page cache for std::istream")
     }
 }
 
+
+TEST_CASE("Test background page fetching")
+{
+    const size_t size = 12345;
+    char buf[size];
+    for (size_t i = 0; i < size; ++i)
+        buf[i] = rand() % 256;
+    std::string tmpFileName = "streampagecache_test_bg.dat";
+    {
+        std::ofstream out(tmpFileName, std::ios::binary);
+        out.write(buf, size);
+    }
+
+    SECTION("Pages are fetched by I/O threads")
+    {
+        StreamPageCache cache(tmpFileName, 3, 1001);
+        std::atomic<int> pagesReady(0);
+        cache.setPageReadyCallback([&]{ ++pagesReady; });
+        CHECK_FALSE(cache.prefetch(0, size, 1));
+        char buf2[size] = {0};
+        for (int i = 0; i < 1000 && !cache.read(buf2, 0, size); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        REQUIRE(cache.read(buf2, 0, size));
+        CHECK(std::memcmp(buf, buf2, size) == 0);
+        CHECK(cache.fetchedPageCount() == 13);
+        CHECK(cache.prefetch(500, 7000));
+    }
+
+    SECTION("Pending pages are fetched in priority order")
+    {
+        StreamPageCache cache(tmpFileName, 0, 1001);
+        cache.prefetch(0, 10, 1);
+        cache.prefetch(5010, 10, 3);
+        cache.prefetch(9010, 10, 2);
+        CHECK(cache.pendingPageCount() == 3);
+        CHECK(cache.fetchNow(1) == 1);
+        char buf2[10];
+        CHECK(cache.read(buf2, 5010, 10));
+        CHECK_FALSE(cache.read(buf2, 9010, 10));
+        cache.clearPending();
+        CHECK(cache.pendingPageCount() == 0);
+        CHECK(cache.fetchNow(10) == 0);
+    }
+}
+
+
+TEST_CASE("Test page cache eviction")
+{
+    const size_t size = 5000;
+    char buf[size];
+    for (size_t i = 0; i < size; ++i)
+        buf[i] = rand() % 256;
+    std::string tmpFileName = "streampagecache_test_evict.dat";
+    {
+        std::ofstream out(tmpFileName, std::ios::binary);
+        out.write(buf, size);
+    }
+
+    std::ifstream in(tmpFileName, std::ios::binary);
+    ResidencyManager residency(2000);
+    StreamPageCache cache(in, 1000);
+    cache.setResidencyManager(&residency);
+    char buf2[10];
+    for (int i = 0; i < 3; ++i)
+    {
+        cache.prefetch(1000*i, 10);
+        cache.fetchNow(1);
+    }
+    CHECK(residency.stats().residentBytes == 3000);
+    CHECK(cache.read(buf2, 0, 10));
+    CHECK(residency.enforceBudget() == 1);
+    // Page 1 is least recently read
+    CHECK(cache.read(buf2, 0, 10));
+    CHECK_FALSE(cache.read(buf2, 1000, 10));
+    CHECK(cache.read(buf2, 2000, 10));
+    CHECK(std::memcmp(buf + 2000, buf2, 10) == 0);
+    CHECK_FALSE(cache.prefetch(1000, 10));
+}
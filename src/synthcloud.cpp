@@ -0,0 +1,153 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Generator for synthetic point clouds used in rendering benchmarks.
+//
+// The scene is a crude city: a 1km square ground plane scattered with box
+// shaped buildings, sampled uniformly by area.  This gives a mix of large
+// open areas and dense occluding surfaces, similar to mobile mapping scans.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "tinyformat.h"
+
+namespace {
+
+struct Building
+{
+    float x0, y0, x1, y1, height;
+};
+
+struct PlyPoint
+{
+    float x, y, z;
+    uint8_t r, g, b;
+};
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        tfm::printfln("Usage: %s out.ply [num_points]", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char* fileName = argv[1];
+    size_t numPoints = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 10000000;
+
+    const float sceneSize = 1000;
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(0, 1);
+
+    // Buildings on a regular grid of blocks, with random size and height
+    const int numBlocks = 10;
+    const float blockSize = sceneSize/numBlocks;
+    std::vector<Building> buildings;
+    std::vector<double> cumulativeArea;
+    double totalArea = sceneSize*sceneSize;
+    cumulativeArea.push_back(totalArea);
+    for (int i = 0; i < numBlocks; ++i)
+    {
+        for (int j = 0; j < numBlocks; ++j)
+        {
+            float w = blockSize*(0.3f + 0.5f*uniform(rng));
+            float d = blockSize*(0.3f + 0.5f*uniform(rng));
+            Building b;
+            b.x0 = i*blockSize + 0.1f*blockSize;
+            b.y0 = j*blockSize + 0.1f*blockSize;
+            b.x1 = b.x0 + w;
+            b.y1 = b.y0 + d;
+            b.height = 10 + 70*uniform(rng);
+            buildings.push_back(b);
+            totalArea += 2*(w + d)*b.height + w*d;
+            cumulativeArea.push_back(totalArea);
+        }
+    }
+
+    std::ofstream out(fileName, std::ios::binary);
+    if (!out)
+    {
+        tfm::format(std::cerr, "Could not open output file \"%s\"\n", fileName);
+        return EXIT_FAILURE;
+    }
+    tfm::format(out, "ply\n"
+                "format binary_little_endian 1.0\n"
+                "comment Synthetic city point cloud\n"
+                "element vertex %d\n"
+                "property float x\n"
+                "property float y\n"
+                "property float z\n"
+                "property uint8 red\n"
+                "property uint8 green\n"
+                "property uint8 blue\n"
+                "end_header\n", numPoints);
+
+    std::vector<PlyPoint> buffer;
+    buffer.reserve(1 << 16);
+    for (size_t n = 0; n < numPoints; ++n)
+    {
+        // Choose surface with probability proportional to area
+        double a = totalArea*uniform(rng);
+        size_t surf = std::upper_bound(cumulativeArea.begin(), cumulativeArea.end(), a) -
+                      cumulativeArea.begin();
+        PlyPoint p;
+        if (surf == 0 || surf > buildings.size())
+        {
+            p.x = sceneSize*uniform(rng);
+            p.y = sceneSize*uniform(rng);
+            p.z = 0.05f*uniform(rng);
+            p.r = p.g = p.b = 90 + uint8_t(40*uniform(rng));
+        }
+        else
+        {
+            const Building& b = buildings[surf-1];
+            float w = b.x1 - b.x0;
+            float d = b.y1 - b.y0;
+            float u = uniform(rng)*(2*(w + d) + w*d/b.height);
+            if (u < 2*(w + d))
+            {
+                // Walls
+                p.z = b.height*uniform(rng);
+                if (u < w)              { p.x = b.x0 + u;         p.y = b.y0; }
+                else if (u < w + d)     { p.x = b.x1;             p.y = b.y0 + u - w; }
+                else if (u < 2*w + d)   { p.x = b.x1 - (u-w-d);   p.y = b.y1; }
+                else                    { p.x = b.x0;             p.y = b.y1 - (u-2*w-d); }
+            }
+            else
+            {
+                // Roof
+                p.x = b.x0 + w*uniform(rng);
+                p.y = b.y0 + d*uniform(rng);
+                p.z = b.height;
+            }
+            float h = p.z/80;
+            p.r = uint8_t(255*h);
+            p.g = uint8_t(120 + 80*uniform(rng));
+            p.b = uint8_t(255*(1-h));
+        }
+        buffer.push_back(p);
+        if (buffer.size() == buffer.capacity() || n + 1 == numPoints)
+        {
+            for (const PlyPoint& q : buffer)
+            {
+                out.write((const char*)&q.x, 3*sizeof(float));
+                out.write((const char*)&q.r, 3);
+            }
+            buffer.clear();
+        }
+    }
+    if (!out)
+    {
+        tfm::format(std::cerr, "Error writing to \"%s\"\n", fileName);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,187 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Throughput benchmark for spilling points to point database tile files,
+// comparing TileSpiller with the original PointDbWriter flushing scheme
+// (reopen the tile file for each flush, and write each point with two small
+// writes) over a range of tile sizes.
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include "pointdb.h"
+#include "tilespiller.h"
+
+#include "tinyformat.h"
+
+namespace {
+
+const int numComponents = 2;
+
+/// Synthetic airborne scan: scan lines sweep across a swath, advancing
+/// along the flight line, with several adjacent flight lines.
+struct ScanPattern
+{
+    size_t numPoints;
+    double swathWidth;
+    double lineSpacing;
+    int pointsPerScan;
+    double scanSpacing;
+
+    ScanPattern()
+        : numPoints(5000000), swathWidth(200), lineSpacing(150),
+        pointsPerScan(200), scanSpacing(0.25) {}
+
+    void point(size_t i, float* P, float* attrs) const
+    {
+        size_t scan = i / pointsPerScan;
+        int j = (int)(i % pointsPerScan);
+        size_t scansPerLine = (size_t)(1000/scanSpacing);
+        int flightLine = (int)(scan / scansPerLine);
+        // Alternate scan direction, as for an oscillating mirror
+        double across = swathWidth*(double(j)/pointsPerScan - 0.5);
+        if (scan % 2)
+            across = -across;
+        P[0] = float(flightLine*lineSpacing + across);
+        P[1] = float((scan % scansPerLine)*scanSpacing);
+        P[2] = float(0.01*(j % 97));
+        attrs[0] = float(j);
+        attrs[1] = float(scan % 7);
+    }
+};
+
+
+/// Original PointDbWriter scheme: tiles buffered in vectors, with tiles not
+/// used since the last flush written out every flushInterval points
+struct ReferenceTile
+{
+    std::vector<float> position;
+    std::vector<float> attributes;
+    bool recentlyUsed;
+    ReferenceTile() : recentlyUsed(false) {}
+};
+
+void referenceFlushToDisk(const std::string& dirName, const TilePos& pos,
+                          ReferenceTile& tile)
+{
+    std::string fileName = tfm::format("%s/%d_%d_%d.dat", dirName, pos.x, pos.y, pos.z);
+    std::ofstream file(fileName.c_str(), std::ios::binary | std::ios::app | std::ios::ate);
+    size_t numPoints = tile.position.size()/3;
+    for (size_t i = 0; i < numPoints; ++i)
+    {
+        file.write((const char*)&tile.position[3*i], 3*sizeof(float));
+        file.write((const char*)&tile.attributes[numComponents*i],
+                   numComponents*sizeof(float));
+    }
+    tile.position.clear();
+    tile.position.shrink_to_fit();
+    tile.attributes.clear();
+    tile.attributes.shrink_to_fit();
+}
+
+void writeReference(const std::string& dirName, const ScanPattern& scan, double tileSize)
+{
+    const size_t flushInterval = 1000000;
+    std::map<TilePos, ReferenceTile, TilePosLess> tiles;
+    float P[3];
+    float attrs[numComponents];
+    for (size_t i = 0; i < scan.numPoints; ++i)
+    {
+        scan.point(i, P, attrs);
+        TilePos pos((int)floor(P[0]/tileSize), (int)floor(P[1]/tileSize),
+                    (int)floor(P[2]/tileSize));
+        ReferenceTile& tile = tiles[pos];
+        tile.recentlyUsed = true;
+        tile.position.insert(tile.position.end(), P, P + 3);
+        tile.attributes.insert(tile.attributes.end(), attrs, attrs + numComponents);
+        if ((i + 1) % flushInterval == 0)
+        {
+            for (auto& it : tiles)
+            {
+                if (!it.second.recentlyUsed && !it.second.position.empty())
+                    referenceFlushToDisk(dirName, it.first, it.second);
+                it.second.recentlyUsed = false;
+            }
+        }
+    }
+    for (auto& it : tiles)
+    {
+        if (!it.second.position.empty())
+            referenceFlushToDisk(dirName, it.first, it.second);
+    }
+}
+
+
+void writeSpilled(const std::string& dirName, const ScanPattern& scan, double tileSize,
+                  double& finishSeconds)
+{
+    TileSpiller spiller(dirName, numComponents, 256*1024, 100*1024*1024, 128);
+    std::map<TilePos, bool, TilePosLess> tiles;
+    float P[3];
+    float attrs[numComponents];
+    for (size_t i = 0; i < scan.numPoints; ++i)
+    {
+        scan.point(i, P, attrs);
+        TilePos pos((int)floor(P[0]/tileSize), (int)floor(P[1]/tileSize),
+                    (int)floor(P[2]/tileSize));
+        spiller.append(pos, P, attrs, 1);
+        tiles[pos] = true;
+    }
+    spiller.flush();
+    auto start = std::chrono::steady_clock::now();
+    for (auto& it : tiles)
+    {
+        const TilePos& pos = it.first;
+        spiller.finishTile(pos, tfm::format("%s/%d_%d_%d.dat", dirName, pos.x, pos.y, pos.z));
+    }
+    finishSeconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+}
+
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    ScanPattern scan;
+    std::string dirName = (std::filesystem::temp_directory_path() /
+                           "displaz_tilespill_bench").string();
+    const double tileSizes[] = {10, 25, 50, 100, 250, 500};
+
+    tfm::printfln("%10s %8s %12s %12s %12s %12s %12s %8s",
+                  "tile_size", "tiles", "ref_s", "ref_Mpt/s",
+                  "spill_s", "finish_s", "new_Mpt/s", "speedup");
+    for (double tileSize : tileSizes)
+    {
+        std::filesystem::remove_all(dirName);
+        std::filesystem::create_directory(dirName);
+        auto start = std::chrono::steady_clock::now();
+        writeReference(dirName, scan, tileSize);
+        double refSeconds = secondsSince(start);
+        size_t numTiles = std::distance(std::filesystem::directory_iterator(dirName),
+                                        std::filesystem::directory_iterator());
+
+        std::filesystem::remove_all(dirName);
+        std::filesystem::create_directory(dirName);
+        double finishSeconds = 0;
+        start = std::chrono::steady_clock::now();
+        writeSpilled(dirName, scan, tileSize, finishSeconds);
+        double newSeconds = secondsSince(start);
+
+        tfm::printfln("%10.0f %8d %12.2f %12.1f %12.2f %12.2f %12.1f %8.2f",
+                      tileSize, numTiles, refSeconds, 1e-6*scan.numPoints/refSeconds,
+                      newSeconds - finishSeconds, finishSeconds,
+                      1e-6*scan.numPoints/newSeconds, refSeconds/newSeconds);
+    }
+    std::filesystem::remove_all(dirName);
+    return 0;
+}
@@ -0,0 +1,344 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include "tilespiller.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#   include <fcntl.h>
+#   include <io.h>
+#   include <sys/stat.h>
+#else
+#   include <fcntl.h>
+#   include <sys/uio.h>
+#   include <unistd.h>
+#endif
+
+#include "pointdb.h"
+
+
+//------------------------------------------------------------------------------
+// Low level file access.  Segments are written with POSIX writev() where
+// available, so a whole segment goes to the kernel in one call.
+namespace {
+
+struct Block
+{
+    const void* data;
+    size_t size;
+};
+
+
+int openForAppend(const std::string& fileName)
+{
+#ifdef _WIN32
+    return _open(fileName.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY,
+                 _S_IREAD | _S_IWRITE);
+#else
+    return ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+#endif
+}
+
+
+void closeFd(int fd)
+{
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+
+/// Write all blocks in order to `fd`, or return false on error
+bool writeBlocks(int fd, Block* blocks, int numBlocks)
+{
+#ifdef _WIN32
+    for (int i = 0; i < numBlocks; ++i)
+    {
+        const char* data = (const char*)blocks[i].data;
+        size_t remaining = blocks[i].size;
+        while (remaining > 0)
+        {
+            unsigned int n = (unsigned int)std::min<size_t>(remaining, 1 << 30);
+            int written = _write(fd, data, n);
+            if (written < 0)
+                return false;
+            data += written;
+            remaining -= written;
+        }
+    }
+    return true;
+#else
+    struct iovec iov[8];
+    assert(numBlocks <= 8);
+    for (int i = 0; i < numBlocks; ++i)
+    {
+        iov[i].iov_base = const_cast<void*>(blocks[i].data);
+        iov[i].iov_len = blocks[i].size;
+    }
+    struct iovec* next = iov;
+    int remaining = numBlocks;
+    while (remaining > 0)
+    {
+        ssize_t written = ::writev(fd, next, remaining);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        // Skip past fully written blocks, and into a partially written one
+        while (remaining > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            ++next;
+            --remaining;
+        }
+        if (remaining > 0)
+        {
+            next->iov_base = (char*)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    return true;
+#endif
+}
+
+}
+
+
+//------------------------------------------------------------------------------
+TileSpiller::TileSpiller(const std::string& dirName, int numComponents,
+                         size_t bufferBytes, size_t maxBufferedBytes, int maxOpenFiles)
+    : m_dirName(dirName),
+    m_numComponents(numComponents),
+    m_pointBytes((3 + numComponents)*sizeof(float)),
+    m_bufferPoints(std::max<size_t>(1, bufferBytes/m_pointBytes)),
+    m_maxBuffers(std::max<size_t>(1, maxBufferedBytes/(m_bufferPoints*m_pointBytes))),
+    m_maxOpenFiles(std::max(1, maxOpenFiles)),
+    m_prevTile(nullptr),
+    m_numBuffers(0)
+{ }
+
+
+TileSpiller::~TileSpiller()
+{
+    for (auto& it : m_tiles)
+    {
+        if (it.second.fd >= 0)
+            closeFd(it.second.fd);
+    }
+}
+
+
+void TileSpiller::append(const TilePos& pos, const float* position,
+                         const float* attributes, size_t numPoints)
+{
+    TileState& tile = findTile(pos);
+    tile.numPoints += numPoints;
+    if (numPoints >= m_bufferPoints)
+    {
+        // Large runs of points go straight to disk without a copy
+        spill(tile);
+        writeSegment(tile, position, attributes, numPoints);
+        return;
+    }
+    while (numPoints > 0)
+    {
+        if (!tile.buffer)
+            acquireBuffer(tile);
+        else if (tile.bufferLruPos != m_bufferLru.begin())
+            m_bufferLru.splice(m_bufferLru.begin(), m_bufferLru, tile.bufferLruPos);
+        WriteBuffer& buf = *tile.buffer;
+        size_t n = std::min(numPoints, m_bufferPoints - buf.numPoints);
+        std::copy(position, position + 3*n, buf.position.data() + 3*buf.numPoints);
+        std::copy(attributes, attributes + m_numComponents*n,
+                  buf.attributes.data() + m_numComponents*buf.numPoints);
+        buf.numPoints += n;
+        position += 3*n;
+        attributes += m_numComponents*n;
+        numPoints -= n;
+        if (buf.numPoints == m_bufferPoints)
+            spill(tile);
+    }
+}
+
+
+void TileSpiller::flush()
+{
+    for (auto& it : m_tiles)
+    {
+        spill(it.second);
+        closeFile(it.second);
+    }
+}
+
+
+void TileSpiller::finishTile(const TilePos& pos, const std::string& fileName)
+{
+    auto it = m_tiles.find(pos);
+    if (it == m_tiles.end())
+        throw DisplazError("No points written to tile %d", pos);
+    TileState& tile = it->second;
+    spill(tile);
+    closeFile(tile);
+    // Copy each segment's blocks into place in the position and attribute
+    // blocks of the tile
+    std::string spillName = spillFileName(pos);
+    std::ifstream in(spillName.c_str(), std::ios::binary);
+    std::ofstream out(fileName.c_str(), std::ios::binary);
+    if (!in || !out)
+        throw DisplazError("Could not write point database tile %s", fileName);
+    PointDbTileHeader(tile.numPoints, m_numComponents).write(out);
+    const uint64_t attributeOffset = PointDbTileHeader::size +
+                                     3*sizeof(float)*tile.numPoints;
+    std::vector<float> block;
+    for (uint64_t begin = 0; begin < tile.numPoints;)
+    {
+        char count[sizeof(uint64_t)];
+        in.read(count, sizeof(count));
+        uint64_t n = in ? readLE<uint64_t>(count) : 0;
+        if (n == 0 || begin + n > tile.numPoints)
+            throw DisplazError("Corrupt temporary tile file %s", spillName);
+        block.resize(3*n);
+        in.read((char*)block.data(), block.size()*sizeof(float));
+        out.seekp(PointDbTileHeader::size + 3*sizeof(float)*begin);
+        out.write((const char*)block.data(), block.size()*sizeof(float));
+        block.resize(m_numComponents*n);
+        in.read((char*)block.data(), block.size()*sizeof(float));
+        out.seekp(attributeOffset + m_numComponents*sizeof(float)*begin);
+        out.write((const char*)block.data(), block.size()*sizeof(float));
+        begin += n;
+    }
+    if (!in || !out)
+        throw DisplazError("Error writing point database tile %s", fileName);
+    in.close();
+    std::remove(spillName.c_str());
+    if (m_prevTile == &tile)
+        m_prevTile = nullptr;
+    m_tiles.erase(it);
+}
+
+
+uint64_t TileSpiller::numPoints(const TilePos& pos) const
+{
+    auto it = m_tiles.find(pos);
+    return it == m_tiles.end() ? 0 : it->second.numPoints;
+}
+
+
+std::string TileSpiller::spillFileName(const TilePos& pos) const
+{
+    return tfm::format("%s/%d_%d_%d.tmp", m_dirName, pos.x, pos.y, pos.z);
+}
+
+
+TileSpiller::TileState& TileSpiller::findTile(const TilePos& pos)
+{
+    if (m_prevTile && m_prevTile->pos == pos)
+        return *m_prevTile;
+    auto it = m_tiles.find(pos);
+    if (it == m_tiles.end())
+    {
+        TileState& tile = m_tiles[pos];
+        tile.pos = pos;
+        tile.numPoints = 0;
+        tile.fd = -1;
+        m_prevTile = &tile;
+        return tile;
+    }
+    m_prevTile = &it->second;
+    return it->second;
+}
+
+
+void TileSpiller::acquireBuffer(TileState& tile)
+{
+    if (m_freeBuffers.empty())
+    {
+        if (m_numBuffers >= m_maxBuffers && !m_bufferLru.empty())
+            spill(*m_bufferLru.back());
+        else
+        {
+            std::unique_ptr<WriteBuffer> buf(new WriteBuffer());
+            buf->position.resize(3*m_bufferPoints);
+            buf->attributes.resize(m_numComponents*m_bufferPoints);
+            m_freeBuffers.push_back(std::move(buf));
+            ++m_numBuffers;
+        }
+    }
+    tile.buffer = std::move(m_freeBuffers.back());
+    m_freeBuffers.pop_back();
+    tile.buffer->numPoints = 0;
+    tile.bufferLruPos = m_bufferLru.insert(m_bufferLru.begin(), &tile);
+}
+
+
+void TileSpiller::spill(TileState& tile)
+{
+    if (!tile.buffer)
+        return;
+    WriteBuffer& buf = *tile.buffer;
+    if (buf.numPoints > 0)
+        writeSegment(tile, buf.position.data(), buf.attributes.data(), buf.numPoints);
+    m_bufferLru.erase(tile.bufferLruPos);
+    m_freeBuffers.push_back(std::move(tile.buffer));
+}
+
+
+void TileSpiller::writeSegment(TileState& tile, const float* position,
+                               const float* attributes, size_t numPoints)
+{
+    int fd = openFile(tile);
+    char count[sizeof(uint64_t)];
+    writeLE<uint64_t>(count, numPoints);
+    Block blocks[] = {
+        {count, sizeof(count)},
+        {position, 3*sizeof(float)*numPoints},
+        {attributes, m_numComponents*sizeof(float)*numPoints}
+    };
+    if (!writeBlocks(fd, blocks, 3))
+    {
+        throw DisplazError("Could not write to temporary tile file %s: %s",
+                           spillFileName(tile.pos), strerror(errno));
+    }
+}
+
+
+int TileSpiller::openFile(TileState& tile)
+{
+    if (tile.fd >= 0)
+    {
+        if (tile.fileLruPos != m_fileLru.begin())
+            m_fileLru.splice(m_fileLru.begin(), m_fileLru, tile.fileLruPos);
+        return tile.fd;
+    }
+    if ((int)m_fileLru.size() >= m_maxOpenFiles)
+        closeFile(*m_fileLru.back());
+    std::string fileName = spillFileName(tile.pos);
+    tile.fd = openForAppend(fileName);
+    if (tile.fd < 0)
+    {
+        throw DisplazError("Could not open temporary tile file %s: %s",
+                           fileName, strerror(errno));
+    }
+    tile.fileLruPos = m_fileLru.insert(m_fileLru.begin(), &tile);
+    return tile.fd;
+}
+
+
+void TileSpiller::closeFile(TileState& tile)
+{
+    if (tile.fd < 0)
+        return;
+    closeFd(tile.fd);
+    tile.fd = -1;
+    m_fileLru.erase(tile.fileLruPos);
+}
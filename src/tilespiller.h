@@ -0,0 +1,116 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#ifndef DISPLAZ_TILESPILLER_H_INCLUDED
+#define DISPLAZ_TILESPILLER_H_INCLUDED
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "util.h"
+
+/// Buffered writer for the temporary tile files of a point database
+///
+/// Points appended to each tile are collected in a write buffer taken from a
+/// shared pool.  When a tile's buffer fills up, or the pool is exhausted and
+/// the least recently appended tile must give up its buffer, the buffered
+/// points are spilled to the end of the tile's temporary file as a segment:
+/// a point count, then a block of positions and a block of attributes,
+/// written together with one vectored write.  The most recently written
+/// tile files are kept open.
+///
+/// Once all points are in, finishTile() assembles the segments of a tile
+/// into a point database tile file (see PointDbTileHeader).
+///
+/// TileSpiller is not thread safe.
+class TileSpiller
+{
+    public:
+        /// Write temporary files into directory `dirName`, for points with
+        /// `numComponents` attribute floats each.  Each tile write buffer
+        /// holds `bufferBytes` of points, and at most `maxBufferedBytes` are
+        /// held in buffers overall.  At most `maxOpenFiles` tile files are
+        /// open at once.
+        TileSpiller(const std::string& dirName, int numComponents,
+                    size_t bufferBytes, size_t maxBufferedBytes, int maxOpenFiles);
+
+        ~TileSpiller();
+
+        /// Append points to tile at `pos`.  `position` holds 3*numPoints
+        /// floats, `attributes` numComponents*numPoints floats, point-major.
+        void append(const TilePos& pos, const float* position,
+                    const float* attributes, size_t numPoints);
+
+        /// Spill all buffered points and close all tile files
+        void flush();
+
+        /// Write all points appended to the tile at `pos` to a point
+        /// database tile file `fileName`, and remove the temporary file.
+        void finishTile(const TilePos& pos, const std::string& fileName);
+
+        /// Return number of bytes held in write buffers, including pooled
+        /// buffers which aren't in use
+        size_t bufferedBytes() const { return m_numBuffers*m_bufferPoints*m_pointBytes; }
+
+        /// Return number of points appended to the tile at `pos`
+        uint64_t numPoints(const TilePos& pos) const;
+
+        /// Return name of temporary file for tile at `pos`
+        std::string spillFileName(const TilePos& pos) const;
+
+    private:
+        struct WriteBuffer
+        {
+            std::vector<float> position;
+            std::vector<float> attributes;
+            size_t numPoints;
+        };
+
+        struct TileState
+        {
+            TilePos pos;
+            uint64_t numPoints;   ///< Points appended, spilled or not
+            std::unique_ptr<WriteBuffer> buffer;
+            std::list<TileState*>::iterator bufferLruPos;
+            int fd;               ///< Open file descriptor, or -1
+            std::list<TileState*>::iterator fileLruPos;
+        };
+
+        TileState& findTile(const TilePos& pos);
+
+        /// Give `tile` a write buffer, spilling another tile if necessary
+        void acquireBuffer(TileState& tile);
+
+        /// Spill buffered points of `tile` and return its buffer to the pool
+        void spill(TileState& tile);
+
+        void writeSegment(TileState& tile, const float* position,
+                          const float* attributes, size_t numPoints);
+
+        int openFile(TileState& tile);
+
+        void closeFile(TileState& tile);
+
+        std::string m_dirName;
+        int m_numComponents;
+        size_t m_pointBytes;
+        size_t m_bufferPoints;
+        size_t m_maxBuffers;
+        int m_maxOpenFiles;
+        std::unordered_map<TilePos, TileState, TilePosHash> m_tiles;
+        TileState* m_prevTile;
+        /// Pool of free buffers, and number allocated in total
+        std::vector<std::unique_ptr<WriteBuffer>> m_freeBuffers;
+        size_t m_numBuffers;
+        /// Tiles holding a buffer, most recently appended first
+        std::list<TileState*> m_bufferLru;
+        /// Tiles with an open file, most recently written first
+        std::list<TileState*> m_fileLru;
+};
+
+
+#endif // DISPLAZ_TILESPILLER_H_INCLUDED
@@ -0,0 +1,92 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <vector>
+
+#include "pointdb.h"
+#include "tilespiller.h"
+
+
+TEST_CASE("Tile spiller keeps points in order per tile")
+{
+    std::string dirName = "tilespiller_test.pointdb";
+    std::filesystem::remove_all(dirName);
+    std::filesystem::create_directory(dirName);
+    const int numComponents = 2;
+    const size_t pointBytes = (3 + numComponents)*sizeof(float);
+    std::map<TilePos, std::vector<float>, TilePosLess> expected;
+    {
+        // Buffers of four points, only three buffers and two open files, so
+        // that buffers are stolen and files closed and reopened often.
+        TileSpiller spiller(dirName, numComponents, 4*pointBytes, 3*4*pointBytes, 2);
+        float value = 0;
+        for (int i = 0; i < 500; ++i)
+        {
+            TilePos pos(i % 5, (i / 7) % 2, 0);
+            // Mostly single points, with occasional runs larger than a buffer
+            size_t numPoints = (i % 37 == 0) ? 9 : 1;
+            std::vector<float> position;
+            std::vector<float> attributes;
+            for (size_t j = 0; j < numPoints; ++j)
+            {
+                for (int c = 0; c < 3; ++c)
+                    position.push_back(value++);
+                for (int c = 0; c < numComponents; ++c)
+                    attributes.push_back(-(value++));
+            }
+            std::vector<float>& exp = expected[pos];
+            for (size_t j = 0; j < numPoints; ++j)
+            {
+                exp.insert(exp.end(), &position[3*j], &position[3*j] + 3);
+                exp.insert(exp.end(), &attributes[numComponents*j],
+                           &attributes[numComponents*j] + numComponents);
+            }
+            spiller.append(pos, position.data(), attributes.data(), numPoints);
+            CHECK(spiller.bufferedBytes() <= 3*4*pointBytes);
+        }
+        spiller.flush();
+        for (auto& it : expected)
+        {
+            const TilePos& pos = it.first;
+            CHECK(spiller.numPoints(pos) == it.second.size()/(3 + numComponents));
+            spiller.finishTile(pos, tfm::format("%s/%d_%d_%d.dat", dirName,
+                                                pos.x, pos.y, pos.z));
+            CHECK(!std::filesystem::exists(spiller.spillFileName(pos)));
+        }
+    }
+
+    for (auto& it : expected)
+    {
+        const TilePos& pos = it.first;
+        const std::vector<float>& exp = it.second;
+        size_t numPoints = exp.size()/(3 + numComponents);
+        std::ifstream tileFile(tfm::format("%s/%d_%d_%d.dat", dirName, pos.x, pos.y, pos.z),
+                               std::ios::binary);
+        PointDbTileHeader header;
+        REQUIRE(header.read(tileFile));
+        REQUIRE(header.numPoints == numPoints);
+        CHECK(header.numComponents == (uint32_t)numComponents);
+        std::vector<float> position(3*numPoints);
+        std::vector<float> attributes(numComponents*numPoints);
+        tileFile.read((char*)position.data(), position.size()*sizeof(float));
+        tileFile.read((char*)attributes.data(), attributes.size()*sizeof(float));
+        REQUIRE(tileFile);
+        bool match = true;
+        for (size_t i = 0; i < numPoints; ++i)
+        {
+            const float* e = &exp[(3 + numComponents)*i];
+            for (int c = 0; c < 3; ++c)
+                match = match && position[3*i + c] == e[c];
+            for (int c = 0; c < numComponents; ++c)
+                match = match && attributes[numComponents*i + c] == e[3 + c];
+        }
+        CHECK(match);
+    }
+
+    std::filesystem::remove_all(dirName);
+}
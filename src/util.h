@@ -9,6 +9,7 @@
 #include <iostream>
 #include <memory>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 #ifdef __clang__
@@ -195,6 +196,15 @@ struct TilePosLess
     }
 };
 
+/// Tile position hash for use with std::unordered_map
+struct TilePosHash
+{
+    inline size_t operator()(const TilePos& p) const
+    {
+        return (size_t)p.x*73856093 ^ (size_t)p.y*19349663 ^ (size_t)p.z*83492791;
+    }
+};
+
 
 //------------------------------------------------------------------------------
 // Resource Acquisition Is Initialization (RAII) utility for FILE pointer
@@ -236,6 +246,27 @@ T readLE(std::istream& in)
     return val;
 }
 
+/// Write integer to memory at `buf` in little endian byte order, whatever
+/// the byte order of the host
+template<typename T>
+void writeLE(char* buf, T val)
+{
+    static_assert(std::is_integral<T>::value, "writeLE to memory requires an integer");
+    for (size_t i = 0; i < sizeof(T); ++i)
+        buf[i] = char(uint64_t(val) >> (8*i));
+}
+
+/// Read integer from memory at `buf` in little endian byte order
+template<typename T>
+T readLE(const char* buf)
+{
+    static_assert(std::is_integral<T>::value, "readLE from memory requires an integer");
+    uint64_t val = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        val |= uint64_t(uint8_t(buf[i])) << (8*i);
+    return T(val);
+}
+
 
 //------------------------------------------------------------------------------
 // System utils
@@ -0,0 +1,399 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+// Benchmark for VoxelBrick voxelization and mipmapping over synthetic
+// leaves, compared to the original implementation using dense bricks,
+// per-brick allocations and scalar z-buffer rendering.
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "voxelizer.h"
+
+#include "tinyformat.h"
+
+namespace {
+
+/// Original orthoZRender(), writing point indices into the raster
+void orthoZRenderReference(size_t* indexImage, float* zbuf, int bufWidth,
+                           float xoff, float yoff, float pixelSize,
+                           const float* position,
+                           float radius, const size_t* pointIndices, int npoints)
+{
+    for (int i = 0; i < bufWidth*bufWidth; ++i)
+        zbuf[i] = -FLT_MAX;
+    float invPixelSize = 1/pixelSize;
+    float rPix = radius/pixelSize;
+    for (int pidxIdx = 0; pidxIdx < npoints; ++pidxIdx)
+    {
+        size_t pidx = pointIndices[pidxIdx];
+        float x = invPixelSize*(position[3*pidx] - xoff);
+        float y = invPixelSize*(position[3*pidx+1] - yoff);
+        float z = position[3*pidx+2];
+        int x0 = (int)floor(x - rPix + 0.5);
+        int y0 = (int)floor(y - rPix + 0.5);
+        int x1 = (int)floor(x + rPix + 0.5);
+        int y1 = (int)floor(y + rPix + 0.5);
+        x0 = std::max(0, std::min(bufWidth, x0));
+        y0 = std::max(0, std::min(bufWidth, y0));
+        x1 = std::max(0, std::min(bufWidth, x1));
+        y1 = std::max(0, std::min(bufWidth, y1));
+        for (int yi = y0; yi < y1; ++yi)
+        for (int xi = x0; xi < x1; ++xi)
+        {
+            int i = xi + yi*bufWidth;
+            if (z > zbuf[i])
+            {
+                zbuf[i] = z;
+                indexImage[i] = pidx;
+            }
+        }
+    }
+}
+
+
+/// Original VoxelBrick::combineAttributes(), for non-categorical components
+void combineAttributesReference(float* result, const float* const* samples,
+                                const float* weights, int nsamp,
+                                int numComponents)
+{
+    float weightSum = 0;
+    for (int s = 0; s < nsamp; ++s)
+        weightSum += weights[s];
+    float invWeightSum = 1/weightSum;
+    for (int c = 0; c < numComponents; ++c)
+    {
+        float sum = 0;
+        for (int s = 0; s < nsamp; ++s)
+            sum += weights[s]*samples[s][c];
+        result[c] = invWeightSum*sum;
+    }
+}
+
+
+/// Original dense voxel brick, with a single non-categorical attribute
+struct DenseBrick
+{
+    int brickRes;
+    std::vector<float> attribute;
+    std::vector<float> coverage;
+    std::vector<V3f> position;
+
+    DenseBrick(int brickRes)
+        : brickRes(brickRes),
+        attribute(brickRes*brickRes*brickRes, 0),
+        coverage(brickRes*brickRes*brickRes, 0),
+        position(brickRes*brickRes*brickRes, V3f(0))
+    { }
+
+    int idx(int x, int y, int z) const { return x + brickRes*(y + brickRes*z); }
+
+    size_t sizeBytes() const
+    {
+        return (attribute.size() + coverage.size())*sizeof(float) +
+               position.size()*sizeof(V3f);
+    }
+};
+
+
+/// Original VoxelBrick::voxelizePoints()
+void voxelizePointsReference(DenseBrick& brick, const V3f& lowerCorner,
+                             float brickWidth, float pointRadius,
+                             const float* position, const float* attributes,
+                             const size_t* pointIndices, int npoints)
+{
+    int brickRes = brick.brickRes;
+    float invVoxelWidth = brickRes/brickWidth;
+    std::vector<std::vector<size_t>> layerInds(brickRes);
+    for (int i = 0; i < npoints; ++i)
+    {
+        float pz = position[3*pointIndices[i] + 2];
+        int layer = Imath::clamp((int)floor(invVoxelWidth*(pz - lowerCorner.z)),
+                                 0, brickRes-1);
+        layerInds[layer].push_back(pointIndices[i]);
+    }
+    const int pixPerVoxel = 4;
+    const int rasterWidth = brickRes*pixPerVoxel;
+    const int npix = rasterWidth*rasterWidth;
+    std::vector<size_t> raster(npix);
+    std::vector<float> zbuf(npix);
+    const float* sampAttrs[pixPerVoxel*pixPerVoxel];
+    float sampWeights[pixPerVoxel*pixPerVoxel];
+    std::fill(sampWeights, sampWeights + pixPerVoxel*pixPerVoxel, 1.0f);
+    float pixelSize = brickWidth/rasterWidth;
+    for (int z = 0; z < brickRes; ++z)
+    {
+        orthoZRenderReference(raster.data(), zbuf.data(), rasterWidth,
+                              lowerCorner.x, lowerCorner.y, pixelSize,
+                              position, pointRadius,
+                              layerInds[z].data(), (int)layerInds[z].size());
+        for (int y = 0; y < brickRes; ++y)
+        for (int x = 0; x < brickRes; ++x)
+        {
+            int sampCount = 0;
+            float zsum = 0;
+            float xsum = 0;
+            float ysum = 0;
+            for (int j = 0; j < pixPerVoxel; ++j)
+            for (int i = 0; i < pixPerVoxel; ++i)
+            {
+                int idx = x*pixPerVoxel + i + (y*pixPerVoxel + j)*rasterWidth;
+                if (zbuf[idx] != -FLT_MAX)
+                {
+                    sampAttrs[sampCount] = attributes + raster[idx];
+                    zsum += zbuf[idx];
+                    xsum += pixelSize*(x*pixPerVoxel + i + 0.5f);
+                    ysum += pixelSize*(y*pixPerVoxel + j + 0.5f);
+                    sampCount += 1;
+                }
+            }
+            int v = brick.idx(x,y,z);
+            if (sampCount != 0)
+            {
+                combineAttributesReference(&brick.attribute[v], sampAttrs,
+                                           sampWeights, sampCount, 1);
+                brick.position[v] = V3f(xsum/sampCount + lowerCorner.x,
+                                        ysum/sampCount + lowerCorner.y,
+                                        zsum/sampCount);
+            }
+            brick.coverage[v] = (float)sampCount / (pixPerVoxel*pixPerVoxel);
+        }
+    }
+}
+
+
+/// Original VoxelBrick::renderFromBricks()
+void renderFromBricksReference(DenseBrick& brick, const DenseBrick* children[8])
+{
+    int brickRes = brick.brickRes;
+    const int M = brickRes/2;
+    for (int childIdx = 0; childIdx < 8; ++childIdx)
+    {
+        const DenseBrick* child = children[childIdx];
+        if (!child)
+            continue;
+        Imath::V3i childPos = zOrderToVec3(childIdx);
+        for (int z = 0; z < brickRes; z+=2)
+        for (int y = 0; y < brickRes; y+=2)
+        for (int x = 0; x < brickRes; x+=2)
+        {
+            const float* sampAttrs[8];
+            float sampWeights[8];
+            int sampCount = 0;
+            V3f posSum = V3f(0);
+            float coverageSum = 0;
+            for (int j = 0; j < 2; ++j)
+            for (int i = 0; i < 2; ++i)
+            {
+                int v0 = child->idx(x+i, y+j, z);
+                int v1 = child->idx(x+i, y+j, z+1);
+                float c1 = child->coverage[v1];
+                float c0 = std::min(1-c1, child->coverage[v0]);
+                if (c0 > 0)
+                {
+                    sampAttrs[sampCount] = &child->attribute[v0];
+                    sampWeights[sampCount++] = c0;
+                }
+                if (c1 > 0)
+                {
+                    sampAttrs[sampCount] = &child->attribute[v1];
+                    sampWeights[sampCount++] = c1;
+                }
+                posSum += c0*child->position[v0] + c1*child->position[v1];
+                coverageSum += c0 + c1;
+            }
+            if (coverageSum != 0)
+            {
+                int v = brick.idx(x/2 + M*childPos.x, y/2 + M*childPos.y,
+                                  z/2 + M*childPos.z);
+                combineAttributesReference(&brick.attribute[v], sampAttrs,
+                                           sampWeights, sampCount, 1);
+                brick.position[v] = (1.0f/coverageSum)*posSum;
+                brick.coverage[v] = coverageSum/4;
+            }
+        }
+    }
+}
+
+
+/// Synthetic leaf: a gently sloping ground surface with a few steps, as
+/// typical of aerial lidar, including points buffered by the point radius.
+struct SyntheticLeaf
+{
+    V3f lowerCorner;
+    std::vector<size_t> inds;
+};
+
+
+/// Return largest difference between voxels of a dense and sparse brick
+float maxDifference(const DenseBrick& a, const VoxelBrick& b)
+{
+    float diff = 0;
+    int numOccupied = 0;
+    int N = a.brickRes;
+    for (int z = 0; z < N; ++z)
+    for (int y = 0; y < N; ++y)
+    for (int x = 0; x < N; ++x)
+    {
+        int i = a.idx(x,y,z);
+        int j = b.find(x,y,z);
+        if (j < 0)
+        {
+            diff = std::max(diff, a.coverage[i]);
+            continue;
+        }
+        ++numOccupied;
+        diff = std::max(diff, std::abs(a.coverage[i] - b.coverage(j)));
+        V3f dp = a.position[i] - b.position(j);
+        diff = std::max(diff, std::max(std::abs(dp.x),
+                              std::max(std::abs(dp.y), std::abs(dp.z))));
+        diff = std::max(diff, std::abs(a.attribute[i] - b.attributes(j)[0]));
+    }
+    if (numOccupied != b.numOccupied())
+        return FLT_MAX;
+    return diff;
+}
+
+
+/// Accumulated timings for reference and new implementations
+struct Timing
+{
+    double ref = 0;
+    double fast = 0;
+    float maxDiff = 0;
+
+    template<typename RefFunc, typename NewFunc>
+    void run(RefFunc refFunc, NewFunc newFunc)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        refFunc();
+        auto t1 = std::chrono::steady_clock::now();
+        newFunc();
+        auto t2 = std::chrono::steady_clock::now();
+        ref += std::chrono::duration<double, std::micro>(t1 - t0).count();
+        fast += std::chrono::duration<double, std::micro>(t2 - t1).count();
+    }
+};
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    const float leafWidth = 2.5f;
+    const float pointRadius = 0.2f;
+    const int numLeaves = 200;
+    const int pointsPerLeaf = 2000;
+    const int brickResolutions[] = {8, 16};
+
+    std::vector<HCloudAttribute> attributes;
+    attributes.push_back(HCloudAttribute("intensity", TypeSpec::float32()));
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::vector<float> position;
+    std::vector<float> intensity;
+    std::vector<SyntheticLeaf> leaves(numLeaves);
+    for (int l = 0; l < numLeaves; ++l)
+    {
+        SyntheticLeaf& leaf = leaves[l];
+        leaf.lowerCorner = V3f(leafWidth*(l % 16), leafWidth*(l / 16), 0);
+        float slope = 0.3f*uniform(rng);
+        float height = 0.5f*uniform(rng);
+        for (int i = 0; i < pointsPerLeaf; ++i)
+        {
+            float x = (leafWidth + 2*pointRadius)*uniform(rng) - pointRadius;
+            float y = (leafWidth + 2*pointRadius)*uniform(rng) - pointRadius;
+            float z = height + slope*x + 0.05f*uniform(rng);
+            if (x > 0.5f*leafWidth && y > 0.5f*leafWidth)
+                z += 1.0f;
+            leaf.inds.push_back(position.size()/3);
+            position.push_back(leaf.lowerCorner.x + x);
+            position.push_back(leaf.lowerCorner.y + y);
+            position.push_back(leaf.lowerCorner.z + z);
+            intensity.push_back(1000*uniform(rng));
+        }
+    }
+
+    tfm::printfln("%10s %8s %14s %14s %8s %14s %14s %8s %10s %10s %10s",
+                  "brick_res", "occupied",
+                  "ref_vox_us", "new_vox_us", "speedup",
+                  "ref_mip_us", "new_mip_us", "speedup",
+                  "ref_bytes", "new_bytes", "max_diff");
+    for (int brickRes : brickResolutions)
+    {
+        const int repeats = brickRes <= 8 ? 20 : 5;
+        Timing voxelize;
+        Timing mipmap;
+        size_t refBytes = 0;
+        size_t newBytes = 0;
+        size_t numOccupied = 0;
+        for (int r = 0; r < repeats; ++r)
+        {
+            // Leaves are downsampled in groups of eight, as in the octree
+            // builder
+            for (int l = 0; l + 8 <= numLeaves; l += 8)
+            {
+                std::vector<DenseBrick> refBricks(8, DenseBrick(brickRes));
+                std::vector<std::unique_ptr<VoxelBrick>> newBricks;
+                const DenseBrick* refChildren[8];
+                VoxelBrick* newChildren[8];
+                for (int c = 0; c < 8; ++c)
+                {
+                    const SyntheticLeaf& leaf = leaves[l + c];
+                    newBricks.emplace_back(new VoxelBrick(brickRes, attributes));
+                    voxelize.run(
+                        [&]() {
+                            voxelizePointsReference(refBricks[c], leaf.lowerCorner,
+                                leafWidth, pointRadius, position.data(),
+                                intensity.data(), leaf.inds.data(), (int)leaf.inds.size());
+                        },
+                        [&]() {
+                            newBricks[c]->voxelizePoints(leaf.lowerCorner, leafWidth,
+                                pointRadius, position.data(), intensity.data(),
+                                leaf.inds.data(), (int)leaf.inds.size());
+                        });
+                    voxelize.maxDiff = std::max(voxelize.maxDiff,
+                        maxDifference(refBricks[c], *newBricks[c]));
+                    refBytes += refBricks[c].sizeBytes();
+                    newBytes += newBricks[c]->sizeBytes();
+                    numOccupied += newBricks[c]->numOccupied();
+                    refChildren[c] = &refBricks[c];
+                    newChildren[c] = newBricks[c].get();
+                }
+                // Include allocation of the parent, as done by the builder
+                std::unique_ptr<DenseBrick> refParent;
+                std::unique_ptr<VoxelBrick> newParent;
+                mipmap.run(
+                    [&]() {
+                        refParent.reset(new DenseBrick(brickRes));
+                        renderFromBricksReference(*refParent, refChildren);
+                    },
+                    [&]() {
+                        newParent.reset(new VoxelBrick(brickRes, attributes));
+                        newParent->renderFromBricks(newChildren);
+                    });
+                mipmap.maxDiff = std::max(mipmap.maxDiff,
+                                          maxDifference(*refParent, *newParent));
+            }
+        }
+        int numBricks = repeats*(numLeaves/8)*8;
+        int numParents = repeats*(numLeaves/8);
+        float maxDiff = std::max(voxelize.maxDiff, mipmap.maxDiff);
+        tfm::printfln("%10d %7.1f%% %14.2f %14.2f %8.2f %14.2f %14.2f %8.2f %10d %10d %10.3g",
+                      brickRes, 100.0*numOccupied/(numBricks*brickRes*brickRes*brickRes),
+                      voxelize.ref/numBricks, voxelize.fast/numBricks,
+                      voxelize.ref/voxelize.fast,
+                      mipmap.ref/numParents, mipmap.fast/numParents,
+                      mipmap.ref/mipmap.fast,
+                      refBytes/numBricks, newBytes/numBricks, maxDiff);
+        if (maxDiff > 1e-3f)
+        {
+            tfm::printfln("Voxelized bricks differ from reference implementation");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -3,31 +3,261 @@
 
 #include "voxelizer.h"
 
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "hcloud.h"
 #include "logger.h"
 #include "octreebuilder.h"
+#include "OrderedWorkQueue.h"
 #include "pointdb.h"
 
+void VoxelBrick::combineAttributes(float* result, const float* const* samples,
+                                   const float* weights, int nsamp) const
+{
+    float weightSum = 0;
+    for (int s = 0; s < nsamp; ++s)
+        weightSum += weights[s];
+    float invWeightSum = 1/weightSum;
+    for (int c = 0; c < m_numComponents; ++c)
+    {
+        if (m_categorical[c])
+        {
+            // Majority vote: choose the label with largest total weight.
+            // Sample counts are small, so the quadratic search is fine.
+            float bestWeight = -1;
+            for (int s = 0; s < nsamp; ++s)
+            {
+                float label = samples[s][c];
+                float w = 0;
+                for (int t = 0; t < nsamp; ++t)
+                {
+                    if (samples[t][c] == label)
+                        w += weights[t];
+                }
+                if (w > bestWeight)
+                {
+                    bestWeight = w;
+                    result[c] = label;
+                }
+            }
+        }
+        else
+        {
+            float sum = 0;
+            for (int s = 0; s < nsamp; ++s)
+                sum += weights[s]*samples[s][c];
+            result[c] = invWeightSum*sum;
+        }
+    }
+}
+
+
+namespace {
+
+/// Scratch buffers for voxelizePoints(), reused between bricks
+struct VoxelizeScratch
+{
+    std::vector<int> pointLayer;
+    std::vector<int> layerStart;
+    std::vector<int> layerFill;
+    std::vector<size_t> layerInds;
+    std::vector<uint32_t> raster;
+    std::vector<float> zbuf;
+    // Occupied voxels in layer order, before sorting into Morton order
+    std::vector<uint32_t> voxelMortonIndex;
+    std::vector<float> voxelCoverage;
+    std::vector<V3f> voxelPosition;
+    std::vector<float> voxelAttributes;
+    std::vector<int> voxelOrder;
+};
+
+
+#ifdef __SSE2__
+inline float horizontalSum(__m128 v)
+{
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2,3,0,1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+#endif
+
+
+/// Sums over the rendered pixels covering one voxel
+struct VoxelSamples
+{
+    int count = 0;
+    float xsum = 0;  ///< Pixel centre offsets from voxel corner, in pixels
+    float ysum = 0;
+    float zsum = 0;
+    int pixels[16];  ///< Raster index of each covered pixel
+};
+
+
+/// Accumulate the 4x4 block of pixels at `pix0` covering a voxel
+inline void reduceVoxel(VoxelSamples& samps, const float* zbuf, int pix0,
+                        int rasterWidth)
+{
+#ifdef __SSE2__
+    const __m128 empty = _mm_set1_ps(-FLT_MAX);
+    const __m128 pixelCentres = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    __m128 xsum = _mm_setzero_ps();
+    __m128 zsum = _mm_setzero_ps();
+    for (int j = 0; j < 4; ++j)
+    {
+        int rowStart = pix0 + j*rasterWidth;
+        __m128 z = _mm_loadu_ps(zbuf + rowStart);
+        __m128 covered = _mm_cmpneq_ps(z, empty);
+        int mask = _mm_movemask_ps(covered);
+        if (mask == 0)
+            continue;
+        zsum = _mm_add_ps(zsum, _mm_and_ps(covered, z));
+        xsum = _mm_add_ps(xsum, _mm_and_ps(covered, pixelCentres));
+        int rowCount = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            if (mask & (1 << i))
+            {
+                samps.pixels[samps.count + rowCount] = rowStart + i;
+                ++rowCount;
+            }
+        }
+        samps.count += rowCount;
+        samps.ysum += rowCount*(j + 0.5f);
+    }
+    samps.xsum = horizontalSum(xsum);
+    samps.zsum = horizontalSum(zsum);
+#else
+    for (int j = 0; j < 4; ++j)
+    for (int i = 0; i < 4; ++i)
+    {
+        int idx = pix0 + i + j*rasterWidth;
+        if (zbuf[idx] != -FLT_MAX)
+        {
+            samps.pixels[samps.count++] = idx;
+            samps.xsum += i + 0.5f;
+            samps.ysum += j + 0.5f;
+            samps.zsum += zbuf[idx];
+        }
+    }
+#endif
+}
+
+}
+
+
+void orthoZRender(uint32_t* indexImage, float* zbuf, int bufWidth,
+                  float xoff, float yoff, float pixelSize,
+                  const float* position,
+                  float radius, const size_t* pointIndices, int npoints)
+{
+    assert(bufWidth % 4 == 0);
+    std::fill(zbuf, zbuf + bufWidth*bufWidth, -FLT_MAX);
+    float invPixelSize = 1/pixelSize;
+    float rPix = radius/pixelSize;
+#ifdef __SSE2__
+    const __m128i laneOffsets = _mm_setr_epi32(0, 1, 2, 3);
+#endif
+    for (int pidxIdx = 0; pidxIdx < npoints; ++pidxIdx)
+    {
+        size_t pidx = pointIndices[pidxIdx];
+        float x = invPixelSize*(position[3*pidx] - xoff);
+        float y = invPixelSize*(position[3*pidx+1] - yoff);
+        float z = position[3*pidx+2];
+        int x0 = (int)floor(x - rPix + 0.5);
+        int y0 = (int)floor(y - rPix + 0.5);
+        int x1 = (int)floor(x + rPix + 0.5);
+        int y1 = (int)floor(y + rPix + 0.5);
+        x0 = std::max(0, std::min(bufWidth, x0));
+        y0 = std::max(0, std::min(bufWidth, y0));
+        x1 = std::max(0, std::min(bufWidth, x1));
+        y1 = std::max(0, std::min(bufWidth, y1));
+#ifdef __SSE2__
+        // Depth test four pixels at a time over aligned groups of the
+        // raster row, masking off lanes outside the [x0,x1) span.
+        __m128 zv = _mm_set1_ps(z);
+        __m128i iv = _mm_set1_epi32((int)pidxIdx);
+        __m128i spanBegin = _mm_set1_epi32(x0 - 1);
+        __m128i spanEnd = _mm_set1_epi32(x1);
+        for (int yi = y0; yi < y1; ++yi)
+        {
+            float* zrow = zbuf + yi*bufWidth;
+            uint32_t* irow = indexImage + yi*bufWidth;
+            for (int xi = x0 & ~3; xi < x1; xi += 4)
+            {
+                __m128i lanes = _mm_add_epi32(_mm_set1_epi32(xi), laneOffsets);
+                __m128i inSpan = _mm_and_si128(_mm_cmpgt_epi32(lanes, spanBegin),
+                                               _mm_cmplt_epi32(lanes, spanEnd));
+                __m128 zold = _mm_loadu_ps(zrow + xi);
+                __m128 write = _mm_and_ps(_mm_cmpgt_ps(zv, zold),
+                                          _mm_castsi128_ps(inSpan));
+                _mm_storeu_ps(zrow + xi, _mm_or_ps(_mm_and_ps(write, zv),
+                                                   _mm_andnot_ps(write, zold)));
+                __m128i writei = _mm_castps_si128(write);
+                __m128i iold = _mm_loadu_si128((const __m128i*)(irow + xi));
+                _mm_storeu_si128((__m128i*)(irow + xi),
+                                 _mm_or_si128(_mm_and_si128(writei, iv),
+                                              _mm_andnot_si128(writei, iold)));
+            }
+        }
+#else
+        for (int yi = y0; yi < y1; ++yi)
+        for (int xi = x0; xi < x1; ++xi)
+        {
+            int i = xi + yi*bufWidth;
+            if (z > zbuf[i])
+            {
+                zbuf[i] = z;
+                indexImage[i] = (uint32_t)pidxIdx;
+            }
+        }
+#endif
+    }
+}
+
+
 void VoxelBrick::voxelizePoints(const V3f& lowerCorner, float brickWidth,
                                 float pointRadius,
-                                const float* position, const float* intensity,
+                                const float* position, const float* attributes,
                                 const size_t* pointIndices, int npoints)
 {
+    static thread_local VoxelizeScratch scratch;
     float invVoxelWidth = m_brickRes/brickWidth;
-    // Sort points into brick voxel layers according to their position
-    std::vector<std::vector<size_t>> layerInds(m_brickRes);
+    // Sort points into brick voxel layers according to their position,
+    // using a counting sort which preserves the input order within a layer.
+    std::vector<int>& pointLayer = scratch.pointLayer;
+    std::vector<int>& layerStart = scratch.layerStart;
+    std::vector<size_t>& layerInds = scratch.layerInds;
+    pointLayer.resize(npoints);
+    layerStart.assign(m_brickRes + 1, 0);
     for (int i = 0; i < npoints; ++i)
     {
         float pz = position[3*pointIndices[i] + 2];
         int layer = Imath::clamp((int)floor(invVoxelWidth*(pz - lowerCorner.z)),
                                  0, m_brickRes-1);
-        layerInds[layer].push_back(pointIndices[i]);
+        pointLayer[i] = layer;
+        ++layerStart[layer + 1];
     }
-    const int pixPerVoxel = 4;  // TODO: Make settable
+    for (int z = 0; z < m_brickRes; ++z)
+        layerStart[z + 1] += layerStart[z];
+    scratch.layerFill.assign(layerStart.begin(), layerStart.end() - 1);
+    layerInds.resize(npoints);
+    for (int i = 0; i < npoints; ++i)
+        layerInds[scratch.layerFill[pointLayer[i]]++] = pointIndices[i];
+
+    const int pixPerVoxel = 4;  // Fixed by the SIMD width in reduceVoxel()
     const int rasterWidth = m_brickRes*pixPerVoxel;
     const int npix = rasterWidth*rasterWidth;
-    std::vector<float> raster(npix);
-    std::vector<float> zbuf(npix);
+    scratch.raster.resize(npix);
+    scratch.zbuf.resize(npix);
+    const uint32_t* raster = scratch.raster.data();
+    const float* zbuf = scratch.zbuf.data();
+    const float* sampAttrs[pixPerVoxel*pixPerVoxel];
+    float sampWeights[pixPerVoxel*pixPerVoxel];
+    std::fill(sampWeights, sampWeights + pixPerVoxel*pixPerVoxel, 1.0f);
     // For each layer, render raw points using orthographic projection from
     // +z direction at a higher resolution; average that to get voxel
     // values for voxels in the layer.
@@ -36,84 +266,138 @@ void VoxelBrick::voxelizePoints(const V3f& lowerCorner, float brickWidth,
     // other angles.  This is probably only useful for appreciable vertical
     // structure - need some nicely scanned cliffs or some such to test.
     float pixelSize = brickWidth/rasterWidth;
-    int coveredCount = 0;
+    scratch.voxelMortonIndex.clear();
+    scratch.voxelCoverage.clear();
+    scratch.voxelPosition.clear();
+    scratch.voxelAttributes.clear();
     for (int z = 0; z < m_brickRes; ++z)
     {
-        orthoZRender(raster.data(), zbuf.data(), rasterWidth,
+        const size_t* inds = layerInds.data() + layerStart[z];
+        int nlayer = layerStart[z + 1] - layerStart[z];
+        if (nlayer == 0)
+            continue;
+        orthoZRender(scratch.raster.data(), scratch.zbuf.data(), rasterWidth,
                      lowerCorner.x, lowerCorner.y, pixelSize,
-                     position, intensity, pointRadius,
-                     layerInds[z].data(), (int)layerInds[z].size());
+                     position, pointRadius, inds, nlayer);
         for (int y = 0; y < m_brickRes; ++y)
         for (int x = 0; x < m_brickRes; ++x)
         {
-            // Average rendered color over the voxel surface, and insert
+            // Average rendered attributes over the voxel surface, and insert
             // into brick along with coverage
-            int sampCount = 0;
-            float colSum = 0;
-            float zsum = 0;
-            float xsum = 0;
-            float ysum = 0;
-            for (int j = 0; j < pixPerVoxel; ++j)
-            for (int i = 0; i < pixPerVoxel; ++i)
-            {
-                int idx = x*pixPerVoxel + i + (y*pixPerVoxel + j)*rasterWidth;
-                if (zbuf[idx] != -FLT_MAX)
-                {
-                    colSum += raster[idx];
-                    zsum += zbuf[idx];
-                    xsum += pixelSize*(x*pixPerVoxel + i + 0.5f);
-                    ysum += pixelSize*(y*pixPerVoxel + j + 0.5f);
-                    sampCount += 1;
-                }
-            }
-            if (sampCount != 0)
+            VoxelSamples samps;
+            reduceVoxel(samps, zbuf, (y*rasterWidth + x)*pixPerVoxel, rasterWidth);
+            if (samps.count == 0)
+                continue;
+            for (int s = 0; s < samps.count; ++s)
             {
-                this->color(x,y,z) = colSum/sampCount;
-                this->position(x,y,z) = V3f(xsum/sampCount + lowerCorner.x,
-                                            ysum/sampCount + lowerCorner.y,
-                                            zsum/sampCount);
-                ++coveredCount;
+                sampAttrs[s] = attributes +
+                               m_numComponents*inds[raster[samps.pixels[s]]];
             }
-            this->coverage(x,y,z) = (float)sampCount / (pixPerVoxel*pixPerVoxel);
+            size_t attrOffset = scratch.voxelAttributes.size();
+            scratch.voxelAttributes.resize(attrOffset + m_numComponents);
+            combineAttributes(&scratch.voxelAttributes[attrOffset], sampAttrs,
+                              sampWeights, samps.count);
+            float invCount = 1.0f/samps.count;
+            scratch.voxelPosition.push_back(V3f(
+                pixelSize*(x*pixPerVoxel + samps.xsum*invCount) + lowerCorner.x,
+                pixelSize*(y*pixPerVoxel + samps.ysum*invCount) + lowerCorner.y,
+                samps.zsum*invCount));
+            scratch.voxelCoverage.push_back((float)samps.count / (pixPerVoxel*pixPerVoxel));
+            scratch.voxelMortonIndex.push_back(vec3ToZOrder(x, y, z));
         }
     }
+    // Copy into the brick in Morton order
+    int numOccupied = (int)scratch.voxelMortonIndex.size();
+    std::vector<int>& order = scratch.voxelOrder;
+    order.resize(numOccupied);
+    for (int i = 0; i < numOccupied; ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return scratch.voxelMortonIndex[a] < scratch.voxelMortonIndex[b];
+    });
+    m_mortonIndex.clear();
+    m_mipCoverage.clear();
+    m_mipPosition.clear();
+    m_mipAttributes.clear();
+    m_mortonIndex.reserve(numOccupied);
+    m_mipCoverage.reserve(numOccupied);
+    m_mipPosition.reserve(3*numOccupied);
+    m_mipAttributes.reserve(m_numComponents*numOccupied);
+    for (int i : order)
+    {
+        float* attrs = appendVoxel(scratch.voxelMortonIndex[i],
+                                   scratch.voxelCoverage[i],
+                                   scratch.voxelPosition[i]);
+        std::copy_n(&scratch.voxelAttributes[m_numComponents*i], m_numComponents, attrs);
+    }
 }
 
 
 void VoxelBrick::renderFromBricks(VoxelBrick* children[8])
 {
-    // Create internal node brick by downsampling child node bricks
-    const int M = m_brickRes/2;
+    // Create internal node brick by downsampling child node bricks.  The
+    // child voxels which downsample into a single parent voxel share the
+    // Morton index prefix `childMortonIndex >> 3`, so are adjacent in the
+    // child; the low three bits give their position in the 2x2x2 group.
+    // The octant of the child supplies the top bits of the parent index,
+    // so the parent voxels are generated in Morton order.
+    int levelBits = 0;
+    while ((1 << levelBits) < m_brickRes)
+        ++levelBits;
+    assert(levelBits > 0);
+    // Every group of occupied child voxels produces one parent voxel, so
+    // count groups to allocate the parent exactly.
+    int numGroups = 0;
+    for (int childIdx = 0; childIdx < 8; ++childIdx)
+    {
+        const VoxelBrick* child = children[childIdx];
+        if (!child)
+            continue;
+        for (int i = 0; i < child->numOccupied(); ++i)
+        {
+            if (i == 0 || (child->m_mortonIndex[i] >> 3) != (child->m_mortonIndex[i-1] >> 3))
+                ++numGroups;
+        }
+    }
+    m_mortonIndex.reserve(numGroups);
+    m_mipCoverage.reserve(numGroups);
+    m_mipPosition.reserve(3*numGroups);
+    m_mipAttributes.reserve(m_numComponents*numGroups);
     for (int childIdx = 0; childIdx < 8; ++childIdx)
     {
         VoxelBrick* child = children[childIdx];
         if (!child)
             continue;
         assert(child->m_brickRes == m_brickRes);
-        Imath::V3i childPos = zOrderToVec3(childIdx);
-        int xoff = M*childPos.x;
-        int yoff = M*childPos.y;
-        int zoff = M*childPos.z;
-        for (int z = 0; z < m_brickRes; z+=2)
-        for (int y = 0; y < m_brickRes; y+=2)
-        for (int x = 0; x < m_brickRes; x+=2)
+        assert(child->m_numComponents == m_numComponents);
+        uint32_t octantPrefix = uint32_t(childIdx) << 3*(levelBits - 1);
+        int numChildVoxels = child->numOccupied();
+        for (int begin = 0, end = 0; begin < numChildVoxels; begin = end)
         {
+            uint32_t groupIndex = child->m_mortonIndex[begin] >> 3;
+            // Occupied voxel index of each of the eight children, or -1
+            int groupVoxels[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+            for (end = begin; end < numChildVoxels &&
+                              (child->m_mortonIndex[end] >> 3) == groupIndex; ++end)
+                groupVoxels[child->m_mortonIndex[end] & 7] = end;
             // 3D mipmap downsampling: Take eight adjacent samples and
             // accumulate them into a single new sample.  In contrast to 2D
             // mipmapping, opacity needs to be taken into account: one
             // layer can partially hide another.  In principle, this
             // introduces view dependence into the mipmap; here we assume
             // the viewer is roughly looking downward.
-            float colSum = 0;
+            const float* sampAttrs[8];
+            float sampWeights[8];
+            int sampCount = 0;
             V3f posSum = V3f(0);
             float coverageSum = 0;
             for (int j = 0; j < 2; ++j)
             for (int i = 0; i < 2; ++i)
             {
-                int x1 = x+i;
-                int y1 = y+j;
-                float c1 = child->coverage(x1,y1,z+1);
-                float c0 = child->coverage(x1,y1,z);
+                int v0 = groupVoxels[i + 2*j];
+                int v1 = groupVoxels[i + 2*j + 4];
+                float c1 = v1 >= 0 ? child->coverage(v1) : 0;
+                float c0 = v0 >= 0 ? child->coverage(v0) : 0;
                 // Unusual compositing rule: assume geometry is perfectly
                 // *coherent* and complementary, so opacities add.  This is
                 // the correct rule for linear surfaces which pass through
@@ -127,21 +411,28 @@ void VoxelBrick::renderFromBricks(VoxelBrick* children[8])
                 // the rules.
                 c0 = std::min(1-c1, c0);
                 //c0 = (1-c1)*c0;  // Usual compositing rule for incoherent geometry
-                colSum += c0*child->color(x1,y1,z)    + c1*child->color(x1,y1,z+1);
-                posSum += c0*child->position(x1,y1,z) + c1*child->position(x1,y1,z+1);
+                if (c0 > 0)
+                {
+                    sampAttrs[sampCount] = child->attributes(v0);
+                    sampWeights[sampCount++] = c0;
+                    posSum += c0*child->position(v0);
+                }
+                if (c1 > 0)
+                {
+                    sampAttrs[sampCount] = child->attributes(v1);
+                    sampWeights[sampCount++] = c1;
+                    posSum += c1*child->position(v1);
+                }
                 coverageSum += c0 + c1;
             }
             if (coverageSum != 0)
             {
-                int x1 = x/2+xoff;
-                int y1 = y/2+yoff;
-                int z1 = z/2+zoff;
                 float w = 1.0f/coverageSum;
-                this->color(x1, y1, z1)    = w*colSum;
-                this->position(x1, y1, z1) = w*posSum;
                 // Note: Coverage is a special case: it's the average of
                 // coverage in the four child cells.
-                this->coverage(x1, y1, z1) = coverageSum/4;
+                float* attrs = appendVoxel(octantPrefix | groupIndex,
+                                           coverageSum/4, w*posSum);
+                combineAttributes(attrs, sampAttrs, sampWeights, sampCount);
             }
         }
     }
@@ -149,26 +440,218 @@ void VoxelBrick::renderFromBricks(VoxelBrick* children[8])
 
 
 //------------------------------------------------------------------------------
+/// Node of the octree, identified by depth and Morton index at that depth
+struct OctreeNodeRef
+{
+    int level;
+    int64_t mortonIndex;
+    Imath::Box3d bbox;
+
+    OctreeNodeRef(int level, int64_t mortonIndex, const Imath::Box3d& bbox)
+        : level(level), mortonIndex(mortonIndex), bbox(bbox) {}
+
+    OctreeNodeRef child(int octant) const
+    {
+        Imath::Box3d childBox = bbox;
+        Imath::V3d halfSize = 0.5*bbox.size();
+        Imath::V3i pos = zOrderToVec3(octant);
+        childBox.min += halfSize*Imath::V3d(pos);
+        childBox.max = childBox.min + halfSize;
+        return OctreeNodeRef(level + 1, 8*mortonIndex + octant, childBox);
+    }
+};
+
+
+/// Leaf bricks and source points for one chunk of the octree
+struct VoxelizedChunk
+{
+    struct Leaf
+    {
+        int level;
+        int64_t mortonIndex;
+        std::unique_ptr<VoxelBrick> brick;
+        std::vector<size_t> pointIndices;
+    };
+
+    std::vector<float> position;
+    std::vector<float> pointAttrs;
+    std::vector<Leaf> leaves;
+};
+
+
+/// Split the nodes inside a chunk adaptively, according to the number of
+/// points in each, and voxelize the resulting leaves.
+class LeafSubdivider
+{
+    public:
+        LeafSubdivider(VoxelizedChunk& chunk, const Imath::V3d& relOffset,
+                       int maxDepth, size_t leafPointCount, float pointRadius,
+                       int brickRes, const std::vector<HCloudAttribute>& attributes)
+            : m_chunk(chunk), m_relOffset(relOffset), m_maxDepth(maxDepth),
+            m_leafPointCount(leafPointCount), m_pointRadius(pointRadius),
+            m_brickRes(brickRes), m_attributes(attributes)
+        { }
+
+        /// Subdivide `node` until each leaf has at most leafPointCount points
+        /// or reaches the maximum depth, appending leaves to the chunk in
+        /// Morton order.
+        ///
+        /// `inside` are the indices of the points inside the node, and
+        /// `buffered` the indices of points within the point radius of it.
+        void subdivide(const OctreeNodeRef& node, std::vector<size_t>& inside,
+                       const std::vector<size_t>& buffered)
+        {
+            if (inside.empty())
+                return;
+            if (node.level < m_maxDepth && inside.size() > m_leafPointCount)
+            {
+                for (int i = 0; i < 8; ++i)
+                {
+                    OctreeNodeRef child = node.child(i);
+                    Imath::Box3f childBox = relativeBox(child.bbox);
+                    std::vector<size_t> childInside;
+                    for (size_t j : inside)
+                    {
+                        if (contains(childBox, j))
+                            childInside.push_back(j);
+                    }
+                    if (childInside.empty())
+                        continue;
+                    childBox.min -= V3f(m_pointRadius);
+                    childBox.max += V3f(m_pointRadius);
+                    std::vector<size_t> childBuffered;
+                    for (size_t j : buffered)
+                    {
+                        if (contains(childBox, j))
+                            childBuffered.push_back(j);
+                    }
+                    subdivide(child, childInside, childBuffered);
+                }
+                return;
+            }
+            // Render points into a MIP brick
+            Imath::Box3f leafBox = relativeBox(node.bbox);
+            VoxelizedChunk::Leaf leaf;
+            leaf.level = node.level;
+            leaf.mortonIndex = node.mortonIndex;
+            leaf.brick.reset(new VoxelBrick(m_brickRes, m_attributes));
+            leaf.brick->voxelizePoints(leafBox.min, leafBox.size().x, m_pointRadius,
+                                       m_chunk.position.data(), m_chunk.pointAttrs.data(),
+                                       buffered.data(), (int)buffered.size());
+            leaf.pointIndices.swap(inside);
+            m_chunk.leaves.push_back(std::move(leaf));
+        }
+
+        /// Return box relative to point position offset
+        Imath::Box3f relativeBox(const Imath::Box3d& box) const
+        {
+            return Imath::Box3f(box.min - m_relOffset, box.max - m_relOffset);
+        }
+
+    private:
+        bool contains(const Imath::Box3f& box, size_t pointIdx) const
+        {
+            const float* p = &m_chunk.position[3*pointIdx];
+            return p[0] >= box.min.x && p[0] < box.max.x &&
+                   p[1] >= box.min.y && p[1] < box.max.y &&
+                   p[2] >= box.min.z && p[2] < box.max.z;
+        }
+
+        VoxelizedChunk& m_chunk;
+        Imath::V3d m_relOffset;
+        int m_maxDepth;
+        size_t m_leafPointCount;
+        float m_pointRadius;
+        int m_brickRes;
+        const std::vector<HCloudAttribute>& m_attributes;
+};
+
+
+/// Return bounding box of points which may affect the voxels of `node`
+static Imath::Box3d bufferedBox(const OctreeNodeRef& node, float pointRadius)
+{
+    Imath::Box3d box = node.bbox;
+    box.min -= V3d(pointRadius);
+    box.max += V3d(pointRadius);
+    return box;
+}
+
+
+/// Query points inside chunk from `pointDb` and voxelize them into leaf
+/// bricks, in Morton order.  Safe to call from several threads at once.
+static std::unique_ptr<VoxelizedChunk> voxelizeChunk(
+        SimplePointDb& pointDb, const OctreeNodeRef& chunkNode, int maxDepth,
+        size_t leafPointCount, float pointRadius, int brickRes,
+        const std::vector<HCloudAttribute>& attributes)
+{
+    std::unique_ptr<VoxelizedChunk> chunk(new VoxelizedChunk());
+    pointDb.query(bufferedBox(chunkNode, pointRadius), chunk->position, chunk->pointAttrs);
+    size_t numPoints = chunk->position.size()/3;
+    // FIXME: A fixed offset() doesn't make sense for really large clouds
+    LeafSubdivider subdivider(*chunk, pointDb.offset(), maxDepth, leafPointCount,
+                              pointRadius, brickRes, attributes);
+    Imath::Box3f chunkBox = subdivider.relativeBox(chunkNode.bbox);
+    std::vector<size_t> inside;
+    std::vector<size_t> buffered(numPoints);
+    for (size_t i = 0; i < numPoints; ++i)
+    {
+        buffered[i] = i;
+        const float* p = &chunk->position[3*i];
+        if (p[0] >= chunkBox.min.x && p[0] < chunkBox.max.x &&
+            p[1] >= chunkBox.min.y && p[1] < chunkBox.max.y &&
+            p[2] >= chunkBox.min.z && p[2] < chunkBox.max.z)
+        {
+            inside.push_back(i);
+        }
+    }
+    subdivider.subdivide(chunkNode, inside, buffered);
+    return chunk;
+}
+
+
+/// Split `node` into chunks of roughly `chunkPointCount` points, going no
+/// deeper than `maxDepth`, according to the point count estimates from
+/// `pointDb`.  Chunks are appended in Morton order; empty nodes are skipped.
+static void findChunks(const SimplePointDb& pointDb, const OctreeNodeRef& node,
+                       int maxDepth, int64_t chunkPointCount,
+                       std::vector<OctreeNodeRef>& chunks)
+{
+    int64_t estimatedPoints = pointDb.estimatePointCount(node.bbox);
+    if (estimatedPoints == 0)
+        return;
+    if (node.level < maxDepth && estimatedPoints > chunkPointCount)
+    {
+        for (int i = 0; i < 8; ++i)
+            findChunks(pointDb, node.child(i), maxDepth, chunkPointCount, chunks);
+        return;
+    }
+    chunks.push_back(node);
+}
+
+
 void voxelizePointCloud(std::ostream& outputStream,
                         SimplePointDb& pointDb, float pointRadius,
                         const Imath::V3d& origin, double rootNodeWidth,
-                        int leafDepth, int brickRes, Logger& logger)
+                        int maxDepth, int leafPointCount, int brickRes,
+                        int numThreads, Logger& logger)
 {
     // Bottom up octree build algorithm.  Each octree node contains a "brick"
     // of M*M*M voxels which are a level-of-detail representation of all points
-    // inside the node.  The root bounding box is filled with a cubic grid of
-    // 2^N * 2^N * 2^N leaf bricks where N is the depth of the octree.
+    // inside the node.  Nodes are split adaptively: a node becomes a leaf
+    // once it contains at most leafPointCount points, or reaches maxDepth.
     //
     // Building the tree proceeds as follows:
     //
-    // * Leaf nodes are traversed in Morton order.
+    // * The root is split into chunks of about a million points each, using
+    //   the tile point counts recorded in the point database.  The points
+    //   for each chunk are extracted from the database in a single query.
     //
-    // * For each leaf node, the points inside the bounding box are extracted
-    //   from the point database and rendered into the brick voxels.  (In
-    //   practise point extraction happens on a chunk level to avoid a lot of
-    //   very small database queries.)
+    // * Nodes within each chunk are split according to the number of points
+    //   they actually contain, and the points for each leaf node are
+    //   rendered into the brick voxels.  Chunks are voxelized in parallel on
+    //   several threads, but handed to the octree builder in Morton order.
     //
-    // * Whenever a group of 8 adjacent nodes are complete, these are
+    // * Whenever a group of up to 8 adjacent nodes are complete, these are
     //   downsampled to produce the next coarser level of detail in the tree.
     //   They are then serialized to an output buffer and deallocated. Index
     //   information for the location of the nodes in the binary stream is
@@ -185,123 +668,74 @@ void voxelizePointCloud(std::ostream& outputStream,
     // "Coherent Out-of-Core Point-Based Global Illumination" by Kontkanen et al.,
     // Eurographics Symposium on Rendering 2011.
 
-    Imath::Box3d rootBound(origin, origin + V3d(rootNodeWidth));
-
-    double leafNodeWidth = rootNodeWidth/(1<<leafDepth);
-
-    // Estimate chunk depth by assuming an essentially 2D point distribution 
-    size_t desiredChunkPointCount = 1000000;
-    double pointDensity = 50;  // points/m^2
-    //int64_t expectedPoints = pointDb.estimatePointCount(rootBound);
-    double expectedPoints = pointDensity*rootNodeWidth*rootNodeWidth;
-    int chunkDepth = std::max(0, (int)ceil(log(expectedPoints/desiredChunkPointCount)/log(4)));
+    OctreeNodeRef root(0, 0, Imath::Box3d(origin, origin + V3d(rootNodeWidth)));
 
-    logger.info("Tree leaf depth: %d", leafDepth);
-    logger.info("Depth of chunk root: %d", chunkDepth);
-    logger.info("Estimated points per chunk: %d", expectedPoints/pow(4,chunkDepth));
+    const int64_t desiredChunkPointCount = 1000000;
+    std::vector<OctreeNodeRef> chunks;
+    findChunks(pointDb, root, maxDepth, desiredChunkPointCount, chunks);
+    int numChunks = (int)chunks.size();
 
-    int chunkRes = 1<<chunkDepth;
-    double chunkWidth = rootNodeWidth/chunkRes;
-    int numChunks = chunkRes*chunkRes*chunkRes;
+    logger.info("Maximum tree depth: %d", maxDepth);
+    logger.info("Target points per leaf: %d", leafPointCount);
+    logger.info("Estimated points: %d in %d chunks",
+                pointDb.estimatePointCount(root.bbox), numChunks);
 
-    int chunkLeafRes = 1 << (leafDepth - chunkDepth);
-
-    std::vector<float> position;
-    std::vector<float> intensity;
-
-    double invLeafNodeWidth = 1/leafNodeWidth;
-    double fractionalPointRadius = pointRadius/leafNodeWidth;
-
-    int leavesPerChunk = chunkLeafRes*chunkLeafRes*chunkLeafRes;
+    const std::vector<HCloudAttribute>& attributes = pointDb.attributes();
 
+    logger.info("Voxelizing with %d threads", numThreads);
     logger.progress("Render chunks");
-    OctreeBuilder builder(outputStream, brickRes, leafDepth, pointDb.offset(),
-                          rootBound, logger);
-    // Traverse chunks in z order
+    OctreeBuilder builder(outputStream, brickRes, maxDepth, pointDb.offset(),
+                          root.bbox, attributes, logger);
+    // Chunks are computed out of order by the workers.  Limiting the number
+    // in flight bounds the memory held in the reorder buffer.
+    OrderedWorkQueue<VoxelizedChunk> chunkQueue(numChunks, numThreads, 2*numThreads,
+        [&](int chunkIdx)
+        {
+            // Workers claim chunks in order, so the chunk numThreads ahead is
+            // the next one needed once this batch is done.  Load its tiles
+            // while this one is voxelized.
+            if (chunkIdx + numThreads < numChunks)
+                pointDb.prefetch(bufferedBox(chunks[chunkIdx + numThreads], pointRadius));
+            return voxelizeChunk(pointDb, chunks[chunkIdx], maxDepth, leafPointCount,
+                                 pointRadius, brickRes, attributes);
+        });
+    std::vector<int64_t> leavesPerLevel(maxDepth + 1, 0);
+    size_t maxLeafPoints = 0;
+    int64_t totalLeafPoints = 0;
     for (int chunkIdx = 0; chunkIdx < numChunks; ++chunkIdx)
     {
-        logger.progress(double(chunkIdx)/(numChunks-1));
-        Imath::V3i chunkPos = zOrderToVec3(chunkIdx);
-        Imath::Box3d chunkBbox;
-        chunkBbox.min = origin + chunkWidth*V3d(chunkPos);
-        chunkBbox.max = origin + chunkWidth*V3d(chunkPos + Imath::V3i(1));
-        Imath::Box3d bufferedBox = chunkBbox;
-        bufferedBox.min -= V3d(pointRadius);
-        bufferedBox.max += V3d(pointRadius);
-        // Origin of chunk relative to overall cloud origin
-        // FIXME: A fixed offset() doesn't make sense for really large clouds
-        Imath::V3d relOrigin = chunkBbox.min - pointDb.offset();
-        pointDb.query(bufferedBox, position, intensity);
-        size_t numPoints = intensity.size();
-        logger.debug("Chunk %d has %d points", chunkPos, numPoints);
-        if (numPoints == 0)
-            continue;
-
-        // TODO: Early bailout when numPoints == 0.  Care must be taken here
-        // in the octree build algorithm.
-
-        // Bin point indices into full leaf node grid.
-        // leafIndices[i] has the indices for points in the ith leaf, where i
-        // is a lexicographic ordering (since that's simpler to compute than the
-        // Morton order)
-        std::vector<std::vector<size_t>> bufferedLeafIndices(leavesPerChunk);
-        std::vector<std::vector<size_t>> leafIndices(leavesPerChunk);
-        for (size_t pointIdx = 0; pointIdx < numPoints; ++pointIdx)
+        logger.progress(double(chunkIdx)/std::max(1, numChunks-1));
+        std::unique_ptr<VoxelizedChunk> chunk = chunkQueue.next();
+        logger.debug("Chunk %d at level %d has %d points",
+                     chunks[chunkIdx].mortonIndex, chunks[chunkIdx].level,
+                     chunk->position.size()/3);
+        // Dump leaf bricks to output.  Since we're traversing both chunks
+        // and leaves in Morton order, the leaves are traversed in Morton
+        // order as a whole.
+        for (VoxelizedChunk::Leaf& leaf: chunk->leaves)
         {
-            // Record point in all leaf nodes it touches out to the point radius
-            double x = invLeafNodeWidth*(position[3*pointIdx]   - relOrigin.x);
-            double y = invLeafNodeWidth*(position[3*pointIdx+1] - relOrigin.y);
-            double z = invLeafNodeWidth*(position[3*pointIdx+2] - relOrigin.z);
-            int xbegin = Imath::clamp((int)floor(x - fractionalPointRadius), 0, chunkLeafRes);
-            int xend   = Imath::clamp((int)ceil (x + fractionalPointRadius), 0, chunkLeafRes);
-            int ybegin = Imath::clamp((int)floor(y - fractionalPointRadius), 0, chunkLeafRes);
-            int yend   = Imath::clamp((int)ceil (y + fractionalPointRadius), 0, chunkLeafRes);
-            int zbegin = Imath::clamp((int)floor(z - fractionalPointRadius), 0, chunkLeafRes);
-            int zend   = Imath::clamp((int)ceil (z + fractionalPointRadius), 0, chunkLeafRes);
-            for (int zi = zbegin; zi < zend; ++zi)
-            for (int yi = ybegin; yi < yend; ++yi)
-            for (int xi = xbegin; xi < xend; ++xi)
-            {
-                int idx = (zi*chunkLeafRes + yi)*chunkLeafRes + xi;
-                bufferedLeafIndices[idx].push_back(pointIdx);
-            }
-            // Record point in leaf node in which it actually resides
-            int xi = (int)floor(x);
-            int yi = (int)floor(y);
-            int zi = (int)floor(z);
-            if (xi >= 0 && xi < chunkLeafRes &&
-                yi >= 0 && yi < chunkLeafRes &&
-                zi >= 0 && zi < chunkLeafRes)
-            {
-                int idx = (zi*chunkLeafRes + yi)*chunkLeafRes + xi;
-                leafIndices[idx].push_back(pointIdx);
-            }
-        }
-        // Render points in each leaf into a MIP brick in z curve order, and
-        // dump to output.  Since we're traversing both chunks and leaves in
-        // Morton order, the leaves are traversed in Morton order as a whole.
-        for (int leafIdx = 0; leafIdx < leavesPerChunk; ++leafIdx)
-        {
-            Imath::V3i leafPos = zOrderToVec3(leafIdx);
-            int lexLeafIdx = (leafPos.z*chunkLeafRes + leafPos.y)*chunkLeafRes + leafPos.x;
-            const std::vector<size_t>& bufferedInds = bufferedLeafIndices[lexLeafIdx];
-            const std::vector<size_t>& inds = leafIndices[lexLeafIdx];
-            if (bufferedInds.empty())
-                continue;
-            double leafWidth = chunkWidth/chunkLeafRes;
-            Imath::V3f leafMin = relOrigin + leafWidth*V3d(leafPos);
-            std::unique_ptr<VoxelBrick> brick(new VoxelBrick(brickRes));
-            brick->voxelizePoints(leafMin, (float)leafWidth, pointRadius,
-                                  position.data(), intensity.data(),
-                                  bufferedInds.data(), (int)bufferedInds.size());
-            LeafPointData leafPointData(position.data(), intensity.data(),
-                                        inds.data(), inds.size());
-            int64_t leafMortonIndex = chunkIdx*leavesPerChunk + leafIdx;
-            builder.addNode(leafDepth, leafMortonIndex, std::move(brick),
+            LeafPointData leafPointData(attributes, chunk->position.data(),
+                                        chunk->pointAttrs.data(),
+                                        leaf.pointIndices.data(),
+                                        leaf.pointIndices.size());
+            builder.addNode(leaf.level, leaf.mortonIndex, std::move(leaf.brick),
                             leafPointData);
+            leavesPerLevel[leaf.level] += 1;
+            maxLeafPoints = std::max(maxLeafPoints, leaf.pointIndices.size());
+            totalLeafPoints += leaf.pointIndices.size();
         }
     }
+    if (totalLeafPoints == 0)
+        throw DisplazError("No points found inside octree bounding box");
     builder.finish();
+    int64_t numLeaves = 0;
+    for (int level = 0; level <= maxDepth; ++level)
+    {
+        if (leavesPerLevel[level] != 0)
+            logger.info("Level %d: %d leaves", level, leavesPerLevel[level]);
+        numLeaves += leavesPerLevel[level];
+    }
+    logger.info("%d points in %d leaves: mean %.0f points per leaf, max %d",
+                totalLeafPoints, numLeaves, double(totalLeafPoints)/numLeaves,
+                maxLeafPoints);
 }
-
-
@@ -5,6 +5,7 @@
 #define DISPLAZ_VOXELIZER_H_INCLUDED
 
 #include <algorithm>
+#include <cfloat>
 #include <vector>
 
 #include "hcloud.h"
@@ -32,6 +33,22 @@ inline Imath::V3i zOrderToVec3(int zIndex)
 }
 
 
+/// Convert 3D vector of cell indices to ZCurve index; the inverse of
+/// zOrderToVec3()
+inline uint32_t vec3ToZOrder(int x, int y, int z)
+{
+    uint32_t zIndex = 0;
+    for (int i = 0; (x | y | z) != 0; ++i)
+    {
+        zIndex |= ((x & 1) << 3*i) | ((y & 1) << (3*i+1)) | ((z & 1) << (3*i+2));
+        x >>= 1;
+        y >>= 1;
+        z >>= 1;
+    }
+    return zIndex;
+}
+
+
 /// Create an octree by voxelizing points from `pointDb`
 ///
 /// Voxelization occurs by rendering points from `pointDb` with radius
@@ -39,48 +56,108 @@ inline Imath::V3i zOrderToVec3(int zIndex)
 /// hcloud format.
 ///
 /// The bounding box of the octree will have a minimum at `origin` and a size
-/// of `rootNodeWidth` in the three directions.  A fixed maximum octree depth
-/// of `leafDepth` is used for the leaf nodes, each of which contains
-/// brickRes*brickRes*brickRes voxels.
+/// of `rootNodeWidth` in the three directions.  Nodes are subdivided while
+/// they contain more than `leafPointCount` points, down to a maximum depth
+/// of `maxDepth`.  Each node contains brickRes*brickRes*brickRes voxels.
+///
+/// Chunks of leaf nodes are voxelized on `numThreads` worker threads; the
+/// output is identical regardless of the number of threads.
 void voxelizePointCloud(std::ostream& outputStream,
                         SimplePointDb& pointDb, float pointRadius,
                         const Imath::V3d& origin, double rootNodeWidth,
-                        int leafDepth, int brickRes, Logger& logger);
+                        int maxDepth, int leafPointCount, int brickRes,
+                        int numThreads, Logger& logger);
+
+
+/// Gather point-major attributes for the points `indices` into the
+/// per-attribute layout expected by encodeNodeData()
+template<typename IndexT>
+std::vector<float> gatherAttributes(const std::vector<HCloudAttribute>& attributes,
+                                    const float* pointAttrs,
+                                    const IndexT* indices, size_t n)
+{
+    int numComponents = attributeComponentCount(attributes);
+    std::vector<float> attrData(numComponents*n);
+    float* out = attrData.data();
+    int componentOffset = 0;
+    for (const HCloudAttribute& attr : attributes)
+    {
+        int count = attr.spec.count;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const float* src = pointAttrs + numComponents*indices[i] +
+                               componentOffset;
+            for (int c = 0; c < count; ++c)
+                *out++ = src[c];
+        }
+        componentOffset += count;
+    }
+    return attrData;
+}
 
 
-/// A 3D N*N*N array of voxels
+/// A sparse 3D N*N*N array of voxels
+///
+/// Only voxels with nonzero coverage are stored, sorted by the Morton index
+/// of the voxel within the brick.  Point clouds are mostly 2.5D surfaces, so
+/// typically only O(N^2) of the voxels are occupied.  In Morton order the
+/// eight voxels which downsample into a single parent voxel are adjacent,
+/// which makes mipmapping a linear pass over the occupied voxels.
+///
+/// N must be a power of two.
 class VoxelBrick
 {
     public:
-        VoxelBrick(int brickRes)
+        VoxelBrick(int brickRes, const std::vector<HCloudAttribute>& attributes)
             : m_brickRes(brickRes),
-            m_mipColor(m_brickRes*m_brickRes*m_brickRes, 0),
-            m_mipCoverage(m_brickRes*m_brickRes*m_brickRes, 0),
-            m_mipPosition(3*m_brickRes*m_brickRes*m_brickRes, 0)
-        { }
+            m_attributes(attributes),
+            m_numComponents(attributeComponentCount(attributes))
+        {
+            assert((brickRes & (brickRes-1)) == 0);
+            for (const HCloudAttribute& attr : attributes)
+                m_categorical.insert(m_categorical.end(), attr.spec.count, attr.categorical);
+        }
 
         /// Return resolution of brick (ie, N, where brick has N*N*N voxels)
         int resolution() const { return m_brickRes; }
 
-        /// Return total number of voxels in brick
-        int numVoxels() const  { return m_brickRes*m_brickRes*m_brickRes; }
+        /// Return number of voxels with nonzero coverage
+        int numOccupied() const { return (int)m_mortonIndex.size(); }
 
-        float& coverage(int x, int y, int z)      { return m_mipCoverage[idx(x,y,z)]; }
-        float coverage(int x, int y, int z) const { return m_mipCoverage[idx(x,y,z)]; }
-        float coverage(int i) const               { return m_mipCoverage[i]; }
+        /// Return approximate memory used by the voxel data, in bytes
+        size_t sizeBytes() const
+        {
+            return m_mortonIndex.capacity()*sizeof(uint32_t) +
+                   (m_mipCoverage.capacity() + m_mipPosition.capacity() +
+                    m_mipAttributes.capacity())*sizeof(float);
+        }
 
-        V3f& position(int x, int y, int z) { return *reinterpret_cast<V3f*>(&m_mipPosition[3*idx(x,y,z)]); }
-        const V3f& position(int x, int y, int z) const { return *reinterpret_cast<const V3f*>(&m_mipPosition[3*idx(x,y,z)]); }
+        /// Accessors for the ith occupied voxel, in Morton order
+        uint32_t mortonIndex(int i) const { return m_mortonIndex[i]; }
+        float coverage(int i) const { return m_mipCoverage[i]; }
         const V3f& position(int i) const { return *reinterpret_cast<const V3f*>(&m_mipPosition[3*i]); }
+        /// Attribute components for a voxel, in the order of the attribute list
+        const float* attributes(int i) const { return &m_mipAttributes[m_numComponents*i]; }
 
-        float& color(int x, int y, int z)      { return m_mipColor[idx(x,y,z)]; }
-        float color(int x, int y, int z) const { return m_mipColor[idx(x,y,z)]; }
-        float color(int i) const               { return m_mipColor[i]; }
+        /// Return occupied voxel index of voxel at (x,y,z), or -1 if the
+        /// voxel has zero coverage
+        int find(int x, int y, int z) const
+        {
+            uint32_t key = vec3ToZOrder(x, y, z);
+            auto it = std::lower_bound(m_mortonIndex.begin(), m_mortonIndex.end(), key);
+            if (it == m_mortonIndex.end() || *it != key)
+                return -1;
+            return int(it - m_mortonIndex.begin());
+        }
 
         /// Render given point set into the brick as voxels
+        ///
+        /// `attributes` holds the attribute components for each point,
+        /// point-major.  Scratch space is kept per thread and reused between
+        /// calls, so voxelizing a brick only allocates the occupied voxels.
         void voxelizePoints(const V3f& lowerCorner, float brickWidth,
                             float pointRadius,
-                            const float* position, const float* intensity,
+                            const float* position, const float* attributes,
                             const size_t* pointIndices, int npoints);
 
         /// Render brick from a Morton ordered set of child bricks
@@ -91,34 +168,29 @@ class VoxelBrick
         /// Return index node to the serialized data
         NodeIndexData serialize(std::ostream& out) const
         {
-            // Serialize all voxels with nonzero coverage
-            std::vector<float> positions;
-            std::vector<float> coverage;
-            std::vector<float> intensity;
-            for (int i = 0, iend = numVoxels(); i < iend; ++i)
-            {
-                float cov = m_mipCoverage[i];
-                if (cov != 0)
-                {
-                    positions.insert(positions.end(), &m_mipPosition[3*i],
-                                     &m_mipPosition[3*i] + 3);
-                    coverage.push_back(cov);
-                    intensity.push_back(m_mipColor[i]);
-                }
-            }
-            out.write((const char*)positions.data(), positions.size()*sizeof(float));
-            out.write((const char*)coverage.data(),  coverage.size()*sizeof(float));
-            out.write((const char*)intensity.data(), intensity.size()*sizeof(float));
+            std::vector<int> voxelInds(numOccupied());
+            for (int i = 0; i < numOccupied(); ++i)
+                voxelInds[i] = i;
+            std::vector<float> attrData = gatherAttributes(m_attributes,
+                m_mipAttributes.data(), voxelInds.data(), voxelInds.size());
             NodeIndexData indexData;
-            indexData.numPoints = (uint32_t)coverage.size();
             indexData.flags = IndexFlags_Voxels;
+            encodeNodeData(out, indexData, m_attributes, m_mipPosition.data(),
+                           m_mipCoverage.data(), attrData.data(),
+                           (uint32_t)m_mipCoverage.size());
             return indexData;
         }
 
     private:
         int m_brickRes;
-        // Attributes for all voxels inside brick
-        std::vector<float> m_mipColor;
+        std::vector<HCloudAttribute> m_attributes;
+        int m_numComponents;
+        /// Whether each attribute component holds categorical labels
+        std::vector<bool> m_categorical;
+        // Morton index within the brick of each occupied voxel, ascending
+        std::vector<uint32_t> m_mortonIndex;
+        // Attributes for occupied voxels
+        std::vector<float> m_mipAttributes;
         std::vector<float> m_mipCoverage;
         // Average position of points within brickmap voxels.  This greatly reduces
         // the octree terracing effect since it pulls points back to the correct
@@ -127,12 +199,27 @@ class VoxelBrick
         // brickmap usage.)
         std::vector<float> m_mipPosition;
 
-        /// Return index of voxel at (x,y,z) in brick
-        int idx(int x, int y, int z) const
+        /// Append occupied voxel, which must come after all existing voxels
+        /// in Morton order.  Return the voxel attributes for filling in.
+        float* appendVoxel(uint32_t mortonIndex, float coverage, const V3f& position)
         {
-            assert(x >= 0 && x < m_brickRes && y >= 0 && y < m_brickRes && z >= 0 && z < m_brickRes);
-            return x + m_brickRes*(y + m_brickRes*z);
+            assert(m_mortonIndex.empty() || m_mortonIndex.back() < mortonIndex);
+            m_mortonIndex.push_back(mortonIndex);
+            m_mipCoverage.push_back(coverage);
+            m_mipPosition.push_back(position.x);
+            m_mipPosition.push_back(position.y);
+            m_mipPosition.push_back(position.z);
+            size_t attrOffset = m_mipAttributes.size();
+            for (int c = 0; c < m_numComponents; ++c)
+                m_mipAttributes.push_back(0);
+            return &m_mipAttributes[attrOffset];
         }
+
+        /// Combine attribute components from `nsamp` sources with given
+        /// weights into `result`.  Categorical components take the value
+        /// with the largest total weight; others are averaged.
+        void combineAttributes(float* result, const float* const* samples,
+                               const float* weights, int nsamp) const;
 };
 
 
@@ -143,26 +230,36 @@ class VoxelBrick
 class LeafPointData
 {
     public:
-        LeafPointData(const float* position, const float* intensity,
+        LeafPointData(const std::vector<HCloudAttribute>& attributes,
+                      const float* position, const float* pointAttrs,
                       const size_t* indices, size_t npoints)
-            : m_position(position), m_intensity(intensity), m_indices(indices), m_npoints(npoints)
+            : m_attributes(attributes), m_position(position),
+            m_pointAttrs(pointAttrs), m_indices(indices), m_npoints(npoints)
         { }
 
         NodeIndexData serialize(std::ostream& out) const
         {
+            std::vector<float> positions(3*m_npoints);
             for (size_t i = 0; i < m_npoints; ++i)
-                out.write((const char*)&m_position[3*m_indices[i]], 3*sizeof(float));
-            for (size_t i = 0; i < m_npoints; ++i)
-                out.write((const char*)&m_intensity[m_indices[i]], sizeof(float));
+            {
+                size_t j = m_indices[i];
+                positions[3*i]   = m_position[3*j];
+                positions[3*i+1] = m_position[3*j+1];
+                positions[3*i+2] = m_position[3*j+2];
+            }
+            std::vector<float> attrData = gatherAttributes(
+                m_attributes, m_pointAttrs, m_indices, m_npoints);
             NodeIndexData indexData;
-            indexData.numPoints = (uint32_t)m_npoints;
             indexData.flags = IndexFlags_Points;
+            encodeNodeData(out, indexData, m_attributes, positions.data(), nullptr,
+                           attrData.data(), (uint32_t)m_npoints);
             return indexData;
         }
 
     private:
+        const std::vector<HCloudAttribute>& m_attributes;
         const float* m_position;
-        const float* m_intensity;
+        const float* m_pointAttrs;
         const size_t* m_indices;
         size_t m_npoints;
 };
@@ -171,51 +268,20 @@ class LeafPointData
 //------------------------------------------------------------------------------
 /// Render points into raster, viewed orthographically from direction +z
 ///
-/// intensityImage - intensity raster of size bufWidth*bufWidth
+/// indexImage - for each pixel, the position in `pointIndices` of the
+///              visible point, of size bufWidth*bufWidth.  Only valid where
+///              zbuf != -FLT_MAX
 /// zbuf      - depth buffer of size bufWidth*bufWidth
-/// bufWidth  - size of raster to render
+/// bufWidth  - size of raster to render; must be a multiple of 4
 /// xoff,yoff - origin of render buffer
 /// pixelSize - Size of raster pixels in point coordinate system
-/// px,py,pz  - Position x,y and z coordinates for each point
-/// intensity - Intensity for each input point
+/// position  - Position x,y and z coordinates for each point
 /// radius    - Point radius in units of the point coordinate system
-/// pointIndices - List of indices into px,py,pz,intensity, of length npoints
-inline void orthoZRender(float* intensityImage, float* zbuf, int bufWidth,
-                         float xoff, float yoff, float pixelSize,
-                         const float* position, const float* intensity,
-                         float radius, size_t* pointIndices, int npoints)
-{
-    memset(intensityImage, 0, sizeof(float)*bufWidth*bufWidth);
-    for (int i = 0; i < bufWidth*bufWidth; ++i)
-        zbuf[i] = -FLT_MAX;
-    float invPixelSize = 1/pixelSize;
-    float rPix = radius/pixelSize;
-    for (int pidxIdx = 0; pidxIdx < npoints; ++pidxIdx)
-    {
-        size_t pidx = pointIndices[pidxIdx];
-        float x = invPixelSize*(position[3*pidx] - xoff);
-        float y = invPixelSize*(position[3*pidx+1] - yoff);
-        float z = position[3*pidx+2];
-        int x0 = (int)floor(x - rPix + 0.5);
-        int y0 = (int)floor(y - rPix + 0.5);
-        int x1 = (int)floor(x + rPix + 0.5);
-        int y1 = (int)floor(y + rPix + 0.5);
-        x0 = std::max(0, std::min(bufWidth, x0));
-        y0 = std::max(0, std::min(bufWidth, y0));
-        x1 = std::max(0, std::min(bufWidth, x1));
-        y1 = std::max(0, std::min(bufWidth, y1));
-        for (int yi = y0; yi < y1; ++yi)
-        for (int xi = x0; xi < x1; ++xi)
-        {
-            int i = xi + yi*bufWidth;
-            if (z > zbuf[i])
-            {
-                zbuf[i] = z;
-                intensityImage[i] = intensity[pidx];
-            }
-        }
-    }
-}
+/// pointIndices - List of indices into position, of length npoints
+void orthoZRender(uint32_t* indexImage, float* zbuf, int bufWidth,
+                  float xoff, float yoff, float pixelSize,
+                  const float* position,
+                  float radius, const size_t* pointIndices, int npoints);
 
 
 
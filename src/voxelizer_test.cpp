@@ -0,0 +1,198 @@
+// Copyright 2015, Christopher J. Foster and the other displaz contributors.
+// Use of this code is governed by the BSD-style license found in LICENSE.txt
+
+#include <catch.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "logger.h"
+#include "pointdb.h"
+#include "voxelizer.h"
+
+
+TEST_CASE("Z order conversion round trip")
+{
+    for (int i = 0; i < 4096; ++i)
+    {
+        Imath::V3i v = zOrderToVec3(i);
+        CHECK(vec3ToZOrder(v.x, v.y, v.z) == (uint32_t)i);
+    }
+    CHECK(vec3ToZOrder(1,0,0) == 1);
+    CHECK(vec3ToZOrder(0,1,0) == 2);
+    CHECK(vec3ToZOrder(0,0,1) == 4);
+    CHECK(vec3ToZOrder(2,0,0) == 8);
+}
+
+
+TEST_CASE("Sparse voxel brick")
+{
+    // Horizontal plane of points filling the brick at height z = 0.3
+    const int N = 8;
+    const float width = 2;
+    std::vector<HCloudAttribute> attributes;
+    attributes.push_back(HCloudAttribute("intensity", TypeSpec::float32()));
+    std::vector<float> position;
+    std::vector<float> intensity;
+    std::vector<size_t> inds;
+    for (int j = 0; j < 64; ++j)
+    for (int i = 0; i < 64; ++i)
+    {
+        inds.push_back(position.size()/3);
+        position.push_back((i + 0.5f)*width/64);
+        position.push_back((j + 0.5f)*width/64);
+        position.push_back(0.3f);
+        intensity.push_back(i < 32 ? 10.0f : 20.0f);
+    }
+    VoxelBrick brick(N, attributes);
+    brick.voxelizePoints(V3f(0), width, 0.05f, position.data(), intensity.data(),
+                         inds.data(), (int)inds.size());
+
+    // Only the layer containing the plane is stored, in Morton order
+    REQUIRE(brick.numOccupied() == N*N);
+    int layer = int(0.3f*N/width);
+    for (int i = 0; i < brick.numOccupied(); ++i)
+    {
+        CHECK(zOrderToVec3(brick.mortonIndex(i)).z == layer);
+        if (i > 0)
+            CHECK(brick.mortonIndex(i) > brick.mortonIndex(i-1));
+        CHECK(brick.coverage(i) == 1.0f);
+        CHECK(brick.position(i).z == Approx(0.3f));
+    }
+    CHECK(brick.find(0, 0, layer) >= 0);
+    CHECK(brick.find(0, 0, layer + 1) == -1);
+    int left = brick.find(1, 5, layer);
+    REQUIRE(left >= 0);
+    CHECK(brick.attributes(left)[0] == 10.0f);
+    CHECK(brick.position(left).x == Approx(1.5f*width/N));
+    CHECK(brick.position(left).y == Approx(5.5f*width/N));
+    int right = brick.find(6, 2, layer);
+    REQUIRE(right >= 0);
+    CHECK(brick.attributes(right)[0] == 20.0f);
+
+    // Downsampling the brick into two octants of the parent gives a plane
+    // at half the resolution in each, still fully covered
+    VoxelBrick* children[8] = {nullptr};
+    children[0] = &brick;
+    children[3] = &brick;
+    VoxelBrick parent(N, attributes);
+    parent.renderFromBricks(children);
+    REQUIRE(parent.numOccupied() == 2*(N/2)*(N/2));
+    for (int i = 1; i < parent.numOccupied(); ++i)
+        CHECK(parent.mortonIndex(i) > parent.mortonIndex(i-1));
+    int parentLeft = parent.find(0, 2, layer/2);
+    REQUIRE(parentLeft >= 0);
+    CHECK(parent.coverage(parentLeft) == 1.0f);
+    CHECK(parent.attributes(parentLeft)[0] == 10.0f);
+    CHECK(parent.position(parentLeft).x == Approx(width/N));
+    int parentOctant3 = parent.find(N/2 + 3, N/2 + 1, layer/2);
+    REQUIRE(parentOctant3 >= 0);
+    CHECK(parent.attributes(parentOctant3)[0] == 20.0f);
+    CHECK(parent.find(N/2, 0, layer/2) == -1);
+}
+
+
+TEST_CASE("Adaptive octree build")
+{
+    // Point database with a sparse ground plane and a small, dense patch
+    // which should be split more finely.
+    std::string dbName = "voxelizer_test.pointdb";
+    std::filesystem::remove_all(dbName);
+    std::filesystem::create_directory(dbName);
+    const double tileSize = 16;
+    std::map<TilePos, std::vector<float>, TilePosLess> tiles;
+    int64_t numPoints = 0;
+    auto addPoint = [&](float x, float y, float z)
+    {
+        TilePos pos((int)floor(x/tileSize), (int)floor(y/tileSize), (int)floor(z/tileSize));
+        std::vector<float>& tile = tiles[pos];
+        tile.push_back(x);
+        tile.push_back(y);
+        tile.push_back(z);
+        tile.push_back(100);  // intensity
+        ++numPoints;
+    };
+    for (int j = 0; j < 64; ++j)
+    for (int i = 0; i < 64; ++i)
+        addPoint(0.5f*i + 0.1f, 0.5f*j + 0.1f, 1.0f);
+    for (int j = 0; j < 200; ++j)
+    for (int i = 0; i < 100; ++i)
+        addPoint(0.04f*i + 0.01f, 0.02f*j + 0.01f, 1.5f);
+    {
+        std::ofstream config(dbName + "/config.txt");
+        config << tileSize << "\n0 0 0 32 32 32\n0 0 0\n";
+        bool writeCount = true;
+        for (auto& tile : tiles)
+        {
+            const TilePos& pos = tile.first;
+            // Older databases don't record the number of points in each tile
+            config << pos.x << " " << pos.y << " " << pos.z;
+            if (writeCount)
+                config << " " << tile.second.size()/4;
+            config << "\n";
+            writeCount = !writeCount;
+            std::ofstream tileFile(tfm::format("%s/%d_%d_%d.dat", dbName, pos.x, pos.y, pos.z),
+                                   std::ios::binary);
+            tileFile.write((const char*)tile.second.data(), tile.second.size()*sizeof(float));
+        }
+    }
+
+    StreamLogger logger(std::cerr);
+    logger.setLogLevel(Logger::Warning);
+    logger.setLogProgress(false);
+    SimplePointDb pointDb(dbName, 10*1024*1024, logger);
+    CHECK(pointDb.estimatePointCount(Imath::Box3d(V3d(0), V3d(64))) == numPoints);
+    CHECK(pointDb.estimatePointCount(Imath::Box3d(V3d(100), V3d(164))) == 0);
+
+    const int maxDepth = 6;
+    const int leafPointCount = 1000;
+    std::stringstream hcloud;
+    voxelizePointCloud(hcloud, pointDb, 0.1f, V3d(0), 64, maxDepth,
+                       leafPointCount, 8, 2, logger);
+
+    HCloudHeader header;
+    header.read(hcloud);
+    hcloud.seekg(header.indexOffset);
+    HCloudIndex index;
+    index.read(hcloud, header);
+    REQUIRE(index.size() > 0);
+
+    // Traverse tree, checking leaf point counts
+    std::vector<std::pair<uint64_t,int>> nodeStack(1, std::make_pair(0, 0));
+    int64_t leafPoints = 0;
+    std::set<int> leafLevels;
+    while (!nodeStack.empty())
+    {
+        uint64_t node = nodeStack.back().first;
+        int level = nodeStack.back().second;
+        nodeStack.pop_back();
+        NodeIndexData idata = index.nodeData(node);
+        if (idata.flags == IndexFlags_Points)
+        {
+            // Leaf points are stored as a child of the leaf brick
+            CHECK(index.isLeaf(node));
+            // Only leaves at the maximum depth may exceed the target size
+            if (level - 1 < maxDepth)
+                CHECK(idata.numPoints <= (uint32_t)leafPointCount);
+            leafPoints += idata.numPoints;
+            leafLevels.insert(level - 1);
+            continue;
+        }
+        CHECK(!index.isLeaf(node));
+        for (int i = 0; i < 8; ++i)
+        {
+            if (index.childMask(node) & (1 << i))
+                nodeStack.push_back(std::make_pair(index.child(node, i), level + 1));
+        }
+    }
+    CHECK(leafPoints == numPoints);
+    // Sparse and dense regions end up at different depths
+    CHECK(leafLevels.size() > 1);
+    CHECK(*leafLevels.rbegin() == maxDepth);
+
+    std::filesystem::remove_all(dbName);
+}